@@ -5,14 +5,25 @@
 #include <list>
 #include <memory>
 #include <string>
+#include <string_view>
 
+#include "SignatureRouter.h"
 
 class Config;
+class SessionRecorder;
 
 class AdbContext {
 public:
     enum FStream {
-        fsStdIn, fsStdOut, fsStdErr
+        fsStdIn, fsStdOut, fsStdErr, fsControl, fsResult
+    };
+
+    enum Event {
+        evLogcatLine, evShellOutput, evShellFailed, evShellExit
+    };
+
+    enum ChannelStatus {
+        chOpen, chRefused, chFailed
     };
     
     AdbContext(std::shared_ptr<Config> cfg);
@@ -21,15 +32,46 @@ public:
     Config *config() {return m_config.get();}
     const Config *config() const {return m_config.get();}
     std::shared_ptr<Config> configShared() {return m_config;}
-    
+    SessionRecorder *recorder() const {return m_recorder.get();}
+    void setRecorder(std::shared_ptr<SessionRecorder> recorder) {m_recorder = std::move(recorder);}
+    // host time the current operation started at, logcat cursors are based on it
+    std::chrono::system_clock::time_point operationStart() const {return m_opStart;}
+    void markOperationStart() {m_opStart = std::chrono::system_clock::now();}
+    // signatures the running tasks wait for; kept with its storage across
+    // operations, a task removes its routes when it goes
+    SignatureRouter &signatures() {return m_signatures;}
+
+    // With a native transport "shell" commands go straight to the adb
+    // server over the shell v2 protocol. Completion then comes as
+    // evShellExit with the exit code as data, ahead of the stdout end.
     virtual bool startAdb(const std::list<std::string> &cl) = 0;
     virtual void stopAdb() = 0;
     virtual bool writeStdIn(const void *buf, std::size_t size) = 0;
     virtual bool timerCtl(FStream fstream, unsigned int timerId, bool start,
                           std::chrono::milliseconds ms=std::chrono::milliseconds::zero()) = 0;
+
+    // Shared per-device logcat stream. Matched agent lines come back as
+    // evLogcatLine events, timers of subscribed tasks live on fsControl.
+    virtual bool subscribeLogcat(std::string_view uniq, std::string_view signature) {return false;}
+    virtual void unsubscribeLogcat() {}
+
+    // Socket to the agent through "adb forward", request is sent on open.
+    // Its data & errors come as fsResult. chRefused: nothing listens on
+    // the host port, i.e. the forward isn't set up.
+    virtual ChannelStatus openResultChannel(unsigned short port, const std::string &request) {return chFailed;}
+    virtual void closeResultChannel() {}
+
+    // Persistent per-device shell, the command goes without "shell". Its
+    // output comes back as evShellOutput, evShellFailed when the shell died
+    // first. Timers of the waiting task live on fsControl.
+    virtual bool runShellCommand(const std::string &command) {return false;}
+    virtual void cancelShellCommand() {}
     
 private:
     std::shared_ptr<Config> m_config;
+    std::shared_ptr<SessionRecorder> m_recorder;
+    std::chrono::system_clock::time_point m_opStart;
+    SignatureRouter m_signatures;
 };
 
 #endif // ADBCONTEXT_H
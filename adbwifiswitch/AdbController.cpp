@@ -1,91 +1,43 @@
 #include "unistd.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 
 #include "AdbController.h"
 #include "Config.h"
 #include "Logger.h"
+#include "SessionRecorder.h"
+#include "ShellProtocol.h"
 
 
 namespace {
 
-class StaticContextDeleter {
-public:
-    void operator()(AdbContext *) {}
+enum {
+    // tools formatting to the terminal width must not cut result lines
+    NativePtyRows = 25,
+    NativePtyCols = 1024,
+    // read buffers of a stream at the scan pool before it stops reading
+    MaxScanChunks = 4,
+    // on fsControl, past the tasks' timer ids
+    HedgeTimerId = 100,
 };
 
-class ConnectScript : public Script {
-public:
-    using Script::Script;
-    
-    virtual std::shared_ptr<AdbTask> getNextTask() override
-    {
-        assert( hasNext() );
-        if (m_curr < 0) m_curr = 0; else m_curr++;
-        switch (m_curr) {
-            case TaskDef::RunConnect:
-                return std::make_shared<AdbTaskRunConnect>( ctx() );
-            case TaskDef::WaitConnectLog:
-                return std::make_shared<AdbTaskWaitConnectLog>( ctx() );
-            default:
-                assert(false);
-        }
-        return std::shared_ptr<AdbTask>();
-    }
-
-    virtual bool hasNext() const override {
-        return m_curr < (TaskCount-1);
-    }
-    
-    
-private:
-    enum TaskDef {
-        RunConnect,
-        WaitConnectLog,
-        TaskCount
-    };
-    
-};
-
-class DisconnectScript : public Script {
+class StaticContextDeleter {
 public:
-    using Script::Script;
-    
-    virtual std::shared_ptr<AdbTask> getNextTask() override
-    {
-        assert( hasNext() );
-        if (m_curr < 0) m_curr = 0; else m_curr++;
-        switch (m_curr) {
-            case TaskDef::RunDisconnect:
-                return std::make_shared<AdbTaskRunDisconnect>( ctx() );
-            case TaskDef::WaitDisconnectLog:
-                return std::make_shared<AdbTaskWaitDisconnectLog>( ctx() );
-            default:
-                assert(false);
-        }
-        return std::shared_ptr<AdbTask>();
-    }
-
-    virtual bool hasNext() const override {
-        return m_curr < (TaskCount-1);
-    }
-    
-    
-private:
-    enum TaskDef {
-        RunDisconnect,
-        WaitDisconnectLog,
-        TaskCount
-    };
-    
+    void operator()(AdbContext *) {}
 };
 
 }
 
 
 AdbController::AdbController(std::shared_ptr<Config> cfg, FilePoller &fpoll)
-    : m_adbCtx(*this, cfg), m_adbProc(ChildProcess::Flags::fDefault | ChildProcess::Flags::fStdErr), 
+    : m_adbCtx(*this, cfg), m_sharedCtx(&m_adbCtx, StaticContextDeleter()), m_adbProc(ChildProcess::Flags::fDefault | ChildProcess::Flags::fStdErr), 
       m_fpoll(fpoll)
 {
     
@@ -100,7 +52,14 @@ bool AdbController::connectWiFi()
 {
     LOGD(true, "connectWiFi()");
 
-    m_script = std::make_shared<ConnectScript>( std::shared_ptr<AdbContext>(&m_adbCtx, StaticContextDeleter() ) );
+    m_succeeded = false;
+    m_phases.clear();
+    m_mode = ConnectWiFi;
+    retireHedges();
+    m_adbCtx.markOperationStart();
+    if (auto rec = m_adbCtx.recorder()) rec->onSessionStart( "connect", *m_adbCtx.config() );
+    if (!initControl()) return false;
+    m_script = Script::createConnect( m_sharedCtx );
     return switchTask( AdbTask::Res::Next );
 }
 
@@ -108,13 +67,39 @@ bool AdbController::disconnectWiFi()
 {
     LOGD(true, "disconnectWiFi()");
         
-    m_script = std::make_shared<DisconnectScript>( std::shared_ptr<AdbContext>(&m_adbCtx, StaticContextDeleter() ) );
+    m_succeeded = false;
+    m_phases.clear();
+    m_mode = DisconnectWiFi;
+    retireHedges();
+    m_adbCtx.markOperationStart();
+    if (auto rec = m_adbCtx.recorder()) rec->onSessionStart( "disconnect", *m_adbCtx.config() );
+    if (!initControl()) return false;
+    m_script = Script::createDisconnect( m_sharedCtx );
     return switchTask( AdbTask::Res::Next );
 }
 
 int AdbController::exitCode() const
 {
-    return m_script && !m_script->hasNext() ? 0 : 1;
+    return m_succeeded ? 0 : 1;
+}
+
+std::size_t AdbController::bytesRead() const
+{
+    std::size_t ret = m_bytesRead;
+    for (auto &h : m_hedges) ret += h.adb->bytesRead();
+    return ret;
+}
+
+std::size_t AdbController::adbLaunches() const
+{
+    std::size_t ret = m_adbLaunches;
+    for (auto &h : m_hedges) ret += h.adb->adbLaunches();
+    return ret;
+}
+
+void AdbController::setRecorder(std::shared_ptr<SessionRecorder> recorder)
+{
+    m_adbCtx.setRecorder( std::move(recorder) );
 }
 
 
@@ -125,6 +110,15 @@ void AdbController::cleanup()
     m_currTask.reset();
     m_script.reset();
 
+    m_adbCtx.unsubscribeLogcat();
+    m_adbCtx.closeResultChannel();
+    m_adbCtx.cancelShellCommand();
+    if (m_control && m_control->handlerId != FilePoller::BadHandlerId) {
+        m_control->setState( false );
+        m_control->stopTimers();
+        m_fpoll.removeHandler( m_control->handlerId );
+        m_control->handlerId = FilePoller::BadHandlerId;
+    }
     cleanupChildProc();
 }
 
@@ -140,15 +134,50 @@ void AdbController::cleanupChildProc()
     m_adbStdin.reset();
     m_adbStdout.reset();
     m_adbStderr.reset();
+    m_native.reset();
 
     m_adbProc.cleanup(true);
 }
 
-inline void AdbController::foreachFh(std::function<void(AdbController::FHCommon *)> proc)
+void AdbController::complete(bool succeeded)
+{
+    m_succeeded = succeeded;
+    cleanup();
+    // the agents they started can't be recalled, only our side stops
+    for (auto &h : m_hedges) {
+        if (h.running) h.adb->cleanup();
+        h.running = false;
+    }
+    if (m_onComplete) m_onComplete( succeeded );
+}
+
+void AdbController::endPhase()
+{
+    if (!m_currTask) return;
+    using namespace std::chrono;
+    const auto duration = duration_cast<microseconds>( steady_clock::now() - m_phaseStart );
+    m_phases.push_back( {m_currTask->name(), duration} );
+    LOGD(true, "Phase %s: %.1f ms", m_currTask->name(), static_cast<double>( duration.count() ) / 1000.0);
+}
+
+void AdbController::finish(bool succeeded)
+{
+    if (!succeeded && hedgesRunning()) {
+        // the first launch is lost, the operation goes on with the others
+        LOGI(true, "Waiting for hedged launches");
+        cleanup();
+        return;
+    }
+    complete( succeeded );
+}
+
+template <typename Proc>
+inline void AdbController::foreachFh(Proc proc)
 {
     for(auto fptr : {static_cast<FHCommon *>(m_adbStdin.get()),
                      static_cast<FHCommon *>(m_adbStdout.get()),
-                     static_cast<FHCommon *>(m_adbStderr.get())} ) {
+                     static_cast<FHCommon *>(m_adbStderr.get()),
+                     static_cast<FHCommon *>(m_native.get())} ) {
         if (fptr) proc( fptr );
     }
 }
@@ -162,6 +191,10 @@ inline FileHandler *AdbController::getFH(AdbContext::FStream fstream)
             return m_adbStdout.get();
         case AdbContext::FStream::fsStdErr:
             return m_adbStderr.get();
+        case AdbContext::FStream::fsControl:
+            return m_control.get();
+        case AdbContext::FStream::fsResult:
+            return m_result.get();
         default:
             assert(false);
             break;
@@ -169,14 +202,54 @@ inline FileHandler *AdbController::getFH(AdbContext::FStream fstream)
     return nullptr;
 }
 
+// The whole operation once more under its own uniq tag, on the same poller,
+// hubs and shells; the earlier launches keep waiting
+void AdbController::hedge()
+{
+    const unsigned int attempt = m_hedgePolicy.attempts();
+    const Config &cfg = *m_adbCtx.config();
+    auto adb = std::make_shared<AdbController>( std::make_shared<Config>( cfg.hedgeAttempt( attempt ) ), m_fpoll );
+    adb->setLogcatHubs( m_hubs );
+    adb->setShellSessions( m_shells );
+    adb->setScanPool( m_scanPool );
+    const std::size_t index = m_hedges.size();
+    adb->setCompletionHandler( [this, index](bool succeeded) {onHedgeDone( index, succeeded );} );
+    m_hedges.push_back( {adb, true} );
+
+    LOGI(true, "No answer yet, hedged launch %u of %u", attempt, cfg.getHedgeAttempts() - 1);
+    if (!(m_mode == ConnectWiFi ? adb->connectWiFi() : adb->disconnectWiFi())) {
+        // the running launches keep waiting
+        LOGI(true, "Can't start hedged launch %u", attempt);
+        m_hedges[index].running = false;
+    }
+    if (m_hedgePolicy.next()) m_control->startTimer( HedgeTimerId, m_hedgePolicy.gap() );
+}
+
+bool AdbController::hedgesRunning() const
+{
+    for (auto &h : m_hedges) {
+        if (h.running) return true;
+    }
+    return false;
+}
+
 bool AdbController::initAdb(const std::list<std::string> &cl_params)
 {
     m_adbProc.cleanup();
+
+    const std::string &serial = m_adbCtx.config()->getSerial();
+    std::list<std::string> cl;
+    if (!serial.empty()) {
+        cl.emplace_back( "-s" );
+        cl.emplace_back( serial );
+    }
+    cl.insert( cl.end(), cl_params.begin(), cl_params.end() );
     
-    if (!m_adbProc.exec( m_adbCtx.config()->getAdbCmd(), cl_params )) {
+    if (!m_adbProc.exec( m_adbCtx.config()->getAdbCmd(), cl )) {
         LOG(true, "Can't spawn %s", m_adbCtx.config()->getAdbCmd().c_str());
         return false;
     }
+    m_adbLaunches++;
     
     m_adbStdin = std::make_shared<FHStdIn>(*this, m_adbProc.getStdinFd());
     m_adbStdout = std::make_shared<FHStdOut>(*this, m_adbProc.getStdoutFd());
@@ -205,6 +278,117 @@ bool AdbController::initAdb(const std::list<std::string> &cl_params)
     return true;
 }
 
+bool AdbController::initNative(const std::list<std::string> &cl_params)
+{
+    // "shell [-t|-T] [command...]" only, the rest needs the adb client
+    auto it = cl_params.begin();
+    if (it == cl_params.end() || *it != "shell") return false;
+    bool pty = false;
+    while (++it != cl_params.end() && (*it == "-t" || *it == "-T")) pty = *it == "-t";
+    std::string command;
+    for (; it != cl_params.end(); ++it) {
+        if (!command.empty()) command.push_back( ' ' );
+        command.append( *it );
+    }
+
+    std::string error;
+    const int fd = ShellProtocol::openShell( ShellProtocol::serverPort(), m_adbCtx.config()->getSerial(),
+                                             command, pty, error );
+    if (fd < 0) {
+        LOGI(true, "Native shell: %s, using adb", error.c_str());
+        return false;
+    }
+    cleanupChildProc();
+
+    // the stream handlers keep no fd, they hold buffers & task timers
+    m_native = std::make_shared<FHNative>(*this, fd);
+    m_adbStdin = std::make_shared<FHStdIn>(*this, -1);
+    m_adbStdout = std::make_shared<FHStdOut>(*this, -1);
+    m_adbStderr = std::make_shared<FHStdErr>(*this, -1);
+    // each as its own type, for the poller's static dispatch
+    auto add = [this](const auto &fh) {
+        fh->handlerId = m_fpoll.addHandler( fh );
+        return fh->handlerId != FilePoller::BadHandlerId;
+    };
+    if (!add( m_adbStdin ) || !add( m_adbStdout ) || !add( m_adbStderr ) || !add( m_native )) {
+        LOG(true, "Fail to register native shell for polling");
+        cleanupChildProc();
+        return false;
+    }
+    foreachFh( [&](AdbController::FHCommon *fptr) { fptr->setState( true ); } );
+    if (pty) m_native->put( ShellProtocol::windowSize( NativePtyRows, NativePtyCols ) );
+    LOGD(true, "Native shell: %s", command.c_str());
+    return true;
+}
+
+bool AdbController::initControl()
+{
+    if (m_control && m_control->handlerId != FilePoller::BadHandlerId) return true;
+    // kept across operations along with its timer storage, registered for each
+    if (!m_control) m_control = std::make_shared<FHControl>( *this );
+    m_control->handlerId = m_fpoll.addHandler( m_control );
+    if (m_control->handlerId == FilePoller::BadHandlerId) {
+        LOG(true, "Fail to register control handler");
+        return false;
+    }
+    m_control->setState( true );
+    return true;
+}
+
+void AdbController::onHedgeDone(std::size_t index, bool succeeded)
+{
+    if (!m_hedges[index].running) return;
+    m_hedges[index].running = false;
+    if (succeeded) {
+        LOGI(true, "Hedged launch %zu answered first", index + 1);
+        complete( true );
+    } else if (!m_currTask && !hedgesRunning()) {
+        // the first launch is over too
+        complete( false );
+    }
+}
+
+void AdbController::onLogcatLine(std::string_view line)
+{
+    assert( m_currTask );
+    if (auto rec = m_adbCtx.recorder()) rec->onLogcatLine( line );
+    switchTask( m_currTask->onEvent( AdbContext::Event::evLogcatLine, line ) );
+}
+
+void AdbController::onShellExit(int status)
+{
+    assert( m_currTask );
+    if (auto rec = m_adbCtx.recorder()) rec->onShellExit( status );
+    auto task = m_currTask;
+    const auto res = task->onEvent( AdbContext::Event::evShellExit, std::to_string( status ) );
+    if (res != AdbTask::Res::Continue) {
+        switchTask( res );
+        return;
+    }
+    // the task didn't take it, it sees the usual end of output then
+    if (m_currTask == task && m_adbStdout) m_adbStdout->feed( nullptr, 0 );
+}
+
+void AdbController::onShellResult(int status, std::string_view output)
+{
+    assert( m_currTask );
+    m_shellCommand = ShellSession::BadCommandId;
+    if (auto rec = m_adbCtx.recorder()) rec->onShellOutput( status, output );
+    const auto event = status == ShellSession::ShellFailed ? AdbContext::Event::evShellFailed
+                                                           : AdbContext::Event::evShellOutput;
+    switchTask( m_currTask->onEvent( event, output ) );
+}
+
+// hedges of the last operation, none of their handlers is running now
+void AdbController::retireHedges()
+{
+    for (auto &h : m_hedges) {
+        m_bytesRead += h.adb->bytesRead();
+        m_adbLaunches += h.adb->adbLaunches();
+    }
+    m_hedges.clear();
+}
+
 bool AdbController::switchTask(AdbTask::Res res)
 {
     switch (res) {
@@ -212,7 +396,8 @@ bool AdbController::switchTask(AdbTask::Res res)
             assert( false );
         case AdbTask::Res::Fail:
             LOGI(true, "Execution failed");
-            cleanup();
+            endPhase();
+            finish( false );
             return false;
 
         case AdbTask::Res::Continue:
@@ -220,19 +405,26 @@ bool AdbController::switchTask(AdbTask::Res res)
 
         case AdbTask::Res::Next:
             if (m_currTask) m_currTask->cleanup();
+            endPhase();
             break;
     }
     
     if (m_script->hasNext()) {
         m_currTask = m_script->getNextTask();
         assert(m_currTask);
+        m_phaseStart = std::chrono::steady_clock::now();
         if (!m_currTask->start()) {
-            cleanup();
+            endPhase();
+            finish( false );
             return false;
         }
+        if (m_currTask->launchesAgent() && m_hedgePolicy.start( *m_adbCtx.config() )) {
+            LOGD(true, "First hedge in %lld ms", static_cast<long long>( m_hedgePolicy.gap().count() ));
+            m_control->startTimer( HedgeTimerId, m_hedgePolicy.gap() );
+        }
     } else {
         LOGI(true, "Execution done");
-        cleanup();
+        finish( true );
     }
     
     return true;
@@ -241,8 +433,8 @@ bool AdbController::switchTask(AdbTask::Res res)
 
 // AdbController::FHCommon class implementation
 
-AdbController::FHCommon::FHCommon(AdbController &owner, int fd)
-    : FileHandler( fd ), m_owner(owner)
+AdbController::FHCommon::FHCommon(AdbController &owner, int fd, AdbContext::FStream fstream)
+    : FileHandler( fd ), m_owner(owner), m_fstream(fstream)
 {
     
 }
@@ -250,27 +442,47 @@ AdbController::FHCommon::FHCommon(AdbController &owner, int fd)
 bool AdbController::FHCommon::onError()
 {
     // LOG(true, "onError() fs:%d", static_cast<int>(getFH()));
+    if (auto rec = m_owner.m_adbCtx.recorder()) rec->onError( getFH() );
     return m_owner.switchTask( m_owner.m_currTask->onError( getFH() ) );
 }
 
 bool AdbController::FHCommon::onReadyToRead()
 {
-    const auto fstream = getFH();
-    LOGD(true, "onReadyToRead() fs:%d", static_cast<int>(fstream));
+    LOGD(true, "onReadyToRead() fs:%d", static_cast<int>(getFH()));
+    return onRead( Read() );
+}
+
+bool AdbController::FHCommon::feed(const char *data, std::size_t size)
+{
+    if (size > 0) {
+        m_readBuf.reserve( size, true );
+        memcpy( m_readBuf.readPtr(), data, size );
+        m_readBuf.addFilled( size );
+    }
+    return onRead( static_cast<long>( size ) );
+}
 
-    auto read_sz = Read();
+bool AdbController::FHCommon::onRead(long read_sz)
+{
+    const auto fstream = getFH();
     if (read_sz > 0) {
+        m_owner.m_bytesRead += static_cast<std::size_t>( read_sz );
 #ifndef NDEBUG
         std::string s(m_readBuf.head(), m_readBuf.filledSize());
         LOGD(true, "Read str: %s", s.c_str());
 #endif
-        LOGE( this == m_owner.m_adbStderr.get(), "AdbErr: %s", s.c_str() );
+        LOGE( this == m_owner.m_adbStderr.get(), "AdbErr: %.*s",
+              static_cast<int>( m_readBuf.filledSize() ), m_readBuf.head() );
     } else {
         LOGD(read_sz == 0, "zero read");
 //        return m_owner.switchTask( AdbTask::Res::Fail );
     }
 
     std::size_t sz = m_readBuf.filledSize();
+    if (auto rec = m_owner.m_adbCtx.recorder()) {
+        const std::size_t added = read_sz > 0 ? static_cast<std::size_t>( read_sz ) : 0;
+        rec->onData( fstream, m_readBuf.head() + sz - added, added );
+    }
     auto res = m_owner.m_currTask->onDataReady( fstream, m_readBuf.head(), sz );
     if (res != AdbTask::Res::Fail) {
         m_readBuf.cut( sz );
@@ -289,6 +501,11 @@ bool AdbController::FHCommon::onTimer(unsigned int timerId)
 {
     const auto fstream = getFH();
     LOGD(true, "Stream %d onTimer() %u", static_cast<int>(fstream), timerId);
+    if (fstream == AdbContext::FStream::fsControl && timerId == HedgeTimerId) {
+        m_owner.hedge();
+        return true;
+    }
+    if (auto rec = m_owner.m_adbCtx.recorder()) rec->onTimer( fstream, timerId );
     return m_owner.switchTask( m_owner.m_currTask->onTimer( fstream, timerId ) );
 }
 
@@ -315,9 +532,12 @@ long AdbController::FHCommon::Read(std::size_t max)
     return static_cast<long>( total );
 }
 
+// adb's stdin pipe or the native shell's socket, adb may be gone from
+// either end
 long AdbController::FHCommon::Write(const void *ptr, std::size_t size)
 {
-    long ret = write( getFd(), ptr, size );
+    long ret = getFH() == AdbContext::FStream::fsStdIn ? writePipe( getFd(), ptr, size )
+                                                       : writeSocket( getFd(), ptr, size );
     if (ret < 0) {
         if (errno == EAGAIN) return 0;
         LOG(true, "Write error occured, Errno %d", errno);
@@ -347,11 +567,6 @@ bool AdbController::FHStdIn::onReadyToWrite()
     return true;
 }
 
-AdbContext::FStream AdbController::FHStdIn::getFH() const
-{
-    return AdbContext::FStream::fsStdIn;
-}
-
 bool AdbController::FHStdIn::put(const std::string &data)
 {
     return put( data.data(), data.size() );
@@ -364,14 +579,101 @@ bool AdbController::FHStdIn::put(const void *buf, std::size_t size)
     return true;
 }
 
-AdbContext::FStream AdbController::FHStdOut::getFH() const
+AdbController::FHStdOut::~FHStdOut()
+{
+    if (m_strand) m_strand->close();
+}
+
+// With a scan pool the task's stream goes there as read, only the lines it
+// needs come back, fed as if they were all the output
+bool AdbController::FHStdOut::onReadyToRead()
+{
+    if (!m_strand) {
+        const StreamPatterns *patterns = m_owner.m_scanPool && m_owner.m_currTask ?
+                                         m_owner.m_currTask->scanPatterns( getFH() ) : nullptr;
+        if (!patterns || m_owner.m_adbStdout.get() != this) return FHCommon::onReadyToRead();
+        std::weak_ptr<FHStdOut> self( m_owner.m_adbStdout );
+        m_strand = ScanStrand::create( *m_owner.m_scanPool, m_owner.m_fpoll, *patterns, MaxScanChunks,
+                                       [self](std::string_view lines, bool eof) {
+            if (auto fh = self.lock()) fh->onScanned( lines, eof );
+        });
+        LOGD(true, "Stdout scanned off the poller thread");
+    }
+    const long sz = Read();
+    std::size_t head, size;
+    auto buf = m_readBuf.swapStorage( m_strand->spare(), head, size );
+    m_eof = sz <= 0;
+    m_strand->push( std::move(buf), head, size, m_eof );
+    // a hung up fd stays readable, it isn't polled after its end
+    if (m_eof || m_strand->full()) setPollPaused( true );
+    return true;
+}
+
+bool AdbController::FHResult::onReadyToRead()
+{
+    // unlike a pipe the socket stays readable after the peer is gone
+    const long read_sz = Read();
+    return read_sz > 0 ? onRead( read_sz ) : onError();
+}
+
+bool AdbController::FHNative::onReadyToRead()
+{
+    const long read_sz = Read();
+
+    // a task switch may close the shell under us, the poller keeps this alive
+    std::size_t used = 0, sz;
+    ShellProtocol::PacketId id;
+    std::string_view payload;
+    while (m_owner.m_native.get() == this &&
+           (sz = ShellProtocol::parse( m_readBuf.head() + used, m_readBuf.filledSize() - used, id, payload )) > 0) {
+        used += sz;
+        switch (id) {
+            case ShellProtocol::PacketId::IdStdout:
+                if (!payload.empty()) m_owner.m_adbStdout->feed( payload.data(), payload.size() );
+                break;
+            case ShellProtocol::PacketId::IdStderr:
+                if (!payload.empty()) m_owner.m_adbStderr->feed( payload.data(), payload.size() );
+                break;
+            case ShellProtocol::PacketId::IdExit:
+                m_exited = true;
+                m_owner.onShellExit( payload.empty() ? -1 : static_cast<unsigned char>( payload[0] ) );
+                break;
+            default:
+                LOGD(true, "Native shell: packet %d ignored", static_cast<int>(id));
+                break;
+        }
+    }
+    if (m_owner.m_native.get() != this) return true;
+    m_readBuf.cut( used );
+
+    if (read_sz <= 0) {
+        // unlike a pipe the socket stays readable after the peer is gone
+        setState( false );
+        if (read_sz < 0) return onError();
+        if (!m_exited) return m_owner.m_adbStdout->feed( nullptr, 0 );
+    }
+    return true;
+}
+
+bool AdbController::FHNative::onReadyToWrite()
 {
-    return AdbContext::FStream::fsStdOut;
+    if (!m_writeBuf.empty()) {
+        auto sz = Write( m_writeBuf.ptr(), m_writeBuf.size() );
+        if (sz < 0) {
+            LOG(true, "Native shell write fail");
+            return m_owner.switchTask( AdbTask::Res::Fail );
+        }
+        m_writeBuf.pushHead( static_cast<std::size_t>( sz ) );
+    }
+    if (m_writeBuf.empty()) setWriteRequest( false );
+    return true;
 }
 
-AdbContext::FStream AdbController::FHStdErr::getFH() const
+bool AdbController::FHNative::put(const std::string &packet)
 {
-    return AdbContext::FStream::fsStdErr;
+    m_writeBuf.append( packet.data(), packet.size() );
+    setWriteRequest( true );
+    return true;
 }
 
 
@@ -385,16 +687,22 @@ AdbController::Context::Context(AdbController &owner, std::shared_ptr<Config> cf
 
 bool AdbController::Context::startAdb(const std::list<std::string> &cl)
 {
+    if (auto rec = recorder()) rec->onStart( cl );
+    if (config()->isNativeShell() && m_owner.initNative( cl )) return true;
     return m_owner.initAdb( cl );
 }
 
 void AdbController::Context::stopAdb()
 {
+    if (auto rec = recorder()) rec->onStop();
     return m_owner.cleanupChildProc();
 }
 
 bool AdbController::Context::writeStdIn(const void *buf, std::size_t size)
 {
+    if (m_owner.m_native) {
+        return m_owner.m_native->put( ShellProtocol::packet( ShellProtocol::PacketId::IdStdin, buf, size ) );
+    }
     return m_owner.m_adbStdin->put( buf, size );
 }
 
@@ -404,3 +712,110 @@ bool AdbController::Context::timerCtl(AdbContext::FStream fstream, unsigned int
     assert( fh );
     return start ? fh->startTimer( timerId, ms ) : fh->stopTimer( timerId );
 }
+
+bool AdbController::Context::subscribeLogcat(std::string_view uniq, std::string_view signature)
+{
+    if (!m_owner.m_hubs) return false;
+    unsubscribeLogcat();
+
+    auto hub = m_owner.m_hubs->hub( config()->getAdbCmd(), config()->getSerial(), config()->isBinaryLogcat() );
+    auto id = hub->subscribe( uniq, signature, [this](LogcatHub::SubscriptionId, std::string_view line) {
+        m_owner.onLogcatLine( line );
+    });
+    if (id == LogcatHub::BadSubscriptionId) {
+        LOGI(true, "Shared logcat is not available, using own stream");
+        return false;
+    }
+    m_owner.m_hub = std::move(hub);
+    m_owner.m_subscription = id;
+    return true;
+}
+
+void AdbController::Context::unsubscribeLogcat()
+{
+    if (!m_owner.m_hub) return;
+    m_owner.m_hub->unsubscribe( m_owner.m_subscription );
+    m_owner.m_hub.reset();
+    m_owner.m_subscription = LogcatHub::BadSubscriptionId;
+}
+
+bool AdbController::Context::runShellCommand(const std::string &command)
+{
+    if (!m_owner.m_shells) return false;
+    cancelShellCommand();
+
+    auto shell = m_owner.m_shells->session( config()->getAdbCmd(), config()->getSerial() );
+    auto id = shell->run( command, [this](ShellSession::CommandId, int status, std::string_view output) {
+        m_owner.onShellResult( status, output );
+    });
+    if (id == ShellSession::BadCommandId) {
+        LOGI(true, "Device shell is not available, using own adb");
+        return false;
+    }
+    if (auto rec = recorder()) rec->onStart( {"shell-session", command} );
+    m_owner.m_shell = std::move(shell);
+    m_owner.m_shellCommand = id;
+    return true;
+}
+
+void AdbController::Context::cancelShellCommand()
+{
+    if (!m_owner.m_shell) return;
+    if (m_owner.m_shellCommand != ShellSession::BadCommandId) m_owner.m_shell->cancel( m_owner.m_shellCommand );
+    m_owner.m_shell.reset();
+    m_owner.m_shellCommand = ShellSession::BadCommandId;
+}
+
+AdbContext::ChannelStatus AdbController::Context::openResultChannel(unsigned short port, const std::string &request)
+{
+    closeResultChannel();
+
+    ChannelStatus ret = ChannelStatus::chFailed;
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (fd >= 0) {
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( port );
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        // loopback connect doesn't block, adb server accepts right away
+        if (connect( fd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof(addr) ) < 0) {
+            ret = errno == ECONNREFUSED ? ChannelStatus::chRefused : ChannelStatus::chFailed;
+        } else if (FileHandler::writeSocket( fd, request.data(), request.size() ) == static_cast<long>( request.size() ) &&
+                   fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) == 0) {
+            ret = ChannelStatus::chOpen;
+        }
+    }
+    if (auto rec = recorder()) rec->onStart( {"result-channel", std::to_string( port ), std::to_string( static_cast<int>(ret) )} );
+    if (ret != ChannelStatus::chOpen) {
+        LOGD(true, "Result channel on port %u: %d, errno %d", port, static_cast<int>(ret), errno);
+        if (fd >= 0) close( fd );
+        return ret;
+    }
+
+    auto fh = std::make_shared<FHResult>( m_owner, fd );
+    fh->handlerId = m_owner.m_fpoll.addHandler( fh );
+    if (fh->handlerId == FilePoller::BadHandlerId) {
+        LOG(true, "Fail to register result channel");
+        return ChannelStatus::chFailed;
+    }
+    fh->setState( true );
+    m_owner.m_result = std::move(fh);
+    return ret;
+}
+
+void AdbController::Context::closeResultChannel()
+{
+    if (!m_owner.m_result) return;
+    m_owner.m_result->setState( false );
+    m_owner.m_fpoll.removeHandler( m_owner.m_result->handlerId );
+    m_owner.m_result.reset();
+}
+
+void AdbController::FHStdOut::onScanned(std::string_view lines, bool eof)
+{
+    if (!m_eof) setPollPaused( false );
+    if (m_owner.m_adbStdout.get() != this) return;
+    if (!lines.empty() && !feed( lines.data(), lines.size() )) return;
+    // the lines may have ended the task's adb
+    if (eof && m_owner.m_adbStdout.get() == this) feed( nullptr, 0 );
+}
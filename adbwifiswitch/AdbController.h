@@ -1,8 +1,10 @@
 #ifndef ADBCONTROLLER_H
 #define ADBCONTROLLER_H
 
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <vector>
 
 #include "AdbContext.h"
 #include "AdbTask.h"
@@ -10,19 +12,41 @@
 #include "ChildProcess.h"
 #include "FileHandler.h"
 #include "FilePoller.h"
+#include "HedgePolicy.h"
+#include "LogcatHub.h"
+#include "ScanPool.h"
+#include "Script.h"
+#include "ShellSession.h"
 
 class Config;
-class Script;
 
 class AdbController
 {
 public:
+    // time spent in one task of the script
+    struct Phase {
+        const char *name;
+        std::chrono::microseconds duration;
+    };
+
     AdbController(std::shared_ptr<Config> cfg, FilePoller &fpoll);
     ~AdbController();
 
     bool connectWiFi();
     bool disconnectWiFi();
     int exitCode() const;
+    // hedged launches included
+    std::size_t bytesRead() const;
+    std::size_t adbLaunches() const;
+    const std::vector<Phase> &phases() const {return m_phases;}
+    void setRecorder(std::shared_ptr<SessionRecorder> recorder);
+    void setLogcatHubs(std::shared_ptr<LogcatHubPool> hubs) {m_hubs = std::move(hubs);}
+    void setShellSessions(std::shared_ptr<ShellSessionPool> shells) {m_shells = std::move(shells);}
+    // logcat scans off the poller thread
+    void setScanPool(std::shared_ptr<ScanPool> pool) {m_scanPool = std::move(pool);}
+    // called once the operation is over, hedged launches included; don't
+    // start the next operation from it
+    void setCompletionHandler(std::function<void(bool succeeded)> handler) {m_onComplete = std::move(handler);}
     
 private:
     enum Mode {
@@ -36,34 +60,40 @@ private:
         
     };
     
+    // The stream handlers are final and registered as their own types: the
+    // poller calls them without going through the vtable
     class FHCommon : public FileHandler {
     public:
-        FHCommon(AdbController &owner, int fd);
+        FHCommon(AdbController &owner, int fd, AdbContext::FStream fstream);
 
-        virtual AdbContext::FStream getFH() const = 0;
+        AdbContext::FStream getFH() const {return m_fstream;}
 
         virtual bool onError() override;
         virtual bool onReadyToRead() override;
         virtual bool onReadyToWrite() override;
         virtual bool onTimer( unsigned int timerId ) override;
 
-        FilePoller::HandlerId handlerId;
+        // data that came some other way than the fd, size 0 is the end
+        bool feed(const char *data, std::size_t size);
+
+        FilePoller::HandlerId handlerId = FilePoller::BadHandlerId;
         
     protected:
+        bool onRead(long read_sz);
         long Read(std::size_t max = 10*1024);
         long Write(const void *ptr, std::size_t size);
         
         ReadBuffer m_readBuf;
         AdbController &m_owner;
+        const AdbContext::FStream m_fstream;
     };
     
-    class FHStdIn : public FHCommon {
+    class FHStdIn final : public FHCommon {
     public:
-        using FHCommon::FHCommon;
+        FHStdIn(AdbController &owner, int fd) : FHCommon(owner, fd, AdbContext::FStream::fsStdIn) {}
 
         virtual bool onReadyToRead() override;
         virtual bool onReadyToWrite() override;
-        virtual AdbContext::FStream getFH() const override;
 
         bool put(const std::string &data);
         bool put(const void *, std::size_t size);
@@ -72,18 +102,58 @@ private:
         WriteBuffer m_writeBuf;
     };
     
-    class FHStdOut : public FHCommon {
+    class FHStdOut final : public FHCommon {
+    public:
+        FHStdOut(AdbController &owner, int fd) : FHCommon(owner, fd, AdbContext::FStream::fsStdOut) {}
+        virtual ~FHStdOut();
+        virtual bool onReadyToRead() override;
+
+    private:
+        void onScanned(std::string_view lines, bool eof);
+
+        std::shared_ptr<ScanStrand> m_strand;
+        bool m_eof = false;
+    };
+    
+    class FHStdErr final : public FHCommon {
+    public:
+        FHStdErr(AdbController &owner, int fd) : FHCommon(owner, fd, AdbContext::FStream::fsStdErr) {}
+    };
+    
+    // no fd, holds timers of tasks waiting on a shared logcat stream
+    class FHControl final : public FHCommon {
+    public:
+        FHControl(AdbController &owner) : FHCommon(owner, -1, AdbContext::FStream::fsControl) {}
+    };
+    
+    // forwarded TCP socket to the agent, owns the fd
+    class FHResult final : public FHCommon {
     public:
-        using FHCommon::FHCommon;
-        virtual AdbContext::FStream getFH() const override;
+        FHResult(AdbController &owner, int fd) : FHCommon(owner, fd, AdbContext::FStream::fsResult) {}
+        virtual bool onReadyToRead() override;
     };
     
-    class FHStdErr : public FHCommon {
+    // adb server socket speaking shell v2, its packets are passed on to the
+    // fd-less stdout & stderr handlers
+    class FHNative final : public FHCommon {
     public:
-        using FHCommon::FHCommon;
-        virtual AdbContext::FStream getFH() const override;
+        FHNative(AdbController &owner, int fd) : FHCommon(owner, fd, AdbContext::FStream::fsStdOut) {}
+        virtual bool onReadyToRead() override;
+        virtual bool onReadyToWrite() override;
+
+        bool put(const std::string &packet);
+
+    private:
+        WriteBuffer m_writeBuf;
+        bool m_exited = false;
     };
     
+    // the operation launched again while the first launch waits
+    struct Hedge {
+        std::shared_ptr<AdbController> adb;
+        bool running;
+    };
+
     class Context : public AdbContext {
     public:
         Context(AdbController &owner, std::shared_ptr<Config> cfg);
@@ -93,42 +163,65 @@ private:
         virtual bool writeStdIn(const void *buf, std::size_t size) override;
         virtual bool timerCtl(FStream fstream, unsigned int timerId, bool start,
                               std::chrono::milliseconds ms=std::chrono::milliseconds::zero()) override;
+        virtual bool subscribeLogcat(std::string_view uniq, std::string_view signature) override;
+        virtual void unsubscribeLogcat() override;
+        virtual ChannelStatus openResultChannel(unsigned short port, const std::string &request) override;
+        virtual void closeResultChannel() override;
+        virtual bool runShellCommand(const std::string &command) override;
+        virtual void cancelShellCommand() override;
     private:
         AdbController &m_owner;
     };
     
     void cleanup();
     void cleanupChildProc();
-    void foreachFh( std::function<void(FHCommon *)> proc );
+    void complete(bool succeeded);
+    void endPhase();
+    void finish(bool succeeded);
+    template <typename Proc>
+    void foreachFh(Proc proc);
     FileHandler *getFH(AdbContext::FStream fstream);
+    void hedge();
+    bool hedgesRunning() const;
     bool initAdb(const std::list<std::string> &cl_params);
+    bool initControl();
+    bool initNative(const std::list<std::string> &cl_params);
+    void onHedgeDone(std::size_t index, bool succeeded);
+    void onLogcatLine(std::string_view line);
+    void onShellExit(int status);
+    void onShellResult(int status, std::string_view output);
+    void retireHedges();
     bool switchTask( AdbTask::Res res );
     
     Context m_adbCtx;
+    // handed to the scripts, made once
+    std::shared_ptr<AdbContext> m_sharedCtx;
     ChildProcess m_adbProc;
     std::shared_ptr<FHStdIn> m_adbStdin;
     std::shared_ptr<FHStdOut> m_adbStdout;
     std::shared_ptr<FHStdErr> m_adbStderr;
+    std::shared_ptr<FHNative> m_native;
+    std::shared_ptr<FHControl> m_control;
+    std::shared_ptr<FHResult> m_result;
+    std::shared_ptr<LogcatHubPool> m_hubs;
+    std::shared_ptr<LogcatHub> m_hub;
+    LogcatHub::SubscriptionId m_subscription = LogcatHub::BadSubscriptionId;
+    std::shared_ptr<ShellSessionPool> m_shells;
+    std::shared_ptr<ShellSession> m_shell;
+    ShellSession::CommandId m_shellCommand = ShellSession::BadCommandId;
+    std::shared_ptr<ScanPool> m_scanPool;
+    std::function<void(bool)> m_onComplete;
     std::shared_ptr<AdbTask> m_currTask;
     FilePoller &m_fpoll;
     std::shared_ptr<Script> m_script;
-};
-
-class Script {
-public:
-    Script(std::shared_ptr<AdbContext> ctx) : m_ctx(std::move(ctx)) {}
-    virtual ~Script() = default;
-    
-    std::shared_ptr<AdbContext> ctx() {return m_ctx;}
-
-    virtual std::shared_ptr<AdbTask> getNextTask() = 0;
-    virtual bool hasNext() const = 0;
-    virtual void reset() {m_curr = -1;}
-
-protected:
-    int m_curr = -1;
-private:
-    std::shared_ptr<AdbContext> m_ctx;
+    Mode m_mode = ConnectWiFi;
+    HedgePolicy m_hedgePolicy;
+    std::vector<Hedge> m_hedges;
+    std::size_t m_bytesRead = 0;
+    std::size_t m_adbLaunches = 0;
+    std::vector<Phase> m_phases;
+    std::chrono::steady_clock::time_point m_phaseStart;
+    bool m_succeeded = false;
 };
 
 
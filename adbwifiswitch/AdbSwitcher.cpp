@@ -0,0 +1,203 @@
+#include "AdbSwitcher.h"
+#include "Config.h"
+#include "LogcatHub.h"
+#include "Logger.h"
+#include "SessionRecorder.h"
+#include "ShellSession.h"
+
+namespace {
+enum {
+    DispatchTimerId = 1,
+};
+} // namespace anonymous
+
+
+// AdbSwitcher class implementation
+
+AdbSwitcher::AdbSwitcher(FilePoller &fpoll)
+    : m_fpoll(fpoll), m_dispatch(std::make_shared<FHDispatch>( *this ))
+{
+
+}
+
+AdbSwitcher::~AdbSwitcher()
+{
+    // controllers go first, they use the shared streams
+    for (auto &op : m_ops) op.adb.reset();
+    if (m_hubs) m_hubs->shutdown();
+    if (m_shells) m_shells->shutdown();
+    if (m_dispatchId != FilePoller::BadHandlerId) m_fpoll.removeHandler( m_dispatchId );
+}
+
+void AdbSwitcher::setLogcatHubs(bool enable)
+{
+    m_hubs = enable ? std::make_shared<LogcatHubPool>( m_fpoll ) : std::shared_ptr<LogcatHubPool>();
+    if (m_hubs) m_hubs->setScanPool( m_scanPool );
+}
+
+void AdbSwitcher::setShellSessions(bool enable)
+{
+    m_shells = enable ? std::make_shared<ShellSessionPool>( m_fpoll ) : std::shared_ptr<ShellSessionPool>();
+}
+
+void AdbSwitcher::setScanPool(std::shared_ptr<ScanPool> pool)
+{
+    m_scanPool = std::move(pool);
+    if (m_hubs) m_hubs->setScanPool( m_scanPool );
+}
+
+AdbSwitcher::OperationId AdbSwitcher::submit(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg,
+                                             AdbSwitcher::Handler handler,
+                                             std::shared_ptr<SessionRecorder> recorder)
+{
+    if (!cfg) return BadOperationId;
+    if (m_dispatchId == FilePoller::BadHandlerId) {
+        m_dispatchId = m_fpoll.addHandler( m_dispatch );
+        if (m_dispatchId == FilePoller::BadHandlerId) {
+            LOGE(true, "Fail to register operation dispatcher");
+            return BadOperationId;
+        }
+    }
+
+    if (++m_lastId == BadOperationId) ++m_lastId;
+    m_ops.emplace_back();
+    Operation &op = m_ops.back();
+    op.id = m_lastId;
+    op.mode = mode;
+    op.cfg = std::move(cfg);
+    op.handler = std::move(handler);
+    op.recorder = std::move(recorder);
+    op.result = Result{op.id, false, false, 0, {}};
+    LOGD(true, "Operation %u for device '%s' submitted, %zu pending", op.id, op.cfg->getSerial().c_str(),
+         m_ops.size());
+    if (isRunnable( std::prev( m_ops.end() ) )) start( op );
+    return op.id;
+}
+
+std::future<AdbSwitcher::Result> AdbSwitcher::submitConnect(std::shared_ptr<Config> cfg)
+{
+    return submitFuture( Mode::Connect, std::move(cfg) );
+}
+
+std::future<AdbSwitcher::Result> AdbSwitcher::submitDisconnect(std::shared_ptr<Config> cfg)
+{
+    return submitFuture( Mode::Disconnect, std::move(cfg) );
+}
+
+bool AdbSwitcher::cancel(AdbSwitcher::OperationId id)
+{
+    for (auto &op : m_ops) {
+        if (op.id != id) continue;
+        if (op.done) return false;
+        LOGD(true, "Operation %u cancelled", id);
+        stop( op );
+        return true;
+    }
+    return false;
+}
+
+void AdbSwitcher::shutdown()
+{
+    for (auto &op : m_ops) {
+        if (!op.done) stop( op );
+    }
+    if (m_hubs) m_hubs->shutdown();
+    if (m_shells) m_shells->shutdown();
+}
+
+
+// AdbSwitcher:: private members
+
+// Finished operations are reported and dropped here, outside of their
+// controllers' handlers, then the devices they held take the next ones
+void AdbSwitcher::dispatch()
+{
+    std::list<Operation> finished;
+    for (auto it = m_ops.begin(); it != m_ops.end();) {
+        auto next = std::next( it );
+        if (it->done) {
+            if (it->adb) {
+                it->result.succeeded = it->result.started && it->adb->exitCode() == 0;
+                it->result.adbLaunches = it->adb->adbLaunches();
+                it->result.phases = it->adb->phases();
+                it->adb.reset();
+            }
+            finished.splice( finished.end(), m_ops, it );
+        }
+        it = next;
+    }
+    for (auto it = m_ops.begin(); it != m_ops.end(); ++it) {
+        if (!it->adb && !it->done && isRunnable( it )) start( *it );
+    }
+
+    for (auto &op : finished) {
+        LOGD(true, "Operation %u %s", op.id, op.result.succeeded ? "succeeded" : "failed");
+        if (op.handler) op.handler( op.result );
+    }
+    // no handlers left, the poller may end
+    if (m_ops.empty()) m_dispatch->setState( false );
+}
+
+void AdbSwitcher::schedule()
+{
+    m_dispatch->setState( true );
+    m_dispatch->startTimer( DispatchTimerId, std::chrono::milliseconds::zero() );
+}
+
+void AdbSwitcher::start(AdbSwitcher::Operation &op)
+{
+    op.adb.reset( new AdbController( op.cfg, m_fpoll ) );
+    if (op.recorder) op.adb->setRecorder( op.recorder );
+    op.adb->setLogcatHubs( m_hubs );
+    op.adb->setShellSessions( m_shells );
+    op.adb->setScanPool( m_scanPool );
+    Operation *ptr = &op;
+    op.adb->setCompletionHandler( [this, ptr](bool) {
+        ptr->done = true;
+        schedule();
+    });
+    op.result.started = op.mode == Mode::Connect ? op.adb->connectWiFi() : op.adb->disconnectWiFi();
+    if (!op.result.started) {
+        op.done = true;
+        schedule();
+    }
+}
+
+void AdbSwitcher::stop(AdbSwitcher::Operation &op)
+{
+    if (op.adb) {
+        op.result.adbLaunches = op.adb->adbLaunches();
+        op.result.phases = op.adb->phases();
+        op.adb.reset();
+    }
+    op.result.succeeded = false;
+    op.done = true;
+    schedule();
+}
+
+// one operation per device at a time, in submission order
+bool AdbSwitcher::isRunnable(const std::list<AdbSwitcher::Operation>::iterator &op) const
+{
+    const std::string &serial = op->cfg->getSerial();
+    for (auto it = m_ops.begin(); it != op; ++it) {
+        if (!it->done && it->cfg->getSerial() == serial) return false;
+    }
+    return true;
+}
+
+std::future<AdbSwitcher::Result> AdbSwitcher::submitFuture(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg)
+{
+    auto promise = std::make_shared<std::promise<Result> >();
+    auto ret = promise->get_future();
+    submit( mode, std::move(cfg), [promise](const Result &res) {promise->set_value( res );} );
+    return ret;
+}
+
+
+// AdbSwitcher::FHDispatch class implementation
+
+bool AdbSwitcher::FHDispatch::onTimer(unsigned int timerId)
+{
+    m_owner.dispatch();
+    return true;
+}
@@ -0,0 +1,119 @@
+#ifndef ADBSWITCHER_H
+#define ADBSWITCHER_H
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "AdbController.h"
+#include "FileHandler.h"
+#include "FilePoller.h"
+
+class Config;
+class LogcatHubPool;
+class ScanPool;
+class SessionRecorder;
+class ShellSessionPool;
+
+// Entry point of the library: runs switch operations on the caller's poller
+// without blocking, any number of them at a time. Operations on different
+// devices overlap, the ones on the same serial run in submission order.
+// Results are handed over from the poller loop, never from inside submit();
+// all calls belong to the thread running the poller, other threads hand
+// them over with FilePoller::post().
+class AdbSwitcher {
+public:
+    typedef unsigned int OperationId;
+    static const OperationId BadOperationId = 0;
+
+    enum class Mode {
+        Connect, Disconnect
+    };
+
+    struct Result {
+        OperationId id;
+        // false when the operation couldn't start or was cancelled first
+        bool started;
+        bool succeeded;
+        std::size_t adbLaunches;
+        std::vector<AdbController::Phase> phases;
+    };
+    typedef std::function<void(const Result &)> Handler;
+
+    explicit AdbSwitcher(FilePoller &fpoll);
+    ~AdbSwitcher();
+
+    // shared per-device logcat streams and shells for all operations, set
+    // before the first submit
+    void setLogcatHubs(bool enable);
+    void setShellSessions(bool enable);
+    // logcat streams scanned on these threads, may be shared by switchers
+    void setScanPool(std::shared_ptr<ScanPool> pool);
+
+    OperationId submit(Mode mode, std::shared_ptr<Config> cfg, Handler handler,
+                       std::shared_ptr<SessionRecorder> recorder = std::shared_ptr<SessionRecorder>());
+    OperationId submitConnect(std::shared_ptr<Config> cfg, Handler handler) {
+        return submit( Mode::Connect, std::move(cfg), std::move(handler) );
+    }
+    OperationId submitDisconnect(std::shared_ptr<Config> cfg, Handler handler) {
+        return submit( Mode::Disconnect, std::move(cfg), std::move(handler) );
+    }
+    // ready once the poller has run the operation
+    std::future<Result> submitConnect(std::shared_ptr<Config> cfg);
+    std::future<Result> submitDisconnect(std::shared_ptr<Config> cfg);
+
+    // a queued operation is dropped, a running one is stopped; either way
+    // its handler gets a failure
+    bool cancel(OperationId id);
+    // submitted and not reported yet
+    std::size_t pending() const {return m_ops.size();}
+    // cancels all operations and closes the shared streams, so the poller
+    // runs out of handlers
+    void shutdown();
+
+private:
+    struct Operation {
+        OperationId id;
+        Mode mode;
+        std::shared_ptr<Config> cfg;
+        Handler handler;
+        std::shared_ptr<SessionRecorder> recorder;
+        std::unique_ptr<AdbController> adb;
+        Result result;
+        bool done = false;
+    };
+
+    // no fd, its timer reports finished operations outside their handlers
+    class FHDispatch final : public FileHandler {
+    public:
+        FHDispatch(AdbSwitcher &owner) : FileHandler(-1), m_owner(owner) {}
+        virtual bool onError() override {return true;}
+        virtual bool onReadyToRead() override {return true;}
+        virtual bool onReadyToWrite() override {return true;}
+        virtual bool onTimer(unsigned int timerId) override;
+
+    private:
+        AdbSwitcher &m_owner;
+    };
+
+    void dispatch();
+    void schedule();
+    void start(Operation &op);
+    void stop(Operation &op);
+    bool isRunnable(const std::list<Operation>::iterator &op) const;
+    std::future<Result> submitFuture(Mode mode, std::shared_ptr<Config> cfg);
+
+    FilePoller &m_fpoll;
+    std::shared_ptr<FHDispatch> m_dispatch;
+    FilePoller::HandlerId m_dispatchId = FilePoller::BadHandlerId;
+    std::shared_ptr<LogcatHubPool> m_hubs;
+    std::shared_ptr<ShellSessionPool> m_shells;
+    std::shared_ptr<ScanPool> m_scanPool;
+    // in submission order
+    std::list<Operation> m_ops;
+    OperationId m_lastId = BadOperationId;
+};
+
+#endif // ADBSWITCHER_H
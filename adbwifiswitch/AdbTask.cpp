@@ -1,8 +1,17 @@
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <span>
 #include <string_view>
 
 #include "Config.h"
+#include "DeviceClock.h"
+#include "LatencyHistory.h"
 #include "Logger.h"
 
 #include "AdbTask.h"
@@ -13,39 +22,206 @@ enum {
     FirstPromptWaitTime = 10, // seconds
     LogcatWaitTime = 30,  // seconds
     SecondPromptWaitTime = 3, // seconds
+    ClockProbeWaitTime = 5, // seconds
+    AgentProbeWaitTime = 5, // seconds
+    // the probe's times are cut to whole milliseconds, its offset may be
+    // that much over on each side
+    ClockRoundingError = 2, // milliseconds
+    ChannelRetryTime = 50, // milliseconds
+    MaxChannelRetries = 60,
     TaskTimerId=10,
+    ChannelRetryTimerId=11,
+    // the composite command's output lines, after its result pattern
+    OutputPattern = 1,
 };
 const char LineFeed[] = "\n";
 const char ExitCmd[] = "\nexit\n";
 const char CtrlC[] = "\0x3";
+const char CmdDate[] = "date";
+const char DateEpochFormat[] = "+%s.%N";
+const char DefaultDevice[] = "-";
+
+// agent probe results by device serial, true for a current agent
+struct AgentVersions {
+    std::mutex lock;
+    std::map<std::string, bool> devices;
+};
+
+AgentVersions &agentVersions()
+{
+    static AgentVersions inst;
+    return inst;
+}
+
+// pattern sets are compiled once, on the first use by their task
+template <typename Add>
+StreamPatterns compilePatterns(Add add)
+{
+    StreamPatterns ret;
+    add( ret );
+    const bool ok = ret.compile();
+    assert( ok );
+    (void)ok;
+    return ret;
+}
 } // namespace anonymous
 
 namespace java {
-const char Agent[] = "com.steinwurf.adbjoinwifi";
-const char AgentTag[] = "adbjoinwifi";
-const char Activity[] = ".MainActivity";
-const char ModeParam[] = "mode ";
-const char ModeConnect[] = "connect";
-const char ModeDisconnect[] = "disconnect";
-const char PasswdParam[] = "password ";
-const char PasswdTypeParam[] = "password_type ";
-const char PasswordTypeWep[] = "WEP";
-const char PasswordTypeWpa[] = "WPA";
-const char SsidParam[] = "ssid ";
-const char UniqParam[] = "uniq ";
-const char ActivitySwitch[] = "-n ";
-const char ExtraSwitch[] = "-e ";
-const char CmdShell[] = "shell";
-const char ShellPtyAlloc[] = "-t";
-const char CmdActivityManager[] = "am";
-const char CmdStart[] = "start";
-const char CmdLogcat[] = "logcat";
-const char LogcatThreadTime[] = "-v threadtime";
-const char LogcatCountParam[] = "-T20";
-const char ConnectSignature[] = "Mode connect run completed";
-const char DisconnectSignature[] = "Mode disconnect run completed";
+constexpr char Agent[] = "com.steinwurf.adbjoinwifi";
+constexpr char AgentTag[] = "adbjoinwifi";
+constexpr char Activity[] = ".MainActivity";
+constexpr char Receiver[] = ".SwitchReceiver";
+constexpr char ModeParam[] = "mode ";
+constexpr char ModeConnect[] = "connect";
+constexpr char ModeDisconnect[] = "disconnect";
+constexpr char PasswdParam[] = "password ";
+constexpr char PasswdTypeParam[] = "password_type ";
+constexpr char PasswordTypeWep[] = "WEP";
+constexpr char PasswordTypeWpa[] = "WPA";
+constexpr char SsidParam[] = "ssid ";
+constexpr char UniqParam[] = "uniq ";
+constexpr char ActivitySwitch[] = "-n ";
+constexpr char ExtraSwitch[] = "-e ";
+constexpr char CmdShell[] = "shell";
+constexpr char CmdExecOut[] = "exec-out";
+constexpr char ShellPtyAlloc[] = "-t";
+constexpr char CmdActivityManager[] = "am";
+constexpr char CmdStart[] = "start";
+constexpr char CmdBroadcast[] = "broadcast";
+constexpr char BroadcastDispatched[] = "Broadcasting:";
+constexpr char CmdLogcat[] = "logcat";
+constexpr char CmdForward[] = "forward";
+constexpr char ForwardTcp[] = "tcp:";
+constexpr char AgentSocket[] = "localabstract:adbjoinwifi";
+constexpr char LogcatThreadTime[] = "-v threadtime";
+constexpr char LogcatBinary[] = "-B";
+constexpr char LogcatCountParam[] = "-T20";
+constexpr char LogcatSinceParam[] = "-T";
+constexpr char LogcatSilentParam[] = "-s";
+constexpr char LogcatAgentFilter[] = "adbjoinwifi:V";
+constexpr char LogcatMaxCount[] = "-m 1";
+constexpr char LogcatRegexParam[] = "-e";
+constexpr char ConnectSignature[] = "Mode connect run completed";
+constexpr char DisconnectSignature[] = "Mode disconnect run completed";
+constexpr char FailedSignature[] = " run failed";
+constexpr char ResultMarker[] = "adbwifiswitch-result";
+constexpr char OutputMarker[] = "adbwifiswitch-output";
+constexpr char StageLaunched[] = "launched";
+constexpr char StageOk[] = "ok";
+constexpr char CmdService[] = "cmd";
+constexpr char PackageService[] = "package";
+constexpr char QueryReceivers[] = "query-receivers";
+constexpr char BriefParam[] = "--brief";
+constexpr char ComponentParam[] = "-n";
+constexpr char NoReceivers[] = "No receivers found";
+}
+
+namespace {
+// Intent command lines are fixed text with the operation's values between:
+// the fixed parts are joined at compile time, a launch only adds the values
+template <std::size_t N>
+struct JoinedText {
+    constexpr std::string_view view() const {return std::string_view( text, N - 1 );}
+
+    char text[N] = {};
+};
+
+template <std::size_t... Ns>
+constexpr JoinedText<(Ns + ...) - sizeof...(Ns) + 1> joinText(const char (&...parts)[Ns])
+{
+    JoinedText<(Ns + ...) - sizeof...(Ns) + 1> ret;
+    std::size_t pos = 0;
+    ((std::copy_n( parts, Ns - 1, ret.text + pos ), pos += Ns - 1), ...);
+    return ret;
+}
+
+enum class IntentValue {
+    None, Uniq, Ssid, Password, PasswordType
+};
+
+// one argument: its fixed text, then the value
+struct IntentArg {
+    std::string_view text;
+    IntentValue value = IntentValue::None;
+};
+
+constexpr auto ActivityComponent = joinText( java::ActivitySwitch, java::Agent, "/", java::Activity );
+constexpr auto ReceiverComponent = joinText( java::ActivitySwitch, java::Agent, "/", java::Receiver );
+constexpr auto ReceiverName = joinText( java::Agent, "/", java::Receiver );
+constexpr auto ConnectMode = joinText( java::ExtraSwitch, java::ModeParam, java::ModeConnect );
+constexpr auto DisconnectMode = joinText( java::ExtraSwitch, java::ModeParam, java::ModeDisconnect );
+constexpr auto UniqExtra = joinText( java::ExtraSwitch, java::UniqParam );
+constexpr auto SsidExtra = joinText( java::ExtraSwitch, java::SsidParam );
+constexpr auto PasswdExtra = joinText( java::ExtraSwitch, java::PasswdParam );
+constexpr auto PasswdTypeExtra = joinText( java::ExtraSwitch, java::PasswdTypeParam );
+
+constexpr IntentArg ConnectStart[] = {
+    {java::CmdActivityManager}, {java::CmdStart}, {ActivityComponent.view()}, {ConnectMode.view()},
+    {UniqExtra.view(), IntentValue::Uniq}, {SsidExtra.view(), IntentValue::Ssid},
+    {PasswdExtra.view(), IntentValue::Password}, {PasswdTypeExtra.view(), IntentValue::PasswordType},
+};
+constexpr IntentArg ConnectBroadcast[] = {
+    {java::CmdActivityManager}, {java::CmdBroadcast}, {ReceiverComponent.view()}, {ConnectMode.view()},
+    {UniqExtra.view(), IntentValue::Uniq}, {SsidExtra.view(), IntentValue::Ssid},
+    {PasswdExtra.view(), IntentValue::Password}, {PasswdTypeExtra.view(), IntentValue::PasswordType},
+};
+constexpr IntentArg DisconnectStart[] = {
+    {java::CmdActivityManager}, {java::CmdStart}, {ActivityComponent.view()}, {DisconnectMode.view()},
+    {UniqExtra.view(), IntentValue::Uniq},
+};
+constexpr IntentArg DisconnectBroadcast[] = {
+    {java::CmdActivityManager}, {java::CmdBroadcast}, {ReceiverComponent.view()}, {DisconnectMode.view()},
+    {UniqExtra.view(), IntentValue::Uniq},
+};
+
+std::span<const IntentArg> intentArgs(bool connect, bool broadcast)
+{
+    if (connect) return broadcast ? std::span<const IntentArg>( ConnectBroadcast ) : std::span<const IntentArg>( ConnectStart );
+    return broadcast ? std::span<const IntentArg>( DisconnectBroadcast ) : std::span<const IntentArg>( DisconnectStart );
+}
+
+std::string_view intentValue(const Config &cfg, const std::string &uniq, IntentValue value)
+{
+    switch (value) {
+        case IntentValue::Uniq: return uniq;
+        case IntentValue::Ssid: return cfg.getSsid();
+        case IntentValue::Password: return cfg.getPassword();
+        case IntentValue::PasswordType: return cfg.getAuthType();
+        default: return std::string_view();
+    }
 }
 
+// as arguments of an adb command line
+void intentParams(std::span<const IntentArg> args, const Config &cfg, const std::string &uniq,
+                  std::list<std::string> &cl)
+{
+    for (auto &arg : args) cl.emplace_back( arg.text ).append( intentValue( cfg, uniq, arg.value ) );
+}
+
+// as a device command, the way adb shell joins the arguments
+void appendIntent(std::span<const IntentArg> args, const Config &cfg, const std::string &uniq, std::string &cmd)
+{
+    for (auto &arg : args) {
+        if (&arg != args.data()) cmd.push_back( ' ' );
+        cmd.append( arg.text ).append( intentValue( cfg, uniq, arg.value ) );
+    }
+}
+
+// device commands are put together here, the shell keeps its own copy
+thread_local std::string t_command;
+
+// adb shell joins its arguments with spaces as well
+std::string joinArgs(const std::list<std::string> &cl)
+{
+    std::string ret;
+    for (auto &s : cl) {
+        if (!ret.empty()) ret.push_back( ' ' );
+        ret.append( s );
+    }
+    return ret;
+}
+} // namespace anonymous
+
 
 AdbTask::AdbTask(std::shared_ptr<AdbContext> ctx)
     : m_context(std::move(ctx))
@@ -71,6 +247,195 @@ AdbTask::Res AdbTask::onTimer(AdbContext::FStream fstream, unsigned int timerId)
     return Res::Fail;
 }
 
+AdbTask::Res AdbTask::onEvent(AdbContext::Event event, std::string_view data)
+{
+    LOGD(true, "Unhandled event %d", static_cast<int>(event));
+    return Res::Continue;
+}
+
+bool AdbTask::runInShell(const std::string &command)
+{
+    m_viaShell = m_context->runShellCommand( command );
+    return m_viaShell;
+}
+
+bool AdbTask::startPhaseTimer(AdbContext::FStream fstream, LatencyHistory::Phase phase, std::chrono::milliseconds fixed)
+{
+    m_phase = phase;
+    m_phaseStart = std::chrono::steady_clock::now();
+    m_phaseDeadline = phaseTimeout( phase, fixed );
+    LOGD(m_phaseDeadline < fixed, "Phase %s deadline %lld ms", name(), static_cast<long long>( m_phaseDeadline.count() ));
+    return m_context->timerCtl(fstream, TaskTimerId, true, m_phaseDeadline);
+}
+
+std::chrono::milliseconds AdbTask::phaseTimeout(LatencyHistory::Phase phase, std::chrono::milliseconds fixed) const
+{
+    const Config &cfg = *m_context->config();
+    if (!cfg.isAdaptiveTimeouts()) return fixed;
+    return LatencyHistory::instance().timeout( cfg.getSerial(), phase, std::chrono::milliseconds(cfg.getMinTimeoutMs()),
+                                               fixed );
+}
+
+void AdbTask::phaseDone()
+{
+    if (m_phaseDeadline == m_phaseDeadline.zero()) return;
+    m_phaseDeadline = m_phaseDeadline.zero();
+    LatencyHistory::instance().add( m_context->config()->getSerial(), m_phase,
+        std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - m_phaseStart ) );
+}
+
+void AdbTask::phaseTimedOut()
+{
+    if (m_phaseDeadline == m_phaseDeadline.zero()) return;
+    LatencyHistory::instance().timedOut( m_context->config()->getSerial(), m_phase, m_phaseDeadline );
+    m_phaseDeadline = m_phaseDeadline.zero();
+}
+
+
+// AdbTaskFlow class implementation
+
+void AdbTaskFlow::cleanup()
+{
+    if (!isRunning()) return;
+    stopTimer();
+    if (m_shellPending) m_context->cancelShellCommand();
+    if (m_adbStarted) m_context->stopAdb();
+    m_shellPending = m_adbStarted = false;
+    setState( State::Stopped );
+}
+
+bool AdbTaskFlow::start()
+{
+    setState( State::Running );
+    m_flow = run();
+    m_flow.resume();
+    if (!m_flow.done()) return true;
+    // the result goes out from a callback, never from start()
+    if (m_flow.result() == Next) {
+        m_timerStream = timerStream();
+        m_timerOn = m_context->timerCtl( m_timerStream, TaskTimerId, true );
+        if (m_timerOn) return true;
+    }
+    cleanup();
+    return false;
+}
+
+AdbTask::Res AdbTaskFlow::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
+{
+    // only a command run by its own adb is read here, stderr is dropped
+    if (!isRunning() || !m_adbStarted || !isStdout( fstream )) return Continue;
+    if (size > 0) {
+        m_output.append( input, size );
+        return Continue;
+    }
+    return onAnswer();
+}
+
+AdbTask::Res AdbTaskFlow::onError(AdbContext::FStream fstream)
+{
+    // stdin goes first when adb exits, the output is read to its end
+    if (!isRunning() || !m_adbStarted || !isStdout( fstream )) return Continue;
+    return onAnswer();
+}
+
+AdbTask::Res AdbTaskFlow::onTimer(AdbContext::FStream fstream, unsigned int timerId)
+{
+    assert( timerId == TaskTimerId );
+    if (!isRunning() || !m_timerOn) return Continue;
+    m_timerOn = false;
+    if (m_flow.done()) return finish();
+    m_timedOut = true;
+    return m_caller ? resume() : Continue;
+}
+
+AdbTask::Res AdbTaskFlow::onEvent(AdbContext::Event event, std::string_view data)
+{
+    if (!isRunning()) return Continue;
+    switch (event) {
+        case AdbContext::Event::evShellOutput:
+        case AdbContext::Event::evShellFailed:
+            if (!m_shellPending) return Continue;
+            m_shellPending = false;
+            m_output.assign( data );
+            m_answerFailed = event == AdbContext::Event::evShellFailed;
+            return onAnswer();
+        case AdbContext::Event::evShellExit:
+            // native shell: the output is in from stdout already
+            return m_adbStarted ? onAnswer() : Continue;
+        default:
+            return AdbTask::onEvent( event, data );
+    }
+}
+
+AdbTaskFlow::Ready<bool> AdbTaskFlow::command(const std::list<std::string> &args)
+{
+    m_output.clear();
+    m_answered = m_answerFailed = m_timedOut = false;
+    if (runInShell( joinArgs( args ) )) {
+        m_shellPending = true;
+        return Ready<bool>{true};
+    }
+    std::list<std::string> cl( args );
+    cl.emplace_front( java::CmdShell );
+    m_adbStarted = m_context->startAdb( cl );
+    return Ready<bool>{m_adbStarted};
+}
+
+AdbTaskFlow::Awaiter AdbTaskFlow::output(std::chrono::milliseconds timeout)
+{
+    return Awaiter( *this, timeout );
+}
+
+
+// AdbTaskFlow:: private members
+
+AdbTaskFlow::Text AdbTaskFlow::answer() const
+{
+    if (!m_answered || m_answerFailed) return std::nullopt;
+    return std::string_view( m_output );
+}
+
+AdbTask::Res AdbTaskFlow::finish()
+{
+    const Res res = m_flow.result();
+    cleanup();
+    return res;
+}
+
+AdbTask::Res AdbTaskFlow::onAnswer()
+{
+    if (m_answered) return Continue;
+    m_answered = true;
+    return m_caller ? resume() : Continue;
+}
+
+AdbTask::Res AdbTaskFlow::resume()
+{
+    stopTimer();
+    std::exchange( m_caller, nullptr ).resume();
+    return m_flow.done() ? finish() : Continue;
+}
+
+void AdbTaskFlow::stopTimer()
+{
+    if (!m_timerOn) return;
+    m_context->timerCtl( m_timerStream, TaskTimerId, false );
+    m_timerOn = false;
+}
+
+bool AdbTaskFlow::suspend(std::coroutine_handle<> caller, std::chrono::milliseconds timeout)
+{
+    if (timeout > timeout.zero()) {
+        m_timerStream = timerStream();
+        m_timerOn = m_context->timerCtl( m_timerStream, TaskTimerId, true, timeout );
+        if (!m_timerOn) {
+            LOGI(true, "Flow %s: can't start its timer", name());
+            return false;
+        }
+    }
+    m_caller = caller;
+    return true;
+}
 
 // AdbTaskWaitFirstPrompt class implementation
 
@@ -79,12 +444,14 @@ void AdbTaskWaitFirstPrompt::cleanup()
     LOGD(true, "AdbTaskWaitFirstPrompt::cleanup()");
     m_context->writeStdIn(ExitCmd, sizeof(ExitCmd)-1);
     m_foundTimes = 0;
+    m_matcher.reset();
     m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
 }
 
 bool AdbTaskWaitFirstPrompt::start()
 {
-    if (!m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, true, std::chrono::seconds(FirstPromptWaitTime))) {
+    if (!startPhaseTimer(AdbContext::FStream::fsStdIn, LatencyHistory::Phase::FirstPrompt,
+                         std::chrono::seconds(FirstPromptWaitTime))) {
         LDEB(true, "Start timer fail");
         return false;
     }
@@ -94,13 +461,18 @@ bool AdbTaskWaitFirstPrompt::start()
 AdbTask::Res AdbTaskWaitFirstPrompt::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
     if (!isStdout( fstream )) return Continue;
-    std::string_view view( input, size );
-    auto pos = view.rfind('$');
-    if (pos == (view.size() - 1)) {
+    bool found = false;
+    m_matcher.feed( input, size, [&](StreamPatterns::PatternId, std::string_view) {
+        found = true;
+        return true;
+    });
+    if (found) {
         if (m_foundTimes++ == 0) {
             LOGD(true, "Found first '$'");
+            phaseDone();
             if (!m_context->writeStdIn(LineFeed, sizeof(LineFeed)-1) ||
-                !m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, true, std::chrono::seconds(SecondPromptWaitTime))) {
+                !startPhaseTimer(AdbContext::FStream::fsStdIn, LatencyHistory::Phase::SecondPrompt,
+                                 std::chrono::seconds(SecondPromptWaitTime))) {
                 LOGD(true, "Write fail");
                 cleanup();
                 return Fail;
@@ -109,128 +481,560 @@ AdbTask::Res AdbTaskWaitFirstPrompt::onDataReady(AdbContext::FStream fstream, co
         } else {
             assert( m_foundTimes == 2 );
             LOGD(true, "Found second '$'");
+            phaseDone();
             return Next;
         }
     }
     return Continue;
 }
 
+const StreamPatterns &AdbTaskWaitFirstPrompt::patterns()
+{
+    static const StreamPatterns ret = compilePatterns( [](StreamPatterns &p) {p.addPrompt( "$" );} );
+    return ret;
+}
+
 AdbTask::Res AdbTaskWaitFirstPrompt::onTimer(AdbContext::FStream fstream, unsigned int timerId)
 {
     assert( fstream == AdbContext::FStream::fsStdIn );
     assert( timerId == TaskTimerId );
 
     LOGI(true, "Wait for prompt timed out (%d)", m_foundTimes);
+    phaseTimedOut();
     cleanup();
     return Fail;
 }
 
 
+// AdbTaskProbeClock class implementation
+
+bool AdbTaskProbeClock::required(const AdbContext &ctx)
+{
+    std::chrono::milliseconds offset, error;
+    return ctx.config()->isLogcatPushdown() &&
+           !DeviceClock::instance().offset( ctx.config()->getSerial(), offset, error );
+}
+
+Flow<AdbTask::Res> AdbTaskProbeClock::run()
+{
+    std::list<std::string> args;
+    args.emplace_back( CmdDate );
+    args.emplace_back( DateEpochFormat );
+    const auto sent = std::chrono::system_clock::now();
+    if (!co_await command( args )) co_return Fail;
+    const auto answer = co_await output( std::chrono::seconds(ClockProbeWaitTime) );
+    const auto recv = std::chrono::system_clock::now();
+    if (!answer) {
+        LOGI(timedOut(), "Device clock probe timed out");
+        LOGI(!timedOut(), "Device clock probe got no answer");
+        co_return Next;
+    }
+
+    // toybox date may not know %N, whole seconds are good enough then
+    const std::string text( *answer );
+    char *end = nullptr;
+    const double device = strtod( text.c_str(), &end );
+    if (end == text.c_str() || device <= 0) {
+        LOGI(true, "Can't read device clock: %s", text.c_str());
+        co_return Next;
+    }
+    const auto dot = text.find( '.' );
+    const bool fraction = dot != std::string::npos && text[dot + 1] >= '0' && text[dot + 1] <= '9';
+
+    using namespace std::chrono;
+    const auto half_rtt = duration_cast<milliseconds>( recv - sent ) / 2;
+    const auto host = duration_cast<milliseconds>( sent.time_since_epoch() ) + half_rtt;
+    const milliseconds offset( static_cast<long long>( device * 1000.0 ) - host.count() );
+    DeviceClock::instance().update( m_context->config()->getSerial(), offset,
+                                    half_rtt + milliseconds(ClockRoundingError) + (fraction ? milliseconds(0) : seconds(1)) );
+    co_return Next;
+}
+
+
+// AdbTaskProbeAgent class implementation
+
+bool AdbTaskProbeAgent::required(const AdbContext &ctx)
+{
+    const Config &cfg = *ctx.config();
+    if (!cfg.isBroadcastEntry() && cfg.getResultPort() == 0) return false;
+    AgentVersions &versions = agentVersions();
+    std::lock_guard<std::mutex> lck( versions.lock );
+    return versions.devices.count( cfg.getSerial().empty() ? DefaultDevice : cfg.getSerial() ) == 0;
+}
+
+bool AdbTaskProbeAgent::isCurrent(const AdbContext &ctx)
+{
+    const std::string &serial = ctx.config()->getSerial();
+    AgentVersions &versions = agentVersions();
+    std::lock_guard<std::mutex> lck( versions.lock );
+    auto it = versions.devices.find( serial.empty() ? DefaultDevice : serial );
+    return it == versions.devices.end() || it->second;
+}
+
+Flow<AdbTask::Res> AdbTaskProbeAgent::run()
+{
+    std::list<std::string> args;
+    args.emplace_back( java::CmdService );
+    args.emplace_back( java::PackageService );
+    args.emplace_back( java::QueryReceivers );
+    args.emplace_back( java::BriefParam );
+    args.emplace_back( java::ComponentParam );
+    args.emplace_back( ReceiverName.view() );
+    if (!co_await command( args )) co_return Fail;
+    const auto answer = co_await output( std::chrono::seconds(AgentProbeWaitTime) );
+    if (!answer) {
+        LOGI(true, "Agent probe got no answer");
+        co_return Next;
+    }
+
+    // a device without 'cmd package query-receivers' can't tell, its agent counts as current
+    const bool current = answer->find( java::NoReceivers ) == std::string_view::npos;
+    LOGW(!current, "The agent on the device is older than this host: no %s, answers come from the activity "
+                   "and logcat. Rebuild and install javaagent", ReceiverName.view().data());
+    const std::string &serial = m_context->config()->getSerial();
+    AgentVersions &versions = agentVersions();
+    std::lock_guard<std::mutex> lck( versions.lock );
+    versions.devices[serial.empty() ? DefaultDevice : serial] = current;
+    co_return Next;
+}
+
+
 // AdbTaskRunDisconnect class implementation
 
 void AdbTaskLaunchActivity::cleanup()
 {
-    LOGD(true, "AdbTaskWaitFirstPrompt::cleanup()");
+    LOGD(true, "AdbTaskLaunchActivity::cleanup()");
     if (isRunning()) {
-        m_context->writeStdIn(CtrlC, sizeof(CtrlC)-1);
-        m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
+        if (m_viaShell) m_context->cancelShellCommand();
+        else m_context->writeStdIn(CtrlC, sizeof(CtrlC)-1);
+        m_context->timerCtl(timerStream(), TaskTimerId, false);
         setState( State::Stopped );
     }
 }
 
 bool AdbTaskLaunchActivity::start()
 {
-    std::list<std::string> cl;
-    createIntentParams( cl );
-
-    if (m_context->startAdb( cl )) {
+    t_command.clear();
+    appendIntent( intentArgs( isConnect(), isBroadcast() ), *m_context->config(), m_context->config()->getUniqTag(),
+                  t_command );
+    shellCommand( t_command );
+    if (runInShell( t_command )) {
         setState( State::Running );
-        if (!m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, true, std::chrono::seconds(FirstAdbLaunchWaitTime))) {
-            LDEB(true, "Start timer fail");
-            cleanup();
-            return false;
-        }
+        return startTimer();
+    }
+    return spawnAdb();
+}
+
+bool AdbTaskLaunchActivity::startTimer()
+{
+    if (!startPhaseTimer(timerStream(), LatencyHistory::Phase::AdbLaunch, std::chrono::seconds(FirstAdbLaunchWaitTime))) {
+        LDEB(true, "Start timer fail");
+        cleanup();
+        return false;
     }
     return true;
 }
 
+bool AdbTaskLaunchActivity::spawnAdb()
+{
+    std::list<std::string> cl;
+    cl.emplace_back(java::CmdShell);
+    intentParams( intentArgs( isConnect(), isBroadcast() ), *m_context->config(), m_context->config()->getUniqTag(), cl );
+
+    m_viaShell = false;
+    if (!m_context->startAdb( cl )) {
+        LOGI(true, "Fail to start adb for am");
+        return false;
+    }
+    setState( State::Running );
+    return startTimer();
+}
+
 AdbTask::Res AdbTaskLaunchActivity::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
-    return size > 0 ? Continue : Next;
+    if (size > 0) return Continue;
+    // end of output, am is done: the next task may not start its own adb
+    return adbDone();
 }
 
 AdbTask::Res AdbTaskLaunchActivity::onError(AdbContext::FStream fstream)
 {
     LOGD(true, "Got onError() stream %d", static_cast<int>(fstream));
-    m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
-    m_context->stopAdb();
-    setState( State::Stopped );
-    return Res::Next;
+    return adbDone();
 }
 
 AdbTask::Res AdbTaskLaunchActivity::onTimer(AdbContext::FStream fstream, unsigned int timerId)
 {
-    assert( fstream == AdbContext::FStream::fsStdIn );
+    assert( fstream == timerStream() );
     assert( timerId == TaskTimerId );
 
     LOGI(true, "Adb hangs");
+    phaseTimedOut();
     cleanup();
     return Fail;
 }
 
+AdbTask::Res AdbTaskLaunchActivity::onEvent(AdbContext::Event event, std::string_view data)
+{
+    if (event == AdbContext::Event::evShellExit) {
+        if (data == "0") return adbDone();
+        // no point to wait for an agent that wasn't started
+        LOGI(true, "am exited with %.*s", static_cast<int>( data.size() ), data.data());
+        adbDone();
+        return Fail;
+    }
+    if (!m_viaShell || event == AdbContext::Event::evLogcatLine) return AdbTask::onEvent( event, data );
+    m_context->timerCtl(AdbContext::FStream::fsControl, TaskTimerId, false);
+    if (event == AdbContext::Event::evShellFailed) {
+        LOGI(true, "Device shell is gone, starting own adb");
+        setState( State::Stopped );
+        return spawnAdb() ? Continue : Fail;
+    }
+    LOGD(true, "am: %.*s", static_cast<int>( data.size() ), data.data());
+    phaseDone();
+    setState( State::Stopped );
+    return Next;
+}
+
+AdbTask::Res AdbTaskLaunchActivity::adbDone()
+{
+    phaseDone();
+    m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
+    m_context->stopAdb();
+    setState( State::Stopped );
+    return Next;
+}
+
 
-// AdbTaskRunConnect class implementation
+// AdbTaskSendBroadcast class implementation
 
-void AdbTaskRunConnect::createIntentParams(std::list<std::string> &cl)
+AdbTaskSendBroadcast::AdbTaskSendBroadcast(std::shared_ptr<AdbContext> ctx, bool connect)
+    : AdbTaskLaunchActivity(std::move(ctx)), m_connect(connect)
 {
-    cl.emplace_back(java::CmdShell);
-    cl.emplace_back(java::CmdActivityManager);
-    cl.emplace_back(java::CmdStart);
-    cl.emplace_back(std::string(java::ActivitySwitch).append(java::Agent).append("/").append(java::Activity));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::ModeParam).append(java::ModeConnect));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::UniqParam).append(m_context->config()->getUniqTag()));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::SsidParam).append(m_context->config()->getSsid()));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::PasswdParam).append(m_context->config()->getPassword()));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::PasswdTypeParam).append(m_context->config()->getAuthType()));
+
 }
 
+void AdbTaskSendBroadcast::cleanup()
+{
+    if (isRunning() && !m_viaShell) {
+        m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
+        m_context->stopAdb();
+        setState( State::Stopped );
+    }
+    m_matcher.reset();
+    AdbTaskLaunchActivity::cleanup();
+}
 
-// AdbTaskRunDisconnect class implementation
+// am waits for the receiver, in the background it doesn't hold the shell
+void AdbTaskSendBroadcast::shellCommand(std::string &command) const
+{
+    command.append( " >/dev/null 2>&1 &" );
+}
 
-void AdbTaskRunDisconnect::createIntentParams(std::list<std::string> &cl)
+AdbTask::Res AdbTaskSendBroadcast::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
-    cl.emplace_back(java::CmdShell);
-    cl.emplace_back(java::CmdActivityManager);
-    cl.emplace_back(java::CmdStart);
-    cl.emplace_back(std::string(java::ActivitySwitch).append(java::Agent).append("/").append(java::Activity));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::ModeParam).append(java::ModeDisconnect));
-    cl.emplace_back(std::string(java::ExtraSwitch).append(java::UniqParam).append(m_context->config()->getUniqTag()));
+    if (size == 0 || !isStdout( fstream )) return AdbTaskLaunchActivity::onDataReady( fstream, input, size );
+
+    // only the first line matters, the rest is the receiver's result
+    bool dispatched = false;
+    size = m_matcher.feed( input, size, [&](StreamPatterns::PatternId, std::string_view) {
+        dispatched = true;
+        return false;
+    });
+    if (!dispatched) return Continue;
+    LOGD(true, "Broadcast dispatched");
+    phaseDone();
+    // the receiver keeps running without am, cleanup() stops adb
+    return Next;
 }
 
+const StreamPatterns &AdbTaskSendBroadcast::patterns()
+{
+    static const StreamPatterns ret = compilePatterns( [](StreamPatterns &p) {
+        p.addLiteral( java::BroadcastDispatched );
+    });
+    return ret;
+}
 
-// AdbTaskRunLogcat class implementation
+bool AdbTaskSendBroadcast::isBroadcastCommand(const std::list<std::string> &cl)
+{
+    for (auto &s : cl) {
+        if (s.find( java::Receiver ) != std::string::npos) return true;
+    }
+    return false;
+}
 
-void AdbTaskRunLogcat::cleanup()
+
+// AdbTaskRunComposite class implementation
+
+AdbTaskRunComposite::AdbTaskRunComposite(std::shared_ptr<AdbContext> ctx, bool connect)
+    : AdbTask(std::move(ctx)), m_connect(connect)
+{
+
+}
+
+void AdbTaskRunComposite::cleanup()
 {
     if (isRunning()) {
         m_context->writeStdIn(CtrlC, sizeof(CtrlC)-1);
         m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, false);
+        m_context->stopAdb();
         setState( State::Stopped );
     }
 }
 
-bool AdbTaskRunLogcat::start()
+bool AdbTaskRunComposite::start()
 {
-    std::list<std::string> cl;
+    m_matcher.reset();
+    const Config &cfg = *m_context->config();
+    const std::string cursor = AdbTaskRunLogcat::logcatCursor( *m_context );
+    const char *signature = m_connect ? java::ConnectSignature : java::DisconnectSignature;
+
+    // R=am; O=$(am start ... 2>&1) && case "$O" in *Error*) false;; esac &&
+    // R=logcat && echo "adbwifiswitch-result <uniq> launched 0" &&
+    // L=$(logcat ... -m 1 -e '<uniq>.*(<signature>| run failed)') &&
+    // R=agent && case "$L" in *'<signature>'*) R=ok;; esac; S=$?;
+    // case $R in am) echo "$O";; agent) echo "$L";; esac | sed 's/^/adbwifiswitch-output /';
+    // echo "adbwifiswitch-result <uniq> $R $S"
+    std::list<std::string> logcat;
+    logcat.emplace_back(java::CmdLogcat);
+    logcat.emplace_back(java::LogcatThreadTime);
+    if (cursor.empty()) {
+        logcat.emplace_back(java::LogcatCountParam);
+    } else {
+        logcat.emplace_back(java::LogcatSinceParam);
+        logcat.emplace_back(cursor);
+    }
+    logcat.emplace_back(java::LogcatSilentParam);
+    logcat.emplace_back(java::LogcatAgentFilter);
+    logcat.emplace_back(java::LogcatMaxCount);
+    logcat.emplace_back(java::LogcatRegexParam);
+    logcat.emplace_back(std::string("'").append(cfg.getUniqTag()).append(".*(").append(signature)
+                        .append("|").append(java::FailedSignature).append(")'"));
 
+    const std::string result = std::string( java::ResultMarker ).append( " " ).append( cfg.getUniqTag() );
+    std::string script( "R=am; O=$(" );
+    appendIntent( intentArgs( m_connect, cfg.isBroadcastEntry() && AdbTaskProbeAgent::isCurrent( *m_context ) ),
+                  cfg, cfg.getUniqTag(), script );
+    // am reports some errors with a zero exit code
+    script.append( " 2>&1) && case \"$O\" in *Error*) false;; esac && R=logcat && echo \"" )
+          .append( result ).append( " " ).append( java::StageLaunched ).append( " 0\" && L=$(" )
+          .append( joinArgs( logcat ) ).append( ") && R=agent && case \"$L\" in *'" ).append( signature )
+          .append( "'*) R=ok;; esac; S=$?; case $R in am) echo \"$O\";; agent) echo \"$L\";; esac | sed 's/^/" )
+          .append( java::OutputMarker ).append( " /'; echo \"" ).append( result ).append( " $R $S\"" );
+
+    std::list<std::string> cl;
     cl.emplace_back(java::CmdShell);
+    // the pty takes the device side down with us on timeout
     cl.emplace_back(java::ShellPtyAlloc);
-    cl.emplace_back(java::CmdLogcat);
-    cl.emplace_back(java::LogcatThreadTime);
-    cl.emplace_back(java::LogcatCountParam);
+    cl.emplace_back(std::move(script));
+
+    if (!m_context->startAdb( cl )) return false;
+    setState( State::Running );
+    // am's share of the command, the answer gets its own deadline once it's done
+    if (!startPhaseTimer(AdbContext::FStream::fsStdIn, LatencyHistory::Phase::AdbLaunch,
+                         std::chrono::seconds(FirstAdbLaunchWaitTime))) {
+        LDEB(true, "Start timer fail");
+        cleanup();
+        return false;
+    }
+    return true;
+}
+
+AdbTask::Res AdbTaskRunComposite::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
+{
+    if (!isStdout( fstream )) return Continue;
+    if (size == 0) {
+        LOGI(true, "Device command ended without result");
+        cleanup();
+        return Fail;
+    }
+
+    Res ret = Continue;
+    size = m_matcher.feed( input, size, [&](StreamPatterns::PatternId id, std::string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+        if (id == OutputPattern) {
+            LOGI(true, "Device: %.*s", static_cast<int>(line.size() - sizeof(java::OutputMarker)),
+                 line.data() + sizeof(java::OutputMarker));
+            return true;
+        }
+        Result res;
+        if (parseResult( line, res )) ret = onResult( res );
+        return ret == Continue;
+    });
+    return ret;
+}
+
+const StreamPatterns &AdbTaskRunComposite::patterns()
+{
+    static const StreamPatterns ret = compilePatterns( [](StreamPatterns &p) {
+        p.addRegex( std::string("^").append( java::ResultMarker ).append( " [^ ]+ [^ ]+ [0-9]+$" ) );
+        p.addRegex( std::string("^").append( java::OutputMarker ).append( " " ) );
+    });
+    return ret;
+}
+
+AdbTask::Res AdbTaskRunComposite::onError(AdbContext::FStream fstream)
+{
+    // the result is read from stdout, which may still have it buffered
+    if (isStdin( fstream )) return Continue;
+    LOGI(true, "Device command failed, stream %d", static_cast<int>(fstream));
+    cleanup();
+    return Fail;
+}
+
+AdbTask::Res AdbTaskRunComposite::onTimer(AdbContext::FStream fstream, unsigned int timerId)
+{
+    assert( fstream == AdbContext::FStream::fsStdIn );
+    assert( timerId == TaskTimerId );
+
+    if (m_phase == LatencyHistory::Phase::AdbLaunch) LOGI(true, "Adb hangs");
+    else LOGI(true, "Operation timed out - no answer from java agent");
+    phaseTimedOut();
+    cleanup();
+    return Fail;
+}
+
+AdbTask::Res AdbTaskRunComposite::onEvent(AdbContext::Event event, std::string_view data)
+{
+    if (event != AdbContext::Event::evShellExit) return AdbTask::onEvent( event, data );
+    // the result line comes before the exit, it wasn't there
+    LOGI(true, "Device command exited with %.*s without result", static_cast<int>( data.size() ), data.data());
+    cleanup();
+    return Fail;
+}
+
+bool AdbTaskRunComposite::parseResult(std::string_view line, AdbTaskRunComposite::Result &res)
+{
+    if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+    const std::size_t marker = sizeof(java::ResultMarker) - 1;
+    if (line.size() <= marker || line.compare( 0, marker, java::ResultMarker ) != 0 || line[marker] != ' ') return false;
+    line.remove_prefix( marker + 1 );
+
+    std::string_view fields[3];
+    for (auto &f : fields) {
+        const auto end = line.find( ' ' );
+        f = line.substr( 0, end );
+        line.remove_prefix( end == std::string_view::npos ? line.size() : end + 1 );
+        if (f.empty()) return false;
+    }
+    int code = 0;
+    for (char c : fields[2]) {
+        if (c < '0' || c > '9') return false;
+        code = code * 10 + (c - '0');
+    }
+    res.uniq = fields[0];
+    res.stage = fields[1];
+    res.code = code;
+    return true;
+}
+
+bool AdbTaskRunComposite::isCompositeCommand(const std::list<std::string> &cl)
+{
+    return !cl.empty() && cl.back().find( java::ResultMarker ) != std::string::npos;
+}
+
+AdbTask::Res AdbTaskRunComposite::onResult(const AdbTaskRunComposite::Result &res)
+{
+    if (res.uniq != m_context->config()->getUniqTag()) {
+        LOGI(true, "Result of another operation: %.*s", static_cast<int>(res.uniq.size()), res.uniq.data());
+        cleanup();
+        return Fail;
+    }
+    if (res.stage == java::StageLaunched) {
+        phaseDone();
+        if (startPhaseTimer(AdbContext::FStream::fsStdIn, LatencyHistory::Phase::Answer,
+                            std::chrono::seconds(LogcatWaitTime))) {
+            return Continue;
+        }
+        LDEB(true, "Start timer fail");
+        cleanup();
+        return Fail;
+    }
+    if (res.stage != java::StageOk || res.code != 0) {
+        LOGI(true, "Device command failed at %.*s, exit code %d", static_cast<int>(res.stage.size()), res.stage.data(), res.code);
+        cleanup();
+        return Fail;
+    }
+    phaseDone();
+    LOG(true, "Wifi %s", m_connect ? "connected" : "disconnected");
+    return Next;
+}
+
+
+// AdbTaskRunLogcat class implementation
+
+AdbTaskRunLogcat::~AdbTaskRunLogcat()
+{
+    for (auto id : m_routes) m_context->signatures().removeRoute( id );
+}
+
+void AdbTaskRunLogcat::cleanup()
+{
+    if (m_channel != Channel::Off) {
+        // logcat was never started
+        m_context->closeResultChannel();
+        m_context->timerCtl(AdbContext::FStream::fsControl, ChannelRetryTimerId, false);
+        m_context->timerCtl(m_timerStream, TaskTimerId, false);
+        m_channel = Channel::Off;
+        setState( State::Stopped );
+    } else if (m_subscribed) {
+        m_context->unsubscribeLogcat();
+        m_context->timerCtl(AdbContext::FStream::fsControl, TaskTimerId, false);
+        m_subscribed = false;
+        setState( State::Stopped );
+    } else if (isRunning()) {
+        m_context->writeStdIn(CtrlC, sizeof(CtrlC)-1);
+        m_context->timerCtl(m_timerStream, TaskTimerId, false);
+        setState( State::Stopped );
+    }
+}
+
+bool AdbTaskRunLogcat::start()
+{
+    if (m_context->subscribeLogcat( m_context->config()->getUniqTag(), m_signature )) {
+        m_subscribed = true;
+        m_timerStream = AdbContext::FStream::fsControl;
+        setState( State::Running );
+        if (!startTaskTimer()) {
+            LDEB(true, "Start timer fail");
+            cleanup();
+            return false;
+        }
+        return true;
+    }
+
+    if (m_context->config()->getResultPort() != 0 && AdbTaskProbeAgent::isCurrent( *m_context )) {
+        m_timerStream = AdbContext::FStream::fsControl;
+        setState( State::Running );
+        if (!startTaskTimer()) {
+            LDEB(true, "Start timer fail");
+            cleanup();
+            return false;
+        }
+        return openChannel() || fallbackToLogcat() != Fail;
+    }
+    return startLogcat();
+}
+
+bool AdbTaskRunLogcat::startTaskTimer()
+{
+    return startPhaseTimer(m_timerStream, LatencyHistory::Phase::Answer, std::chrono::seconds(LogcatWaitTime));
+}
+
+bool AdbTaskRunLogcat::startLogcat()
+{
+    m_binary = m_context->config()->isBinaryLogcat();
+    m_parser.setTagFilter( agentTag() );
+    m_parser.reset();
+    m_matcher.reset();
+    m_cursor = logcatCursor( *m_context );
+
+    std::list<std::string> cl;
+    createLogcatParams( cl, m_binary, m_context->config()->isLogcatPushdown(), m_cursor );
 
     if (m_context->startAdb( cl )) {
-        if (!m_context->timerCtl(AdbContext::FStream::fsStdIn, TaskTimerId, true, std::chrono::seconds(LogcatWaitTime))) {
+        if (!startTaskTimer()) {
             LDEB(true, "Start timer fail");
             setState( State::Stopped );
             return false;
@@ -241,69 +1045,287 @@ bool AdbTaskRunLogcat::start()
 
 AdbTask::Res AdbTaskRunLogcat::onTimer(AdbContext::FStream fstream, unsigned int timerId)
 {
-    assert( fstream == AdbContext::FStream::fsStdIn );
+    if (timerId == ChannelRetryTimerId) {
+        assert( fstream == AdbContext::FStream::fsControl );
+        return openChannel() ? Continue : fallbackToLogcat();
+    }
+    assert( fstream == m_timerStream );
     assert( timerId == TaskTimerId );
 
     LOGI(true, "Operation timed out - no answer from java agent");
+    phaseTimedOut();
     cleanup();
     return Fail;
 }
 
+AdbTask::Res AdbTaskRunLogcat::onError(AdbContext::FStream fstream)
+{
+    if (fstream == AdbContext::FStream::fsResult) return onChannelClosed();
+    if (m_channel == Channel::Forwarding) return isStdout( fstream ) ? onForwardDone() : Continue;
+    if (m_binary && m_parser.entries() + m_parser.skipped() == 0) return fallbackToText();
+    return AdbTask::onError( fstream );
+}
+
+AdbTask::Res AdbTaskRunLogcat::onEvent(AdbContext::Event event, std::string_view data)
+{
+    if (event != AdbContext::Event::evLogcatLine) return AdbTask::onEvent( event, data );
+    return onTagLine( data );
+}
+
+void AdbTaskRunLogcat::createLogcatParams(std::list<std::string> &cl, bool binary, bool pushdown,
+                                          const std::string &cursor)
+{
+    if (binary) {
+        // no pty: it would mangle the binary stream
+        cl.emplace_back(java::CmdExecOut);
+        cl.emplace_back(java::CmdLogcat);
+        cl.emplace_back(java::LogcatBinary);
+    } else {
+        cl.emplace_back(java::CmdShell);
+        cl.emplace_back(java::ShellPtyAlloc);
+        cl.emplace_back(java::CmdLogcat);
+        cl.emplace_back(java::LogcatThreadTime);
+    }
+    if (cursor.empty()) {
+        cl.emplace_back(java::LogcatCountParam);
+    } else {
+        cl.emplace_back(java::LogcatSinceParam);
+        cl.emplace_back(cursor);
+    }
+    if (pushdown) {
+        // everything but the agent is silenced on the device
+        cl.emplace_back(java::LogcatSilentParam);
+        cl.emplace_back(java::LogcatAgentFilter);
+    }
+}
+
+std::string AdbTaskRunLogcat::logcatCursor(const AdbContext &ctx)
+{
+    const Config &cfg = *ctx.config();
+    DeviceClock::TimePoint since;
+    if (!cfg.isLogcatPushdown() || !DeviceClock::instance().toDevice( cfg.getSerial(), ctx.operationStart(), since )) {
+        return std::string();
+    }
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>( since.time_since_epoch() ).count();
+    char buf[32];
+    snprintf( buf, sizeof(buf), "%lld.%03lld", static_cast<long long>( ms / 1000 ), static_cast<long long>( ms % 1000 ) );
+    return buf;
+}
+
+const StreamPatterns &AdbTaskRunLogcat::patterns()
+{
+    static const StreamPatterns ret = compilePatterns( [](StreamPatterns &p) {p.addLiteral( java::AgentTag );} );
+    return ret;
+}
+
+// text logcat only, the binary one is parsed as a whole
+const StreamPatterns *AdbTaskRunLogcat::scanPatterns(AdbContext::FStream fstream) const
+{
+    return isStdout( fstream ) && !m_binary && !m_subscribed && m_channel == Channel::Off ? &patterns() : nullptr;
+}
+
+const char *AdbTaskRunLogcat::agentTag()
+{
+    return java::AgentTag;
+}
+
+bool AdbTaskRunLogcat::isAgentLine(std::string_view line)
+{
+    return line.find( java::AgentTag ) != std::string_view::npos;
+}
+
+std::size_t AdbTaskRunLogcat::parseResultFrame(const char *input, std::size_t size, std::string_view &payload)
+{
+    if (size < 2) return 0;
+    const std::size_t len = (static_cast<std::size_t>( static_cast<unsigned char>( input[0] ) ) << 8) |
+                            static_cast<unsigned char>( input[1] );
+    if (size < len + 2) return 0;
+    payload = std::string_view( input + 2, len );
+    return len + 2;
+}
+
 AdbTask::Res AdbTaskRunLogcat::lookupTag(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
+    if (fstream == AdbContext::FStream::fsResult) return size ? onChannelData( input, size ) : onChannelClosed();
+    if (m_channel == Channel::Forwarding) return isStdout( fstream ) && size == 0 ? onForwardDone() : Continue;
+    if (m_binary) return lookupEntries( fstream, input, size );
     if (!isStdout( fstream )) return Continue;
-    std::string_view view( input, size );
-    std::size_t pos;
-    LOGD(true, "On entry size = %zu", size);
-    size = 0;
-    while ((pos = view.find("\n")) != std::string::npos) {
-        size += pos + 1;
-        if (pos == 0) {
-            view.remove_prefix( 1 );
-            continue;
-        }
-        std::string_view line( view.substr(0, pos) );
-        view.remove_prefix( pos+1 );
+    Res ret = Res::Continue;
+    size = m_matcher.feed( input, size, [&](StreamPatterns::PatternId, std::string_view line) {
+        ret = onTagLine( line );
+        return ret == Res::Continue;
+    });
+    return ret;
+}
+
+AdbTask::Res AdbTaskRunLogcat::lookupEntries(AdbContext::FStream fstream, const char *input, std::size_t &size)
+{
+    if (!isStdout( fstream )) return Continue;
+    Res ret = Res::Continue;
+    const std::size_t used = m_parser.parse( input, size, [&](const LogEntry &entry) {
+        std::string_view line( entry.message );
+        ret = onTagLine( line );
+        return ret == Res::Continue;
+    });
+    // logcat without -B support either prints text or just exits
+    const bool eof = size == 0 && m_parser.entries() + m_parser.skipped() == 0;
+    if (ret != Res::Continue || (!m_parser.failed() && !eof)) {
+        size = used;
+        return ret;
+    }
 
-        if (line.find( java::AgentTag ) != std::string_view::npos) {
-            Res ret = onTagLine( line );
-            if (ret != Res::Continue) return ret;
+    return fallbackToText();
+}
+
+AdbTask::Res AdbTaskRunLogcat::fallbackToText()
+{
+    LOGI(true, "Binary logcat isn't supported, falling back to text");
+    m_binary = false;
+    m_matcher.reset();
+    std::list<std::string> cl;
+    createLogcatParams( cl, false, m_context->config()->isLogcatPushdown(), m_cursor );
+    if (!m_context->startAdb( cl ) || !startTaskTimer()) {
+        setState( State::Stopped );
+        return Fail;
+    }
+    return Continue;
+}
+
+bool AdbTaskRunLogcat::openChannel()
+{
+    const unsigned short port = m_context->config()->getResultPort();
+    switch (m_context->openResultChannel( port, m_context->config()->getUniqTag() + "\n" )) {
+        case AdbContext::ChannelStatus::chOpen:
+            m_channel = Channel::Open;
+            return true;
+        case AdbContext::ChannelStatus::chRefused:
+            if (!m_forwarded) {
+                // nothing on the port yet: set up the forward & try again when adb is done
+                m_forwarded = true;
+                std::list<std::string> cl;
+                cl.emplace_back(java::CmdForward);
+                cl.emplace_back(std::string(java::ForwardTcp).append(std::to_string( port )));
+                cl.emplace_back(java::AgentSocket);
+                if (m_context->startAdb( cl )) {
+                    m_channel = Channel::Forwarding;
+                    return true;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    m_channel = Channel::Off;
+    return false;
+}
+
+AdbTask::Res AdbTaskRunLogcat::onChannelData(const char *input, std::size_t &size)
+{
+    std::string_view payload;
+    std::size_t used = 0, frame;
+    while ((frame = parseResultFrame( input + used, size - used, payload )) > 0) {
+        used += frame;
+        LOGD(true, "Agent: %.*s", static_cast<int>(payload.size()), payload.data());
+        if (payload.find( m_context->config()->getUniqTag() ) != std::string_view::npos &&
+                payload.find( java::FailedSignature ) != std::string_view::npos) {
+            LOGI(true, "Agent: %.*s", static_cast<int>(payload.size()), payload.data());
+            size = used;
+            return Fail;
+        }
+        Res ret = onTagLine( payload );
+        if (ret != Res::Continue) {
+            size = used;
+            return ret;
         }
     }
-    LOGD(true, "On exit size = %zu", size);
+    size = used;
     return Continue;
 }
 
+AdbTask::Res AdbTaskRunLogcat::onChannelClosed()
+{
+    // adb accepts the forwarded connection and drops it when the agent isn't listening yet
+    m_context->closeResultChannel();
+    if (m_channelRetries++ < MaxChannelRetries &&
+            m_context->timerCtl(AdbContext::FStream::fsControl, ChannelRetryTimerId, true,
+                                std::chrono::milliseconds(ChannelRetryTime))) {
+        m_channel = Channel::Retrying;
+        return Continue;
+    }
+    return fallbackToLogcat();
+}
+
+AdbTask::Res AdbTaskRunLogcat::onForwardDone()
+{
+    m_context->stopAdb();
+    return openChannel() ? Continue : fallbackToLogcat();
+}
+
+AdbTask::Res AdbTaskRunLogcat::fallbackToLogcat()
+{
+    LOGI(true, "Agent result channel isn't available, reading logcat");
+    m_context->closeResultChannel();
+    m_channel = Channel::Off;
+    return startLogcat() ? Continue : Fail;
+}
+
+bool AdbTaskRunLogcat::matchSignature(std::string_view line)
+{
+    m_signatureFound = false;
+    m_context->signatures().dispatch( line );
+    if (m_signatureFound) phaseDone();
+    return m_signatureFound;
+}
+
+void AdbTaskRunLogcat::watchSignature(const char *signature)
+{
+    m_signature = signature;
+    m_routes.push_back( m_context->signatures().addRoute( m_context->config()->getUniqTag(), signature,
+                        [this](SignatureRouter::RouteId, std::string_view) {m_signatureFound = true;} ) );
+}
+
 
 // AdbTaskWaitConnectLog class implementation
 
+AdbTaskWaitConnectLog::AdbTaskWaitConnectLog(std::shared_ptr<AdbContext> ctx)
+    : AdbTaskRunLogcat(std::move(ctx))
+{
+    watchSignature( java::ConnectSignature );
+}
+
 AdbTask::Res AdbTaskWaitConnectLog::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
-    
-    return fstream == AdbContext::FStream::fsStdOut ? lookupTag( fstream, input, size ) : Res::Continue;
+    return lookupTag( fstream, input, size );
 }
 
 AdbTask::Res AdbTaskWaitConnectLog::onTagLine(std::string_view &line)
 {
-    LOGD(true, std::string(line.cbegin(), line.cend()).c_str() );
-    if (line.find(m_context->config()->getUniqTag()) != std::string_view::npos && 
-            line.find( java::ConnectSignature ) != std::string_view::npos) {
+    LOGD(true, "%.*s", static_cast<int>( line.size() ), line.data());
+    if (matchSignature( line )) {
         LOG(true, "Wifi connected");
         return Res::Next;
     }
     return Res::Continue;
 }
 
+
+// AdbTaskWaitDisconnectLog class implementation
+
+AdbTaskWaitDisconnectLog::AdbTaskWaitDisconnectLog(std::shared_ptr<AdbContext> ctx)
+    : AdbTaskRunLogcat(std::move(ctx))
+{
+    watchSignature( java::DisconnectSignature );
+}
+
 AdbTask::Res AdbTaskWaitDisconnectLog::onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size)
 {
-    return fstream == AdbContext::FStream::fsStdOut ? lookupTag( fstream, input, size ) : Res::Continue;
+    return lookupTag( fstream, input, size );
 }
 
 AdbTask::Res AdbTaskWaitDisconnectLog::onTagLine(std::string_view &line)
 {
-    LOGD(true, std::string(line.cbegin(), line.cend()).c_str() );
-    if (line.find(m_context->config()->getUniqTag()) != std::string_view::npos && 
-            line.find( java::DisconnectSignature ) != std::string_view::npos) {
+    LOGD(true, "%.*s", static_cast<int>( line.size() ), line.data());
+    if (matchSignature( line )) {
         LOG(true, "Wifi disconnected");
         return Res::Next;
     }
@@ -1,11 +1,23 @@
 #ifndef ADBTASK_H
 #define ADBTASK_H
 
+#include <chrono>
+#include <coroutine>
 #include <functional>
+#include <list>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "AdbContext.h"
+#include "Flow.h"
+#include "LatencyHistory.h"
+#include "LogEntryParser.h"
+#include "OperationArena.h"
+#include "SignatureRouter.h"
+#include "StreamMatcher.h"
 
 
 class AdbTask {
@@ -26,6 +38,15 @@ public:
     virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size);
     virtual Res onError(AdbContext::FStream fstream);
     virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId);
+    virtual Res onEvent(AdbContext::Event event, std::string_view data);
+    // phase name for timings
+    virtual const char *name() const = 0;
+    // the step starting the agent, a late operation is launched again
+    // counting from its start
+    virtual bool launchesAgent() const {return false;}
+    // the lines of the stream matching these are all the task needs from
+    // it, the stream may be scanned for them off the poller thread
+    virtual const StreamPatterns *scanPatterns(AdbContext::FStream fstream) const {return nullptr;}
 
 protected:
     
@@ -33,11 +54,97 @@ protected:
     bool isStdin(AdbContext::FStream fstream) const {return fstream == AdbContext::FStream::fsStdIn;}
     bool isStdout(AdbContext::FStream fstream) const {return fstream == AdbContext::FStream::fsStdOut;}
     bool isStderr(AdbContext::FStream fstream) const {return fstream == AdbContext::FStream::fsStdErr;}
+    // task timer lives on adb's stdin, or on fsControl without own adb
+    AdbContext::FStream timerStream() const {
+        return m_viaShell ? AdbContext::FStream::fsControl : AdbContext::FStream::fsStdIn;
+    }
     
     void setState(State state) {m_state = state;}
+    // device command in the persistent shell when there is one
+    bool runInShell(const std::string &command);
+    // task timer for a phase, the fixed deadline is its upper bound
+    bool startPhaseTimer(AdbContext::FStream fstream, LatencyHistory::Phase phase, std::chrono::milliseconds fixed);
+    // learned from the device's earlier latencies of the phase if enabled
+    std::chrono::milliseconds phaseTimeout(LatencyHistory::Phase phase, std::chrono::milliseconds fixed) const;
+    // the phase ended in time, its latency counts since the timer start
+    void phaseDone();
+    void phaseTimedOut();
     
     std::shared_ptr<AdbContext> m_context;
     State m_state = State::Idle;
+    bool m_viaShell = false;
+    LatencyHistory::Phase m_phase = LatencyHistory::Phase::AdbLaunch;
+    std::chrono::steady_clock::time_point m_phaseStart;
+    // zero while no phase is timed
+    std::chrono::milliseconds m_phaseDeadline = std::chrono::milliseconds::zero();
+};
+
+// A task written as one coroutine: run() sends device commands and awaits
+// their answers in order, the callbacks resume it and its co_return ends the
+// task. An answer stays valid until the next command.
+class AdbTaskFlow : public AdbTask {
+public:
+    using AdbTask::AdbTask;
+    virtual void cleanup() override;
+    virtual bool start() override;
+    virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
+    virtual Res onError(AdbContext::FStream fstream) override;
+    virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId) override;
+    virtual Res onEvent(AdbContext::Event event, std::string_view data) override;
+
+protected:
+    typedef std::optional<std::string_view> Text;
+
+    class Awaiter {
+    public:
+        Awaiter(AdbTaskFlow &task, std::chrono::milliseconds timeout) : m_task(task), m_timeout(timeout) {}
+        bool await_ready() {return m_task.m_answered;}
+        bool await_suspend(std::coroutine_handle<> caller) {return m_task.suspend( caller, m_timeout );}
+        Text await_resume() {return m_task.answer();}
+
+    private:
+        AdbTaskFlow &m_task;
+        std::chrono::milliseconds m_timeout;
+    };
+
+    // a result known at once, co_awaited for a uniform flow
+    template <typename T>
+    struct Ready {
+        T value;
+        bool await_ready() const noexcept {return true;}
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        T await_resume() {return std::move(value);}
+    };
+
+    virtual Flow<Res> run() = 0;
+
+    // device command in the persistent shell when there is one, else in
+    // "adb shell"; its answer comes from output()
+    Ready<bool> command(const std::list<std::string> &args);
+    // the command's whole output; none if the shell died or at the timeout
+    Awaiter output(std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+    // the last wait ended by its timeout
+    bool timedOut() const {return m_timedOut;}
+
+private:
+    Text answer() const;
+    Res finish();
+    Res onAnswer();
+    Res resume();
+    void stopTimer();
+    bool suspend(std::coroutine_handle<> caller, std::chrono::milliseconds timeout);
+
+    Flow<Res> m_flow;
+    std::coroutine_handle<> m_caller;
+    AdbContext::FStream m_timerStream = AdbContext::FStream::fsStdIn;
+    bool m_timerOn = false;
+    bool m_timedOut = false;
+    bool m_adbStarted = false;
+    // command() answer: the shell's output, or adb's stdout collected
+    std::string m_output;
+    bool m_shellPending = false;
+    bool m_answered = false;
+    bool m_answerFailed = false;
 };
 
 class AdbTaskWaitFirstPrompt : public AdbTask {
@@ -47,11 +154,43 @@ public:
     virtual bool start() override;
     virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
     virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId) override;
+    virtual const char *name() const override {return "first-prompt";}
 
 private:
+    static const StreamPatterns &patterns();
+
+    StreamMatcher m_matcher{patterns()};
     int m_foundTimes = 0;
 };
 
+// Measures device clock offset for logcat -T cursors, never fails the script
+class AdbTaskProbeClock : public AdbTaskFlow {
+public:
+    using AdbTaskFlow::AdbTaskFlow;
+    virtual const char *name() const override {return "probe-clock";}
+
+    static bool required(const AdbContext &ctx);
+
+private:
+    virtual Flow<Res> run() override;
+};
+
+// Checks once per device that its agent has the broadcast receiver and the
+// result channel; an agent built before them only answers in logcat to the
+// activity. Never fails the script, an unknown agent counts as current.
+class AdbTaskProbeAgent : public AdbTaskFlow {
+public:
+    using AdbTaskFlow::AdbTaskFlow;
+    virtual const char *name() const override {return "probe-agent";}
+
+    static bool required(const AdbContext &ctx);
+    // false once the probe found an older agent on the device
+    static bool isCurrent(const AdbContext &ctx);
+
+private:
+    virtual Flow<Res> run() override;
+};
+
 class AdbTaskLaunchActivity : public AdbTask {
 public:
     using AdbTask::AdbTask;
@@ -60,46 +199,163 @@ public:
     virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
     virtual Res onError(AdbContext::FStream fstream) override;
     virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId) override;
+    virtual Res onEvent(AdbContext::Event event, std::string_view data) override;
+    virtual const char *name() const override {return "am-start";}
+    virtual bool launchesAgent() const override {return true;}
+protected:
+    bool startTimer();
+    bool spawnAdb();
+    // am's own adb is over
+    Res adbDone();
 private:
-    virtual void createIntentParams(std::list<std::string> &cl) = 0;
+    // the intent the agent gets
+    virtual bool isConnect() const = 0;
+    virtual bool isBroadcast() const {return false;}
+    // makes the command as given to the persistent shell, in place
+    virtual void shellCommand(std::string &command) const {}
 };
 
 class AdbTaskRunConnect : public AdbTaskLaunchActivity {
 public:
     using AdbTaskLaunchActivity::AdbTaskLaunchActivity;
 private:
-    virtual void createIntentParams(std::list<std::string> &cl) override;
+    virtual bool isConnect() const override {return true;}
 };
 
 class AdbTaskRunDisconnect : public AdbTaskLaunchActivity {
 public:
     using AdbTaskLaunchActivity::AdbTaskLaunchActivity;
 private:
-    virtual void createIntentParams(std::list<std::string> &cl) override;
+    virtual bool isConnect() const override {return false;}
+};
+
+// Hands the intent to the agent's broadcast receiver, no activity start.
+// "am broadcast" returns when the receiver is done, so the task ends as
+// soon as the broadcast is dispatched
+class AdbTaskSendBroadcast : public AdbTaskLaunchActivity {
+public:
+    AdbTaskSendBroadcast(std::shared_ptr<AdbContext> ctx, bool connect);
+    virtual void cleanup() override;
+    virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
+    virtual const char *name() const override {return "am-broadcast";}
+
+    // true for both the plain and the composite broadcast command lines
+    static bool isBroadcastCommand(const std::list<std::string> &cl);
+private:
+    virtual bool isConnect() const override {return m_connect;}
+    virtual bool isBroadcast() const override {return true;}
+    virtual void shellCommand(std::string &command) const override;
+    static const StreamPatterns &patterns();
+
+    StreamMatcher m_matcher{patterns()};
+    bool m_connect;
+};
+
+// Starts the activity and waits for its signature or a failure in one
+// device shell command, which prints "adbwifiswitch-result <uniq> launched 0"
+// once am is done and then its result line:
+// "adbwifiswitch-result <uniq> <ok|am|logcat|agent> <exit code>"
+// am's output or the agent's failure line come before it as
+// "adbwifiswitch-output <line>"
+class AdbTaskRunComposite : public AdbTask {
+public:
+    struct Result {
+        std::string_view uniq;
+        std::string_view stage;
+        int code = -1;
+    };
+
+    AdbTaskRunComposite(std::shared_ptr<AdbContext> ctx, bool connect);
+    virtual void cleanup() override;
+    virtual bool start() override;
+    virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
+    virtual Res onError(AdbContext::FStream fstream) override;
+    virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId) override;
+    virtual Res onEvent(AdbContext::Event event, std::string_view data) override;
+    virtual const char *name() const override {return "composite";}
+    virtual bool launchesAgent() const override {return true;}
+
+    static bool parseResult(std::string_view line, Result &res);
+    static bool isCompositeCommand(const std::list<std::string> &cl);
+
+private:
+    Res onResult(const Result &res);
+    static const StreamPatterns &patterns();
+
+    StreamMatcher m_matcher{patterns()};
+    bool m_connect;
 };
 
 class AdbTaskRunLogcat : public AdbTask {
 public:
     using AdbTask::AdbTask;
+    virtual ~AdbTaskRunLogcat();
     virtual void cleanup() override;
     virtual bool start() override;
+    virtual Res onError(AdbContext::FStream fstream) override;
     virtual Res onTimer(AdbContext::FStream fstream, unsigned int timerId) override;
+    virtual Res onEvent(AdbContext::Event event, std::string_view data) override;
+    virtual const char *name() const override {return "wait-result";}
+    virtual const StreamPatterns *scanPatterns(AdbContext::FStream fstream) const override;
+
+    static void createLogcatParams(std::list<std::string> &cl, bool binary, bool pushdown = true,
+                                   const std::string &cursor = std::string());
+    static std::string logcatCursor(const AdbContext &ctx);
+    static bool isAgentLine(std::string_view line);
+    static const char *agentTag();
+    // agent lines of a text logcat
+    static const StreamPatterns &agentPatterns() {return patterns();}
+    // result channel frame: 2 bytes big endian length, then text;
+    // returns the frame size or 0 while it is incomplete
+    static std::size_t parseResultFrame(const char *input, std::size_t size, std::string_view &payload);
+
 protected:
     Res lookupTag(AdbContext::FStream fstream, const char *input, std::size_t &size);
+    Res lookupEntries(AdbContext::FStream fstream, const char *input, std::size_t &size);
+    bool matchSignature(std::string_view line);
+    void watchSignature(const char *signature);
+
 private:
+    enum class Channel {
+        Off, Forwarding, Open, Retrying
+    };
+
     virtual Res onTagLine(std::string_view &line) = 0;
+    bool startLogcat();
+    bool startTaskTimer();
+    Res fallbackToText();
+    bool openChannel();
+    Res onChannelData(const char *input, std::size_t &size);
+    Res onChannelClosed();
+    Res onForwardDone();
+    Res fallbackToLogcat();
+    static const StreamPatterns &patterns();
+
+    // ours at the context's router
+    std::vector<SignatureRouter::RouteId, ArenaAllocator<SignatureRouter::RouteId> > m_routes;
+    StreamMatcher m_matcher{patterns()};
+    LogEntryParser m_parser;
+    std::string m_cursor;
+    const char *m_signature = "";
+    AdbContext::FStream m_timerStream = AdbContext::FStream::fsStdIn;
+    Channel m_channel = Channel::Off;
+    unsigned int m_channelRetries = 0;
+    bool m_forwarded = false;
+    bool m_binary = false;
+    bool m_signatureFound = false;
+    bool m_subscribed = false;
 };
 
 class AdbTaskWaitConnectLog : public AdbTaskRunLogcat {
 public:
-    using AdbTaskRunLogcat::AdbTaskRunLogcat;
+    AdbTaskWaitConnectLog(std::shared_ptr<AdbContext> ctx);
     virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
     virtual Res onTagLine(std::string_view &line) override;
 };
 
 class AdbTaskWaitDisconnectLog : public AdbTaskRunLogcat {
 public:
-    using AdbTaskRunLogcat::AdbTaskRunLogcat;
+    AdbTaskWaitDisconnectLog(std::shared_ptr<AdbContext> ctx);
     virtual Res onDataReady(AdbContext::FStream fstream, const char *input, std::size_t &size) override;
 private:
     virtual Res onTagLine(std::string_view &line) override;
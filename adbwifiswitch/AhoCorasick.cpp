@@ -0,0 +1,126 @@
+#include <cassert>
+
+#include "AhoCorasick.h"
+
+namespace {
+const std::uint32_t NoState = ~0u;
+const std::uint32_t NoPattern = ~0u;
+}
+
+
+// AhoCorasick class implementation
+
+AhoCorasick::AhoCorasick()
+{
+    m_class.fill( 0 );
+}
+
+AhoCorasick::PatternId AhoCorasick::add(std::string_view pattern)
+{
+    assert( !pattern.empty() );
+    m_compiled = false;
+    m_patternText.append( pattern );
+    m_patternEnd.push_back( static_cast<std::uint32_t>( m_patternText.size() ) );
+    return static_cast<PatternId>( m_patternEnd.size() - 1 );
+}
+
+void AhoCorasick::clear()
+{
+    m_patternText.clear();
+    m_patternEnd.clear();
+    m_next.clear();
+    m_outBegin.clear();
+    m_out.clear();
+    m_class.fill( 0 );
+    m_classCount = 1;
+    m_compiled = false;
+}
+
+void AhoCorasick::compile()
+{
+    // bytes not used by any pattern share class 0
+    m_class.fill( 0 );
+    m_classCount = 1;
+    for (unsigned char c : m_patternText) {
+        if (!m_class[c]) m_class[c] = static_cast<std::uint8_t>( m_classCount++ );
+    }
+    assert( m_classCount <= 256 );
+    const std::size_t ncls = m_classCount;
+    const std::size_t patterns = patternCount();
+
+    // trie
+    m_next.assign( ncls, NoState );
+    m_ownOut.assign( 1, NoPattern );
+    m_endState.resize( patterns );
+    for (PatternId id = 0; id < patterns; id++) {
+        State s = 0;
+        for (unsigned char c : pattern( id )) {
+            const std::size_t edge = s * ncls + m_class[c];
+            if (m_next[edge] == NoState) {
+                m_next[edge] = static_cast<State>( m_ownOut.size() );
+                m_ownOut.push_back( NoPattern );
+                m_next.resize( m_next.size() + ncls, NoState );
+            }
+            s = m_next[edge];
+        }
+        m_endState[id] = s;
+    }
+    // patterns ending in a state, chained in id order
+    m_chain.assign( patterns, NoPattern );
+    for (PatternId id = static_cast<PatternId>( patterns ); id-- > 0;) {
+        m_chain[id] = m_ownOut[m_endState[id]];
+        m_ownOut[m_endState[id]] = id;
+    }
+    const std::size_t states = m_ownOut.size();
+
+    // failure links, resolved into full DFA transitions in BFS order
+    m_fail.assign( states, 0 );
+    m_order.clear();
+    for (std::size_t c = 0; c < ncls; c++) {
+        State &n = m_next[c];
+        if (n == NoState) {
+            n = 0;
+        } else {
+            m_fail[n] = 0;
+            m_order.push_back( n );
+        }
+    }
+    for (std::size_t head = 0; head < m_order.size(); head++) {
+        const State s = m_order[head];
+        for (std::size_t c = 0; c < ncls; c++) {
+            State &n = m_next[s * ncls + c];
+            if (n == NoState) {
+                n = m_next[m_fail[s] * ncls + c];
+            } else {
+                m_fail[n] = m_next[m_fail[s] * ncls + c];
+                m_order.push_back( n );
+            }
+        }
+    }
+
+    // a state reports its own patterns then its failure state's, which
+    // comes earlier in BFS order; the root has none
+    m_outBegin.assign( states + 1, 0 );
+    for (State s : m_order) {
+        std::uint32_t count = m_outBegin[m_fail[s] + 1];
+        for (PatternId id = m_ownOut[s]; id != NoPattern; id = m_chain[id]) count++;
+        m_outBegin[s + 1] = count;
+    }
+    for (std::size_t s = 0; s < states; s++) m_outBegin[s + 1] += m_outBegin[s];
+    m_out.resize( m_outBegin[states] );
+    for (State s : m_order) {
+        std::uint32_t o = m_outBegin[s];
+        for (PatternId id = m_ownOut[s]; id != NoPattern; id = m_chain[id]) m_out[o++] = id;
+        for (auto f = m_outBegin[m_fail[s]]; f != m_outBegin[m_fail[s] + 1]; f++) m_out[o++] = m_out[f];
+    }
+    m_compiled = true;
+}
+
+
+// AhoCorasick:: private members
+
+std::string_view AhoCorasick::pattern(AhoCorasick::PatternId id) const
+{
+    const std::uint32_t begin = id ? m_patternEnd[id - 1] : 0;
+    return std::string_view( m_patternText ).substr( begin, m_patternEnd[id] - begin );
+}
@@ -0,0 +1,69 @@
+#ifndef AHOCORASICK_H
+#define AHOCORASICK_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Multi-pattern matcher. Patterns are compiled into a DFA over byte classes,
+// scan() reports every occurrence of every pattern in a single pass.
+// Recompiling keeps the storage of the previous build, a matcher rebuilt
+// with patterns of similar sizes allocates nothing.
+class AhoCorasick {
+public:
+    typedef unsigned int PatternId;
+
+    AhoCorasick();
+
+    PatternId add(std::string_view pattern);
+    void clear();
+    void compile();
+    bool compiled() const {return m_compiled;}
+    std::size_t patternCount() const {return m_patternEnd.size();}
+    std::size_t stateCount() const {return m_outBegin.empty() ? 0 : m_outBegin.size() - 1;}
+
+    // proc(PatternId, std::size_t end_pos) is called for each match,
+    // scanning stops if it returns false
+    template <typename Proc>
+    void scan(std::string_view text, Proc &&proc) const;
+
+private:
+    typedef std::uint32_t State;
+
+    std::string_view pattern(PatternId id) const;
+
+    // all patterns back to back
+    std::string m_patternText;
+    std::vector<std::uint32_t> m_patternEnd;
+    std::array<std::uint8_t, 256> m_class;
+    std::size_t m_classCount = 1;
+    std::vector<State> m_next;
+    std::vector<std::uint32_t> m_outBegin;
+    std::vector<PatternId> m_out;
+    bool m_compiled = false;
+    // compile() scratch
+    std::vector<State> m_fail;
+    std::vector<State> m_order;
+    std::vector<State> m_endState;
+    std::vector<PatternId> m_ownOut;
+    std::vector<PatternId> m_chain;
+};
+
+template <typename Proc>
+void AhoCorasick::scan(std::string_view text, Proc &&proc) const
+{
+    if (!m_compiled || m_patternEnd.empty()) return;
+    const State *next = m_next.data();
+    const std::size_t ncls = m_classCount;
+    State state = 0;
+    for (std::size_t i = 0; i < text.size(); i++) {
+        state = next[state * ncls + m_class[static_cast<unsigned char>( text[i] )]];
+        for (auto o = m_outBegin[state], e = m_outBegin[state + 1]; o != e; o++) {
+            if (!proc( m_out[o], i + 1 )) return;
+        }
+    }
+}
+
+#endif // AHOCORASICK_H
@@ -75,6 +75,15 @@ void ReadBuffer::addFilled(std::size_t size)
     assert((m_filled + m_head) <= m_buf.size());
 }
 
+std::vector<char> ReadBuffer::swapStorage(std::vector<char> spare, std::size_t &head, std::size_t &size)
+{
+    head = m_head;
+    size = m_filled;
+    m_buf.swap( spare );
+    m_head = m_filled = 0;
+    return spare;
+}
+
 
 // WriteBuffer class implementation
 
@@ -83,4 +92,12 @@ WriteBuffer &WriteBuffer::append(const void *buf, size_t size, bool trim)
     reserve( size, trim );
     memcpy( endPtr(), buf, size );
     m_filled += size;
+    return *this;
+}
+
+void WriteBuffer::cutTail(std::size_t size)
+{
+    assert( size <= m_filled );
+    m_filled -= size;
+    if (m_filled == 0) m_head = 0;
 }
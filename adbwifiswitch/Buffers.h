@@ -28,6 +28,9 @@ public:
     using BufferBase::BufferBase;
     
     void addFilled(std::size_t size);
+    // hands the storage out along with the filled range, the buffer goes
+    // on with the spare one
+    std::vector<char> swapStorage(std::vector<char> spare, std::size_t &head, std::size_t &size);
     const char *head() const {return headPtr();}
     void *readPtr() {return endPtr();}
 };
@@ -39,6 +42,8 @@ public:
     WriteBuffer &append(const void *buf, size_t size, bool trim = false);
     const void *ptr() const {return reinterpret_cast<const void *>( headPtr() );}
     void pushHead(std::size_t size, bool trim = false) {cut( size, trim );}
+    // drops the last size bytes appended
+    void cutTail(std::size_t size);
     std::size_t size() const {return m_filled;}
 };
 
@@ -3,8 +3,13 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -20,8 +25,116 @@ enum {
     PIPE_STDOUT = 1,
     PIPE_STDERR = 2
 };
+
+enum {
+    // a child given up gets this long to exit before SIGKILL
+    ReapGraceTime = 3000, // milliseconds
+    ReapPollTime = 10, // milliseconds
+};
+
+void logExit(int pid, int wstatus)
+{
+    if (WIFEXITED(wstatus)) {
+        LOGD(true, "Chaild process %d exited normally. Exit status %d", pid, WEXITSTATUS(wstatus));
+    } else if (WIFSIGNALED(wstatus)) {
+        LOGD(true, "Chaild process %d exited by signal %d%s.", pid, WTERMSIG(wstatus),
+             WCOREDUMP(wstatus) ? " with core dump" : "");
+    } else {
+        LOGD(true, "Shouldn't be");
+    }
 }
 
+// true once the child is collected, or can't be
+bool reapChild(int pid)
+{
+    int wstatus;
+    const int ret = waitpid( pid, &wstatus, WNOHANG );
+    if (ret == 0) return false;
+    if (ret == pid) logExit( pid, wstatus );
+    else LOGD(true, "No child %d or ignoring SIGCHLD, errno %d", pid, errno);
+    return true;
+}
+
+// Children their owners are done with. Their exits are collected on a
+// thread of its own, polling waitpid(), so no event loop waits for one; a
+// child still there after the grace time is killed
+class ChildReaper {
+public:
+    static ChildReaper &instance();
+    ~ChildReaper();
+
+    void add(int pid);
+
+private:
+    struct Child {
+        int pid;
+        std::chrono::steady_clock::time_point deadline;
+        bool killed;
+    };
+
+    void run();
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::vector<Child> m_children;
+    std::thread m_thread;
+    bool m_stop = false;
+};
+
+ChildReaper &ChildReaper::instance()
+{
+    static ChildReaper inst;
+    return inst;
+}
+
+// at exit the ones left are killed and waited for
+ChildReaper::~ChildReaper()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable()) m_thread.join();
+    for (auto &c : m_children) {
+        kill( c.pid, SIGKILL );
+        waitpid( c.pid, nullptr, 0 );
+    }
+}
+
+void ChildReaper::add(int pid)
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_children.push_back( Child{pid, std::chrono::steady_clock::now() + std::chrono::milliseconds(ReapGraceTime), false} );
+        if (!m_thread.joinable()) m_thread = std::thread( &ChildReaper::run, this );
+    }
+    m_cond.notify_one();
+}
+
+void ChildReaper::run()
+{
+    std::unique_lock<std::mutex> lck( m_lock );
+    while (!m_stop) {
+        if (m_children.empty()) {
+            m_cond.wait( lck );
+            continue;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        m_children.erase( std::remove_if( m_children.begin(), m_children.end(), [now](Child &c) {
+            if (reapChild( c.pid )) return true;
+            if (!c.killed && c.deadline <= now) {
+                LOGD(true, "Killing pid %d", c.pid);
+                kill( c.pid, SIGKILL );
+                c.killed = true;
+            }
+            return false;
+        }), m_children.end() );
+        m_cond.wait_for( lck, std::chrono::milliseconds(ReapPollTime) );
+    }
+}
+} // namespace anonymous
+
 ChildProcess::ChildProcess(int flags)
     : m_flags(flags), m_pid(-1)
 {
@@ -42,7 +155,10 @@ void ChildProcess::cleanup(bool force_stop, int signal)
         }
     }
     if (m_pid > 0) {
-        wait( force_stop, signal );
+        if (force_stop) kill( m_pid, signal ? signal : SIGTERM );
+        // an exited child is collected right here, a running one later
+        if (!reapChild( m_pid )) ChildReaper::instance().add( m_pid );
+        m_pid = 0;
     }
 }
 
@@ -78,6 +194,12 @@ bool ChildProcess::exec(const std::string &cmd, const std::list<std::string> &cl
         return false;
     }
 
+    // the child only execs: pointers into the strings, made before the fork
+    m_argv.clear();
+    m_argv.push_back( const_cast<char *>( cmd.c_str() ) );
+    for (auto &str : cl_params) m_argv.push_back( const_cast<char *>( str.c_str() ) );
+    m_argv.push_back( nullptr );
+
     child_pid = fork();
     if (0 == child_pid) {
         // child process
@@ -100,20 +222,7 @@ bool ChildProcess::exec(const std::string &cmd, const std::list<std::string> &cl
         for(std::size_t j=PIPE_STDIN; j <= (with_stderr ? PIPE_STDERR : PIPE_STDOUT); j++ )
             for(auto i = 0; i < 2; i++) close( pipes[j][i] );
 
-        const std::size_t argc = cl_params.size();
-        std::vector<char *> argvref;
-        std::vector<std::vector<char> > argv;
-        argv.emplace_back( std::vector<char>( cmd.begin(), cmd.end() ) );
-        argv.back().push_back(0);
-        std::size_t i = 1;
-        for(auto &str : cl_params) {
-            argv.emplace_back( std::vector<char>( str.begin(), str.end() ) );
-            argv.back().push_back(0);
-        }
-        for(auto &v : argv) argvref.push_back( v.data() );
-        argvref.push_back( nullptr );
-        
-        nResult = execvp(cmd.c_str(), argvref.data());
+        nResult = execvp(cmd.c_str(), m_argv.data());
 
         LOGE(true, "Exec() error. Result %d ", nResult);
 
@@ -176,14 +285,15 @@ bool ChildProcess::wait(bool force_stop, int signal)
         }
     }
     int wstatus, ret = 0;
-    for (int i=0; i<3; i++) {
+    // poll the child in short steps, a stopped adb usually exits within milliseconds
+    for (int i=0; i<300; i++) {
         ret = waitpid( m_pid, &wstatus, WNOHANG );
         if (ret > 0) {
             assert( ret == m_pid );
             break;
         } else if (ret == 0) {
-            LOGD(true, "wait for 1 second...");
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            LOGD(i == 0, "wait up to 3 seconds...");
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         } else {
             assert( errno != EINVAL );
             LOGD(true, "waitpid() ret %d", ret);
@@ -211,16 +321,7 @@ bool ChildProcess::wait(bool force_stop, int signal)
     }
 
     const bool process_stopped = ret == m_pid;
-    if (process_stopped) {
-        if (WIFEXITED(wstatus)) {
-            LOGD(true, "Chaild process %d exited normally. Exit status %d", m_pid, WEXITSTATUS(wstatus));
-        } else if (WIFSIGNALED(wstatus)) {
-            LOGD(true, "Chaild process %d exited by signal %d%s.", m_pid, WTERMSIG(wstatus),
-                 WCOREDUMP(wstatus) ? " with core dump" : "");
-        } else {
-            LOGD(true, "Shouldn't be");
-        }
-    }
+    if (process_stopped) logExit( m_pid, wstatus );
     m_pid = 0;
     return process_stopped;
 }
@@ -3,6 +3,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 
 class ChildProcess
 {
@@ -21,12 +22,16 @@ public:
     ChildProcess(const ChildProcess &) = delete;
     ~ChildProcess();
 
+    // With force_stop the child gets the signal, SIGTERM by default. Never
+    // waits: a child that hasn't exited yet is collected in the background,
+    // killed if it takes over 3 seconds
     void cleanup(bool force_stop = false, int signal = 0);
     bool exec(const std::string &cmd, const std::list<std::string> &cl_params);
 
     int getStdinFd() const {return m_fdStdin;}
     int getStdoutFd() const {return m_fdStdout;}
     int getStderrFd() const {return m_fdStderr;}
+    // blocks till the child is gone, up to 3 seconds before SIGKILL
     bool wait(bool force_stop = false, int signal = 0);
 
 private:
@@ -38,6 +43,7 @@ private:
     int m_fdStderr = -1;
     int m_flags;
     int m_pid;
+    std::vector<char *> m_argv;
 };
 
 #endif // CHILDPROCESS_H
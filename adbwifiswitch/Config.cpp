@@ -11,6 +11,7 @@ Config Config::Builder::build() const
     Config ret;
 
     *static_cast<ConfigData *>(&ret) = *this;
+    if (!ret.uniqTag.empty()) return ret;
 
     auto time = std::chrono::time_point_cast<std::chrono::milliseconds>( std::chrono::system_clock::now() )
                     .time_since_epoch().count();
@@ -22,10 +23,26 @@ Config Config::Builder::build() const
     return ret;
 }
 
+Config Config::hedgeAttempt(unsigned int attempt) const
+{
+    Config ret( *this );
+    ret.uniqTag.append( "h" ).append( std::to_string( attempt ) );
+    ret.hedgeAttempts = 1;
+    return ret;
+}
+
 std::string Config::to_string() const
 {
     std::stringstream ss;
-    ss << "Adb " << getAdbCmd() << " ssid " << getSsid() << " key " << getPassword()
-       << " auth type " << getAuthType() << " uniq " << getUniqTag();
+    ss << "Adb " << getAdbCmd() << " serial " << getSerial() << " ssid " << getSsid() << " key " << getPassword()
+       << " auth type " << getAuthType() << " uniq " << getUniqTag()
+       << " logcat " << (getLogcatFormat().empty() ? "text" : getLogcatFormat())
+       << (isLogcatPushdown() ? " pushdown" : "") << (isCompositeCommand() ? " composite" : "")
+       << (isBroadcastEntry() ? " broadcast" : "") << (isNativeShell() ? " native-shell" : "")
+       << " result port " << getResultPort();
+    if (getHedgeAttempts() > 1) {
+        ss << " hedge " << getHedgeAttempts() << " at p" << getHedgePercentile() << " or " << getHedgeDelayMs() << " ms";
+    }
+    if (isAdaptiveTimeouts()) ss << " adaptive timeouts from " << getMinTimeoutMs() << " ms";
     return ss.str();
 }
@@ -6,9 +6,21 @@
 struct ConfigData {
     std::string adbCmd;
     std::string authType;
+    std::string logcatFormat;
     std::string password;
+    std::string serial;
     std::string ssid;
     std::string uniqTag;
+    bool adaptiveTimeouts = true;
+    bool broadcastEntry = false;
+    bool compositeCommand = false;
+    bool logcatPushdown = true;
+    bool nativeShell = false;
+    unsigned short resultPort = 0;
+    unsigned int hedgeAttempts = 1;
+    unsigned int hedgePercentile = 95;
+    unsigned int hedgeDelayMs = 5000;
+    unsigned int minTimeoutMs = 1000;
 };
 
 class Config : ConfigData {
@@ -16,19 +28,51 @@ public:
 
     class Builder :  ConfigData {
     public:
+        Builder &setAdaptiveTimeouts(bool enable) {adaptiveTimeouts = enable; return *this;}
         Builder &setAdbCmd(const std::string &cmd) {adbCmd.assign( cmd ); return *this;}
         Builder &setAuthType(const std::string &atype) {authType.assign( atype ); return *this;}
+        Builder &setBroadcastEntry(bool enable) {broadcastEntry = enable; return *this;}
+        Builder &setCompositeCommand(bool enable) {compositeCommand = enable; return *this;}
+        Builder &setHedgeAttempts(unsigned int attempts) {hedgeAttempts = attempts; return *this;}
+        Builder &setHedgeDelayMs(unsigned int ms) {hedgeDelayMs = ms; return *this;}
+        Builder &setHedgePercentile(unsigned int pct) {hedgePercentile = pct; return *this;}
+        Builder &setLogcatPushdown(bool enable) {logcatPushdown = enable; return *this;}
+        Builder &setMinTimeoutMs(unsigned int ms) {minTimeoutMs = ms; return *this;}
+        Builder &setNativeShell(bool enable) {nativeShell = enable; return *this;}
+        Builder &setLogcatFormat(const std::string &format) {logcatFormat.assign( format ); return *this;}
         Builder &setPassword(const std::string &pwd) {password.assign( pwd ); return *this;}
+        Builder &setResultPort(unsigned short port) {resultPort = port; return *this;}
+        Builder &setSerial(const std::string &_serial) {serial.assign( _serial ); return *this;}
         Builder &setSsid(const std::string &_ssid) {ssid.assign( _ssid ); return *this;}
+        Builder &setUniqTag(const std::string &tag) {uniqTag.assign( tag ); return *this;}
         Config build() const;
     };
 
     const std::string &getAdbCmd() const {return adbCmd;}
     const std::string &getAuthType() const {return authType;}
+    // launches of the agent per operation, more than 1 enables hedging
+    unsigned int getHedgeAttempts() const {return hedgeAttempts;}
+    // first hedge without enough latency history for the device
+    unsigned int getHedgeDelayMs() const {return hedgeDelayMs;}
+    unsigned int getHedgePercentile() const {return hedgePercentile;}
+    const std::string &getLogcatFormat() const {return logcatFormat;}
+    // lower bound of the phase deadlines learned from the device
+    unsigned int getMinTimeoutMs() const {return minTimeoutMs;}
     const std::string &getPassword() const {return password;}
+    unsigned short getResultPort() const {return resultPort;}
+    bool isAdaptiveTimeouts() const {return adaptiveTimeouts;}
+    bool isBroadcastEntry() const {return broadcastEntry;}
+    bool isBinaryLogcat() const {return logcatFormat == "binary";}
+    bool isCompositeCommand() const {return compositeCommand;}
+    bool isLogcatPushdown() const {return logcatPushdown;}
+    bool isNativeShell() const {return nativeShell;}
+    const std::string &getSerial() const {return serial;}
     const std::string &getSsid() const {return ssid;}
     const std::string &getUniqTag() const {return uniqTag;}
     
+    // the operation launched once more, under its own uniq tag starting
+    // with this one's
+    Config hedgeAttempt(unsigned int attempt) const;
     std::string to_string() const;
 };
 
@@ -0,0 +1,78 @@
+#include <fstream>
+
+#include "DeviceClock.h"
+#include "Logger.h"
+
+namespace {
+const auto MaxAge = std::chrono::hours(1);
+const char DefaultDevice[] = "-";
+} // namespace anonymous
+
+
+// DeviceClock class implementation
+
+DeviceClock &DeviceClock::instance()
+{
+    static DeviceClock inst;
+    return inst;
+}
+
+bool DeviceClock::offset(const std::string &serial, std::chrono::milliseconds &offset,
+                         std::chrono::milliseconds &error) const
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    auto it = m_devices.find( serial.empty() ? DefaultDevice : serial );
+    if (it == m_devices.end()) return false;
+    const auto age = std::chrono::system_clock::now() - it->second.measured;
+    if (age > MaxAge || age < age.zero()) return false;
+    offset = it->second.offset;
+    error = it->second.error;
+    return true;
+}
+
+void DeviceClock::update(const std::string &serial, std::chrono::milliseconds offset,
+                         std::chrono::milliseconds error)
+{
+    LOGD(true, "Device %s clock offset %lld ms +-%lld", serial.c_str(),
+         static_cast<long long>( offset.count() ), static_cast<long long>( error.count() ));
+    std::lock_guard<std::mutex> lck( m_lock );
+    m_devices[serial.empty() ? DefaultDevice : serial] = Entry{offset, error, std::chrono::system_clock::now()};
+}
+
+bool DeviceClock::toDevice(const std::string &serial, DeviceClock::TimePoint host, DeviceClock::TimePoint &device) const
+{
+    std::chrono::milliseconds off, err;
+    if (!offset( serial, off, err )) return false;
+    device = host + off - err;
+    return true;
+}
+
+bool DeviceClock::load(const std::string &path)
+{
+    std::ifstream is( path );
+    if (!is) return false;
+    std::string serial;
+    long long off, err, measured;
+    std::lock_guard<std::mutex> lck( m_lock );
+    while (is >> serial >> off >> err >> measured) {
+        m_devices[serial] = Entry{std::chrono::milliseconds(off), std::chrono::milliseconds(err),
+                                  TimePoint( std::chrono::milliseconds(measured) )};
+    }
+    return true;
+}
+
+bool DeviceClock::save(const std::string &path) const
+{
+    std::ofstream os( path, std::ios::trunc );
+    if (!os) {
+        LOGD(true, "Can't save device clocks to %s", path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lck( m_lock );
+    for (auto &d : m_devices) {
+        os << d.first << ' ' << d.second.offset.count() << ' ' << d.second.error.count() << ' '
+           << std::chrono::duration_cast<std::chrono::milliseconds>( d.second.measured.time_since_epoch() ).count()
+           << '\n';
+    }
+    return static_cast<bool>( os );
+}
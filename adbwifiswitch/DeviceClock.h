@@ -0,0 +1,40 @@
+#ifndef DEVICECLOCK_H
+#define DEVICECLOCK_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Per-device clock offsets (device time minus host time), used to turn
+// a host timestamp into a logcat -T cursor. Kept in memory and optionally
+// in a small state file, so a one shot run doesn't probe every time.
+// Shared by all reactor threads, calls lock.
+class DeviceClock {
+public:
+    typedef std::chrono::system_clock::time_point TimePoint;
+
+    static DeviceClock &instance();
+
+    bool offset(const std::string &serial, std::chrono::milliseconds &offset,
+                std::chrono::milliseconds &error) const;
+    void update(const std::string &serial, std::chrono::milliseconds offset,
+                std::chrono::milliseconds error);
+    // device time matching the host time point, minus the measurement error
+    bool toDevice(const std::string &serial, TimePoint host, TimePoint &device) const;
+
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+
+private:
+    struct Entry {
+        std::chrono::milliseconds offset;
+        std::chrono::milliseconds error;
+        TimePoint measured;
+    };
+
+    mutable std::mutex m_lock;
+    std::map<std::string, Entry> m_devices;
+};
+
+#endif // DEVICECLOCK_H
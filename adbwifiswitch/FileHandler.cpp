@@ -1,12 +1,25 @@
+#include <signal.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+
 #include "FileHandler.h"
+#include "FilePoller.h"
 
 
 namespace {
 enum Flags {
     fState = 0x1,
     fPollOut = 0x2,
+    fPollPaused = 0x4,
+};
+
+enum {
+    // a handler rarely runs more timers at once, the list never grows then
+    TimerSlots = 8,
 };
 }
 
@@ -18,6 +31,8 @@ FileHandler::FileHandler(int fd)
 
 FileHandler::~FileHandler()
 {
+    // before the fd is closed, its epoll registration goes with it
+    if (m_poller) m_poller->detach( m_pollerId );
     if (m_fd != -1) {
         close( m_fd );
     }
@@ -25,15 +40,8 @@ FileHandler::~FileHandler()
 
 void FileHandler::checkTimer(std::chrono::steady_clock::time_point now)
 {
-    while(1) {
-        auto it = m_timers.cbegin();
-        if (it == m_timers.cend() || it->first > now)
-            break;
-
-        auto timerId = it->second;
-        m_timers.erase( it );
-        onTimer( timerId );
-    }
+    unsigned int timerId;
+    while (takeTimer( now, timerId )) onTimer( timerId );
 }
 
 std::chrono::steady_clock::time_point FileHandler::getClosestTime() const
@@ -53,6 +61,11 @@ bool FileHandler::writeRequired() const
     return isFlag(fPollOut);
 }
 
+bool FileHandler::pollPaused() const
+{
+    return isFlag(fPollPaused);
+}
+
 void FileHandler::setState(bool enable)
 {
     setFlag( fState, enable );
@@ -63,16 +76,27 @@ bool FileHandler::startTimer(unsigned int timerId, std::chrono::milliseconds ms,
     auto now = std::chrono::steady_clock::now() + ms;
 
     if (reset_prev) stopTimer( timerId );
-    m_timers.emplace( now, timerId );
+    if (m_timers.capacity() < TimerSlots) m_timers.reserve( TimerSlots );
+    // after the ones due at the same time
+    auto it = std::upper_bound( m_timers.begin(), m_timers.end(), now,
+                                [](std::chrono::steady_clock::time_point t, const TimerList::value_type &timer) {
+                                    return t < timer.first;
+                                });
+    m_timers.emplace( it, now, timerId );
     return true;
 }
 
 bool FileHandler::stopTimer(unsigned int timerId)
 {
-    for(auto it = m_timers.begin(); it != m_timers.end(); ) {
-        if (it->second == timerId) it = m_timers.erase( it );
-        else ++it;
-    }
+    m_timers.erase( std::remove_if( m_timers.begin(), m_timers.end(),
+                                    [timerId](const TimerList::value_type &timer) {return timer.second == timerId;} ),
+                    m_timers.end() );
+    return true;
+}
+
+void FileHandler::stopTimers()
+{
+    m_timers.clear();
 }
 
 void FileHandler::setWriteRequest(bool enable)
@@ -80,9 +104,51 @@ void FileHandler::setWriteRequest(bool enable)
     setFlag( Flags::fPollOut, enable);
 }
 
+void FileHandler::setPollPaused(bool pause)
+{
+    setFlag( Flags::fPollPaused, pause );
+}
+
+// SIGPIPE is blocked for the thread around the write; the one raised by it
+// is taken off the pending set before the mask is restored, one pending
+// from before is left
+long FileHandler::writePipe(int fd, const void *buf, std::size_t size)
+{
+    sigset_t pipe_set, old_set, pending;
+    sigemptyset( &pipe_set );
+    sigaddset( &pipe_set, SIGPIPE );
+    pthread_sigmask( SIG_BLOCK, &pipe_set, &old_set );
+    sigpending( &pending );
+    const bool was_pending = sigismember( &pending, SIGPIPE );
+
+    const long ret = write( fd, buf, size );
+    const int err = errno;
+    if (ret < 0 && err == EPIPE && !was_pending) {
+        const struct timespec zero = {0, 0};
+        while (sigtimedwait( &pipe_set, nullptr, &zero ) < 0 && errno == EINTR) {}
+    }
+    pthread_sigmask( SIG_SETMASK, &old_set, nullptr );
+    errno = err;
+    return ret;
+}
+
+long FileHandler::writeSocket(int fd, const void *buf, std::size_t size)
+{
+    return send( fd, buf, size, MSG_NOSIGNAL );
+}
+
 
 // FileHandler:: private methods
 
+bool FileHandler::takeTimer(std::chrono::steady_clock::time_point now, unsigned int &timerId)
+{
+    auto it = m_timers.cbegin();
+    if (it == m_timers.cend() || it->first > now) return false;
+    timerId = it->second;
+    m_timers.erase( it );
+    return true;
+}
+
 inline bool FileHandler::isFlag(int flag) const
 {
     return (m_flags & flag) == flag;
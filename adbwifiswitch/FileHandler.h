@@ -2,7 +2,11 @@
 #define FILEHANDLER_H
 
 #include <chrono>
-#include <map>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+class FilePoller;
 
 class FileHandler {
 public:
@@ -15,10 +19,20 @@ public:
     std::chrono::steady_clock::time_point getClosestTime() const;
     bool isEnabled() const;
     bool writeRequired() const;
+    bool pollPaused() const;
     void setState( bool enable );
     bool startTimer(unsigned int timerId, std::chrono::milliseconds ms, bool reset_prev = true);
     bool stopTimer(unsigned int timerId);
+    void stopTimers();
     void setWriteRequest(bool enable);
+    // the fd isn't polled while paused, timers still run
+    void setPollPaused(bool pause);
+
+    // write() to a pipe whose reader may be gone: fails with EPIPE instead
+    // of raising SIGPIPE, whatever the process' disposition
+    static long writePipe(int fd, const void *buf, std::size_t size);
+    // the same for a socket
+    static long writeSocket(int fd, const void *buf, std::size_t size);
 
     virtual bool onTimer( unsigned int timerId ) {return false;}
     virtual bool onReadyToRead() = 0;
@@ -26,15 +40,23 @@ public:
     virtual bool onError() = 0;
 
 private:
+    friend class FilePoller;
 
+    // the earliest timer due by now, taken off the list
+    bool takeTimer(std::chrono::steady_clock::time_point now, unsigned int &timerId);
     bool isFlag(int flag) const;
     void setFlag( int flag, bool enable );
 
-    typedef std::multimap<std::chrono::steady_clock::time_point, unsigned int> TimerList;
+    // by due time, a handler has a few at most: a sorted vector keeps its
+    // storage from one timer to the next
+    typedef std::vector<std::pair<std::chrono::steady_clock::time_point, unsigned int> > TimerList;
 
     int m_fd;
     int m_flags;
     TimerList m_timers;
+    // the poller it's registered with, told when the handler goes
+    FilePoller *m_poller = nullptr;
+    unsigned int m_pollerId = 0;
 };
 
 #endif // FILEHANDLER_H
@@ -1,47 +1,173 @@
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <iostream>
 
 #include "FilePoller.h"
 #include "Logger.h"
 
+namespace {
+enum {
+    // posted tasks run per loop iteration, the rest after the handlers
+    MaxPostedPerRun = 256,
+};
+enum : std::uint32_t {
+    // handler id: generation above the slot index
+    SlotBits = 20,
+    SlotMask = (1u << SlotBits) - 1,
+    MaxGeneration = (1u << (32 - SlotBits)) - 1,
+    NoSlot = ~0u,
+};
+// epoll data of the wakeup eventfd, no handler has this id
+const std::uint64_t WakeupKey = ~std::uint64_t(0);
+} // namespace anonymous
+
+
+// FilePoller class implementation
+
 FilePoller::FilePoller(bool single_threaded)
-    : m_singleThreaded(single_threaded)
+    : m_freeSlot(NoSlot), m_singleThreaded(single_threaded)
 {
+    m_wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    LOGE(m_wakeFd == -1, "eventfd error %d, posted tasks wait for other events", errno);
 }
 
-FilePoller::HandlerId FilePoller::addHandler(std::shared_ptr<FileHandler> handler)
+FilePoller::~FilePoller()
 {
-    assert(handler);
-    auto lck( getLock() );
-
-    auto seq = getNextSeq();
-    if (seq != BadHandlerId) {
-        m_hndList.emplace( seq, handler );
+    for (auto &e : m_entries) {
+        if (e.handler) e.handler->m_poller = nullptr;
     }
-    return seq;
+    if (m_epollFd != -1) close( m_epollFd );
+    if (m_wakeFd != -1) close( m_wakeFd );
+}
+
+FilePoller::HandlerId FilePoller::addHandler(std::shared_ptr<FileHandler> handler)
+{
+    return add( std::move(handler), &s_dispatch<FileHandler> );
 }
 
 void FilePoller::exec()
 {
-    std::vector<pollfd> pfd;
-    std::vector<FilePoller::HandlerId> ind;
-    while( pollHandlers(std::chrono::milliseconds::max(), pfd, ind) );
+    while( pollHandlers(std::chrono::milliseconds::max(), m_pollFds, m_pollIds) );
 }
 
 bool FilePoller::pollHandlers(std::chrono::milliseconds timeout)
 {
-    std::vector<pollfd> pfd;
-    std::vector<FilePoller::HandlerId> ind;
-    return pollHandlers(timeout, pfd, ind);
+    return pollHandlers(timeout, m_pollFds, m_pollIds);
 }
 
 void FilePoller::removeHandler(FilePoller::HandlerId hndId)
 {
     auto lck( getLock() );
-    m_hndList.erase( hndId );
+    if (Entry *entry = find( hndId )) release( *entry );
+}
+
+int FilePoller::embedFd()
+{
+    if (m_epollFd == -1) {
+        m_epollFd = epoll_create1( EPOLL_CLOEXEC );
+        LOGE(m_epollFd == -1, "epoll_create1 error %d", errno);
+        if (m_epollFd != -1 && m_wakeFd != -1) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = WakeupKey;
+            LOGE(epoll_ctl( m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev ) != 0, "epoll_ctl error %d for eventfd", errno);
+        }
+    }
+    return m_epollFd;
+}
+
+std::chrono::steady_clock::time_point FilePoller::nextDeadline()
+{
+    auto ret = std::chrono::steady_clock::time_point::max();
+    if (embedFd() != -1) syncEmbedded( ret );
+    return ret;
+}
+
+bool FilePoller::dispatchReady(std::size_t maxEvents)
+{
+    if (embedFd() == -1) return false;
+    m_loopThread.store( std::this_thread::get_id(), std::memory_order_relaxed );
+    runPosted();
+    m_events.resize( std::max<std::size_t>( maxEvents, 1 ) );
+    const int count = epoll_wait( m_epollFd, m_events.data(), static_cast<int>( m_events.size() ), 0 );
+    LOGE(count < 0 && errno != EINTR, "epoll_wait error %d", errno);
+    for (int i = 0; i < count; i++) {
+        if (m_events[i].data.u64 == WakeupKey) {
+            runPosted();
+            continue;
+        }
+        const int fd = static_cast<int>( m_events[i].data.u64 >> 32 );
+        const auto hId = static_cast<HandlerId>( m_events[i].data.u64 & 0xffffffffu );
+        {
+            // other threads may add or remove handlers meanwhile
+            auto lck( getLock() );
+            Entry *entry = find( hId );
+            // a closed fd's registration lingering in a child's copy
+            if (!entry || !entry->registered || entry->regFd != fd) continue;
+            entry->regEvents = 0;
+        }
+        const std::uint32_t ev = m_events[i].events;
+        dispatchEvents( hId, fd, static_cast<short>( ((ev & EPOLLIN) ? POLLIN : 0) | ((ev & EPOLLOUT) ? POLLOUT : 0) |
+                                                     ((ev & EPOLLERR) ? POLLERR : 0) | ((ev & EPOLLHUP) ? POLLHUP : 0) ) );
+    }
+    // timers started since the last sync come with the next call, the host
+    // doesn't wait then: nextDeadline() has them
+    const auto now = std::chrono::steady_clock::now();
+    if (m_embedDeadline <= now) checkTimers( now );
+
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    return syncEmbedded( deadline );
 }
 
+void FilePoller::post(std::function<void()> task)
+{
+    m_posted.push( std::move(task) );
+    wakeup();
+}
+
+void FilePoller::dispatch(std::function<void()> task)
+{
+    if (m_loopThread.load( std::memory_order_relaxed ) == std::this_thread::get_id()) {
+        task();
+    } else {
+        post( std::move(task) );
+    }
+}
+
+
+// FilePoller:: private members
+
+FilePoller::HandlerId FilePoller::add(std::shared_ptr<FileHandler> handler, const FilePoller::Dispatch *dispatch)
+{
+    assert(handler);
+    auto lck( getLock() );
+    if (handler->m_poller) {
+        LOGE(true, "Handler for fd %d is registered already", handler->getFd());
+        return BadHandlerId;
+    }
+
+    std::uint32_t slot = m_freeSlot;
+    if (slot != NoSlot) {
+        m_freeSlot = m_slots[slot].entry;
+    } else {
+        if (m_slots.size() > SlotMask) return BadHandlerId;
+        slot = static_cast<std::uint32_t>( m_slots.size() );
+        m_slots.push_back( Slot{1, 0} );
+    }
+    m_slots[slot].entry = static_cast<std::uint32_t>( m_entries.size() );
+    const HandlerId id = (m_slots[slot].generation << SlotBits) | slot;
+    m_entries.push_back( Entry{handler.get(), handler, dispatch, id, false, -1, 0} );
+    handler->m_poller = this;
+    handler->m_pollerId = id;
+    // a poll blocked in another thread takes it in right away
+    if (!m_singleThreaded) wakeup();
+    return id;
+}
 
 inline std::unique_lock<std::mutex> FilePoller::getLock()
 {
@@ -49,12 +175,49 @@ inline std::unique_lock<std::mutex> FilePoller::getLock()
                               std::unique_lock<std::mutex>(m_lock);
 }
 
-FilePoller::HandlerId FilePoller::getNextSeq()
+FilePoller::Entry *FilePoller::find(FilePoller::HandlerId hId)
+{
+    const std::uint32_t slot = hId & SlotMask;
+    if (slot >= m_slots.size() || m_slots[slot].generation != hId >> SlotBits) return nullptr;
+    return &m_entries[m_slots[slot].entry];
+}
+
+// The fd is still open here, the registration must go before it's closed:
+// a child process holding a copy would keep it alive otherwise
+void FilePoller::release(FilePoller::Entry &entry)
+{
+    if (entry.registered) epoll_ctl( m_epollFd, EPOLL_CTL_DEL, entry.regFd, nullptr );
+    entry.registered = false;
+    entry.handler->m_poller = nullptr;
+    entry.handler = nullptr;
+    entry.owner.reset();
+
+    Slot &slot = m_slots[entry.id & SlotMask];
+    slot.generation = slot.generation == MaxGeneration ? 1 : slot.generation + 1;
+    slot.entry = m_freeSlot;
+    m_freeSlot = entry.id & SlotMask;
+    m_removed++;
+}
+
+// from the handler's destructor
+void FilePoller::detach(FilePoller::HandlerId hId)
+{
+    auto lck( getLock() );
+    if (Entry *entry = find( hId )) release( *entry );
+}
+
+void FilePoller::compact()
 {
-    auto startSeq = m_seq++;
-    while((m_seq == BadHandlerId || m_hndList.find(m_seq) != m_hndList.cend()) &&
-          m_seq != startSeq) m_seq++;
-    return m_seq;
+    if (!m_removed || m_walking) return;
+    std::size_t out = 0;
+    for (std::size_t i = 0; i < m_entries.size(); i++) {
+        if (!m_entries[i].handler) continue;
+        if (out != i) m_entries[out] = std::move( m_entries[i] );
+        m_slots[m_entries[out].id & SlotMask].entry = static_cast<std::uint32_t>( out );
+        out++;
+    }
+    m_entries.resize( out );
+    m_removed = 0;
 }
 
 bool FilePoller::pollHandlers(std::chrono::milliseconds timeout,
@@ -71,76 +234,89 @@ bool FilePoller::pollHandlers(std::chrono::milliseconds timeout,
     }
     std::size_t fd_count = 0;
 
+    m_loopThread.store( std::this_thread::get_id(), std::memory_order_relaxed );
+    // before the poll set is built, so handlers the tasks add are in it;
+    // the tasks count as this iteration's events, the poll doesn't wait
+    if (runPosted()) timeout = timeout.zero();
+
     HandlerId firstTimer = BadHandlerId;
     bool moreTimers = false;
 
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool any = false;
     {
         auto lck( getLock() );
+        compact();
 
-        for(auto it = m_hndList.begin(); it != m_hndList.end();) {
-            auto handler = it->second.lock();
-            if (handler) {
-                if (!handler->isEnabled()) {
-                    ++it;
-                    continue;
-                }
+        for (const Entry &e : m_entries) {
+            FileHandler *handler = e.handler;
+            if (!handler || !handler->isEnabled()) continue;
+            any = true;
 
+            // fd-less and paused handlers are here for their timers only
+            if (handler->getFd() >= 0 && !handler->pollPaused()) {
                 struct pollfd spfd;
                 spfd.fd = handler->getFd();
                 spfd.events = POLLIN | POLLERR | (handler->writeRequired() ? POLLOUT : 0);
                 spfd.revents = 0;
-                const HandlerId hId = it->first;
                 if (fd_count < pfd_size) {
                     pfd[fd_count] = spfd;
-                    ind[fd_count] = hId;
+                    ind[fd_count] = e.id;
                 } else {
                     pfd.push_back( spfd );
-                    ind.push_back( hId );
+                    ind.push_back( e.id );
                 }
                 fd_count++;
+            }
 
-                // timers
-                const auto timer = handler->getClosestTime();
-                const bool empty_timer = timer == timer.max();
-                if (!empty_timer) {
-                    bool use_timer = false;
-                    if (timer <= now) {
+            // timers
+            const auto timer = handler->getClosestTime();
+            const bool empty_timer = timer == timer.max();
+            if (!empty_timer) {
+                bool use_timer = false;
+                if (timer <= now) {
+                    use_timer = true;
+                    timeout = timeout.zero();
+                } else if (timeout != timeout.zero()) {
+                    auto diff = std::chrono::duration_cast<decltype(timeout)>( timer - now );
+                    if (diff < timeout) {
+                        timeout = diff;
                         use_timer = true;
-                        timeout = timeout.zero();
-                    } else if (timeout != timeout.zero()) {
-                        auto diff = std::chrono::duration_cast<decltype(timeout)>( timer - now );
-//                        std::cerr << "now " << now.time_since_epoch().count() << " timer "
-//                                  << timer.time_since_epoch().count()
-//                                  << " diff " << diff.count()
-//                                  << " curr timeout " << timeout.count() << std::endl;
-                            if (diff < timeout) {
-                                timeout = diff;
-                                use_timer = true;
-                            }
-                    }
-                    if (use_timer) {
-                        moreTimers = firstTimer != BadHandlerId;
-                        firstTimer = hId;
                     }
                 }
-                ++it;
-            } else {
-                it  = m_hndList.erase( it );
+                if (use_timer) {
+                    moreTimers = firstTimer != BadHandlerId;
+                    firstTimer = e.id;
+                }
             }
         }
     }
 
-    if (!fd_count) {
+    if (!any) {
         LOGD(true, "No more handlers to poll");
         return false;
     }
 
+    // the eventfd goes last and only along with handlers, alone it would
+    // keep the loop going
+    std::size_t nfds = fd_count;
+    if (m_wakeFd != -1) {
+        const struct pollfd wpfd = {m_wakeFd, POLLIN, 0};
+        if (nfds < pfd_size) {
+            pfd[nfds] = wpfd;
+            ind[nfds] = BadHandlerId;
+        } else {
+            pfd.push_back( wpfd );
+            ind.push_back( static_cast<HandlerId>( BadHandlerId ) );
+        }
+        nfds++;
+    }
+
     int poll_timeo = timeout == timeout.max() ? -1 : static_cast<int>( timeout.count() );
 
     LOGD(true, "Running poll. fd count %zu timeout %d", fd_count, poll_timeo);
 
-    const int pret = poll( pfd.data(), static_cast<nfds_t>(fd_count), poll_timeo );
+    const int pret = poll( pfd.data(), static_cast<nfds_t>(nfds), poll_timeo );
 
     if (pret < 0) {
         LOGE(true, "Poll error %d", errno);
@@ -150,33 +326,13 @@ bool FilePoller::pollHandlers(std::chrono::milliseconds timeout,
     const bool has_fileevents = pret > 0;
 
     if (has_fileevents) {
-        for(std::size_t i = 0; i < fd_count; i++) {
+        for(std::size_t i = 0; i < nfds; i++) {
             const struct pollfd &spfd = pfd[i];
-            if (spfd.revents != 0) {
-                LOGD((spfd.revents & ~(POLLERR|POLLIN|POLLOUT)), "revent = 0x%x", spfd.revents);
-                auto lck( getLock() );
-                auto it = m_hndList.find( ind[i] );
-                if (it != m_hndList.cend()) {
-                    auto handler = it->second.lock();
-                    if (handler) {
-                        bool henabled = handler->isEnabled();
-                        if (henabled && spfd.revents & POLLIN) {
-                            handler->onReadyToRead();
-                            henabled = handler->isEnabled();
-                        }
-                        if (henabled && spfd.revents & POLLERR) {
-                            handler->onError();
-                            henabled = handler->isEnabled();
-                        }
-                        if (henabled && spfd.revents & POLLOUT) {
-                            handler->onReadyToWrite();
-                        }
-                    } else {
-                        LOGD(true, "Handler for fd %d was destroyed", spfd.fd);
-                    }
-                } else {
-                    LOGD(true, "Handler for fd %d was removed", spfd.fd);
-                }
+            if (spfd.revents != 0 && ind[i] == BadHandlerId) {
+                runPosted();
+            } else if (spfd.revents != 0) {
+                LOGD((spfd.revents & ~(POLLERR|POLLHUP|POLLIN|POLLOUT)), "revent = 0x%x", spfd.revents);
+                dispatchEvents( ind[i], spfd.fd, spfd.revents );
             }
         }
     }
@@ -184,34 +340,116 @@ bool FilePoller::pollHandlers(std::chrono::milliseconds timeout,
     if (firstTimer != BadHandlerId) {
         now = std::chrono::steady_clock::now();
         if (moreTimers) {
-            HandlerId curr = 0;
-            while(1) {
-                auto lck( getLock() );
-                auto it = m_hndList.upper_bound( curr );
-                decltype(it->second.lock()) handler;
-                for(; it != m_hndList.cend(); ++it) {
-                    handler = it->second.lock();
-                    if (handler && handler->isEnabled())
-                        break;
-                }
-                if (it != m_hndList.cend()) {
-                    curr = it->first;
-                    handler->checkTimer( now );
-                } else {
-                    break;
-                }
-            }
+            checkTimers( now );
         } else {
             auto lck( getLock() );
-            auto it = m_hndList.find( firstTimer );
-            if (it != m_hndList.cend()) {
-                auto handler = it->second.lock();
-                if (handler && handler->isEnabled()) {
-                    handler->checkTimer( now );
-                }
-            }
+            if (Entry *entry = find( firstTimer )) fireTimers( static_cast<std::size_t>( entry - m_entries.data() ), now );
         }
     }
 
     return true;
 }
+
+void FilePoller::dispatchEvents(FilePoller::HandlerId hId, int fd, short revents)
+{
+    auto lck( getLock() );
+    Entry *entry = find( hId );
+    if (!entry) {
+        LOGD(true, "Handler for fd %d was removed", fd);
+        return;
+    }
+    // kept alive through its callbacks, they may drop its owner's reference
+    auto handler = entry->owner.lock();
+    if (handler) entry->dispatch->events( handler.get(), revents );
+}
+
+// A timer callback keeps its handler alive, the others are checked by
+// pointer only
+void FilePoller::fireTimers(std::size_t index, std::chrono::steady_clock::time_point now)
+{
+    const Entry &entry = m_entries[index];
+    if (!entry.handler || !entry.handler->isEnabled() || entry.handler->getClosestTime() > now) return;
+    auto handler = entry.owner.lock();
+    if (handler) entry.dispatch->timers( handler.get(), now );
+}
+
+// Handlers added by the callbacks are walked as well, removed ones stay in
+// place till the walk is over
+void FilePoller::checkTimers(std::chrono::steady_clock::time_point now)
+{
+    m_walking++;
+    for (std::size_t i = 0; ; i++) {
+        auto lck( getLock() );
+        if (i >= m_entries.size()) break;
+        fireTimers( i, now );
+    }
+    m_walking--;
+}
+
+// Brings the epoll set in line with the handlers: one shot registrations,
+// re-armed here after they fire, so a registration outliving its fd in a
+// child process fires once at most
+bool FilePoller::syncEmbedded(std::chrono::steady_clock::time_point &deadline)
+{
+    auto lck( getLock() );
+    compact();
+    auto ctl = [this](int op, int fd, std::uint32_t events, HandlerId hId) {
+        struct epoll_event ev = {};
+        ev.events = events | EPOLLONESHOT;
+        ev.data.u64 = (static_cast<std::uint64_t>( static_cast<unsigned int>( fd ) ) << 32) | hId;
+        return epoll_ctl( m_epollFd, op, fd, &ev ) == 0;
+    };
+    bool any = false;
+    for (Entry &e : m_entries) {
+        FileHandler *handler = e.handler;
+        if (!handler) continue;
+        if (!handler->isEnabled() || handler->getFd() < 0 || handler->pollPaused()) {
+            if (e.registered) epoll_ctl( m_epollFd, EPOLL_CTL_DEL, e.regFd, nullptr );
+            e.registered = false;
+        } else {
+            const int fd = handler->getFd();
+            const std::uint32_t events = EPOLLIN | (handler->writeRequired() ? EPOLLOUT : 0u);
+            // the fd may have been closed and reused under a known registration
+            if (e.registered && e.regEvents == events) {
+            } else if (!ctl( e.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, events, e.id ) &&
+                       !ctl( e.registered ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, events, e.id )) {
+                LOGE(true, "epoll_ctl error %d for fd %d", errno, fd);
+            }
+            e.registered = true;
+            e.regFd = fd;
+            e.regEvents = events;
+        }
+        if (handler->isEnabled()) {
+            any = true;
+            deadline = std::min( deadline, handler->getClosestTime() );
+        }
+    }
+    m_embedDeadline = deadline;
+    return any;
+}
+
+
+// The eventfd is reset before the pending flag, a post racing with the
+// drain then leaves a spurious wakeup at worst, never a lost one
+bool FilePoller::runPosted()
+{
+    if (!m_postPending.load( std::memory_order_acquire )) return false;
+    std::uint64_t count;
+    if (m_wakeFd != -1) (void)!read( m_wakeFd, &count, sizeof(count) );
+    // pairs with the exchange in wakeup(): a post it doesn't see here
+    // finds the flag cleared and writes the eventfd again
+    m_postPending.exchange( false, std::memory_order_acq_rel );
+
+    std::function<void()> task;
+    std::size_t n = 0;
+    for (; n < MaxPostedPerRun && m_posted.pop( task ); n++) task();
+    if (n == MaxPostedPerRun) wakeup();
+    return n > 0;
+}
+
+void FilePoller::wakeup()
+{
+    if (m_postPending.exchange( true, std::memory_order_acq_rel ) || m_wakeFd == -1) return;
+    const std::uint64_t one = 1;
+    (void)!write( m_wakeFd, &one, sizeof(one) );
+}
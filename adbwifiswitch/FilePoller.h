@@ -2,13 +2,21 @@
 #define FILEPOLLER_H
 
 #include <poll.h>
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <type_traits>
 
-#include <map>
 #include <memory>
 #include <mutex>
 #include <vector>
 
 #include "FileHandler.h"
+#include "MpscQueue.h"
 
 class FilePoller {
 public:
@@ -16,23 +24,147 @@ public:
     static const HandlerId BadHandlerId = 0;
 
     FilePoller(bool single_threaded = true);
+    ~FilePoller();
 
+    // Handlers added as FileHandler are called through its virtual
+    // interface. Added as its own type, a handler's callbacks are bound at
+    // compile time: a final class's are called directly
     HandlerId addHandler( std::shared_ptr<FileHandler> handler);
+    template <typename Handler>
+    HandlerId addHandler(std::shared_ptr<Handler> handler);
     void exec();
     bool pollHandlers(std::chrono::milliseconds timeout);
     void removeHandler( HandlerId hndId );
 
+    // Embedding into a host event loop instead of exec(): the host waits
+    // for embedFd() to be readable or for nextDeadline(), whichever comes
+    // first, then calls dispatchReady(). Handler changes made outside of
+    // dispatchReady() are picked up by nextDeadline(), so the host asks
+    // for it before every wait. Don't mix with exec() & pollHandlers().
+    // epoll fd of the handlers' fds, -1 if it can't be created
+    int embedFd();
+    std::chrono::steady_clock::time_point nextDeadline();
+    // handles at most maxEvents ready fds and the due timers, never
+    // blocks; false when no enabled handlers are left
+    bool dispatchReady(std::size_t maxEvents = 64);
+
+    // Hands a task over to the thread running the poller, safe from any
+    // thread: a lock free queue and an eventfd which wakes a blocked poll
+    // or the host loop. Tasks run in posting order before the handlers are
+    // polled; posted to a poller with no handlers left they wait for its
+    // next loop iteration
+    void post(std::function<void()> task);
+    // runs the task right away when called from the poller's thread
+    void dispatch(std::function<void()> task);
+
 private:
-    typedef std::map<HandlerId, std::weak_ptr<FileHandler> > HandlerList;
+    friend class FileHandler;
+
+    // a handler type's callbacks, called on that type
+    struct Dispatch {
+        void (*events)(FileHandler *handler, short revents);
+        void (*timers)(FileHandler *handler, std::chrono::steady_clock::time_point now);
+    };
+    template <typename Handler>
+    static void dispatchAs(FileHandler *handler, short revents);
+    template <typename Handler>
+    static void checkTimersAs(FileHandler *handler, std::chrono::steady_clock::time_point now);
+    template <typename Handler>
+    static const Dispatch s_dispatch;
+
+    // One per handler, dense in registration order. A removed entry stays
+    // till the next compaction, never while the entries are walked
+    struct Entry {
+        // null once removed or destroyed, no refcount to check it
+        FileHandler *handler;
+        // locked around the handler's callbacks only
+        std::weak_ptr<FileHandler> owner;
+        const Dispatch *dispatch;
+        HandlerId id;
+        // epoll interest of the fd in the embedded mode
+        bool registered;
+        int regFd;
+        std::uint32_t regEvents;    // 0: fired, wants re-arming
+    };
 
+    // An id is a slot index and the slot's generation, which moves on when
+    // the handler goes: a stale id never finds the slot's next handler
+    struct Slot {
+        std::uint32_t generation;
+        std::uint32_t entry;    // index in m_entries, or the next free slot
+    };
+
+    HandlerId add(std::shared_ptr<FileHandler> handler, const Dispatch *dispatch);
     std::unique_lock<std::mutex> getLock();
-    HandlerId getNextSeq();
+    Entry *find(HandlerId hId);
+    void release(Entry &entry);
+    void detach(HandlerId hId);
+    void compact();
     bool pollHandlers(std::chrono::milliseconds, std::vector<pollfd> &pfd, std::vector<HandlerId> &ind);
+    void dispatchEvents(HandlerId hId, int fd, short revents);
+    void fireTimers(std::size_t index, std::chrono::steady_clock::time_point now);
+    void checkTimers(std::chrono::steady_clock::time_point now);
+    bool syncEmbedded(std::chrono::steady_clock::time_point &deadline);
+    bool runPosted();
+    void wakeup();
 
-    HandlerList m_hndList;
+    std::vector<Entry> m_entries;
+    std::vector<Slot> m_slots;
+    std::uint32_t m_freeSlot;
+    std::size_t m_removed = 0;
+    // entries are walked with callbacks running, compaction waits
+    unsigned int m_walking = 0;
     std::mutex m_lock;
     bool m_singleThreaded;
-    HandlerId m_seq = BadHandlerId;
+    int m_epollFd = -1;
+    std::chrono::steady_clock::time_point m_embedDeadline = std::chrono::steady_clock::time_point::min();
+    std::vector<epoll_event> m_events;
+    // poll set of the last loop iteration, its storage is kept
+    std::vector<pollfd> m_pollFds;
+    std::vector<HandlerId> m_pollIds;
+    MpscQueue<std::function<void()> > m_posted;
+    // set by the first post after a drain, only that one writes the eventfd
+    std::atomic<bool> m_postPending{false};
+    std::atomic<std::thread::id> m_loopThread{std::thread::id()};
+    int m_wakeFd = -1;
 };
 
+template <typename Handler>
+FilePoller::HandlerId FilePoller::addHandler(std::shared_ptr<Handler> handler)
+{
+    static_assert(std::is_base_of<FileHandler, Handler>::value, "not a FileHandler");
+    return add( std::move(handler), &s_dispatch<Handler> );
+}
+
+// hang up is reported to readers as end of file
+template <typename Handler>
+void FilePoller::dispatchAs(FileHandler *handler, short revents)
+{
+    Handler *h = static_cast<Handler *>( handler );
+    bool henabled = h->isEnabled();
+    if (henabled && revents & (POLLIN|POLLHUP)) {
+        h->onReadyToRead();
+        henabled = h->isEnabled();
+    }
+    if (henabled && revents & POLLERR) {
+        h->onError();
+        henabled = h->isEnabled();
+    }
+    if (henabled && revents & POLLOUT) {
+        h->onReadyToWrite();
+    }
+}
+
+template <typename Handler>
+void FilePoller::checkTimersAs(FileHandler *handler, std::chrono::steady_clock::time_point now)
+{
+    Handler *h = static_cast<Handler *>( handler );
+    unsigned int timerId;
+    while (h->takeTimer( now, timerId )) h->onTimer( timerId );
+}
+
+template <typename Handler>
+const FilePoller::Dispatch FilePoller::s_dispatch = {&FilePoller::dispatchAs<Handler>,
+                                                     &FilePoller::checkTimersAs<Handler>};
+
 #endif // FILEPOLLER_H
@@ -0,0 +1,60 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "OperationArena.h"
+
+// Lazy coroutine returning T. It runs from resume() to its next co_await,
+// the result is kept once it co_returns.
+template <typename T>
+class Flow {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct promise_type {
+        Flow get_return_object() {return Flow( Handle::from_promise( *this ) );}
+        std::suspend_always initial_suspend() noexcept {return {};}
+        std::suspend_always final_suspend() noexcept {return {};}
+        void return_value(T val) {value.emplace( std::move(val) );}
+        // built without exceptions
+        void unhandled_exception() {std::terminate();}
+
+        static void *operator new(std::size_t size) {return OperationArena::allocate( size );}
+        static void operator delete(void *ptr, std::size_t size) {OperationArena::release( ptr, size );}
+
+        std::optional<T> value;
+    };
+
+    Flow() = default;
+    Flow(Flow &&other) noexcept : m_handle(std::exchange( other.m_handle, nullptr )) {}
+    Flow &operator=(Flow &&other) noexcept {
+        if (this != &other) {
+            reset();
+            m_handle = std::exchange( other.m_handle, nullptr );
+        }
+        return *this;
+    }
+    ~Flow() {reset();}
+
+    bool valid() const {return static_cast<bool>( m_handle );}
+    bool done() const {return m_handle && m_handle.done();}
+    void resume() {m_handle.resume();}
+    T &result() {return *m_handle.promise().value;}
+    void reset() {
+        if (m_handle) m_handle.destroy();
+        m_handle = nullptr;
+    }
+
+private:
+    explicit Flow(Handle handle) : m_handle(handle) {}
+
+    Handle m_handle;
+};
+
+#endif // FLOW_H
@@ -0,0 +1,36 @@
+#include <algorithm>
+
+#include "Config.h"
+#include "HedgePolicy.h"
+#include "LatencyHistory.h"
+
+namespace {
+enum {
+    MinHedgeDelay = 100, // milliseconds
+};
+} // namespace anonymous
+
+
+// HedgePolicy class implementation
+
+bool HedgePolicy::start(const Config &cfg)
+{
+    m_attempts = 1;
+    m_maxAttempts = cfg.getHedgeAttempts();
+    if (m_maxAttempts < 2) return false;
+
+    const LatencyHistory &history = LatencyHistory::instance();
+    std::chrono::milliseconds answer( cfg.getHedgeDelayMs() );
+    std::chrono::milliseconds launch( 0 );
+    history.percentile( cfg.getSerial(), LatencyHistory::Phase::Answer, cfg.getHedgePercentile(), answer );
+    history.percentile( cfg.getSerial(), LatencyHistory::Phase::AdbLaunch, cfg.getHedgePercentile(), launch );
+    m_gap = std::max( launch + answer, std::chrono::milliseconds(MinHedgeDelay) );
+    return true;
+}
+
+bool HedgePolicy::next()
+{
+    m_attempts++;
+    m_gap *= 2;
+    return m_attempts < m_maxAttempts;
+}
@@ -0,0 +1,31 @@
+#ifndef HEDGEPOLICY_H
+#define HEDGEPOLICY_H
+
+#include <chrono>
+
+class Config;
+
+// When a late operation is launched again while its earlier launches keep
+// waiting. The first extra attempt comes once the operation has taken
+// longer than the configured percentile of the device's am and answer
+// latencies, or the configured delay while there are too few of them; the
+// gaps double after it. Timed from the script step that starts the agent,
+// whatever it starts it with.
+class HedgePolicy {
+public:
+    // false when the operation isn't hedged
+    bool start(const Config &cfg);
+    // an attempt was launched, false when it was the last one
+    bool next();
+    // wait before the next attempt
+    std::chrono::milliseconds gap() const {return m_gap;}
+    // launches so far, the first one included
+    unsigned int attempts() const {return m_attempts;}
+
+private:
+    std::chrono::milliseconds m_gap = std::chrono::milliseconds::zero();
+    unsigned int m_attempts = 0;
+    unsigned int m_maxAttempts = 1;
+};
+
+#endif // HEDGEPOLICY_H
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "LatencyHistory.h"
+#include "Logger.h"
+
+namespace {
+enum {
+    MinSamples = 5,
+    MaxSamples = 64,
+    // a deadline is the larger of mean + 4 deviations and twice the p99
+    DeviationFactor = 4,
+    TimeoutPercentile = 99,
+    PercentileFactor = 2,
+};
+const char DefaultDevice[] = "-";
+const char *const PhaseNames[LatencyHistory::PhaseCount] = {"launch", "prompt", "prompt2", "answer"};
+} // namespace anonymous
+
+
+// LatencyHistory class implementation
+
+LatencyHistory &LatencyHistory::instance()
+{
+    static LatencyHistory inst;
+    return inst;
+}
+
+void LatencyHistory::add(const std::string &serial, LatencyHistory::Phase phase, std::chrono::milliseconds latency)
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    addSample( serial, phase, latency );
+}
+
+void LatencyHistory::timedOut(const std::string &serial, LatencyHistory::Phase phase,
+                              std::chrono::milliseconds deadline)
+{
+    LOGD(true, "Device %s %s timed out at %lld ms", serial.c_str(), PhaseNames[static_cast<std::size_t>( phase )],
+         static_cast<long long>( deadline.count() ));
+    std::lock_guard<std::mutex> lck( m_lock );
+    addSample( serial, phase, deadline );
+}
+
+bool LatencyHistory::percentile(const std::string &serial, LatencyHistory::Phase phase, unsigned int pct,
+                                std::chrono::milliseconds &latency) const
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return percentile( find( serial, phase ), pct, latency );
+}
+
+std::chrono::milliseconds LatencyHistory::timeout(const std::string &serial, LatencyHistory::Phase phase,
+                                                  std::chrono::milliseconds floor,
+                                                  std::chrono::milliseconds ceiling) const
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    const Estimate *est = find( serial, phase );
+    std::chrono::milliseconds tail;
+    if (!percentile( est, TimeoutPercentile, tail )) return ceiling;
+    const double deviations = static_cast<double>( DeviationFactor ) * est->dev;
+    const std::chrono::milliseconds smooth( static_cast<long long>( std::ceil( est->mean + deviations ) ) );
+    return std::clamp( std::max( smooth, PercentileFactor * tail ), std::min( floor, ceiling ), ceiling );
+}
+
+bool LatencyHistory::load(const std::string &path)
+{
+    std::ifstream is( path );
+    if (!is) return false;
+    std::lock_guard<std::mutex> lck( m_lock );
+    std::string line;
+    while (std::getline( is, line )) {
+        std::istringstream ls( line );
+        std::string serial, name;
+        Estimate est;
+        std::size_t count = 0;
+        if (!(ls >> serial >> name >> est.mean >> est.dev >> count) || count > MaxSamples) continue;
+        const auto phase = std::find( std::begin( PhaseNames ), std::end( PhaseNames ), name );
+        if (phase == std::end( PhaseNames )) continue;
+        long long ms;
+        while (est.recent.size() < count && ls >> ms) est.recent.emplace_back( ms );
+        if (est.recent.size() != count) continue;
+        m_devices[serial][static_cast<std::size_t>( phase - std::begin( PhaseNames ) )] = std::move( est );
+    }
+    return true;
+}
+
+bool LatencyHistory::save(const std::string &path) const
+{
+    std::ofstream os( path, std::ios::trunc );
+    if (!os) {
+        LOGD(true, "Can't save device latencies to %s", path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lck( m_lock );
+    for (auto &d : m_devices) {
+        for (std::size_t i = 0; i < PhaseCount; i++) {
+            const Estimate &est = d.second[i];
+            if (est.recent.empty()) continue;
+            os << d.first << ' ' << PhaseNames[i] << ' ' << est.mean << ' ' << est.dev << ' ' << est.recent.size();
+            for (auto ms : est.recent) os << ' ' << ms.count();
+            os << '\n';
+        }
+    }
+    return static_cast<bool>( os );
+}
+
+
+// LatencyHistory:: private members
+
+void LatencyHistory::addSample(const std::string &serial, LatencyHistory::Phase phase,
+                               std::chrono::milliseconds latency)
+{
+    const std::string_view key = serial.empty() ? std::string_view( DefaultDevice ) : std::string_view( serial );
+    auto it = m_devices.find( key );
+    if (it == m_devices.end()) it = m_devices.emplace( key, Phases() ).first;
+    Estimate &est = it->second[static_cast<std::size_t>( phase )];
+    const double ms = static_cast<double>( latency.count() );
+    if (est.recent.empty()) {
+        est.mean = ms;
+        est.dev = ms / 2;
+    } else {
+        // RFC 6298 gains: 1/4 for the deviation, 1/8 for the mean
+        est.dev += (std::fabs( est.mean - ms ) - est.dev) / 4;
+        est.mean += (ms - est.mean) / 8;
+    }
+    // room for the one over, the window then slides in place
+    if (est.recent.capacity() <= MaxSamples) est.recent.reserve( MaxSamples + 1 );
+    est.recent.push_back( latency );
+    if (est.recent.size() > MaxSamples) est.recent.erase( est.recent.begin() );
+    LOGD(true, "Device %s %s latency %lld ms, mean %.0f +-%.0f, %zu samples", serial.c_str(),
+         PhaseNames[static_cast<std::size_t>( phase )], static_cast<long long>( latency.count() ),
+         est.mean, est.dev, est.recent.size());
+}
+
+const LatencyHistory::Estimate *LatencyHistory::find(const std::string &serial, LatencyHistory::Phase phase) const
+{
+    auto it = m_devices.find( serial.empty() ? std::string_view( DefaultDevice ) : std::string_view( serial ) );
+    return it != m_devices.end() ? &it->second[static_cast<std::size_t>( phase )] : nullptr;
+}
+
+bool LatencyHistory::percentile(const LatencyHistory::Estimate *est, unsigned int pct,
+                                std::chrono::milliseconds &latency)
+{
+    if (!est || est->recent.size() < MinSamples) return false;
+
+    // nearest rank
+    std::array<std::chrono::milliseconds, MaxSamples> sorted;
+    const std::size_t count = std::min<std::size_t>( est->recent.size(), MaxSamples );
+    std::copy_n( est->recent.begin(), count, sorted.begin() );
+    const std::size_t rank = (std::min( pct, 100u ) * count + 99) / 100;
+    const std::size_t idx = rank > 0 ? rank - 1 : 0;
+    std::nth_element( sorted.begin(), sorted.begin() + static_cast<long>( idx ), sorted.begin() + static_cast<long>( count ) );
+    latency = sorted[idx];
+    return true;
+}
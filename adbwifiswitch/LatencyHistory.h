@@ -0,0 +1,62 @@
+#ifndef LATENCYHISTORY_H
+#define LATENCYHISTORY_H
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Per-device latencies of the operation phases: a smoothed mean and
+// deviation as TCP keeps them for its RTO, and the most recent samples for
+// percentiles. They tell how long a phase may take before its end is
+// unlikely to come. Kept in memory and optionally in a small state file,
+// so a one shot run starts with what earlier ones have seen. Shared by all
+// reactor threads, calls lock.
+class LatencyHistory {
+public:
+    enum class Phase {
+        AdbLaunch,      // am start/broadcast until its adb is done
+        FirstPrompt,    // interactive shell until its prompt
+        SecondPrompt,   // a line feed until the next prompt
+        Answer,         // agent launch until its answer
+    };
+    static const std::size_t PhaseCount = 4;
+
+    static LatencyHistory &instance();
+
+    void add(const std::string &serial, Phase phase, std::chrono::milliseconds latency);
+    // the phase didn't end by the deadline: counts as a sample of it, so
+    // the next deadline backs off
+    void timedOut(const std::string &serial, Phase phase, std::chrono::milliseconds deadline);
+    // false while there are too few samples for the device
+    bool percentile(const std::string &serial, Phase phase, unsigned int pct,
+                    std::chrono::milliseconds &latency) const;
+    // deadline for the phase within [floor, ceiling], ceiling while there
+    // are too few samples
+    std::chrono::milliseconds timeout(const std::string &serial, Phase phase, std::chrono::milliseconds floor,
+                                      std::chrono::milliseconds ceiling) const;
+
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+
+private:
+    struct Estimate {
+        double mean = 0;    // ms
+        double dev = 0;     // ms
+        // oldest first, its capacity is kept
+        std::vector<std::chrono::milliseconds> recent;
+    };
+    typedef std::array<Estimate, PhaseCount> Phases;
+
+    void addSample(const std::string &serial, Phase phase, std::chrono::milliseconds latency);
+    const Estimate *find(const std::string &serial, Phase phase) const;
+    static bool percentile(const Estimate *est, unsigned int pct, std::chrono::milliseconds &latency);
+
+    mutable std::mutex m_lock;
+    std::map<std::string, Phases, std::less<> > m_devices;
+};
+
+#endif // LATENCYHISTORY_H
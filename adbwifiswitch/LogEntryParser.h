@@ -0,0 +1,104 @@
+#ifndef LOGENTRYPARSER_H
+#define LOGENTRYPARSER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// One entry of the binary logcat stream, tag & message point into the
+// buffer passed to LogEntryParser::parse().
+struct LogEntry {
+    std::int32_t pid;
+    std::uint32_t tid;
+    std::uint32_t sec;
+    std::uint32_t nsec;
+    std::uint8_t prio;
+    std::string_view tag;
+    std::string_view message;
+};
+
+// Parses "logcat -B" output: logger_entry headers (v1..v4, told apart by
+// hdr_size) followed by prio, NUL terminated tag and message. Headers are
+// read in place, entries of other tags are skipped before their message is
+// looked at.
+class LogEntryParser {
+public:
+    enum {
+        HeaderV1Size = 20,
+        MaxHeaderSize = 64,
+        MaxPayloadSize = 5*1024,
+    };
+
+    void setTagFilter(const std::string &tag) {m_tag = tag;}
+    void reset() {m_failed = false; m_entries = m_skipped = 0;}
+
+    // Returns bytes consumed, a tail with an incomplete entry is left over.
+    // Proc is bool(const LogEntry &), false stops parsing after the entry.
+    template <typename Proc>
+    std::size_t parse(const char *data, std::size_t size, Proc proc);
+
+    // input isn't a logger_entry stream, e.g. text from an old logcat
+    bool failed() const {return m_failed;}
+    std::size_t entries() const {return m_entries;}
+    std::size_t skipped() const {return m_skipped;}
+
+private:
+    template <typename T>
+    static T field(const char *p) {T v; memcpy( &v, p, sizeof(v) ); return v;}
+
+    std::string m_tag;
+    std::size_t m_entries = 0;
+    std::size_t m_skipped = 0;
+    bool m_failed = false;
+};
+
+
+template <typename Proc>
+std::size_t LogEntryParser::parse(const char *data, std::size_t size, Proc proc)
+{
+    std::size_t pos = 0;
+    while (!m_failed && size - pos >= 4) {
+        const char *hdr = data + pos;
+        const std::size_t len = field<std::uint16_t>( hdr );
+        std::size_t hdr_size = field<std::uint16_t>( hdr + 2 );
+        if (hdr_size == 0) hdr_size = HeaderV1Size;
+        if (hdr_size < HeaderV1Size || hdr_size > MaxHeaderSize || len < 3 || len > MaxPayloadSize) {
+            m_failed = true;
+            break;
+        }
+        if (size - pos < hdr_size + len) break;
+
+        const char *payload = hdr + hdr_size;
+        const char *tag_end = static_cast<const char *>( memchr( payload + 1, 0, len - 1 ) );
+        if (!tag_end || static_cast<std::uint8_t>( payload[0] ) > 8) {
+            m_failed = true;
+            break;
+        }
+        pos += hdr_size + len;
+
+        const std::string_view tag( payload + 1, static_cast<std::size_t>( tag_end - payload - 1 ) );
+        if (!m_tag.empty() && tag != m_tag) {
+            m_skipped++;
+            continue;
+        }
+
+        std::size_t msg_size = static_cast<std::size_t>( payload + len - tag_end - 1 );
+        const char *msg = tag_end + 1;
+        while (msg_size && (msg[msg_size - 1] == 0 || msg[msg_size - 1] == '\n')) msg_size--;
+
+        LogEntry e;
+        e.pid = field<std::int32_t>( hdr + 4 );
+        e.tid = field<std::uint32_t>( hdr + 8 );
+        e.sec = field<std::uint32_t>( hdr + 12 );
+        e.nsec = field<std::uint32_t>( hdr + 16 );
+        e.prio = static_cast<std::uint8_t>( payload[0] );
+        e.tag = tag;
+        e.message = std::string_view( msg, msg_size );
+        m_entries++;
+        if (!proc( e )) break;
+    }
+    return pos;
+}
+
+#endif // LOGENTRYPARSER_H
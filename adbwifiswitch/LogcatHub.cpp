@@ -0,0 +1,341 @@
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+
+#include "AdbTask.h"
+#include "Logger.h"
+#include "LogcatHub.h"
+
+namespace {
+enum {
+    BacklogLines = 64,
+    // a backlog slot's storage, longer lines grow it
+    BacklogLineSize = 256,
+    MaxRestarts = 3,
+    MaxLineSize = 64*1024,
+    ReadChunk = 16*1024,
+    // read buffers at the scan pool before the stream stops reading
+    MaxScanChunks = 4,
+    IdleTimerId = 1,
+    DeliverTimerId = 2,
+};
+const char CtrlC[] = "\x03";
+} // namespace anonymous
+
+
+// LogcatHub class implementation
+
+LogcatHub::LogcatHub(FilePoller &fpoll, const std::string &adbCmd, const std::string &serial, bool binary,
+                     std::chrono::milliseconds idleTimeout)
+    : m_fpoll(fpoll), m_adbCmd(adbCmd), m_serial(serial), m_idleTimeout(idleTimeout),
+      m_binary(binary), m_proc(ChildProcess::Flags::fDefault)
+{
+
+}
+
+LogcatHub::~LogcatHub()
+{
+    stopStream();
+}
+
+LogcatHub::SubscriptionId LogcatHub::subscribe(std::string_view uniq, std::string_view signature,
+                                               LogcatHub::Handler handler)
+{
+    if (!m_stream) {
+        m_restarts = 0;
+        if (!startStream()) return BadSubscriptionId;
+    }
+    m_stream->stopTimer( IdleTimerId );
+
+    auto id = m_router.addRoute( uniq, signature, std::move(handler) );
+    const std::size_t size = m_backlog.size();
+    for (std::size_t i = 0; i < size; i++) {
+        const std::string &line = m_backlog[(m_backlogNext + i) % size];
+        if (line.find( uniq ) != std::string::npos && line.find( signature ) != std::string::npos) {
+            // never call back from inside subscribe()
+            if (m_pendingCount == m_pending.size()) m_pending.emplace_back();
+            m_pending[m_pendingCount].first = id;
+            m_pending[m_pendingCount++].second.assign( line );
+            m_stream->startTimer( DeliverTimerId, std::chrono::milliseconds::zero() );
+            break;
+        }
+    }
+    LOGD(true, "Logcat hub %s: subscription %u, %zu total", m_serial.c_str(), id, m_router.size());
+    return id;
+}
+
+void LogcatHub::unsubscribe(LogcatHub::SubscriptionId id)
+{
+    if (!m_router.removeRoute( id )) return;
+    LOGD(true, "Logcat hub %s: unsubscribed %u, %zu left", m_serial.c_str(), id, m_router.size());
+    if (m_router.empty() && m_stream) m_stream->startTimer( IdleTimerId, m_idleTimeout );
+}
+
+void LogcatHub::shutdown()
+{
+    m_pendingCount = 0;
+    stopStream();
+}
+
+
+// LogcatHub:: private members
+
+bool LogcatHub::startStream()
+{
+    std::list<std::string> cl;
+    if (!m_serial.empty()) {
+        cl.emplace_back( "-s" );
+        cl.emplace_back( m_serial );
+    }
+    AdbTaskRunLogcat::createLogcatParams( cl, m_binary );
+    m_parser.reset();
+    m_parser.setTagFilter( AdbTaskRunLogcat::agentTag() );
+
+    m_proc.cleanup( true );
+    if (!m_proc.exec( m_adbCmd, cl )) {
+        LOGE(true, "Can't spawn %s for logcat hub", m_adbCmd.c_str());
+        return false;
+    }
+
+    m_stdinFd = m_proc.getStdinFd();
+    m_stream = std::make_shared<FHStream>( *this, m_proc.getStdoutFd() );
+    m_stream->handlerId = m_fpoll.addHandler( m_stream );
+    if (m_stream->handlerId == FilePoller::BadHandlerId) {
+        LOGE(true, "Fail to register logcat hub stream");
+        stopStream();
+        return false;
+    }
+    if (m_scanPool && !m_binary) {
+        std::weak_ptr<FHStream> weak( m_stream );
+        m_stream->strand = ScanStrand::create( *m_scanPool, m_fpoll, AdbTaskRunLogcat::agentPatterns(),
+                                               MaxScanChunks, [this, weak](std::string_view lines, bool eof) {
+            if (auto stream = weak.lock()) onStreamScanned( stream, lines, eof );
+        });
+    }
+    m_stream->setState( true );
+    LOGD(true, "Logcat hub %s: stream started", m_serial.c_str());
+    return true;
+}
+
+// Ctrl-C asks a running adb to stop, after the stream's end it's gone and
+// the pipe has no reader
+void LogcatHub::stopStream(bool interrupt)
+{
+    if (m_stdinFd >= 0) {
+        if (interrupt && FileHandler::writePipe( m_stdinFd, CtrlC, sizeof(CtrlC)-1 ) < 0) {
+            LOGD(true, "Logcat hub: stdin is closed, errno %d", errno);
+        }
+        close( m_stdinFd );
+        m_stdinFd = -1;
+    }
+    if (m_stream) {
+        m_stream->setState( false );
+        m_fpoll.removeHandler( m_stream->handlerId );
+        m_stream.reset();
+        LOGD(true, "Logcat hub %s: stream stopped", m_serial.c_str());
+    }
+    m_proc.cleanup( true );
+}
+
+void LogcatHub::onStreamData(bool eof)
+{
+    // handlers may stop the stream, keep the buffer alive while walking it
+    auto stream = m_stream;
+    const std::size_t used = m_binary ? parseEntries( stream ) : parseLines( stream );
+    if (m_stream != stream) return;
+
+    if (m_binary && (m_parser.failed() || (eof && m_parser.entries() + m_parser.skipped() == 0))) {
+        LOGI(true, "Logcat hub %s: binary logcat isn't supported, falling back to text", m_serial.c_str());
+        m_binary = false;
+        stopStream( !eof );
+        startStream();
+        return;
+    }
+    stream->readBuf.cut( used );
+    if (eof) onStreamEnd();
+}
+
+// agent lines found by the scan pool, in stream order
+void LogcatHub::onStreamScanned(const std::shared_ptr<FHStream> &stream, std::string_view lines, bool eof)
+{
+    if (m_stream != stream) return;
+    if (!stream->eof) stream->setPollPaused( false );
+    std::size_t pos;
+    while (m_stream == stream && (pos = lines.find( '\n' )) != std::string_view::npos) {
+        std::string_view line( lines.substr( 0, pos ) );
+        lines.remove_prefix( pos + 1 );
+        if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+        onAgentLine( line );
+    }
+    if (eof && m_stream == stream) onStreamEnd();
+}
+
+void LogcatHub::onStreamEnd()
+{
+    LOGI(true, "Logcat hub %s: stream closed by adb", m_serial.c_str());
+    stopStream( false );
+    if (!m_router.empty() && m_restarts++ < MaxRestarts) startStream();
+}
+
+std::size_t LogcatHub::parseEntries(const std::shared_ptr<FHStream> &stream)
+{
+    ReadBuffer &buf = stream->readBuf;
+    return m_parser.parse( buf.head(), buf.filledSize(), [&](const LogEntry &entry) {
+        onAgentLine( entry.message );
+        return m_stream == stream;
+    });
+}
+
+std::size_t LogcatHub::parseLines(const std::shared_ptr<FHStream> &stream)
+{
+    ReadBuffer &buf = stream->readBuf;
+    std::string_view view( buf.head(), buf.filledSize() );
+    std::size_t used = 0, pos;
+    while (m_stream == stream && (pos = view.find( '\n' )) != std::string_view::npos) {
+        std::string_view line( view.substr( 0, pos ) );
+        view.remove_prefix( pos + 1 );
+        used += pos + 1;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+        if (AdbTaskRunLogcat::isAgentLine( line )) onAgentLine( line );
+    }
+    return view.size() > MaxLineSize ? buf.filledSize() : used;
+}
+
+void LogcatHub::onStreamTimer(unsigned int timerId)
+{
+    switch (timerId) {
+        case IdleTimerId:
+            if (m_router.empty()) {
+                LOGD(true, "Logcat hub %s: idle", m_serial.c_str());
+                stopStream();
+            }
+            break;
+        case DeliverTimerId:
+            deliverPending();
+            break;
+        default:
+            assert( false );
+            break;
+    }
+}
+
+void LogcatHub::onAgentLine(std::string_view line)
+{
+    m_restarts = 0;
+    if (m_backlog.size() < BacklogLines) {
+        m_backlog.emplace_back();
+        m_backlog.back().reserve( BacklogLineSize );
+        m_backlog.back().assign( line );
+    } else {
+        m_backlog[m_backlogNext].assign( line );
+        m_backlogNext = (m_backlogNext + 1) % BacklogLines;
+    }
+    m_router.dispatch( line );
+}
+
+// handlers may subscribe, their lines are delivered in this pass
+void LogcatHub::deliverPending()
+{
+    for (std::size_t i = 0; i < m_pendingCount; i++) {
+        m_delivering.swap( m_pending[i].second );
+        m_router.deliver( m_pending[i].first, m_delivering );
+    }
+    m_pendingCount = 0;
+}
+
+
+// LogcatHub::FHStream class implementation
+
+LogcatHub::FHStream::FHStream(LogcatHub &owner, int fd)
+    : FileHandler( fd ), m_owner(owner)
+{
+
+}
+
+LogcatHub::FHStream::~FHStream()
+{
+    if (strand) strand->close();
+}
+
+bool LogcatHub::FHStream::onError()
+{
+    m_owner.onStreamData( true );
+    return true;
+}
+
+bool LogcatHub::FHStream::onReadyToRead()
+{
+    if (strand) return scanRead();
+    bool eof = false;
+    while (1) {
+        readBuf.reserve( ReadChunk, true );
+        const std::size_t rest = readBuf.restSize();
+        long ret = read( getFd(), readBuf.readPtr(), rest );
+        if (ret < 0) {
+            eof = errno != EAGAIN;
+            LOGD(eof, "Logcat hub read error, errno %d", errno);
+            break;
+        }
+        if (ret == 0) {
+            eof = true;
+            break;
+        }
+        readBuf.addFilled( static_cast<std::size_t>( ret ) );
+        if (static_cast<std::size_t>( ret ) < rest) break;
+    }
+    m_owner.onStreamData( eof );
+    return true;
+}
+
+bool LogcatHub::FHStream::onReadyToWrite()
+{
+    return true;
+}
+
+bool LogcatHub::FHStream::onTimer(unsigned int timerId)
+{
+    m_owner.onStreamTimer( timerId );
+    return true;
+}
+
+// One read per call, the buffer goes to the scan pool as is; the stream
+// isn't polled while the pool holds enough of it, nor after its end
+bool LogcatHub::FHStream::scanRead()
+{
+    readBuf.reserve( ReadChunk, true );
+    const long ret = read( getFd(), readBuf.readPtr(), readBuf.restSize() );
+    if (ret < 0 && errno == EAGAIN) return true;
+    LOGD(ret < 0, "Logcat hub read error, errno %d", errno);
+    if (ret > 0) readBuf.addFilled( static_cast<std::size_t>( ret ) );
+    eof = ret <= 0;
+    std::size_t head, size;
+    auto buf = readBuf.swapStorage( strand->spare(), head, size );
+    strand->push( std::move(buf), head, size, eof );
+    if (eof || strand->full()) setPollPaused( true );
+    return true;
+}
+
+
+// LogcatHubPool class implementation
+
+LogcatHubPool::LogcatHubPool(FilePoller &fpoll, std::chrono::milliseconds idleTimeout)
+    : m_fpoll(fpoll), m_idleTimeout(idleTimeout)
+{
+
+}
+
+std::shared_ptr<LogcatHub> LogcatHubPool::hub(const std::string &adbCmd, const std::string &serial, bool binary)
+{
+    auto it = m_hubs.find( std::tie( adbCmd, serial, binary ) );
+    if (it != m_hubs.end()) return it->second;
+    auto ret = std::make_shared<LogcatHub>( m_fpoll, adbCmd, serial, binary, m_idleTimeout );
+    ret->setScanPool( m_scanPool );
+    m_hubs.emplace( std::make_tuple( adbCmd, serial, binary ), ret );
+    return ret;
+}
+
+void LogcatHubPool::shutdown()
+{
+    for (auto &h : m_hubs) h.second->shutdown();
+}
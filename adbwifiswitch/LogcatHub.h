@@ -0,0 +1,119 @@
+#ifndef LOGCATHUB_H
+#define LOGCATHUB_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "Buffers.h"
+#include "ChildProcess.h"
+#include "FileHandler.h"
+#include "FilePoller.h"
+#include "LogEntryParser.h"
+#include "ScanPool.h"
+#include "SignatureRouter.h"
+
+// One long-lived "adb shell -t logcat" stream per device. The stream is
+// split and tag filtered once, agent lines are fanned out to subscribed
+// operations through a SignatureRouter. Recent agent lines are kept, so a
+// subscriber coming after its line was logged still gets it. The stream is
+// closed when nobody is subscribed for idle timeout.
+class LogcatHub {
+public:
+    typedef SignatureRouter::RouteId SubscriptionId;
+    typedef std::function<void(SubscriptionId, std::string_view)> Handler;
+    static const SubscriptionId BadSubscriptionId = SignatureRouter::BadRouteId;
+
+    LogcatHub(FilePoller &fpoll, const std::string &adbCmd, const std::string &serial, bool binary,
+              std::chrono::milliseconds idleTimeout);
+    LogcatHub(const LogcatHub &) = delete;
+    ~LogcatHub();
+
+    // text streams are scanned there, set before subscribing
+    void setScanPool(std::shared_ptr<ScanPool> pool) {m_scanPool = std::move(pool);}
+    SubscriptionId subscribe(std::string_view uniq, std::string_view signature, Handler handler);
+    void unsubscribe(SubscriptionId id);
+    void shutdown();
+    bool running() const {return m_stream != nullptr;}
+    std::size_t subscribers() const {return m_router.size();}
+
+private:
+    class FHStream final : public FileHandler {
+    public:
+        FHStream(LogcatHub &owner, int fd);
+        virtual ~FHStream();
+
+        virtual bool onError() override;
+        virtual bool onReadyToRead() override;
+        virtual bool onReadyToWrite() override;
+        virtual bool onTimer( unsigned int timerId ) override;
+
+        ReadBuffer readBuf;
+        FilePoller::HandlerId handlerId = FilePoller::BadHandlerId;
+        std::shared_ptr<ScanStrand> strand;
+        bool eof = false;
+
+    private:
+        bool scanRead();
+
+        LogcatHub &m_owner;
+    };
+
+    bool startStream();
+    void stopStream(bool interrupt = true);
+    void onStreamData(bool eof);
+    void onStreamScanned(const std::shared_ptr<FHStream> &stream, std::string_view lines, bool eof);
+    void onStreamEnd();
+    std::size_t parseEntries(const std::shared_ptr<FHStream> &stream);
+    std::size_t parseLines(const std::shared_ptr<FHStream> &stream);
+    void onStreamTimer(unsigned int timerId);
+    void onAgentLine(std::string_view line);
+    void deliverPending();
+
+    FilePoller &m_fpoll;
+    std::shared_ptr<ScanPool> m_scanPool;
+    std::string m_adbCmd;
+    std::string m_serial;
+    std::chrono::milliseconds m_idleTimeout;
+    bool m_binary;
+    LogEntryParser m_parser;
+    ChildProcess m_proc;
+    std::shared_ptr<FHStream> m_stream;
+    SignatureRouter m_router;
+    // ring of the recent agent lines, the oldest at m_backlogNext when full;
+    // slots keep their storage
+    std::vector<std::string> m_backlog;
+    std::size_t m_backlogNext = 0;
+    // lines found for new subscriptions, the first m_pendingCount slots
+    std::vector<std::pair<SubscriptionId, std::string> > m_pending;
+    std::size_t m_pendingCount = 0;
+    std::string m_delivering;
+    int m_stdinFd = -1;
+    unsigned int m_restarts = 0;
+};
+
+// Hands out one hub per (adb command, device serial, stream format).
+class LogcatHubPool {
+public:
+    LogcatHubPool(FilePoller &fpoll, std::chrono::milliseconds idleTimeout = std::chrono::seconds(30));
+
+    std::shared_ptr<LogcatHub> hub(const std::string &adbCmd, const std::string &serial, bool binary = false);
+    void shutdown();
+    // for the hubs created after it
+    void setScanPool(std::shared_ptr<ScanPool> pool) {m_scanPool = std::move(pool);}
+
+private:
+    FilePoller &m_fpoll;
+    std::shared_ptr<ScanPool> m_scanPool;
+    std::chrono::milliseconds m_idleTimeout;
+    // looked up without copying the key
+    std::map<std::tuple<std::string, std::string, bool>, std::shared_ptr<LogcatHub>, std::less<> > m_hubs;
+};
+
+#endif // LOGCATHUB_H
@@ -0,0 +1,72 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded multi producer, single consumer queue (D. Vyukov's intrusive
+// design over a stub node). push() is one exchange plus one store from any
+// thread and never waits; pop() belongs to one thread. A producer preempted
+// between its two steps hides what comes after it: pop() reports empty
+// until it finishes, callers wake the consumer after push() returns.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : m_head(&m_stub), m_tail(&m_stub) {}
+    ~MpscQueue()
+    {
+        T item;
+        while (pop( item ));
+    }
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T item)
+    {
+        push( new Node( std::move(item) ) );
+    }
+
+    // false when empty or the next item isn't linked yet
+    bool pop(T &item)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.load( std::memory_order_acquire );
+        if (tail == &m_stub) {
+            if (!next) return false;
+            m_tail = tail = next;
+            next = next->next.load( std::memory_order_acquire );
+        }
+        if (!next) {
+            if (tail != m_head.load( std::memory_order_acquire )) return false;
+            // the last node goes only with the stub behind it
+            push( &m_stub );
+            next = tail->next.load( std::memory_order_acquire );
+            if (!next) return false;
+        }
+        m_tail = next;
+        item = std::move(tail->item);
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        explicit Node(T &&val) : item(std::move(val)) {}
+        std::atomic<Node *> next{nullptr};
+        T item;
+    };
+
+    void push(Node *node)
+    {
+        node->next.store( nullptr, std::memory_order_relaxed );
+        Node *prev = m_head.exchange( node, std::memory_order_acq_rel );
+        prev->next.store( node, std::memory_order_release );
+    }
+
+    Node m_stub;
+    std::atomic<Node *> m_head;
+    Node *m_tail;
+};
+
+#endif // MPSCQUEUE_H
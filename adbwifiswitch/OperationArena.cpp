@@ -0,0 +1,70 @@
+#include <new>
+
+#include "OperationArena.h"
+
+namespace {
+enum {
+    BlockGranule = 64,
+    BlockClasses = 64,
+    // kept per class, a burst beyond it goes back to the heap
+    MaxFreeBlocks = 64,
+};
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+struct FreeLists {
+    // left empty for the blocks released after it at thread exit
+    ~FreeLists()
+    {
+        for (auto &head : heads) {
+            while (head) {
+                FreeBlock *next = head->next;
+                ::operator delete( head );
+                head = next;
+            }
+        }
+    }
+
+    FreeBlock *heads[BlockClasses] = {};
+    std::size_t counts[BlockClasses] = {};
+};
+
+thread_local FreeLists t_blocks;
+
+// 1-based, 0 for the heap
+std::size_t blockClass(std::size_t size)
+{
+    const std::size_t cls = (size + BlockGranule - 1) / BlockGranule;
+    return cls <= BlockClasses ? cls : 0;
+}
+} // namespace anonymous
+
+
+// OperationArena class implementation
+
+void *OperationArena::allocate(std::size_t size)
+{
+    const std::size_t cls = blockClass( size );
+    if (!cls) return ::operator new( size );
+    FreeBlock *&head = t_blocks.heads[cls - 1];
+    if (!head) return ::operator new( cls * BlockGranule );
+    FreeBlock *block = head;
+    head = block->next;
+    t_blocks.counts[cls - 1]--;
+    return block;
+}
+
+void OperationArena::release(void *block, std::size_t size)
+{
+    const std::size_t cls = blockClass( size );
+    if (!cls || t_blocks.counts[cls - 1] >= MaxFreeBlocks) {
+        ::operator delete( block );
+        return;
+    }
+    FreeBlock *free = static_cast<FreeBlock *>( block );
+    free->next = t_blocks.heads[cls - 1];
+    t_blocks.heads[cls - 1] = free;
+    t_blocks.counts[cls - 1]++;
+}
@@ -0,0 +1,41 @@
+#ifndef OPERATIONARENA_H
+#define OPERATIONARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Per-operation objects, i.e. tasks, scripts, coroutine frames and the
+// containers they use, come from per-thread free lists by size class. A loop
+// thread gets its blocks back as its operations end, so once warm, an
+// operation allocates nothing. Blocks over the largest class use the heap.
+class OperationArena {
+public:
+    static void *allocate(std::size_t size);
+    static void release(void *block, std::size_t size);
+};
+
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator() = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &) {}
+
+    T *allocate(std::size_t n) {return static_cast<T *>( OperationArena::allocate( n * sizeof(T) ) );}
+    void deallocate(T *ptr, std::size_t n) {OperationArena::release( ptr, n * sizeof(T) );}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &) const {return true;}
+};
+
+// object and its control block in one arena block
+template <typename T, typename... Args>
+std::shared_ptr<T> makeArenaShared(Args&&... args)
+{
+    return std::allocate_shared<T>( ArenaAllocator<T>(), std::forward<Args>(args)... );
+}
+
+#endif // OPERATIONARENA_H
@@ -0,0 +1,181 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "Config.h"
+#include "Logger.h"
+#include "ReactorGroup.h"
+
+namespace {
+enum {
+    // an idle device stays on its reactor unless that has this many more
+    // pending operations than the least loaded one: its streams are warm
+    RebalanceSlack = 2,
+};
+} // namespace anonymous
+
+
+// ReactorGroup class implementation
+
+ReactorGroup::ReactorGroup(std::size_t reactors, ReactorGroup::Placement placement, bool pinned)
+    : m_count(reactors), m_placement(placement), m_pinned(pinned)
+{
+    if (!m_count) m_count = std::max( std::thread::hardware_concurrency(), 1u );
+}
+
+ReactorGroup::~ReactorGroup()
+{
+    stop();
+}
+
+bool ReactorGroup::start()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    if (m_running || !m_reactors.empty()) return false;
+    if (m_scanThreads && !m_scanPool) m_scanPool = std::make_shared<ScanPool>( m_scanThreads );
+    for (std::size_t i = 0; i < m_count; i++) {
+        m_reactors.emplace_back( new Reactor() );
+        Reactor &r = *m_reactors.back();
+        r.switcher.reset( new AdbSwitcher( r.fpoll ) );
+        r.switcher->setLogcatHubs( m_hubs );
+        r.switcher->setShellSessions( m_shells );
+        r.switcher->setScanPool( m_scanPool );
+        r.idle = std::make_shared<FHIdle>();
+        r.idle->setState( true );
+        if (r.fpoll.addHandler( r.idle ) == FilePoller::BadHandlerId) {
+            LOGE(true, "Fail to register reactor %zu", i);
+            m_reactors.pop_back();
+            break;
+        }
+    }
+    if (m_reactors.size() != m_count) {
+        m_reactors.clear();
+        return false;
+    }
+    for (std::size_t i = 0; i < m_count; i++) {
+        m_reactors[i]->thread = std::thread( &ReactorGroup::run, this, i );
+    }
+    m_running = true;
+    LOGD(true, "%zu reactors started", m_count);
+    return true;
+}
+
+void ReactorGroup::stop()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        if (!m_running) return;
+        m_running = false;
+    }
+    for (auto &r : m_reactors) {
+        Reactor *ptr = r.get();
+        r->fpoll.post( [ptr]() {
+            ptr->switcher->shutdown();
+            ptr->idle->setState( false );
+        });
+    }
+    for (auto &r : m_reactors) {
+        if (r->thread.joinable()) r->thread.join();
+    }
+    // switchers go before their pollers
+    m_reactors.clear();
+    m_devices.clear();
+}
+
+bool ReactorGroup::submit(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg, AdbSwitcher::Handler handler,
+                          std::shared_ptr<SessionRecorder> recorder)
+{
+    if (!cfg) return false;
+    const std::string serial = cfg->getSerial();
+    // posted under the lock: stop() posts its shutdown after this task
+    std::lock_guard<std::mutex> lck( m_lock );
+    if (!m_running) return false;
+    auto it = m_devices.find( serial );
+    const std::size_t index = place( serial, it != m_devices.end() ? &it->second : nullptr );
+    Device &dev = it != m_devices.end() ? it->second : m_devices[serial];
+    LOGD(it != m_devices.end() && dev.reactor != index, "Device '%s' moves from reactor %zu to %zu",
+         serial.c_str(), dev.reactor, index);
+    dev.reactor = index;
+    dev.pending++;
+    Reactor *r = m_reactors[index].get();
+    r->pending++;
+
+    r->fpoll.post( [this, r, mode, cfg, handler, recorder, serial]() {
+        auto done = [this, r, handler, serial](const AdbSwitcher::Result &res) {
+            finished( *r, serial );
+            if (handler) handler( res );
+        };
+        if (r->switcher->submit( mode, cfg, done, recorder ) == AdbSwitcher::BadOperationId) {
+            done( AdbSwitcher::Result{AdbSwitcher::BadOperationId, false, false, 0, {}} );
+        }
+    });
+    return true;
+}
+
+std::future<AdbSwitcher::Result> ReactorGroup::submitConnect(std::shared_ptr<Config> cfg)
+{
+    return submitFuture( AdbSwitcher::Mode::Connect, std::move(cfg) );
+}
+
+std::future<AdbSwitcher::Result> ReactorGroup::submitDisconnect(std::shared_ptr<Config> cfg)
+{
+    return submitFuture( AdbSwitcher::Mode::Disconnect, std::move(cfg) );
+}
+
+std::size_t ReactorGroup::load(std::size_t reactor) const
+{
+    return reactor < m_reactors.size() ? m_reactors[reactor]->pending.load( std::memory_order_relaxed ) : 0;
+}
+
+
+// ReactorGroup:: private members
+
+void ReactorGroup::run(std::size_t index)
+{
+    if (m_pinned) {
+        const unsigned int cores = std::max( std::thread::hardware_concurrency(), 1u );
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( index % cores, &set );
+        const int err = pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+        LOGD(err != 0, "Reactor %zu isn't pinned, error %d", index, err);
+    }
+    m_reactors[index]->fpoll.exec();
+    LOGD(true, "Reactor %zu done", index);
+}
+
+// a device with operations pending stays where they are, they run in order
+std::size_t ReactorGroup::place(const std::string &serial, const ReactorGroup::Device *dev) const
+{
+    if (dev && dev->pending) return dev->reactor;
+    if (m_placement == Placement::SerialHash) return std::hash<std::string>()( serial ) % m_reactors.size();
+
+    std::size_t least = 0;
+    for (std::size_t i = 1; i < m_reactors.size(); i++) {
+        if (m_reactors[i]->pending < m_reactors[least]->pending) least = i;
+    }
+    if (dev && m_reactors[dev->reactor]->pending <= m_reactors[least]->pending + RebalanceSlack) {
+        return dev->reactor;
+    }
+    return least;
+}
+
+void ReactorGroup::finished(ReactorGroup::Reactor &reactor, const std::string &serial)
+{
+    reactor.pending--;
+    std::lock_guard<std::mutex> lck( m_lock );
+    auto it = m_devices.find( serial );
+    if (it != m_devices.end() && it->second.pending) it->second.pending--;
+}
+
+std::future<AdbSwitcher::Result> ReactorGroup::submitFuture(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg)
+{
+    auto promise = std::make_shared<std::promise<AdbSwitcher::Result> >();
+    auto ret = promise->get_future();
+    if (!submit( mode, std::move(cfg), [promise](const AdbSwitcher::Result &res) {promise->set_value( res );} )) {
+        promise->set_value( AdbSwitcher::Result{AdbSwitcher::BadOperationId, false, false, 0, {}} );
+    }
+    return ret;
+}
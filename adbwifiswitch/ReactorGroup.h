@@ -0,0 +1,104 @@
+#ifndef REACTORGROUP_H
+#define REACTORGROUP_H
+
+#include <atomic>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AdbSwitcher.h"
+#include "FileHandler.h"
+#include "FilePoller.h"
+
+class Config;
+class SessionRecorder;
+
+// N event loops on their own threads, each with its own FilePoller and
+// AdbSwitcher. A device belongs to one reactor while it has operations
+// pending: its handlers, timers, adb processes and shared streams stay on
+// that thread, so the loops share nothing and take no locks. Operations
+// are handed over with FilePoller::post(). An idle device may move to a
+// less loaded reactor with its next operation.
+class ReactorGroup {
+public:
+    enum class Placement {
+        SerialHash,     // fixed reactor per serial
+        LeastLoaded,    // fewest pending operations, sticky while close
+    };
+
+    // reactors 0: one per core; pinned: reactor i runs on core i
+    explicit ReactorGroup(std::size_t reactors = 0, Placement placement = Placement::LeastLoaded,
+                          bool pinned = true);
+    ~ReactorGroup();
+
+    // per reactor, set before start()
+    void setLogcatHubs(bool enable) {m_hubs = enable;}
+    void setShellSessions(bool enable) {m_shells = enable;}
+    // one scan pool of this many workers for all reactors, 0: none
+    void setScanThreads(std::size_t threads) {m_scanThreads = threads;}
+
+    bool start();
+    // cancels all operations, their handlers get failures, then ends the
+    // loops and joins their threads
+    void stop();
+
+    // Any thread. The handler runs on the device's reactor thread; false
+    // when the group isn't running
+    bool submit(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg, AdbSwitcher::Handler handler,
+                std::shared_ptr<SessionRecorder> recorder = std::shared_ptr<SessionRecorder>());
+    std::future<AdbSwitcher::Result> submitConnect(std::shared_ptr<Config> cfg);
+    std::future<AdbSwitcher::Result> submitDisconnect(std::shared_ptr<Config> cfg);
+
+    std::size_t size() const {return m_reactors.size();}
+    // pending operations of a reactor
+    std::size_t load(std::size_t reactor) const;
+
+private:
+    // no fd, keeps the loop running while the group does
+    class FHIdle final : public FileHandler {
+    public:
+        FHIdle() : FileHandler(-1) {}
+        virtual bool onError() override {return true;}
+        virtual bool onReadyToRead() override {return true;}
+        virtual bool onReadyToWrite() override {return true;}
+    };
+
+    struct Reactor {
+        FilePoller fpoll;
+        std::unique_ptr<AdbSwitcher> switcher;
+        std::shared_ptr<FHIdle> idle;
+        std::thread thread;
+        std::atomic<std::size_t> pending{0};
+    };
+
+    struct Device {
+        std::size_t reactor;
+        std::size_t pending = 0;
+    };
+
+    void run(std::size_t index);
+    std::size_t place(const std::string &serial, const Device *dev) const;
+    void finished(Reactor &reactor, const std::string &serial);
+    std::future<AdbSwitcher::Result> submitFuture(AdbSwitcher::Mode mode, std::shared_ptr<Config> cfg);
+
+    std::size_t m_count;
+    Placement m_placement;
+    bool m_pinned;
+    bool m_hubs = false;
+    bool m_shells = false;
+    std::size_t m_scanThreads = 0;
+    // outlives the reactors, their strands refer to it
+    std::shared_ptr<ScanPool> m_scanPool;
+    std::vector<std::unique_ptr<Reactor> > m_reactors;
+    // guards the device map and the running flag; taken per submitted and
+    // finished operation, never by the loops' handlers
+    mutable std::mutex m_lock;
+    bool m_running = false;
+    std::map<std::string, Device> m_devices;
+};
+
+#endif // REACTORGROUP_H
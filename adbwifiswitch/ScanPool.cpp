@@ -0,0 +1,191 @@
+#include <algorithm>
+
+#include "Logger.h"
+#include "ScanPool.h"
+
+namespace {
+// the pool & worker index of the current thread, its submits go local
+thread_local ScanPool *t_pool = nullptr;
+thread_local std::size_t t_worker = 0;
+} // namespace anonymous
+
+
+// ScanPool class implementation
+
+ScanPool::ScanPool(std::size_t workers)
+{
+    if (!workers) workers = std::max( std::thread::hardware_concurrency(), 1u );
+    for (std::size_t i = 0; i < workers; i++) m_workers.emplace_back( new Worker() );
+    for (std::size_t i = 0; i < workers; i++) m_workers[i]->thread = std::thread( &ScanPool::run, this, i );
+    LOGD(true, "Scan pool of %zu workers started", workers);
+}
+
+ScanPool::~ScanPool()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_idleLock );
+        m_stop = true;
+    }
+    m_idle.notify_all();
+    for (auto &w : m_workers) w->thread.join();
+}
+
+void ScanPool::submit(ScanPool::Job job)
+{
+    const std::size_t index = t_pool == this ? t_worker :
+                              m_next.fetch_add( 1, std::memory_order_relaxed ) % m_workers.size();
+    // counted first: a worker seeing the job gone retries, one not seeing
+    // it counted would sleep on it
+    m_queued.fetch_add( 1 );
+    {
+        std::lock_guard<std::mutex> lck( m_workers[index]->lock );
+        m_workers[index]->jobs.push_back( std::move(job) );
+    }
+    if (m_sleeping.load()) {
+        { std::lock_guard<std::mutex> lck( m_idleLock ); }
+        m_idle.notify_one();
+    }
+}
+
+
+// ScanPool:: private members
+
+void ScanPool::run(std::size_t index)
+{
+    t_pool = this;
+    t_worker = index;
+    Job job;
+    while (1) {
+        if (take( index, job )) {
+            job();
+            job = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lck( m_idleLock );
+        if (m_stop && !m_queued.load()) break;
+        m_sleeping.fetch_add( 1 );
+        m_idle.wait( lck, [this]() {return m_stop || m_queued.load() > 0;} );
+        m_sleeping.fetch_sub( 1 );
+    }
+}
+
+// own jobs newest first, they are warm in the cache; stolen ones oldest first
+bool ScanPool::take(std::size_t index, ScanPool::Job &job)
+{
+    const std::size_t count = m_workers.size();
+    for (std::size_t i = 0; i < count; i++) {
+        Worker &w = *m_workers[(index + i) % count];
+        std::lock_guard<std::mutex> lck( w.lock );
+        if (w.jobs.empty()) continue;
+        if (i == 0) {
+            job = std::move( w.jobs.back() );
+            w.jobs.pop_back();
+        } else {
+            job = std::move( w.jobs.front() );
+            w.jobs.pop_front();
+        }
+        m_queued.fetch_sub( 1 );
+        return true;
+    }
+    return false;
+}
+
+
+// ScanStrand class implementation
+
+std::shared_ptr<ScanStrand> ScanStrand::create(ScanPool &pool, FilePoller &fpoll, const StreamPatterns &patterns,
+                                               std::size_t maxInFlight, ScanStrand::Handler handler)
+{
+    return std::shared_ptr<ScanStrand>( new ScanStrand( pool, fpoll, patterns, maxInFlight, std::move(handler) ) );
+}
+
+std::vector<char> ScanStrand::spare()
+{
+    if (m_spare.empty()) return std::vector<char>();
+    std::vector<char> ret = std::move( m_spare.back() );
+    m_spare.pop_back();
+    return ret;
+}
+
+void ScanStrand::push(std::vector<char> &&buf, std::size_t head, std::size_t size, bool eof)
+{
+    m_inFlight++;
+    std::lock_guard<std::mutex> lck( m_lock );
+    if (m_closed) return;
+    m_queue.push_back( Chunk{std::move(buf), head, size, eof} );
+    if (m_scheduled) return;
+    m_scheduled = true;
+    auto self = shared_from_this();
+    m_pool.submit( [self]() {self->scanNext();} );
+}
+
+void ScanStrand::close()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    m_closed = true;
+    m_queue.clear();
+}
+
+
+// ScanStrand:: private members
+
+ScanStrand::ScanStrand(ScanPool &pool, FilePoller &fpoll, const StreamPatterns &patterns, std::size_t maxInFlight,
+                       ScanStrand::Handler handler)
+    : m_pool(pool), m_fpoll(fpoll), m_maxInFlight(std::max<std::size_t>( maxInFlight, 1 )),
+      m_handler(std::move(handler)), m_matcher(patterns)
+{
+
+}
+
+// One chunk per job, the next one is a new job: a busy stream doesn't keep
+// a worker from the others' queues, and idle workers may steal it
+void ScanStrand::scanNext()
+{
+    Chunk chunk;
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        if (m_closed || m_queue.empty()) {
+            m_scheduled = false;
+            return;
+        }
+        chunk = std::move( m_queue.front() );
+        m_queue.pop_front();
+    }
+
+    std::string lines;
+    const char *last = nullptr;
+    m_matcher.feed( chunk.buf.data() + chunk.head, chunk.size, [&](StreamPatterns::PatternId, std::string_view line) {
+        // a line matching several patterns is reported once per pattern
+        if (line.data() != last) lines.append( line ).push_back( '\n' );
+        last = line.data();
+        return true;
+    });
+
+    std::lock_guard<std::mutex> lck( m_lock );
+    // the poller may be gone once closed
+    if (m_closed) {
+        m_scheduled = false;
+        return;
+    }
+    auto self = shared_from_this();
+    m_fpoll.post( [self, chunk = std::move(chunk), lines = std::move(lines)]() mutable {
+        self->deliver( chunk, lines );
+    });
+    if (m_queue.empty()) {
+        m_scheduled = false;
+        return;
+    }
+    m_pool.submit( [self]() {self->scanNext();} );
+}
+
+void ScanStrand::deliver(ScanStrand::Chunk &chunk, const std::string &lines)
+{
+    m_inFlight--;
+    if (m_spare.size() < m_maxInFlight) m_spare.push_back( std::move(chunk.buf) );
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        if (m_closed) return;
+    }
+    // may close the strand, the poster's copy of self keeps it
+    if (m_handler) m_handler( lines, chunk.eof );
+}
@@ -0,0 +1,109 @@
+#ifndef SCANPOOL_H
+#define SCANPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "FilePoller.h"
+#include "StreamMatcher.h"
+
+// Work stealing threads for scanning stream buffers off the I/O threads.
+// Each worker takes jobs from the back of its own deque and steals from the
+// front of the others' when it runs dry; jobs submitted by a worker go to
+// its own deque, the others are dealt round robin.
+class ScanPool {
+public:
+    typedef std::function<void()> Job;
+
+    // workers 0: one per core
+    explicit ScanPool(std::size_t workers = 0);
+    // runs the queued jobs to the end
+    ~ScanPool();
+    ScanPool(const ScanPool &) = delete;
+
+    // any thread
+    void submit(Job job);
+    std::size_t size() const {return m_workers.size();}
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Job> jobs;
+        std::thread thread;
+    };
+
+    void run(std::size_t index);
+    bool take(std::size_t index, Job &job);
+
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::atomic<std::size_t> m_next{0};
+    std::atomic<std::size_t> m_queued{0};
+    std::atomic<std::size_t> m_sleeping{0};
+    std::mutex m_idleLock;
+    std::condition_variable m_idle;
+    bool m_stop = false;
+};
+
+// The scan stage of one stream. Filled read buffers are handed over whole,
+// scanned on the pool one at a time in stream order, and the lines matching
+// the patterns come back to the stream's poller thread through
+// FilePoller::post(). The buffers return with them for reuse. Everything
+// but the scan itself belongs to the poller thread.
+class ScanStrand : public std::enable_shared_from_this<ScanStrand> {
+public:
+    // matched lines, each ending with '\n', then eof once the stream ended
+    typedef std::function<void(std::string_view lines, bool eof)> Handler;
+
+    // literal & regex patterns only, prompts never match here
+    static std::shared_ptr<ScanStrand> create(ScanPool &pool, FilePoller &fpoll, const StreamPatterns &patterns,
+                                              std::size_t maxInFlight, Handler handler);
+    ScanStrand(const ScanStrand &) = delete;
+
+    // storage for the next read, a returned buffer when there is one
+    std::vector<char> spare();
+    // takes the buffer's storage with its filled range
+    void push(std::vector<char> &&buf, std::size_t head, std::size_t size, bool eof);
+    // the stream stops reading till a buffer comes back
+    bool full() const {return m_inFlight >= m_maxInFlight;}
+    std::size_t inFlight() const {return m_inFlight;}
+    // no handler calls after this; the pool drops the rest
+    void close();
+
+private:
+    struct Chunk {
+        std::vector<char> buf;
+        std::size_t head;
+        std::size_t size;
+        bool eof;
+    };
+
+    ScanStrand(ScanPool &pool, FilePoller &fpoll, const StreamPatterns &patterns, std::size_t maxInFlight,
+               Handler handler);
+    void scanNext();
+    void deliver(Chunk &chunk, const std::string &lines);
+
+    ScanPool &m_pool;
+    FilePoller &m_fpoll;
+    std::size_t m_maxInFlight;
+    Handler m_handler;
+    // poller thread
+    std::size_t m_inFlight = 0;
+    std::vector<std::vector<char> > m_spare;
+    // the worker holding the strand
+    StreamMatcher m_matcher;
+    // guards the queue, the scheduled & closed flags
+    std::mutex m_lock;
+    std::deque<Chunk> m_queue;
+    bool m_scheduled = false;
+    bool m_closed = false;
+};
+
+#endif // SCANPOOL_H
@@ -0,0 +1,63 @@
+#include "Config.h"
+#include "OperationArena.h"
+#include "ScriptPipeline.h"
+
+#include "Script.h"
+
+namespace {
+
+bool clockRequired(const AdbContext &ctx)
+{
+    return AdbTaskProbeClock::required( ctx );
+}
+
+bool agentRequired(const AdbContext &ctx)
+{
+    return AdbTaskProbeAgent::required( ctx );
+}
+
+// an older agent has no receiver, it gets the activity
+bool broadcastEntry(const AdbContext &ctx)
+{
+    return ctx.config()->isBroadcastEntry() && AdbTaskProbeAgent::isCurrent( ctx );
+}
+
+bool activityEntry(const AdbContext &ctx)
+{
+    return !broadcastEntry( ctx );
+}
+
+typedef ScriptPipeline<PipelineStep<AdbTaskProbeClock, &clockRequired>,
+                       PipelineStep<AdbTaskProbeAgent, &agentRequired>,
+                       PipelineStep<AdbTaskSendBroadcast, &broadcastEntry, true>,
+                       PipelineStep<AdbTaskRunConnect, &activityEntry>,
+                       PipelineStep<AdbTaskWaitConnectLog> > ConnectPipeline;
+
+typedef ScriptPipeline<PipelineStep<AdbTaskProbeClock, &clockRequired>,
+                       PipelineStep<AdbTaskProbeAgent, &agentRequired>,
+                       PipelineStep<AdbTaskSendBroadcast, &broadcastEntry, false>,
+                       PipelineStep<AdbTaskRunDisconnect, &activityEntry>,
+                       PipelineStep<AdbTaskWaitDisconnectLog> > DisconnectPipeline;
+
+// One device command instead of am start & logcat launches
+template <bool Connect>
+using CompositePipeline = ScriptPipeline<PipelineStep<AdbTaskProbeClock, &clockRequired>,
+                                         PipelineStep<AdbTaskProbeAgent, &agentRequired>,
+                                         PipelineStep<AdbTaskRunComposite, &stepAlways, Connect> >;
+
+} // namespace anonymous
+
+
+// Script class implementation
+
+std::shared_ptr<Script> Script::createConnect(std::shared_ptr<AdbContext> ctx)
+{
+    if (ctx->config()->isCompositeCommand()) return makeArenaShared<CompositePipeline<true> >( std::move(ctx) );
+    return makeArenaShared<ConnectPipeline>( std::move(ctx) );
+}
+
+std::shared_ptr<Script> Script::createDisconnect(std::shared_ptr<AdbContext> ctx)
+{
+    if (ctx->config()->isCompositeCommand()) return makeArenaShared<CompositePipeline<false> >( std::move(ctx) );
+    return makeArenaShared<DisconnectPipeline>( std::move(ctx) );
+}
@@ -0,0 +1,29 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <memory>
+
+#include "AdbContext.h"
+#include "AdbTask.h"
+
+class Script {
+public:
+    Script(std::shared_ptr<AdbContext> ctx) : m_ctx(std::move(ctx)) {}
+    virtual ~Script() = default;
+
+    static std::shared_ptr<Script> createConnect(std::shared_ptr<AdbContext> ctx);
+    static std::shared_ptr<Script> createDisconnect(std::shared_ptr<AdbContext> ctx);
+
+    std::shared_ptr<AdbContext> ctx() {return m_ctx;}
+
+    virtual std::shared_ptr<AdbTask> getNextTask() = 0;
+    virtual bool hasNext() const = 0;
+
+protected:
+    const std::shared_ptr<AdbContext> &context() const {return m_ctx;}
+
+private:
+    std::shared_ptr<AdbContext> m_ctx;
+};
+
+#endif // SCRIPT_H
@@ -0,0 +1,80 @@
+#ifndef SCRIPTPIPELINE_H
+#define SCRIPTPIPELINE_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+#include "AdbContext.h"
+#include "AdbTask.h"
+#include "Script.h"
+
+inline bool stepAlways(const AdbContext &) {return true;}
+
+// A pipeline step: Task made as Task(ctx, Args...) when When(ctx) holds at
+// its turn, skipped otherwise
+template <typename Task, auto When = &stepAlways, auto... Args>
+struct PipelineStep {
+    typedef Task TaskType;
+
+    static bool enabled(const AdbContext &ctx) {return When( ctx );}
+    static void make(std::optional<Task> &slot, const std::shared_ptr<AdbContext> &ctx) {slot.emplace( ctx, Args... );}
+};
+
+// Script of steps fixed at compile time. Every step's task lives in the
+// script's own storage and is made when its turn comes; advancing picks the
+// next step through an unrolled chain, with no allocation or table. A task
+// handed out shares the script's ownership, so it stays valid as long as
+// either is held.
+//
+//    typedef ScriptPipeline<PipelineStep<AdbTaskProbeClock, &clockRequired>,
+//                           PipelineStep<AdbTaskRunComposite, &stepAlways, true> > Pipeline;
+//    std::shared_ptr<Script> script = makeArenaShared<Pipeline>( ctx );
+template <typename... Steps>
+class ScriptPipeline final : public Script, public std::enable_shared_from_this<ScriptPipeline<Steps...> > {
+public:
+    explicit ScriptPipeline(std::shared_ptr<AdbContext> ctx) : Script(std::move(ctx)) {}
+
+    virtual std::shared_ptr<AdbTask> getNextTask() override
+    {
+        assert( hasNext() );
+        AdbTask *task = m_next;
+        m_next = nullptr;
+        return std::shared_ptr<AdbTask>( this->shared_from_this(), task );
+    }
+
+    virtual bool hasNext() const override {
+        if (!m_next) m_next = advance( std::index_sequence_for<Steps...>() );
+        return m_next != nullptr;
+    }
+
+private:
+    template <std::size_t... I>
+    AdbTask *advance(std::index_sequence<I...>) const
+    {
+        AdbTask *task = nullptr;
+        (step<I>( task ), ...);
+        return task;
+    }
+
+    template <std::size_t I>
+    void step(AdbTask *&task) const
+    {
+        if (task || m_curr != I) return;
+        typedef std::tuple_element_t<I, std::tuple<Steps...> > Step;
+        m_curr = I + 1;
+        if (!Step::enabled( *context() )) return;
+        auto &slot = std::get<I>( m_tasks );
+        Step::make( slot, context() );
+        task = &*slot;
+    }
+
+    mutable std::tuple<std::optional<typename Steps::TaskType>...> m_tasks;
+    mutable std::size_t m_curr = 0;
+    mutable AdbTask *m_next = nullptr;
+};
+
+#endif // SCRIPTPIPELINE_H
@@ -0,0 +1,203 @@
+#include "Config.h"
+#include "Logger.h"
+#include "SessionRecorder.h"
+
+// Recording format, one event per record:
+//   <type> <usec since start> <fields...>\n
+// variable size values follow the record line as "<size>\n<bytes>\n".
+//   H 0 <mode>\n  + uniq, ssid, auth type values
+//   S <t> <argc>\n + argc values
+//   D <t> <fstream>\n + data value
+//   E <t> <fstream>\n
+//   T <t> <fstream> <timer id>\n
+//   X <t>\n
+//   L <t>\n + line value
+//   O <t> <status>\n + output value
+//   Q <t> <status>\n
+// L is a line from a shared logcat hub, O a persistent shell command's
+// result. Q is the exit status of a native shell command from its shell
+// protocol v2 exit packet, no value follows it.
+
+namespace {
+const char Magic[] = "adbwifiswitch-session 1";
+
+bool readBlob(std::istream &is, std::string &out)
+{
+    std::size_t size;
+    if (!(is >> size) || is.get() != '\n') return false;
+    out.resize( size );
+    if (size && !is.read( &out[0], static_cast<std::streamsize>( size ) )) return false;
+    return is.get() == '\n';
+}
+} // namespace anonymous
+
+
+// SessionRecorder class implementation
+
+SessionRecorder::~SessionRecorder()
+{
+    m_os.flush();
+}
+
+std::shared_ptr<SessionRecorder> SessionRecorder::open(const std::string &path)
+{
+    std::shared_ptr<SessionRecorder> ret( new SessionRecorder() );
+    ret->m_os.open( path, std::ios::binary | std::ios::trunc );
+    if (!ret->m_os) {
+        LOGE(true, "Can't open %s for recording", path.c_str());
+        return std::shared_ptr<SessionRecorder>();
+    }
+    ret->m_os << Magic << '\n';
+    ret->m_start = std::chrono::steady_clock::now();
+    return ret;
+}
+
+void SessionRecorder::onSessionStart(const std::string &mode, const Config &cfg)
+{
+    m_start = std::chrono::steady_clock::now();
+    writeEvent( SessionEvent::evHeader, mode );
+    for (auto s : {&cfg.getUniqTag(), &cfg.getSsid(), &cfg.getAuthType()}) writeBlob( s->data(), s->size() );
+}
+
+void SessionRecorder::onStart(const std::list<std::string> &cl)
+{
+    writeEvent( SessionEvent::evStart, std::to_string( cl.size() ) );
+    for (auto &s : cl) writeBlob( s.data(), s.size() );
+}
+
+void SessionRecorder::onData(AdbContext::FStream fstream, const char *buf, std::size_t size)
+{
+    writeEvent( SessionEvent::evData, std::to_string( static_cast<int>(fstream) ) );
+    writeBlob( buf, size );
+}
+
+void SessionRecorder::onError(AdbContext::FStream fstream)
+{
+    writeEvent( SessionEvent::evError, std::to_string( static_cast<int>(fstream) ) );
+}
+
+void SessionRecorder::onTimer(AdbContext::FStream fstream, unsigned int timerId)
+{
+    writeEvent( SessionEvent::evTimer, std::to_string( static_cast<int>(fstream) ) + " " + std::to_string( timerId ) );
+}
+
+void SessionRecorder::onStop()
+{
+    writeEvent( SessionEvent::evStop, std::string() );
+    m_os.flush();
+}
+
+void SessionRecorder::onLogcatLine(std::string_view line)
+{
+    writeEvent( SessionEvent::evLogcatLine, std::string() );
+    writeBlob( line.data(), line.size() );
+}
+
+void SessionRecorder::onShellOutput(int status, std::string_view output)
+{
+    writeEvent( SessionEvent::evShellOutput, std::to_string( status ) );
+    writeBlob( output.data(), output.size() );
+}
+
+void SessionRecorder::onShellExit(int status)
+{
+    writeEvent( SessionEvent::evShellExit, std::to_string( status ) );
+}
+
+void SessionRecorder::writeEvent(SessionEvent::Type type, const std::string &fields)
+{
+    const auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - m_start ).count();
+    m_os << static_cast<char>(type) << ' ' << usec;
+    if (!fields.empty()) m_os << ' ' << fields;
+    m_os << '\n';
+}
+
+void SessionRecorder::writeBlob(const char *buf, std::size_t size)
+{
+    m_os << size << '\n';
+    m_os.write( buf, static_cast<std::streamsize>( size ) );
+    m_os << '\n';
+}
+
+
+// SessionRecording class implementation
+
+bool SessionRecording::load(const std::string &path)
+{
+    std::ifstream is( path, std::ios::binary );
+    std::string line;
+    if (!is || !std::getline( is, line ) || line != Magic) {
+        LOGE(true, "%s is not a session recording", path.c_str());
+        return false;
+    }
+
+    m_events.clear();
+    m_logcatHub = m_shellSession = false;
+    char type;
+    while (is >> type) {
+        SessionEvent ev;
+        long long usec;
+        if (!(is >> usec)) break;
+        ev.type = static_cast<SessionEvent::Type>( type );
+        ev.time = std::chrono::microseconds( usec );
+
+        bool ok = true;
+        int fs;
+        switch (ev.type) {
+            case SessionEvent::evHeader:
+                ok = static_cast<bool>( is >> m_mode ) && is.get() == '\n' &&
+                     readBlob( is, m_uniqTag ) && readBlob( is, m_ssid ) && readBlob( is, m_authType );
+                break;
+            case SessionEvent::evStart:
+            {
+                std::size_t argc;
+                ok = static_cast<bool>( is >> argc ) && is.get() == '\n';
+                for (std::size_t i = 0; ok && i < argc; i++) {
+                    ev.args.emplace_back();
+                    ok = readBlob( is, ev.args.back() );
+                }
+            }
+                break;
+            case SessionEvent::evData:
+                ok = static_cast<bool>( is >> fs ) && is.get() == '\n' && readBlob( is, ev.data );
+                ev.fstream = static_cast<AdbContext::FStream>( fs );
+                break;
+            case SessionEvent::evError:
+                ok = static_cast<bool>( is >> fs ) && is.get() == '\n';
+                ev.fstream = static_cast<AdbContext::FStream>( fs );
+                break;
+            case SessionEvent::evTimer:
+                ok = static_cast<bool>( is >> fs >> ev.timerId ) && is.get() == '\n';
+                ev.fstream = static_cast<AdbContext::FStream>( fs );
+                break;
+            case SessionEvent::evStop:
+                ok = is.get() == '\n';
+                break;
+            case SessionEvent::evLogcatLine:
+                ok = is.get() == '\n' && readBlob( is, ev.data );
+                m_logcatHub = true;
+                break;
+            case SessionEvent::evShellOutput:
+                ok = static_cast<bool>( is >> ev.status ) && is.get() == '\n' && readBlob( is, ev.data );
+                m_shellSession = true;
+                break;
+            case SessionEvent::evShellExit:
+                ok = static_cast<bool>( is >> ev.status ) && is.get() == '\n';
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            LOGE(true, "Broken record '%c' in %s", type, path.c_str());
+            return false;
+        }
+        if (ev.type != SessionEvent::evHeader) m_events.push_back( std::move(ev) );
+    }
+    if (m_mode.empty()) {
+        LOGE(true, "No session header in %s", path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef SESSIONRECORDER_H
+#define SESSIONRECORDER_H
+
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "AdbContext.h"
+
+class Config;
+
+struct SessionEvent {
+    enum Type : char {
+        evHeader = 'H',
+        evStart = 'S',
+        evData = 'D',
+        evError = 'E',
+        evTimer = 'T',
+        evStop = 'X',
+        evLogcatLine = 'L',
+        evShellOutput = 'O',
+        evShellExit = 'Q',
+    };
+
+    Type type;
+    std::chrono::microseconds time;
+    AdbContext::FStream fstream = AdbContext::FStream::fsStdIn;
+    unsigned int timerId = 0;
+    int status = 0;
+    std::string data;
+    std::list<std::string> args;
+};
+
+// Captures everything an AdbTask sees during one run: adb launches, stream
+// chunks exactly as they were passed to onDataReady(), errors, timer hits,
+// lines delivered by a shared logcat hub, persistent shell results and
+// exit codes of native shell commands.
+class SessionRecorder {
+public:
+    SessionRecorder(const SessionRecorder &) = delete;
+    ~SessionRecorder();
+
+    static std::shared_ptr<SessionRecorder> open(const std::string &path);
+
+    void onSessionStart(const std::string &mode, const Config &cfg);
+    void onStart(const std::list<std::string> &cl);
+    void onData(AdbContext::FStream fstream, const char *buf, std::size_t size);
+    void onError(AdbContext::FStream fstream);
+    void onTimer(AdbContext::FStream fstream, unsigned int timerId);
+    void onStop();
+    void onLogcatLine(std::string_view line);
+    void onShellOutput(int status, std::string_view output);
+    void onShellExit(int status);
+
+private:
+    SessionRecorder() = default;
+
+    void writeEvent(SessionEvent::Type type, const std::string &fields);
+    void writeBlob(const char *buf, std::size_t size);
+
+    std::ofstream m_os;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+class SessionRecording {
+public:
+    bool load(const std::string &path);
+
+    const std::string &mode() const {return m_mode;}
+    const std::string &uniqTag() const {return m_uniqTag;}
+    const std::string &ssid() const {return m_ssid;}
+    const std::string &authType() const {return m_authType;}
+    const std::vector<SessionEvent> &events() const {return m_events;}
+    bool usesLogcatHub() const {return m_logcatHub;}
+    bool usesShellSession() const {return m_shellSession;}
+
+private:
+    std::string m_mode;
+    std::string m_uniqTag;
+    std::string m_ssid;
+    std::string m_authType;
+    std::vector<SessionEvent> m_events;
+    bool m_logcatHub = false;
+    bool m_shellSession = false;
+};
+
+#endif // SESSIONRECORDER_H
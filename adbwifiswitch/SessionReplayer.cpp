@@ -0,0 +1,273 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <thread>
+
+#include "Config.h"
+#include "Logger.h"
+#include "Script.h"
+#include "SessionReplayer.h"
+
+
+namespace {
+const char ResultChannelEvent[] = "result-channel";
+const char ShellSessionEvent[] = "shell-session";
+
+// launches are matched by adb command and the first word of it
+bool sameLaunch(const std::list<std::string> &a, const std::list<std::string> &b)
+{
+    auto ia = a.begin(), ib = b.begin();
+    for (int i = 0; i < 2; i++, ++ia, ++ib) {
+        if (ia == a.end() || ib == b.end()) return ia == a.end() && ib == b.end();
+        if (*ia != *ib) return false;
+    }
+    return true;
+}
+} // namespace anonymous
+
+
+SessionReplayer::SessionReplayer(const SessionRecording &recording)
+    : m_recording(recording)
+{
+    // the clock probe is replayed only if it was recorded
+    bool probed = false, composite = false, broadcast = false;
+    unsigned short result_port = 0;
+    for (auto &ev : recording.events()) {
+        if (ev.type != SessionEvent::evStart) continue;
+        if (ev.args.size() > 1 && *std::next( ev.args.begin() ) == "date") probed = true;
+        if (ev.args.size() > 1 && ev.args.front() == ShellSessionEvent &&
+            std::next( ev.args.begin() )->compare( 0, 5, "date " ) == 0) probed = true;
+        if (AdbTaskRunComposite::isCompositeCommand( ev.args )) composite = true;
+        if (AdbTaskSendBroadcast::isBroadcastCommand( ev.args )) broadcast = true;
+        if (ev.args.size() > 1 && ev.args.front() == ResultChannelEvent) {
+            result_port = static_cast<unsigned short>( strtoul( std::next( ev.args.begin() )->c_str(), nullptr, 10 ) );
+        }
+    }
+    // the host's latency history isn't recorded, replay with fixed deadlines
+    auto cfg = std::make_shared<Config>( Config::Builder().setAdbCmd( "replay" )
+                                                          .setAdaptiveTimeouts( false )
+                                                          .setBroadcastEntry( broadcast )
+                                                          .setCompositeCommand( composite )
+                                                          .setLogcatPushdown( probed )
+                                                          .setResultPort( result_port )
+                                                          .setSsid( recording.ssid() )
+                                                          .setAuthType( recording.authType() )
+                                                          .setUniqTag( recording.uniqTag() )
+                                                          .build() );
+    m_ctx = std::make_shared<Context>( *this, cfg );
+}
+
+SessionReplayer::~SessionReplayer() = default;
+
+bool SessionReplayer::run(SessionReplayer::Pace pace)
+{
+    if (m_recording.mode() == "connect") {
+        m_script = Script::createConnect( m_ctx );
+    } else if (m_recording.mode() == "disconnect") {
+        m_script = Script::createDisconnect( m_ctx );
+    } else {
+        LOGE(true, "Unknown recorded mode %s", m_recording.mode().c_str());
+        return false;
+    }
+
+    m_ctx->markOperationStart();
+    m_nextEvent = 0;
+    m_bytes = 0;
+    m_finished = m_succeeded = false;
+    m_currTask.reset();
+    m_timers.clear();
+    resetStreams();
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!switchTask( AdbTask::Res::Next )) return false;
+
+    const auto &events = m_recording.events();
+    while (!m_finished && m_nextEvent < events.size()) {
+        const SessionEvent &ev = events[m_nextEvent++];
+        if (pace == Pace::RealTime) std::this_thread::sleep_until( start + ev.time );
+
+        switch (ev.type) {
+            case SessionEvent::evData:
+            {
+                ReadBuffer &buf = m_streams[ev.fstream];
+                if (!ev.data.empty()) {
+                    buf.reserve( ev.data.size(), true );
+                    memcpy( buf.readPtr(), ev.data.data(), ev.data.size() );
+                    buf.addFilled( ev.data.size() );
+                    m_bytes += ev.data.size();
+                }
+                std::size_t sz = buf.filledSize();
+                auto res = m_currTask->onDataReady( ev.fstream, buf.head(), sz );
+                if (res != AdbTask::Res::Fail) buf.cut( sz );
+                switchTask( res );
+            }
+                break;
+            case SessionEvent::evError:
+                switchTask( m_currTask->onError( ev.fstream ) );
+                break;
+            case SessionEvent::evTimer:
+                if (m_timers.erase( std::make_pair( ev.fstream, ev.timerId ) )) {
+                    switchTask( m_currTask->onTimer( ev.fstream, ev.timerId ) );
+                } else {
+                    LOGD(true, "Skip timer %u, not armed in replay", ev.timerId);
+                }
+                break;
+            case SessionEvent::evLogcatLine:
+                switchTask( m_currTask->onEvent( AdbContext::Event::evLogcatLine, ev.data ) );
+                break;
+            case SessionEvent::evShellOutput:
+                switchTask( m_currTask->onEvent( ev.status < 0 ? AdbContext::Event::evShellFailed
+                                                               : AdbContext::Event::evShellOutput, ev.data ) );
+                break;
+            case SessionEvent::evShellExit:
+                // a task that doesn't take it gets the recorded end of stdout next
+                switchTask( m_currTask->onEvent( AdbContext::Event::evShellExit, std::to_string( ev.status ) ) );
+                break;
+            case SessionEvent::evStart:
+            case SessionEvent::evStop:
+            default:
+                // launches & stops are driven by the tasks themselves
+                break;
+        }
+    }
+
+    if (!m_finished) LOGI(true, "Recording ended before the script");
+    return m_succeeded;
+}
+
+int SessionReplayer::exitCode() const
+{
+    return m_succeeded ? 0 : 1;
+}
+
+
+// SessionReplayer:: private members
+
+void SessionReplayer::resetStreams()
+{
+    for (auto &buf : m_streams) buf.cut();
+}
+
+bool SessionReplayer::switchTask(AdbTask::Res res)
+{
+    switch (res) {
+        default:
+            assert( false );
+        case AdbTask::Res::Fail:
+            LOGI(true, "Replay: execution failed");
+            m_finished = true;
+            return false;
+
+        case AdbTask::Res::Continue:
+            return true;
+
+        case AdbTask::Res::Next:
+            if (m_currTask) m_currTask->cleanup();
+            break;
+    }
+
+    if (m_script->hasNext()) {
+        m_currTask = m_script->getNextTask();
+        assert( m_currTask );
+        if (!m_currTask->start()) {
+            m_finished = true;
+            return false;
+        }
+    } else {
+        LOGI(true, "Replay: execution done");
+        m_finished = m_succeeded = true;
+    }
+    return true;
+}
+
+
+// SessionReplayer::Context class implementation
+
+SessionReplayer::Context::Context(SessionReplayer &owner, std::shared_ptr<Config> cfg)
+    : AdbContext(std::move(cfg)), m_owner(owner)
+{
+}
+
+bool SessionReplayer::Context::startAdb(const std::list<std::string> &cl)
+{
+    const auto &events = m_owner.m_recording.events();
+    while (m_owner.m_nextEvent < events.size() &&
+           (events[m_owner.m_nextEvent].type != SessionEvent::evStart ||
+            !sameLaunch( events[m_owner.m_nextEvent].args, cl ))) {
+        LOGD(true, "Replay: skip event '%c' before adb launch", events[m_owner.m_nextEvent].type);
+        m_owner.m_nextEvent++;
+    }
+    if (m_owner.m_nextEvent >= events.size()) {
+        LOGI(true, "Replay: no more recorded adb launches");
+        return false;
+    }
+    LOGD(events[m_owner.m_nextEvent].args != cl, "Replay: adb command line differs from recorded");
+    m_owner.m_nextEvent++;
+    m_owner.resetStreams();
+    return true;
+}
+
+void SessionReplayer::Context::stopAdb()
+{
+    m_owner.resetStreams();
+}
+
+bool SessionReplayer::Context::writeStdIn(const void *, std::size_t)
+{
+    return true;
+}
+
+bool SessionReplayer::Context::timerCtl(AdbContext::FStream fstream, unsigned int timerId, bool start,
+                                        std::chrono::milliseconds)
+{
+    const auto key = std::make_pair( fstream, timerId );
+    if (start) m_owner.m_timers.insert( key );
+    else m_owner.m_timers.erase( key );
+    return true;
+}
+
+bool SessionReplayer::Context::subscribeLogcat(std::string_view, std::string_view)
+{
+    return m_owner.m_recording.usesLogcatHub();
+}
+
+AdbContext::ChannelStatus SessionReplayer::Context::openResultChannel(unsigned short port, const std::string &)
+{
+    const std::list<std::string> key = {ResultChannelEvent, std::to_string( port )};
+    const auto &events = m_owner.m_recording.events();
+    while (m_owner.m_nextEvent < events.size() &&
+           (events[m_owner.m_nextEvent].type != SessionEvent::evStart ||
+            !sameLaunch( events[m_owner.m_nextEvent].args, key ))) {
+        m_owner.m_nextEvent++;
+    }
+    if (m_owner.m_nextEvent >= events.size() || events[m_owner.m_nextEvent].args.size() != 3) {
+        LOGI(true, "Replay: no more recorded result channels");
+        return ChannelStatus::chFailed;
+    }
+    const int status = atoi( events[m_owner.m_nextEvent++].args.back().c_str() );
+    m_owner.m_streams[FStream::fsResult].cut();
+    return static_cast<ChannelStatus>( status );
+}
+
+// commands went to the shell only if the recording has their output
+bool SessionReplayer::Context::runShellCommand(const std::string &command)
+{
+    if (!m_owner.m_recording.usesShellSession()) return false;
+    const auto &events = m_owner.m_recording.events();
+    std::size_t i = m_owner.m_nextEvent;
+    while (i < events.size() && (events[i].type != SessionEvent::evStart || events[i].args.empty() ||
+                                 events[i].args.front() != ShellSessionEvent)) i++;
+    if (i >= events.size()) {
+        LOGI(true, "Replay: no more recorded shell commands");
+        return false;
+    }
+    LOGD(events[i].args.back() != command, "Replay: shell command differs from recorded");
+    m_owner.m_nextEvent = i + 1;
+    return true;
+}
+
+void SessionReplayer::Context::closeResultChannel()
+{
+    m_owner.m_streams[FStream::fsResult].cut();
+}
@@ -0,0 +1,65 @@
+#ifndef SESSIONREPLAYER_H
+#define SESSIONREPLAYER_H
+
+#include <array>
+#include <memory>
+#include <set>
+#include <utility>
+
+#include "AdbContext.h"
+#include "AdbTask.h"
+#include "Buffers.h"
+#include "SessionRecorder.h"
+
+class Config;
+class Script;
+
+// Feeds a SessionRecording back into the AdbTask objects of the recorded
+// script, with the recorded chunking, in real time or as fast as possible.
+class SessionReplayer {
+public:
+    enum Pace {
+        RealTime, AsFastAsPossible
+    };
+
+    SessionReplayer(const SessionRecording &recording);
+    ~SessionReplayer();
+
+    bool run(Pace pace);
+    int exitCode() const;
+    std::size_t bytesReplayed() const {return m_bytes;}
+
+private:
+    class Context : public AdbContext {
+    public:
+        Context(SessionReplayer &owner, std::shared_ptr<Config> cfg);
+
+        virtual bool startAdb(const std::list<std::string> &cl) override;
+        virtual void stopAdb() override;
+        virtual bool writeStdIn(const void *buf, std::size_t size) override;
+        virtual bool timerCtl(FStream fstream, unsigned int timerId, bool start,
+                              std::chrono::milliseconds ms=std::chrono::milliseconds::zero()) override;
+        virtual bool subscribeLogcat(std::string_view uniq, std::string_view signature) override;
+        virtual ChannelStatus openResultChannel(unsigned short port, const std::string &request) override;
+        virtual void closeResultChannel() override;
+        virtual bool runShellCommand(const std::string &command) override;
+    private:
+        SessionReplayer &m_owner;
+    };
+
+    void resetStreams();
+    bool switchTask(AdbTask::Res res);
+
+    const SessionRecording &m_recording;
+    std::shared_ptr<Context> m_ctx;
+    std::shared_ptr<Script> m_script;
+    std::shared_ptr<AdbTask> m_currTask;
+    std::array<ReadBuffer, AdbContext::FStream::fsResult + 1> m_streams;
+    std::set<std::pair<AdbContext::FStream, unsigned int> > m_timers;
+    std::size_t m_nextEvent = 0;
+    std::size_t m_bytes = 0;
+    bool m_finished = false;
+    bool m_succeeded = false;
+};
+
+#endif // SESSIONREPLAYER_H
@@ -0,0 +1,145 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ShellProtocol.h"
+
+namespace {
+enum {
+    DefaultServerPort = 5037,
+    HandshakeTimeoutMs = 2000,
+    MaxFailMessage = 1024,
+};
+
+bool readExact(int fd, char *buf, std::size_t size)
+{
+    while (size > 0) {
+        long ret = read( fd, buf, size );
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        buf += ret;
+        size -= static_cast<std::size_t>( ret );
+    }
+    return true;
+}
+
+bool writeExact(int fd, const std::string &data)
+{
+    std::size_t done = 0;
+    while (done < data.size()) {
+        long ret = send( fd, data.data() + done, data.size() - done, MSG_NOSIGNAL );
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        done += static_cast<std::size_t>( ret );
+    }
+    return true;
+}
+
+// smart socket request: 4 hex digits of length, then the text;
+// the server answers OKAY, or FAIL with a message framed the same way
+bool request(int fd, const std::string &service, std::string &error)
+{
+    char len[5];
+    snprintf( len, sizeof(len), "%04x", static_cast<unsigned int>( service.size() & 0xffff ) );
+    char status[4];
+    if (!writeExact( fd, std::string(len, 4) + service ) || !readExact( fd, status, sizeof(status) )) {
+        error = "adb server hung up on " + service;
+        return false;
+    }
+    if (memcmp( status, "OKAY", sizeof(status) ) == 0) return true;
+    error.assign( service ).append( ": " );
+    char msg[MaxFailMessage];
+    if (memcmp( status, "FAIL", sizeof(status) ) == 0 && readExact( fd, len, 4 )) {
+        len[4] = 0;
+        const std::size_t size = strtoul( len, nullptr, 16 );
+        if (size < sizeof(msg) && readExact( fd, msg, size )) error.append( msg, size );
+    } else {
+        error.append( "bad answer" );
+    }
+    return false;
+}
+} // namespace anonymous
+
+
+// ShellProtocol class implementation
+
+unsigned short ShellProtocol::serverPort()
+{
+    const char *env = getenv( "ANDROID_ADB_SERVER_PORT" );
+    char *end = nullptr;
+    const long port = env ? strtol( env, &end, 10 ) : 0;
+    if (!end || *end != 0 || port <= 0 || port >= 65536) return static_cast<unsigned short>( DefaultServerPort );
+    return static_cast<unsigned short>( port );
+}
+
+int ShellProtocol::openShell(unsigned short port, const std::string &serial, const std::string &command,
+                             bool pty, std::string &error)
+{
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (fd < 0) {
+        error = "socket() failed";
+        return -1;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    // the server is local and answers at once, a stuck one must not hang us
+    struct timeval tv = {HandshakeTimeoutMs / 1000, (HandshakeTimeoutMs % 1000) * 1000};
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+
+    bool ok = false;
+    if (connect( fd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof(addr) ) < 0) {
+        error = errno == ECONNREFUSED ? "no adb server on port " + std::to_string( port ) : "connect() failed";
+    } else {
+        const std::string transport = serial.empty() ? "host:transport-any" : "host:transport:" + serial;
+        const std::string shell = std::string("shell,v2,").append( pty ? "pty:" : "raw:" ).append( command );
+        ok = request( fd, transport, error ) && request( fd, shell, error ) &&
+             fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) == 0;
+    }
+    if (!ok) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+std::string ShellProtocol::packet(ShellProtocol::PacketId id, const void *payload, std::size_t size)
+{
+    std::string ret;
+    ret.reserve( HeaderSize + size );
+    ret.push_back( static_cast<char>( id ) );
+    for (unsigned int i = 0; i < 4; i++) ret.push_back( static_cast<char>( (size >> (8 * i)) & 0xff ) );
+    ret.append( static_cast<const char *>( payload ), size );
+    return ret;
+}
+
+std::string ShellProtocol::windowSize(unsigned int rows, unsigned int cols)
+{
+    char buf[64];
+    const int len = snprintf( buf, sizeof(buf), "%ux%u,0x0", rows, cols );
+    return packet( IdWindowSize, buf, static_cast<std::size_t>( len ) );
+}
+
+std::size_t ShellProtocol::parse(const char *input, std::size_t size, ShellProtocol::PacketId &id,
+                                 std::string_view &payload)
+{
+    if (size < HeaderSize) return 0;
+    std::size_t len = 0;
+    for (unsigned int i = 0; i < 4; i++) {
+        len |= static_cast<std::size_t>( static_cast<unsigned char>( input[1 + i] ) ) << (8 * i);
+    }
+    if (size - HeaderSize < len) return 0;
+    id = static_cast<PacketId>( input[0] );
+    payload = std::string_view( input + HeaderSize, len );
+    return HeaderSize + len;
+}
@@ -0,0 +1,40 @@
+#ifndef SHELLPROTOCOL_H
+#define SHELLPROTOCOL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Talks to the local adb server directly, without an adb client process,
+// and opens "shell,v2" services on the device. With the v2 protocol every
+// chunk is a packet: 1 byte id, 4 bytes little endian payload length, the
+// payload. stdout, stderr and the exit code come apart, no text heuristics.
+class ShellProtocol {
+public:
+    enum PacketId : std::uint8_t {
+        IdStdin = 0,
+        IdStdout = 1,
+        IdStderr = 2,
+        IdExit = 3,
+        IdCloseStdin = 4,
+        IdWindowSize = 5,
+    };
+    static const std::size_t HeaderSize = 5;
+
+    // ANDROID_ADB_SERVER_PORT or adb's default 5037
+    static unsigned short serverPort();
+
+    // Selects the device and starts the command, an empty one is an
+    // interactive shell. Returns a non-blocking socket or -1 with the
+    // reason in error. A refused connection means no server is running.
+    static int openShell(unsigned short port, const std::string &serial, const std::string &command,
+                         bool pty, std::string &error);
+
+    static std::string packet(PacketId id, const void *payload, std::size_t size);
+    // "<rows>x<cols>,<x pixels>x<y pixels>" as the adb client sends it
+    static std::string windowSize(unsigned int rows, unsigned int cols);
+    // returns the packet size or 0 while it is incomplete
+    static std::size_t parse(const char *input, std::size_t size, PacketId &id, std::string_view &payload);
+};
+
+#endif // SHELLPROTOCOL_H
@@ -0,0 +1,418 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "Logger.h"
+#include "ShellSession.h"
+
+namespace {
+enum {
+    MaxLineSize = 64*1024,
+    ReadChunk = 16*1024,
+    IdleTimerId = 1,
+};
+const char CmdShell[] = "shell";
+} // namespace anonymous
+
+
+// ShellSession class implementation
+
+ShellSession::ShellSession(FilePoller &fpoll, const std::string &adbCmd, const std::string &serial,
+                           std::chrono::milliseconds idleTimeout)
+    : m_fpoll(fpoll), m_adbCmd(adbCmd), m_serial(serial), m_idleTimeout(idleTimeout),
+      m_proc(ChildProcess::Flags::fDefault)
+{
+
+}
+
+ShellSession::~ShellSession()
+{
+    stopShell();
+}
+
+ShellSession::CommandId ShellSession::run(const std::string &command, ShellSession::Handler handler)
+{
+    if (!m_output && !startShell()) return BadCommandId;
+    m_output->stopTimer( IdleTimerId );
+
+    if (++m_lastId == BadCommandId) ++m_lastId;
+    if (m_queued == m_commands.size()) m_commands.emplace_back();
+    Command &cmd = m_commands[m_queued++];
+    cmd.id = m_lastId;
+    cmd.text.assign( command );
+    cmd.handler = std::move(handler);
+    if (!send( cmd )) {
+        drop( m_queued - 1 );
+        return BadCommandId;
+    }
+    LOGD(true, "Shell %s: command %u queued, %zu in flight", m_serial.c_str(), m_lastId, m_queued);
+    return m_lastId;
+}
+
+void ShellSession::cancel(ShellSession::CommandId id)
+{
+    const std::size_t index = find( id );
+    if (index == m_queued) return;
+
+    const std::size_t start = m_commands[index].start;
+    drop( index );
+    if (!m_output) return;
+    if (m_input->written() > start) {
+        // the shell has it and runs it when it gets there
+        LOGD(true, "Shell %s: restarting for cancelled command %u", m_serial.c_str(), id);
+        restartShell();
+        return;
+    }
+    // still ours to write: the commands after it go again without it
+    m_input->unput( start );
+    bool ok = true;
+    for (std::size_t i = index; i < m_queued; i++) ok = ok && send( m_commands[i] );
+    if (!ok) return onShellDied();
+    if (!m_queued) m_output->startTimer( IdleTimerId, m_idleTimeout );
+}
+
+void ShellSession::shutdown()
+{
+    while (m_queued) drop( m_queued - 1 );
+    stopShell();
+}
+
+
+// ShellSession:: private members
+
+bool ShellSession::startShell()
+{
+    std::list<std::string> cl;
+    if (!m_serial.empty()) {
+        cl.emplace_back( "-s" );
+        cl.emplace_back( m_serial );
+    }
+    cl.emplace_back( CmdShell );
+
+    m_proc.cleanup( true );
+    if (!m_proc.exec( m_adbCmd, cl )) {
+        LOGE(true, "Can't spawn %s for shell session", m_adbCmd.c_str());
+        return false;
+    }
+    m_launches++;
+
+    // a fresh nonce per shell, output of an earlier one can't match
+    std::random_device rd;
+    char nonce[32];
+    snprintf( nonce, sizeof(nonce), "aws%08x%08x", rd(), rd() );
+    m_nonce = nonce;
+    m_current = BadCommandId;
+    m_collected.clear();
+
+    const int in_fd = m_proc.getStdinFd();
+    fcntl( in_fd, F_SETFL, fcntl( in_fd, F_GETFL ) | O_NONBLOCK );
+    m_input = std::make_shared<FHInput>( *this, in_fd );
+    m_output = std::make_shared<FHOutput>( *this, m_proc.getStdoutFd() );
+    m_input->handlerId = m_fpoll.addHandler( m_input );
+    m_output->handlerId = m_input->handlerId != FilePoller::BadHandlerId ? m_fpoll.addHandler( m_output )
+                                                                         : FilePoller::BadHandlerId;
+    if (m_output->handlerId == FilePoller::BadHandlerId) {
+        LOGE(true, "Fail to register shell session streams");
+        stopShell();
+        return false;
+    }
+    m_input->setState( true );
+    m_output->setState( true );
+    LOGD(true, "Shell %s: started", m_serial.c_str());
+    return true;
+}
+
+void ShellSession::stopShell()
+{
+    for (auto fh : {static_cast<FileHandler *>(m_input.get()), static_cast<FileHandler *>(m_output.get())}) {
+        if (fh) fh->setState( false );
+    }
+    if (m_input && m_input->handlerId != FilePoller::BadHandlerId) m_fpoll.removeHandler( m_input->handlerId );
+    if (m_output && m_output->handlerId != FilePoller::BadHandlerId) m_fpoll.removeHandler( m_output->handlerId );
+    const bool was_running = m_output != nullptr;
+    // closing stdin ends the device shell
+    m_input.reset();
+    m_output.reset();
+    m_proc.cleanup( true );
+    m_current = BadCommandId;
+    LOGD(was_running, "Shell %s: stopped", m_serial.c_str());
+}
+
+// the command the shell is running fails, the ones it hasn't begun go to a
+// new shell
+void ShellSession::restartShell()
+{
+    const CommandId current = m_current;
+    Handler handler;
+    const std::size_t index = find( current );
+    if (index != m_queued) {
+        handler = std::move( m_commands[index].handler );
+        drop( index );
+    }
+    stopShell();
+    if (m_queued) {
+        bool ok = startShell();
+        for (std::size_t i = 0; ok && i < m_queued; i++) ok = send( m_commands[i] );
+        if (!ok) onShellDied();
+    }
+    if (handler) handler( current, ShellFailed, std::string_view() );
+}
+
+// "{ ...\n}" keeps a command without trailing newline or with a trailing
+// comment whole; the empty echo puts the end sentinel on its own line
+bool ShellSession::send(ShellSession::Command &cmd)
+{
+    char id[16];
+    const std::string_view num( id, static_cast<std::size_t>( std::to_chars( id, id + sizeof(id), cmd.id ).ptr - id ) );
+    m_frame.clear();
+    m_frame.append( "echo " ).append( m_nonce ).append( ":" ).append( num ).append( ":b\n{ " ).append( cmd.text )
+           .append( "\n} </dev/null 2>&1; _rc=$?; echo; echo " )
+           .append( m_nonce ).append( ":" ).append( num ).append( ":e $_rc\n" );
+    cmd.start = m_input->end();
+    return m_input->put( m_frame );
+}
+
+std::size_t ShellSession::find(ShellSession::CommandId id) const
+{
+    std::size_t ret = 0;
+    while (ret < m_queued && m_commands[ret].id != id) ret++;
+    return ret;
+}
+
+// the slot goes behind the ones in flight
+void ShellSession::drop(std::size_t index)
+{
+    m_commands[index].handler = nullptr;
+    std::rotate( m_commands.begin() + static_cast<long>( index ), m_commands.begin() + static_cast<long>( index ) + 1,
+                 m_commands.begin() + static_cast<long>( m_queued ) );
+    m_queued--;
+}
+
+void ShellSession::onOutput(bool eof)
+{
+    // handlers may restart the shell, keep the buffer alive while walking it
+    auto stream = m_output;
+    ReadBuffer &buf = stream->readBuf;
+    std::string_view view( buf.head(), buf.filledSize() );
+    std::size_t used = 0, pos;
+    while (m_output == stream && (pos = view.find( '\n' )) != std::string_view::npos) {
+        std::string_view line( view.substr( 0, pos ) );
+        view.remove_prefix( pos + 1 );
+        used += pos + 1;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+        onLine( line );
+    }
+    if (m_output != stream) return;
+    buf.cut( view.size() > MaxLineSize ? buf.filledSize() : used );
+
+    if (eof) {
+        LOGI(true, "Shell %s: closed by adb", m_serial.c_str());
+        onShellDied();
+    }
+}
+
+void ShellSession::onLine(std::string_view line)
+{
+    if (line.size() > m_nonce.size() && line.compare( 0, m_nonce.size(), m_nonce ) == 0 &&
+        line[m_nonce.size()] == ':') {
+        std::string_view tail( line.substr( m_nonce.size() + 1 ) );
+        CommandId id = BadCommandId;
+        const auto parsed = std::from_chars( tail.data(), tail.data() + tail.size(), id );
+        tail.remove_prefix( static_cast<std::size_t>( parsed.ptr - tail.data() ) );
+        if (parsed.ec == std::errc() && tail == ":b") {
+            m_current = id;
+            m_collected.clear();
+            return;
+        }
+        if (parsed.ec == std::errc() && tail.substr( 0, 3 ) == ":e ") {
+            int status = 0;
+            std::from_chars( tail.data() + 3, tail.data() + tail.size(), status );
+            complete( id, status );
+            return;
+        }
+    }
+    if (m_current != BadCommandId) {
+        m_collected.append( line ).push_back( '\n' );
+    } else {
+        LOGD(true, "Shell %s: stray line %.*s", m_serial.c_str(), static_cast<int>( line.size() ), line.data());
+    }
+}
+
+void ShellSession::onShellDied()
+{
+    std::vector<Command> commands;
+    for (std::size_t i = 0; i < m_queued; i++) commands.push_back( std::move( m_commands[i] ) );
+    m_queued = 0;
+    stopShell();
+    for (auto &cmd : commands) {
+        if (cmd.handler) cmd.handler( cmd.id, ShellFailed, std::string_view() );
+    }
+}
+
+void ShellSession::onTimer(unsigned int timerId)
+{
+    assert( timerId == IdleTimerId );
+    if (!m_queued) {
+        LOGD(true, "Shell %s: idle", m_serial.c_str());
+        stopShell();
+    }
+}
+
+void ShellSession::complete(ShellSession::CommandId id, int status)
+{
+    m_current = BadCommandId;
+    m_completed.swap( m_collected );
+    m_collected.clear();
+    // drop the newline of the empty echo
+    if (!m_completed.empty()) m_completed.pop_back();
+
+    const std::size_t index = find( id );
+    if (index == m_queued) {
+        LOGD(true, "Shell %s: command %u was cancelled", m_serial.c_str(), id);
+        return;
+    }
+    Handler handler = std::move( m_commands[index].handler );
+    drop( index );
+    if (!m_queued) m_output->startTimer( IdleTimerId, m_idleTimeout );
+    LOGD(true, "Shell %s: command %u done, status %d", m_serial.c_str(), id, status);
+    if (handler) handler( id, status, m_completed );
+}
+
+
+// ShellSession::FHInput class implementation
+
+ShellSession::FHInput::FHInput(ShellSession &owner, int fd)
+    : FileHandler( fd ), m_owner(owner)
+{
+
+}
+
+bool ShellSession::FHInput::onError()
+{
+    m_owner.onShellDied();
+    return true;
+}
+
+bool ShellSession::FHInput::onReadyToRead()
+{
+    // the write side of a pipe is only readable when the reader is gone
+    m_owner.onShellDied();
+    return true;
+}
+
+bool ShellSession::FHInput::onReadyToWrite()
+{
+    if (!m_writeBuf.empty()) {
+        long ret = writePipe( getFd(), m_writeBuf.ptr(), m_writeBuf.size() );
+        if (ret < 0 && errno != EAGAIN) {
+            LOGD(true, "Shell session write error, errno %d", errno);
+            m_owner.onShellDied();
+            return true;
+        }
+        if (ret > 0) m_writeBuf.pushHead( static_cast<std::size_t>( ret ) );
+    }
+    if (m_writeBuf.empty()) setWriteRequest( false );
+    return true;
+}
+
+bool ShellSession::FHInput::put(const std::string &data)
+{
+    m_writeBuf.append( data.data(), data.size() );
+    m_end += data.size();
+    setWriteRequest( true );
+    return true;
+}
+
+void ShellSession::FHInput::unput(std::size_t offset)
+{
+    assert( offset >= written() && offset <= m_end );
+    m_writeBuf.cutTail( m_end - offset );
+    m_end = offset;
+    if (m_writeBuf.empty()) setWriteRequest( false );
+}
+
+
+// ShellSession::FHOutput class implementation
+
+ShellSession::FHOutput::FHOutput(ShellSession &owner, int fd)
+    : FileHandler( fd ), m_owner(owner)
+{
+
+}
+
+bool ShellSession::FHOutput::onError()
+{
+    m_owner.onOutput( true );
+    return true;
+}
+
+bool ShellSession::FHOutput::onReadyToRead()
+{
+    bool eof = false;
+    while (1) {
+        readBuf.reserve( ReadChunk, true );
+        const std::size_t rest = readBuf.restSize();
+        long ret = read( getFd(), readBuf.readPtr(), rest );
+        if (ret < 0) {
+            eof = errno != EAGAIN;
+            LOGD(eof, "Shell session read error, errno %d", errno);
+            break;
+        }
+        if (ret == 0) {
+            eof = true;
+            break;
+        }
+        readBuf.addFilled( static_cast<std::size_t>( ret ) );
+        if (static_cast<std::size_t>( ret ) < rest) break;
+    }
+    m_owner.onOutput( eof );
+    return true;
+}
+
+bool ShellSession::FHOutput::onReadyToWrite()
+{
+    return true;
+}
+
+bool ShellSession::FHOutput::onTimer(unsigned int timerId)
+{
+    m_owner.onTimer( timerId );
+    return true;
+}
+
+
+// ShellSessionPool class implementation
+
+ShellSessionPool::ShellSessionPool(FilePoller &fpoll, std::chrono::milliseconds idleTimeout)
+    : m_fpoll(fpoll), m_idleTimeout(idleTimeout)
+{
+
+}
+
+std::shared_ptr<ShellSession> ShellSessionPool::session(const std::string &adbCmd, const std::string &serial)
+{
+    auto it = m_sessions.find( std::tie( adbCmd, serial ) );
+    if (it != m_sessions.end()) return it->second;
+    auto ret = std::make_shared<ShellSession>( m_fpoll, adbCmd, serial, m_idleTimeout );
+    m_sessions.emplace( std::make_tuple( adbCmd, serial ), ret );
+    return ret;
+}
+
+void ShellSessionPool::shutdown()
+{
+    for (auto &s : m_sessions) s.second->shutdown();
+}
+
+std::size_t ShellSessionPool::launches() const
+{
+    std::size_t ret = 0;
+    for (auto &s : m_sessions) ret += s.second->launches();
+    return ret;
+}
@@ -0,0 +1,148 @@
+#ifndef SHELLSESSION_H
+#define SHELLSESSION_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "Buffers.h"
+#include "ChildProcess.h"
+#include "FileHandler.h"
+#include "FilePoller.h"
+
+// One long-lived "adb shell" per device. Commands are written to its stdin
+// back to back, without waiting for the earlier ones to finish. Each one is
+// framed by echoed sentinels carrying a per-shell nonce and the command id,
+// so the output is split per command whatever it prints, without prompt
+// detection. Commands run with stdin from /dev/null and stderr merged into
+// stdout. The shell is closed after idle timeout with nothing queued.
+class ShellSession {
+public:
+    typedef unsigned int CommandId;
+    // status is the command's exit code, or ShellFailed when the shell died
+    typedef std::function<void(CommandId, int status, std::string_view output)> Handler;
+    static const CommandId BadCommandId = 0;
+    static const int ShellFailed = -1;
+
+    ShellSession(FilePoller &fpoll, const std::string &adbCmd, const std::string &serial,
+                 std::chrono::milliseconds idleTimeout);
+    ShellSession(const ShellSession &) = delete;
+    ~ShellSession();
+
+    CommandId run(const std::string &command, Handler handler);
+    // the handler isn't called after this. A command already written to the
+    // shell can't be taken back, the shell is restarted without it: the
+    // command it was running then fails with ShellFailed, the others are
+    // sent again
+    void cancel(CommandId id);
+    void shutdown();
+    bool running() const {return m_output != nullptr;}
+    std::size_t queued() const {return m_queued;}
+    std::size_t launches() const {return m_launches;}
+
+private:
+    struct Command {
+        CommandId id;
+        std::string text;
+        Handler handler;
+        // offset of its frame in the shell's input
+        std::size_t start = 0;
+    };
+
+    class FHInput final : public FileHandler {
+    public:
+        FHInput(ShellSession &owner, int fd);
+
+        virtual bool onError() override;
+        virtual bool onReadyToRead() override;
+        virtual bool onReadyToWrite() override;
+
+        bool put(const std::string &data);
+        // takes back the input from the offset on, none of it may be written
+        void unput(std::size_t offset);
+        // offsets in the input
+        std::size_t end() const {return m_end;}
+        std::size_t written() const {return m_end - m_writeBuf.size();}
+
+        FilePoller::HandlerId handlerId = FilePoller::BadHandlerId;
+
+    private:
+        WriteBuffer m_writeBuf;
+        std::size_t m_end = 0;
+        ShellSession &m_owner;
+    };
+
+    class FHOutput final : public FileHandler {
+    public:
+        FHOutput(ShellSession &owner, int fd);
+
+        virtual bool onError() override;
+        virtual bool onReadyToRead() override;
+        virtual bool onReadyToWrite() override;
+        virtual bool onTimer( unsigned int timerId ) override;
+
+        ReadBuffer readBuf;
+        FilePoller::HandlerId handlerId = FilePoller::BadHandlerId;
+
+    private:
+        ShellSession &m_owner;
+    };
+
+    bool startShell();
+    void stopShell();
+    void restartShell();
+    bool send(Command &cmd);
+    // index of the command, m_queued if it isn't in flight
+    std::size_t find(CommandId id) const;
+    void drop(std::size_t index);
+    void onOutput(bool eof);
+    void onLine(std::string_view line);
+    void onShellDied();
+    void onTimer(unsigned int timerId);
+    void complete(CommandId id, int status);
+
+    FilePoller &m_fpoll;
+    std::string m_adbCmd;
+    std::string m_serial;
+    std::chrono::milliseconds m_idleTimeout;
+    ChildProcess m_proc;
+    std::shared_ptr<FHInput> m_input;
+    std::shared_ptr<FHOutput> m_output;
+    // the first m_queued are in flight in order, the slots past them keep
+    // their storage for the next commands
+    std::vector<Command> m_commands;
+    std::size_t m_queued = 0;
+    std::string m_frame;
+    std::string m_nonce;
+    std::string m_collected;
+    // output of the completed command, valid until the next completion
+    std::string m_completed;
+    CommandId m_current = BadCommandId;
+    CommandId m_lastId = BadCommandId;
+    std::size_t m_launches = 0;
+};
+
+// Hands out one shell per (adb command, device serial).
+class ShellSessionPool {
+public:
+    ShellSessionPool(FilePoller &fpoll, std::chrono::milliseconds idleTimeout = std::chrono::seconds(30));
+
+    std::shared_ptr<ShellSession> session(const std::string &adbCmd, const std::string &serial);
+    void shutdown();
+    // adb processes started by all shells so far
+    std::size_t launches() const;
+
+private:
+    FilePoller &m_fpoll;
+    std::chrono::milliseconds m_idleTimeout;
+    // looked up without copying the key
+    std::map<std::tuple<std::string, std::string>, std::shared_ptr<ShellSession>, std::less<> > m_sessions;
+};
+
+#endif // SHELLSESSION_H
@@ -0,0 +1,139 @@
+#include <algorithm>
+
+#include "SignatureRouter.h"
+
+namespace {
+enum : unsigned int {
+    RouteIndexBits = 16,
+    RouteIndexMask = (1u << RouteIndexBits) - 1,
+    MaxRouteGeneration = (1u << (32 - RouteIndexBits)) - 1,
+};
+} // namespace anonymous
+
+
+// SignatureRouter class implementation
+
+SignatureRouter::RouteId SignatureRouter::addRoute(std::string_view uniq, std::string_view signature,
+                                                   SignatureRouter::Handler handler)
+{
+    unsigned int index;
+    if (!m_freeRoutes.empty()) {
+        index = m_freeRoutes.back();
+        m_freeRoutes.pop_back();
+    } else {
+        if (m_routes.size() > RouteIndexMask) return BadRouteId;
+        index = static_cast<unsigned int>( m_routes.size() );
+        m_routes.emplace_back();
+    }
+    Route &r = m_routes[index];
+    r.generation = r.generation % MaxRouteGeneration + 1;
+    r.id = (r.generation << RouteIndexBits) | index;
+    r.uniq.assign( uniq );
+    r.signature.assign( signature );
+    r.handler = std::move(handler);
+    m_size++;
+    m_dirty = true;
+    return r.id;
+}
+
+bool SignatureRouter::removeRoute(SignatureRouter::RouteId id)
+{
+    Route *r = find( id );
+    if (!r) return false;
+    r->id = BadRouteId;
+    r->handler = nullptr;
+    m_freeRoutes.push_back( id & RouteIndexMask );
+    m_size--;
+    m_dirty = true;
+    return true;
+}
+
+std::size_t SignatureRouter::dispatch(std::string_view line)
+{
+    if (!m_size) return 0;
+    if (m_dirty) rebuild();
+
+    if (++m_generation == 0) {
+        std::fill( m_seen.begin(), m_seen.end(), 0 );
+        m_generation = 1;
+    }
+    m_uniqHits.clear();
+    m_matcher.scan( line, [this](AhoCorasick::PatternId id, std::size_t) {
+        if (m_seen[id] != m_generation) {
+            m_seen[id] = m_generation;
+            if (m_byUniqBegin[id] != m_byUniqBegin[id + 1]) m_uniqHits.push_back( id );
+        }
+        return true;
+    });
+
+    m_matched.clear();
+    for (auto id : m_uniqHits) {
+        for (auto i = m_byUniqBegin[id]; i != m_byUniqBegin[id + 1]; i++) {
+            const RouteId rid = m_byUniq[i];
+            if (m_seen[find( rid )->signaturePattern] == m_generation) m_matched.push_back( rid );
+        }
+    }
+
+    // handlers may add or remove routes
+    std::size_t delivered = 0;
+    for (auto rid : m_matched) {
+        if (deliver( rid, line )) delivered++;
+    }
+    return delivered;
+}
+
+bool SignatureRouter::deliver(SignatureRouter::RouteId id, std::string_view line)
+{
+    Route *r = find( id );
+    if (!r) return false;
+    // the route's slot may be reused by the handler
+    Handler handler = r->handler;
+    handler( id, line );
+    return true;
+}
+
+
+// SignatureRouter:: private methods
+
+SignatureRouter::Route *SignatureRouter::find(SignatureRouter::RouteId id)
+{
+    const unsigned int index = id & RouteIndexMask;
+    if (id == BadRouteId || index >= m_routes.size() || m_routes[index].id != id) return nullptr;
+    return &m_routes[index];
+}
+
+// Equal strings share a pattern: a run of them in sorted order gets one
+void SignatureRouter::rebuild()
+{
+    m_keys.clear();
+    for (unsigned int i = 0; i < m_routes.size(); i++) {
+        if (m_routes[i].id == BadRouteId) continue;
+        m_keys.emplace_back( m_routes[i].uniq, 2 * i );
+        m_keys.emplace_back( m_routes[i].signature, 2 * i + 1 );
+    }
+    std::sort( m_keys.begin(), m_keys.end() );
+    m_matcher.clear();
+    AhoCorasick::PatternId id = 0;
+    for (std::size_t k = 0; k < m_keys.size(); k++) {
+        if (k == 0 || m_keys[k].first != m_keys[k - 1].first) id = m_matcher.add( m_keys[k].first );
+        Route &r = m_routes[m_keys[k].second / 2];
+        (m_keys[k].second % 2 ? r.signaturePattern : r.uniqPattern) = id;
+    }
+    m_matcher.compile();
+
+    // counted, then filled in slot order with m_seen as the cursors
+    const std::size_t patterns = m_matcher.patternCount();
+    m_byUniqBegin.assign( patterns + 1, 0 );
+    for (auto &r : m_routes) {
+        if (r.id != BadRouteId) m_byUniqBegin[r.uniqPattern + 1]++;
+    }
+    for (std::size_t p = 0; p < patterns; p++) m_byUniqBegin[p + 1] += m_byUniqBegin[p];
+    m_byUniq.resize( m_byUniqBegin[patterns] );
+    m_seen.assign( m_byUniqBegin.begin(), m_byUniqBegin.end() - 1 );
+    for (auto &r : m_routes) {
+        if (r.id != BadRouteId) m_byUniq[m_seen[r.uniqPattern]++] = r.id;
+    }
+    m_seen.assign( patterns, 0 );
+    m_generation = 0;
+    m_dirty = false;
+}
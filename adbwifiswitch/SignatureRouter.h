@@ -0,0 +1,64 @@
+#ifndef SIGNATUREROUTER_H
+#define SIGNATUREROUTER_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "AhoCorasick.h"
+
+// Routes agent log lines to the operations waiting for them. A route matches
+// when both its uniq tag and its signature occur in the line; all routes are
+// checked with one automaton pass per line.
+class SignatureRouter {
+public:
+    typedef unsigned int RouteId;
+    typedef std::function<void(RouteId, std::string_view)> Handler;
+    static const RouteId BadRouteId = 0;
+
+    RouteId addRoute(std::string_view uniq, std::string_view signature, Handler handler);
+    bool removeRoute(RouteId id);
+    bool empty() const {return m_size == 0;}
+    std::size_t size() const {return m_size;}
+
+    // returns number of routes the line was delivered to
+    std::size_t dispatch(std::string_view line);
+    // hands the line to one route without matching
+    bool deliver(RouteId id, std::string_view line);
+
+private:
+    // Slots are reused along with their strings' storage. An id is the slot
+    // index with the slot's generation above it
+    struct Route {
+        std::string uniq;
+        std::string signature;
+        Handler handler;
+        RouteId id = BadRouteId;    // BadRouteId while free
+        unsigned int generation = 0;
+        AhoCorasick::PatternId uniqPattern = 0;
+        AhoCorasick::PatternId signaturePattern = 0;
+    };
+
+    Route *find(RouteId id);
+    void rebuild();
+
+    std::vector<Route> m_routes;
+    std::vector<unsigned int> m_freeRoutes;
+    std::size_t m_size = 0;
+    AhoCorasick m_matcher;
+    // routes by uniq pattern p: m_byUniq[m_byUniqBegin[p] .. m_byUniqBegin[p + 1])
+    std::vector<unsigned int> m_byUniqBegin;
+    std::vector<RouteId> m_byUniq;
+    // rebuild() scratch: the routes' strings sorted, a route's slot * 2 + 1
+    // for its signature
+    std::vector<std::pair<std::string_view, unsigned int> > m_keys;
+    std::vector<unsigned int> m_seen;
+    std::vector<AhoCorasick::PatternId> m_uniqHits;
+    std::vector<RouteId> m_matched;
+    unsigned int m_generation = 0;
+    bool m_dirty = false;
+};
+
+#endif // SIGNATUREROUTER_H
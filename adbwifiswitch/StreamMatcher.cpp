@@ -0,0 +1,413 @@
+#include <algorithm>
+#include <cctype>
+#include <map>
+
+#include "StreamMatcher.h"
+
+namespace {
+enum {
+    MaxDfaStates = 4096,
+    MaxLineSize = 64*1024,
+    MaxSkipTables = 64,
+    MinSkipLoops = 192,
+};
+} // namespace anonymous
+
+
+// Recursive descent over the regex, builds Thompson fragments
+class StreamPatterns::RegexParser {
+public:
+    RegexParser(StreamPatterns &owner, std::string_view re) : m_owner(owner), m_re(re) {}
+
+    bool parse(Fragment &frag, bool &anchored, bool &eol);
+
+private:
+    typedef std::array<bool, 256> ByteSet;
+
+    bool alternation(Fragment &frag);
+    bool concatenation(Fragment &frag);
+    bool repetition(Fragment &frag);
+    bool atom(Fragment &frag);
+    bool bracket(ByteSet &set);
+    bool escape(ByteSet &set);
+    Fragment bytes(const ByteSet &set);
+    bool atEnd() const {return m_pos >= m_re.size();}
+    char peek() const {return m_re[m_pos];}
+
+    StreamPatterns &m_owner;
+    std::string_view m_re;
+    std::size_t m_pos = 0;
+};
+
+bool StreamPatterns::RegexParser::parse(StreamPatterns::Fragment &frag, bool &anchored, bool &eol)
+{
+    anchored = !m_re.empty() && m_re.front() == '^';
+    if (anchored) m_re.remove_prefix( 1 );
+    // "$" is an anchor unless escaped
+    std::size_t slashes = 0;
+    while (slashes + 1 < m_re.size() && m_re[m_re.size() - 2 - slashes] == '\\') slashes++;
+    eol = !m_re.empty() && m_re.back() == '$' && slashes % 2 == 0;
+    if (eol) m_re.remove_suffix( 1 );
+    return alternation( frag ) && atEnd();
+}
+
+bool StreamPatterns::RegexParser::alternation(StreamPatterns::Fragment &frag)
+{
+    if (!concatenation( frag )) return false;
+    while (!atEnd() && peek() == '|') {
+        m_pos++;
+        Fragment other;
+        if (!concatenation( other )) return false;
+        const int split = m_owner.addState( NfaState::Split );
+        m_owner.m_nfa[split].out = frag.start;
+        m_owner.m_nfa[split].out1 = other.start;
+        frag.start = split;
+        frag.outs.insert( frag.outs.end(), other.outs.begin(), other.outs.end() );
+    }
+    return true;
+}
+
+bool StreamPatterns::RegexParser::concatenation(StreamPatterns::Fragment &frag)
+{
+    // an empty branch matches the empty string
+    frag.start = m_owner.addState( NfaState::Split );
+    frag.outs.assign( 1, std::make_pair( frag.start, 0 ) );
+    bool first = true;
+    while (!atEnd() && peek() != '|' && peek() != ')') {
+        Fragment next;
+        if (!repetition( next )) return false;
+        if (first) {
+            frag = std::move(next);
+            first = false;
+        } else {
+            m_owner.patch( frag, next.start );
+            frag.outs = std::move(next.outs);
+        }
+    }
+    return true;
+}
+
+bool StreamPatterns::RegexParser::repetition(StreamPatterns::Fragment &frag)
+{
+    if (!atom( frag )) return false;
+    while (!atEnd() && (peek() == '*' || peek() == '+' || peek() == '?')) {
+        const char op = m_re[m_pos++];
+        const int split = m_owner.addState( NfaState::Split );
+        m_owner.m_nfa[split].out = frag.start;
+        if (op == '?') {
+            frag.start = split;
+            frag.outs.emplace_back( split, 1 );
+            continue;
+        }
+        m_owner.patch( frag, split );
+        frag.outs.assign( 1, std::make_pair( split, 1 ) );
+        if (op == '*') frag.start = split;
+    }
+    return true;
+}
+
+bool StreamPatterns::RegexParser::atom(StreamPatterns::Fragment &frag)
+{
+    ByteSet set = {};
+    const char c = m_re[m_pos++];
+    switch (c) {
+        case '(':
+            if (!alternation( frag ) || atEnd() || peek() != ')') return false;
+            m_pos++;
+            return true;
+        case '.':
+            set.fill( true );
+            break;
+        case '[':
+            if (!bracket( set )) return false;
+            break;
+        case '\\':
+            if (!escape( set )) return false;
+            break;
+        case '*': case '+': case '?': case ')': case '^': case '$':
+            return false;
+        default:
+            set[static_cast<unsigned char>( c )] = true;
+            break;
+    }
+    frag = bytes( set );
+    return true;
+}
+
+bool StreamPatterns::RegexParser::bracket(ByteSet &set)
+{
+    const bool negate = !atEnd() && peek() == '^';
+    if (negate) m_pos++;
+    bool first = true;
+    while (!atEnd() && (first || peek() != ']')) {
+        first = false;
+        ByteSet item = {};
+        unsigned char lo = static_cast<unsigned char>( m_re[m_pos++] );
+        if (lo == '\\') {
+            if (atEnd() || !escape( item )) return false;
+            for (std::size_t b = 0; b < set.size(); b++) set[b] = set[b] || item[b];
+            continue;
+        }
+        unsigned char hi = lo;
+        if (m_pos + 1 < m_re.size() && peek() == '-' && m_re[m_pos + 1] != ']') {
+            hi = static_cast<unsigned char>( m_re[m_pos + 1] );
+            m_pos += 2;
+            if (hi < lo) return false;
+        }
+        for (unsigned int b = lo; b <= hi; b++) set[b] = true;
+    }
+    if (atEnd()) return false;
+    m_pos++;
+    if (negate) {
+        for (auto &b : set) b = !b;
+    }
+    return true;
+}
+
+bool StreamPatterns::RegexParser::escape(ByteSet &set)
+{
+    if (atEnd()) return false;
+    const char c = m_re[m_pos++];
+    switch (c) {
+        case 'd':
+            for (unsigned int b = '0'; b <= '9'; b++) set[b] = true;
+            break;
+        case 's':
+            set[' '] = set['\t'] = true;
+            break;
+        case 'w':
+            for (unsigned int b = 0; b < set.size(); b++) set[b] = isalnum( static_cast<int>( b ) ) || b == '_';
+            break;
+        case 't':
+            set['\t'] = true;
+            break;
+        default:
+            set[static_cast<unsigned char>( c )] = true;
+            break;
+    }
+    return true;
+}
+
+StreamPatterns::Fragment StreamPatterns::RegexParser::bytes(const ByteSet &set)
+{
+    const int s = m_owner.addState( NfaState::Bytes, m_owner.addSet( set ) );
+    return Fragment{s, {std::make_pair( s, 0 )}};
+}
+
+
+// StreamPatterns class implementation
+
+StreamPatterns::PatternId StreamPatterns::addLiteral(std::string_view text)
+{
+    return text.empty() ? BadPatternId : addFragment( literal( text ), false, Accept::InLine );
+}
+
+StreamPatterns::PatternId StreamPatterns::addRegex(std::string_view regex)
+{
+    const std::size_t states = m_nfa.size(), sets = m_sets.size();
+    Fragment frag;
+    bool anchored, eol;
+    if (!RegexParser( *this, regex ).parse( frag, anchored, eol )) {
+        m_nfa.resize( states );
+        m_sets.resize( sets );
+        return BadPatternId;
+    }
+    return addFragment( frag, anchored, eol ? Accept::AtEol : Accept::InLine );
+}
+
+StreamPatterns::PatternId StreamPatterns::addPrompt(std::string_view text)
+{
+    return text.empty() ? BadPatternId : addFragment( literal( text ), false, Accept::AtEnd );
+}
+
+bool StreamPatterns::compile()
+{
+    // byte classes: bytes in the same sets take the same transitions
+    std::map<std::vector<bool>, std::uint8_t> classes;
+    std::vector<unsigned char> sample;
+    for (unsigned int b = 0; b < 256; b++) {
+        std::vector<bool> key( m_sets.size() );
+        for (std::size_t i = 0; i < m_sets.size(); i++) key[i] = m_sets[i][b];
+        auto it = classes.find( key );
+        if (it == classes.end()) {
+            it = classes.emplace( key, static_cast<std::uint8_t>( classes.size() ) ).first;
+            sample.push_back( static_cast<unsigned char>( b ) );
+        }
+        m_class[b] = it->second;
+    }
+    m_classCount = classes.size();
+    const std::size_t ncls = m_classCount;
+
+    // subset construction; any position may start a floating pattern
+    std::vector<unsigned int> mark( m_nfa.size(), 0 );
+    unsigned int gen = 0;
+    auto close = [&](const std::vector<int> &seeds) {
+        std::vector<int> ret;
+        ++gen;
+        for (int s : seeds) closure( s, ret, mark, gen );
+        for (int s : m_floating) closure( s, ret, mark, gen );
+        std::sort( ret.begin(), ret.end() );
+        return ret;
+    };
+
+    std::map<std::vector<int>, State> ids;
+    std::vector<std::vector<int> > dstates;
+    dstates.push_back( close( m_anchored ) );
+    ids.emplace( dstates.back(), 0 );
+    std::vector<State> next;
+    for (std::size_t k = 0; k < dstates.size(); k++) {
+        next.resize( (k + 1) * ncls );
+        for (std::size_t c = 0; c < ncls; c++) {
+            std::vector<int> seeds;
+            for (int s : dstates[k]) {
+                const NfaState &ns = m_nfa[s];
+                if (ns.type == NfaState::Bytes && m_sets[ns.arg][sample[c]]) seeds.push_back( ns.out );
+            }
+            auto target = close( seeds );
+            auto it = ids.find( target );
+            if (it == ids.end()) {
+                if (dstates.size() >= MaxDfaStates) return false;
+                it = ids.emplace( target, static_cast<State>( dstates.size() ) ).first;
+                dstates.push_back( std::move(target) );
+            }
+            next[k * ncls + c] = it->second;
+        }
+    }
+
+    m_hit.assign( dstates.size(), 0 );
+    m_eol.assign( dstates.size(), 0 );
+    m_end.assign( dstates.size(), 0 );
+    for (std::size_t k = 0; k < dstates.size(); k++) {
+        for (int s : dstates[k]) {
+            if (m_nfa[s].type != NfaState::Match) continue;
+            const PatternId id = m_nfa[s].arg;
+            const Mask bit = Mask(1) << id;
+            switch (m_accept[id]) {
+                case Accept::InLine: m_hit[k] |= bit; break;
+                case Accept::AtEol: m_eol[k] |= bit; break;
+                case Accept::AtEnd: m_end[k] |= bit; break;
+            }
+        }
+    }
+
+    // states looping on most bytes get a table of the bytes that leave
+    // them, the walk skips the rest without going through the transitions.
+    // With a single such byte memchr() does the skipping; '\r' only has to
+    // stop the walk for patterns anchored at the line end
+    const bool eol_anchors = std::find( m_accept.begin(), m_accept.end(), Accept::AtEol ) != m_accept.end();
+    m_skip.assign( dstates.size(), std::uint32_t(NoSkip) );
+    m_skipByte.assign( dstates.size(), -1 );
+    m_stops.clear();
+    for (std::size_t k = 0; k < dstates.size() && m_stops.size() < MaxSkipTables * 256; k++) {
+        std::array<std::uint8_t, 256> stop;
+        unsigned int loops = 0, exits = 0;
+        int exit = -1;
+        for (unsigned int b = 0; b < 256; b++) {
+            const bool leaves = b != '\n' && (next[k * ncls + m_class[b]] != k || (b == '\r' && eol_anchors));
+            stop[b] = leaves || b == '\n' || b == '\r';
+            loops += !stop[b];
+            if (leaves) {
+                exits++;
+                exit = static_cast<int>( b );
+            }
+        }
+        if (loops < MinSkipLoops) continue;
+        m_skip[k] = static_cast<std::uint32_t>( m_stops.size() );
+        m_stops.insert( m_stops.end(), stop.begin(), stop.end() );
+        if (exits == 1) m_skipByte[k] = static_cast<std::int16_t>( exit );
+    }
+    m_next.swap( next );
+    return true;
+}
+
+
+// StreamPatterns:: private members
+
+StreamPatterns::PatternId StreamPatterns::addFragment(const StreamPatterns::Fragment &frag, bool anchored,
+                                                      StreamPatterns::Accept accept)
+{
+    if (m_patterns >= MaxPatterns) return BadPatternId;
+    const PatternId id = static_cast<PatternId>( m_patterns++ );
+    patch( frag, addState( NfaState::Match, id ) );
+    (anchored ? m_anchored : m_floating).push_back( frag.start );
+    m_accept.push_back( accept );
+    m_next.clear();
+    return id;
+}
+
+StreamPatterns::Fragment StreamPatterns::literal(std::string_view text)
+{
+    Fragment frag{-1, {}};
+    for (unsigned char c : text) {
+        std::array<bool, 256> set = {};
+        set[c] = true;
+        const int s = addState( NfaState::Bytes, addSet( set ) );
+        if (frag.start < 0) frag.start = s; else patch( frag, s );
+        frag.outs.assign( 1, std::make_pair( s, 0 ) );
+    }
+    return frag;
+}
+
+int StreamPatterns::addState(StreamPatterns::NfaState::Type type, unsigned int arg)
+{
+    NfaState s;
+    s.type = type;
+    s.arg = arg;
+    m_nfa.push_back( s );
+    return static_cast<int>( m_nfa.size() - 1 );
+}
+
+unsigned int StreamPatterns::addSet(std::array<bool, 256> set)
+{
+    // lines never hold a line feed
+    set['\n'] = false;
+    auto it = std::find( m_sets.begin(), m_sets.end(), set );
+    if (it != m_sets.end()) return static_cast<unsigned int>( it - m_sets.begin() );
+    m_sets.push_back( set );
+    return static_cast<unsigned int>( m_sets.size() - 1 );
+}
+
+void StreamPatterns::patch(const StreamPatterns::Fragment &frag, int target)
+{
+    for (auto &o : frag.outs) (o.second ? m_nfa[o.first].out1 : m_nfa[o.first].out) = target;
+}
+
+void StreamPatterns::closure(int s, std::vector<int> &set, std::vector<unsigned int> &mark, unsigned int gen) const
+{
+    if (s < 0 || mark[s] == gen) return;
+    mark[s] = gen;
+    if (m_nfa[s].type == NfaState::Split) {
+        closure( m_nfa[s].out, set, mark, gen );
+        closure( m_nfa[s].out1, set, mark, gen );
+    } else {
+        set.push_back( s );
+    }
+}
+
+
+// StreamMatcher class implementation
+
+StreamMatcher::StreamMatcher(const StreamPatterns &patterns)
+    : m_patterns(patterns)
+{
+    reset();
+}
+
+void StreamMatcher::reset()
+{
+    m_partial.clear();
+    m_state = m_crState = 0;
+    m_hits = m_patterns.compiled() ? m_patterns.m_hit[0] : 0;
+}
+
+void StreamMatcher::keepPartial(const char *data, std::size_t size)
+{
+    if (m_partial.size() + size > MaxLineSize) {
+        // its start is lost, the rest is matched as a line of its own
+        m_partial.clear();
+        m_state = 0;
+        m_hits = m_patterns.m_hit[0];
+        return;
+    }
+    m_partial.append( data, size );
+}
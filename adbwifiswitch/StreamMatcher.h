@@ -0,0 +1,197 @@
+#ifndef STREAMMATCHER_H
+#define STREAMMATCHER_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class StreamMatcher;
+
+// Line oriented patterns for device output, compiled together into one DFA
+// over byte classes:
+//  - literal: the text anywhere in a line
+//  - regex: . [...] [^...] \c * + ? | ( ); ^ and $ anchor at line start & end
+//  - prompt: the text at the very end of the output so far, the device
+//    waits for input then
+// Lines end with '\n', a '\r' before it isn't part of the line.
+// Compiled patterns are read only, one set serves any number of matchers.
+class StreamPatterns {
+public:
+    typedef unsigned int PatternId;
+    static const PatternId BadPatternId = ~0u;
+    static const std::size_t MaxPatterns = 64;
+
+    PatternId addLiteral(std::string_view text);
+    // BadPatternId on a syntax error
+    PatternId addRegex(std::string_view regex);
+    PatternId addPrompt(std::string_view text);
+    // false when the automaton gets too big
+    bool compile();
+    bool compiled() const {return !m_next.empty();}
+    std::size_t patternCount() const {return m_patterns;}
+    std::size_t stateCount() const {return m_hit.size();}
+
+private:
+    friend class StreamMatcher;
+    typedef std::uint32_t State;
+    typedef std::uint64_t Mask;
+    static const std::uint32_t NoSkip = ~0u;
+
+    enum class Accept {
+        InLine, AtEol, AtEnd
+    };
+
+    struct NfaState {
+        enum Type {Bytes, Split, Match} type;
+        int out = -1;
+        int out1 = -1;
+        unsigned int arg = 0; // byte set or pattern id
+    };
+
+    // Thompson fragment: start state and dangling outs (state, which)
+    struct Fragment {
+        int start;
+        std::vector<std::pair<int, int> > outs;
+    };
+
+    class RegexParser;
+
+    PatternId addFragment(const Fragment &frag, bool anchored, Accept accept);
+    Fragment literal(std::string_view text);
+    int addState(NfaState::Type type, unsigned int arg = 0);
+    unsigned int addSet(std::array<bool, 256> set);
+    void patch(const Fragment &frag, int target);
+    void closure(int s, std::vector<int> &set, std::vector<unsigned int> &mark, unsigned int gen) const;
+
+    std::vector<NfaState> m_nfa;
+    std::vector<std::array<bool, 256> > m_sets;
+    std::vector<int> m_anchored;
+    std::vector<int> m_floating;
+    std::vector<Accept> m_accept;
+    std::size_t m_patterns = 0;
+
+    std::array<std::uint8_t, 256> m_class = {};
+    std::size_t m_classCount = 1;
+    std::vector<State> m_next;
+    std::vector<Mask> m_hit;    // pattern seen in the line so far
+    std::vector<Mask> m_eol;    // pattern done if the line ends here
+    std::vector<Mask> m_end;    // prompt done if the output ends here
+    std::vector<std::uint32_t> m_skip;  // offset in m_stops or NoSkip
+    std::vector<std::uint8_t> m_stops;  // 256 per table, 1 for bytes leaving the state
+    std::vector<std::int16_t> m_skipByte;   // the only byte leaving it or -1
+};
+
+// Match state of one stream. Chunks are fed as they come, the state is kept
+// across them, so no byte is scanned twice; only an unfinished line is kept
+// to hand it over whole later.
+class StreamMatcher {
+public:
+    explicit StreamMatcher(const StreamPatterns &patterns);
+
+    void reset();
+
+    // proc(PatternId, std::string_view line) is called for each pattern
+    // matching a finished line, or the unfinished one for prompts. Feeding
+    // stops after the line if proc returns false; returns the bytes used,
+    // what follows that line is left for the next call
+    template <typename Proc>
+    std::size_t feed(const char *input, std::size_t size, Proc &&proc);
+
+private:
+    typedef StreamPatterns::State State;
+    typedef StreamPatterns::Mask Mask;
+
+    template <typename Proc>
+    static bool report(Mask matched, std::string_view line, Proc &proc);
+    void keepPartial(const char *data, std::size_t size);
+
+    const StreamPatterns &m_patterns;
+    std::string m_partial;
+    State m_state = 0;
+    State m_crState = 0;
+    Mask m_hits = 0;
+};
+
+template <typename Proc>
+bool StreamMatcher::report(StreamMatcher::Mask matched, std::string_view line, Proc &proc)
+{
+    for (; matched; matched &= matched - 1) {
+        if (!proc( static_cast<StreamPatterns::PatternId>( __builtin_ctzll( matched ) ), line )) return false;
+    }
+    return true;
+}
+
+template <typename Proc>
+std::size_t StreamMatcher::feed(const char *input, std::size_t size, Proc &&proc)
+{
+    const StreamPatterns &p = m_patterns;
+    if (!p.compiled()) return size;
+    // the walk runs on locals, stores to members would force reloads
+    const State *next = p.m_next.data();
+    const Mask *hit = p.m_hit.data();
+    const std::uint8_t *cls = p.m_class.data();
+    const std::uint32_t *skip = p.m_skip.data();
+    const std::uint8_t *stops = p.m_stops.data();
+    const std::int16_t *skip_byte = p.m_skipByte.data();
+    const std::size_t ncls = p.m_classCount;
+    State state = m_state, cr_state = m_crState;
+    Mask hits = m_hits;
+    std::size_t begin = 0, eol = 0;
+    for (std::size_t i = 0; i < size; i++) {
+        const unsigned char c = static_cast<unsigned char>( input[i] );
+        if (c != '\n') {
+            if (c == '\r') cr_state = state;
+            state = next[state * ncls + cls[c]];
+            hits |= hit[state];
+            if (skip[state] == StreamPatterns::NoSkip) continue;
+            if (skip_byte[state] >= 0) {
+                if (eol <= i) {
+                    const void *nl = memchr( input + i + 1, '\n', size - i - 1 );
+                    eol = nl ? static_cast<std::size_t>( static_cast<const char *>( nl ) - input ) : size;
+                }
+                const void *stop = memchr( input + i + 1, skip_byte[state], eol - i - 1 );
+                i = (stop ? static_cast<std::size_t>( static_cast<const char *>( stop ) - input ) : eol) - 1;
+            } else {
+                const std::uint8_t *stop = stops + skip[state];
+                while (i + 1 < size && !stop[static_cast<unsigned char>( input[i + 1] )]) i++;
+            }
+            continue;
+        }
+
+        std::string_view line( input + begin, i - begin );
+        if (!m_partial.empty()) {
+            m_partial.append( line );
+            line = m_partial;
+        }
+        State last = state;
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix( 1 );
+            last = cr_state;
+        }
+        const Mask matched = hits | p.m_eol[last];
+        state = 0;
+        hits = hit[0];
+        begin = i + 1;
+        const bool go_on = !matched || report( matched, line, proc );
+        m_partial.clear();
+        if (!go_on) {
+            m_state = state;
+            m_hits = hits;
+            return begin;
+        }
+    }
+    m_state = state;
+    m_crState = cr_state;
+    m_hits = hits;
+    if (begin < size) {
+        keepPartial( input + begin, size - begin );
+        const Mask prompts = p.m_end[state];
+        if (prompts) report( prompts, m_partial, proc );
+    }
+    return size;
+}
+
+#endif // STREAMMATCHER_H
@@ -0,0 +1,251 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+#include "Bench.h"
+
+namespace {
+enum {
+    MaxIterations = 1000000000,
+    CorpusLines = 20000,
+};
+
+std::string jsonEscape(const std::string &s)
+{
+    std::string ret;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            ret.push_back( '\\' );
+            ret.push_back( c );
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf( buf, sizeof(buf), "\\u%04x", c );
+            ret.append( buf );
+        } else {
+            ret.push_back( c );
+        }
+    }
+    return ret;
+}
+
+class StateDir {
+public:
+    StateDir() {
+        char tmpl[] = "/tmp/adbwifiswitch-bench-XXXXXX";
+        if (mkdtemp( tmpl )) path = tmpl;
+    }
+    ~StateDir() {
+        if (path.empty()) return;
+        // forwards left running would serve from the removed directory
+        setenv( "FAKEADB_STATE_DIR", path.c_str(), 1 );
+        unsetenv( "ANDROID_ADB_SERVER_PORT" );
+        benchKillFakeAdb();
+        std::error_code ec;
+        std::filesystem::remove_all( path, ec );
+    }
+
+    std::string path;
+};
+} // namespace anonymous
+
+
+// BenchState class implementation
+
+BenchState::BenchState(std::uint64_t iterations)
+    : m_iterations(iterations), m_left(iterations)
+{
+}
+
+bool BenchState::next()
+{
+    if (!m_running && m_left == m_iterations && m_skipReason.empty()) {
+        m_running = true;
+        m_start = Clock::now();
+    }
+    if (m_left == 0) {
+        pauseTiming();
+        return false;
+    }
+    m_left--;
+    return true;
+}
+
+void BenchState::pauseTiming()
+{
+    if (!m_running) return;
+    m_elapsed += Clock::now() - m_start;
+    m_running = false;
+}
+
+void BenchState::resumeTiming()
+{
+    if (m_running) return;
+    m_running = true;
+    m_start = Clock::now();
+}
+
+
+// Bench class implementation
+
+bool Bench::add(const std::string &name, Function fn, std::uint64_t iterations)
+{
+    registry().push_back( Entry{name, std::move(fn), iterations} );
+    return true;
+}
+
+const Bench::Options &Bench::options()
+{
+    return mutableOptions();
+}
+
+int Bench::runAll(const Options &opt, std::ostream &json)
+{
+    mutableOptions() = opt;
+
+    auto entries = registry();
+    std::sort( entries.begin(), entries.end(),
+               [](const Entry &a, const Entry &b) {return a.name < b.name;} );
+
+    json << "{\n  \"context\": {\"cpus\": " << sysconf( _SC_NPROCESSORS_ONLN )
+         << ", \"min_time_ms\": " << opt.minTime.count()
+#ifdef NDEBUG
+         << ", \"assertions\": false"
+#else
+         << ", \"assertions\": true"
+#endif
+         << "},\n  \"benchmarks\": [";
+
+    bool first = true, failed = false;
+    for (auto &e : entries) {
+        if (!opt.filter.empty() && e.name.find( opt.filter ) == std::string::npos) continue;
+
+        std::uint64_t iterations = e.iterations ? e.iterations : 1;
+        BenchState state( iterations );
+        while (1) {
+            state = BenchState( iterations );
+            e.fn( state );
+            if (e.iterations || !state.skipReason().empty()) break;
+            const auto elapsed = state.elapsed();
+            if (elapsed >= opt.minTime || iterations >= MaxIterations) break;
+            const double scale = elapsed.count() > 0 ?
+                        1.4 * std::chrono::duration<double>( opt.minTime ).count() /
+                        std::chrono::duration<double>( elapsed ).count() : 10.0;
+            iterations = std::min<std::uint64_t>( MaxIterations,
+                             std::max<std::uint64_t>( iterations * 2,
+                                 static_cast<std::uint64_t>( static_cast<double>( iterations ) * std::min( scale, 100.0 ) ) ) );
+        }
+
+        const double ns = static_cast<double>( state.elapsed().count() );
+        const double secs = ns / 1e9;
+        json << (first ? "\n" : ",\n") << "    {\"name\": \"" << jsonEscape( e.name ) << "\"";
+        first = false;
+        if (!state.skipReason().empty()) {
+            json << ", \"skipped\": \"" << jsonEscape( state.skipReason() ) << "\"}";
+            fprintf(stderr, "%-48s skipped: %s\n", e.name.c_str(), state.skipReason().c_str());
+            continue;
+        }
+        json << std::fixed << std::setprecision(1)
+             << ", \"iterations\": " << state.iterations()
+             << ", \"real_time_ns\": " << ns
+             << ", \"ns_per_op\": " << ns / static_cast<double>( state.iterations() );
+        if (state.bytesProcessed() && secs > 0)
+            json << ", \"bytes_per_second\": " << static_cast<double>( state.bytesProcessed() ) / secs;
+        if (state.itemsProcessed() && secs > 0)
+            json << ", \"items_per_second\": " << static_cast<double>( state.itemsProcessed() ) / secs;
+        json << ", \"counters\": {";
+        bool cfirst = true;
+        for (auto &c : state.counters()) {
+            json << (cfirst ? "" : ", ") << "\"" << jsonEscape( c.first ) << "\": " << std::setprecision(3) << c.second;
+            cfirst = false;
+        }
+        json << "}";
+        if (!state.failReason().empty()) json << ", \"error\": \"" << jsonEscape( state.failReason() ) << "\"";
+        json << "}" << std::defaultfloat;
+        fprintf(stderr, "%-48s %14.1f ns/op %10llu iterations\n", e.name.c_str(),
+                ns / static_cast<double>( state.iterations() ),
+                static_cast<unsigned long long>( state.iterations() ));
+        if (!state.failReason().empty()) {
+            fprintf(stderr, "%-48s FAILED: %s\n", e.name.c_str(), state.failReason().c_str());
+            failed = true;
+        }
+    }
+    json << "\n  ]\n}\n";
+    return failed ? 1 : 0;
+}
+
+std::vector<Bench::Entry> &Bench::registry()
+{
+    static std::vector<Entry> inst;
+    return inst;
+}
+
+Bench::Options &Bench::mutableOptions()
+{
+    static Options inst;
+    return inst;
+}
+
+
+const std::string &benchStateDir()
+{
+    static StateDir dir;
+    return dir.path;
+}
+
+void benchKillFakeAdb()
+{
+    const std::string &fakeAdb = Bench::options().fakeAdb;
+    if (fakeAdb.empty()) return;
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl( fakeAdb.c_str(), fakeAdb.c_str(), "kill-server", nullptr );
+        _exit( 127 );
+    }
+    if (pid > 0) waitpid( pid, nullptr, 0 );
+}
+
+const std::string &benchLogcatCorpus()
+{
+    static std::string corpus;
+    if (!corpus.empty()) return corpus;
+
+    const std::string &file = Bench::options().logcatFile;
+    if (!file.empty()) {
+        std::ifstream is( file, std::ios::binary );
+        std::stringstream ss;
+        ss << is.rdbuf();
+        corpus = ss.str();
+        if (!corpus.empty()) return corpus;
+        fprintf(stderr, "Can't read %s, using synthetic logcat\n", file.c_str());
+    }
+
+    static const char * const Tags[] = {"ActivityManager", "WifiStateMachine", "chatty",
+                                        "SurfaceFlinger", "NetworkMonitor", "BatteryService"};
+    std::ostringstream os;
+    unsigned int seed = 1;
+    for (int i = 0; i < CorpusLines; i++) {
+        seed = seed * 1103515245u + 12345u;
+        const int pid = 1000 + static_cast<int>( (seed >> 8) % 9000 );
+        char head[64];
+        snprintf( head, sizeof(head), "10-19 12:%02d:%02d.%03d %5d %5d %c ",
+                  (i / 60000) % 60, (i / 1000) % 60, i % 1000, pid, pid + i % 7, "VDIW"[i % 4] );
+        os << head;
+        if (i % 100 == 50) {
+            os << "adbjoinwifi: " << (seed % 100000) << " Joining, network id=" << (i % 10);
+        } else {
+            os << Tags[i % 6] << ": Background concurrent copying GC freed " << seed % 100000
+               << "(1024KB) AllocSpace objects, 0(0B) LOS objects, 49% free #" << i;
+        }
+        os << "\r\n";
+    }
+    corpus = os.str();
+    return corpus;
+}
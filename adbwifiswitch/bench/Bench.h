@@ -0,0 +1,94 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class BenchState {
+public:
+    BenchState(std::uint64_t iterations);
+
+    bool next();
+    void pauseTiming();
+    void resumeTiming();
+
+    void setBytesProcessed(std::uint64_t bytes) {m_bytes = bytes;}
+    void setItemsProcessed(std::uint64_t items) {m_items = items;}
+    void setCounter(const std::string &name, double value) {m_counters[name] = value;}
+    void skip(const std::string &reason) {m_skipReason = reason; m_left = 0;}
+    // the run is reported and the bench exits with an error
+    void fail(const std::string &reason) {m_failReason = reason;}
+
+    std::uint64_t iterations() const {return m_iterations;}
+    std::uint64_t bytesProcessed() const {return m_bytes;}
+    std::uint64_t itemsProcessed() const {return m_items;}
+    const std::map<std::string, double> &counters() const {return m_counters;}
+    std::chrono::nanoseconds elapsed() const {return m_elapsed;}
+    const std::string &skipReason() const {return m_skipReason;}
+    const std::string &failReason() const {return m_failReason;}
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::uint64_t m_iterations;
+    std::uint64_t m_left;
+    std::uint64_t m_bytes = 0;
+    std::uint64_t m_items = 0;
+    std::map<std::string, double> m_counters;
+    std::string m_skipReason;
+    std::string m_failReason;
+    Clock::time_point m_start;
+    std::chrono::nanoseconds m_elapsed = std::chrono::nanoseconds::zero();
+    bool m_running = false;
+};
+
+class Bench {
+public:
+    typedef std::function<void(BenchState &)> Function;
+
+    struct Options {
+        std::chrono::milliseconds minTime = std::chrono::milliseconds(200);
+        std::string filter;
+        std::string logcatFile;
+        std::string fakeAdb;
+    };
+
+    // Registers a benchmark. Zero iterations means calibrate to Options::minTime.
+    static bool add(const std::string &name, Function fn, std::uint64_t iterations = 0);
+    static const Options &options();
+    static int runAll(const Options &opt, std::ostream &json);
+
+private:
+    struct Entry {
+        std::string name;
+        Function fn;
+        std::uint64_t iterations;
+    };
+
+    static std::vector<Entry> &registry();
+    static Options &mutableOptions();
+};
+
+#define BENCH_CONCAT2(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT2(a, b)
+#define BENCHMARK(name, ...) \
+    static const bool BENCH_CONCAT(benchReg_, __LINE__) = Bench::add( (name), __VA_ARGS__ )
+
+// Recorded or synthetic logcat text used by the parser benchmarks
+const std::string &benchLogcatCorpus();
+
+// This run's FAKEADB_STATE_DIR, empty if it can't be made. At exit fakeadb's
+// daemons of the run are stopped and the directory is removed
+const std::string &benchStateDir();
+
+// fakeadb kill-server for the state dir & server port in the environment
+void benchKillFakeAdb();
+
+// heap allocations of the calling thread so far
+std::uint64_t benchAllocations();
+
+#endif // BENCH_H
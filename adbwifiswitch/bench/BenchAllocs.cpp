@@ -0,0 +1,47 @@
+#include <cstdlib>
+#include <new>
+
+#include "Bench.h"
+
+// The bench binary's own operator new, it counts the allocations per thread
+
+namespace {
+thread_local std::uint64_t t_allocations = 0;
+} // namespace anonymous
+
+std::uint64_t benchAllocations()
+{
+    return t_allocations;
+}
+
+void *operator new(std::size_t size)
+{
+    t_allocations++;
+    if (void *ptr = std::malloc( size ? size : 1 )) return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new( size );
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    std::free( ptr );
+}
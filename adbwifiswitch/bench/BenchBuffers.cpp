@@ -0,0 +1,46 @@
+#include <cstring>
+#include <vector>
+
+#include "Bench.h"
+#include "Buffers.h"
+
+namespace {
+
+enum {
+    LineTail = 100,
+};
+
+// Same pattern as AdbController::FHCommon::Read() followed by a parser that
+// leaves an incomplete line in the buffer
+void readCut(BenchState &state, std::size_t chunk)
+{
+    std::vector<char> src( chunk, 'a' );
+    ReadBuffer buf;
+    while (state.next()) {
+        if (buf.restSize() < chunk) buf.reserve( chunk, true );
+        memcpy( buf.readPtr(), src.data(), chunk );
+        buf.addFilled( chunk );
+        const std::size_t filled = buf.filledSize();
+        buf.cut( filled > LineTail ? filled - LineTail : 0 );
+    }
+    state.setBytesProcessed( state.iterations() * chunk );
+}
+
+void appendPush(BenchState &state, std::size_t chunk)
+{
+    std::vector<char> src( chunk, 'a' );
+    WriteBuffer buf;
+    while (state.next()) {
+        buf.append( src.data(), chunk, true );
+        buf.pushHead( buf.size() / 2 + 1 );
+    }
+    state.setBytesProcessed( state.iterations() * chunk );
+}
+
+}
+
+BENCHMARK("buffers/read_cut/512", [](BenchState &s) {readCut( s, 512 );});
+BENCHMARK("buffers/read_cut/4096", [](BenchState &s) {readCut( s, 4096 );});
+BENCHMARK("buffers/read_cut/65536", [](BenchState &s) {readCut( s, 65536 );});
+BENCHMARK("buffers/write_append_push/64", [](BenchState &s) {appendPush( s, 64 );});
+BENCHMARK("buffers/write_append_push/4096", [](BenchState &s) {appendPush( s, 4096 );});
@@ -0,0 +1,271 @@
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include "AdbContext.h"
+#include "AdbTask.h"
+#include "Bench.h"
+#include "Buffers.h"
+#include "Config.h"
+#include "SignatureRouter.h"
+#include "StreamMatcher.h"
+
+namespace {
+
+class NullContext : public AdbContext {
+public:
+    using AdbContext::AdbContext;
+
+    virtual bool startAdb(const std::list<std::string> &) override {return true;}
+    virtual void stopAdb() override {}
+    virtual bool writeStdIn(const void *, std::size_t) override {return true;}
+    virtual bool timerCtl(FStream, unsigned int, bool, std::chrono::milliseconds) override {return true;}
+};
+
+std::shared_ptr<AdbContext> makeContext(const char *logcatFormat = "text")
+{
+    auto cfg = std::make_shared<Config>( Config::Builder().setSsid( "bench" )
+                                                          .setLogcatFormat( logcatFormat ).build() );
+    return std::make_shared<NullContext>( cfg );
+}
+
+// The text corpus as "logcat -B" would send it: logger_entry v4 records
+const std::string &binaryCorpus(std::size_t &entries)
+{
+    static std::string corpus;
+    static std::size_t count = 0;
+    entries = count;
+    if (!corpus.empty()) return corpus;
+
+    std::string_view text( benchLogcatCorpus() );
+    std::size_t pos;
+    while ((pos = text.find( '\n' )) != std::string_view::npos) {
+        std::string_view line( text.substr( 0, pos ) );
+        text.remove_prefix( pos + 1 );
+        if (!line.empty() && line.back() == '\r') line.remove_suffix( 1 );
+        // MM-DD HH:MM:SS.mmm pid tid P tag: message
+        const auto tag_pos = line.find_first_not_of( ' ', 33 );
+        const auto colon = line.find( ": ", tag_pos );
+        if (line.size() < 34 || tag_pos == std::string_view::npos || colon == std::string_view::npos) continue;
+        std::string_view tag( line.substr( tag_pos, colon - tag_pos ) );
+        while (!tag.empty() && tag.back() == ' ') tag.remove_suffix( 1 );
+        std::string_view msg( line.substr( colon + 2 ) );
+
+        const std::uint16_t len = static_cast<std::uint16_t>( tag.size() + msg.size() + 3 );
+        const std::uint16_t hdr_size = 28;
+        const std::uint32_t fields[6] = {4321, 4321, 1600000000, 0, 0, 10000};
+        corpus.append( reinterpret_cast<const char *>( &len ), sizeof(len) );
+        corpus.append( reinterpret_cast<const char *>( &hdr_size ), sizeof(hdr_size) );
+        corpus.append( reinterpret_cast<const char *>( fields ), sizeof(fields) );
+        corpus.push_back( 4 );
+        corpus.append( tag.data(), tag.size() ).push_back( 0 );
+        corpus.append( msg.data(), msg.size() ).push_back( 0 );
+        count++;
+    }
+    entries = count;
+    return corpus;
+}
+
+// Feeds a corpus through AdbTaskWaitConnectLog the way FHCommon does:
+// read chunks are appended to a ReadBuffer, consumed bytes are cut off
+void feedTask(BenchState &state, AdbTaskWaitConnectLog &task, const std::string &corpus,
+              std::size_t items, std::size_t chunk)
+{
+    ReadBuffer buf;
+
+    while (state.next()) {
+        for (std::size_t pos = 0; pos < corpus.size(); pos += chunk) {
+            const std::size_t sz = std::min( chunk, corpus.size() - pos );
+            if (buf.restSize() < sz) buf.reserve( sz, true );
+            memcpy( buf.readPtr(), corpus.data() + pos, sz );
+            buf.addFilled( sz );
+            std::size_t used = buf.filledSize();
+            if (task.onDataReady( AdbContext::FStream::fsStdOut, buf.head(), used ) != AdbTask::Res::Continue) {
+                return state.skip( "corpus contains the connect signature" );
+            }
+            buf.cut( used );
+        }
+        buf.cut();
+    }
+    state.setBytesProcessed( state.iterations() * corpus.size() );
+    state.setItemsProcessed( state.iterations() * items );
+}
+
+void lookupTag(BenchState &state, std::size_t chunk)
+{
+    const std::string &corpus = benchLogcatCorpus();
+    auto ctx = makeContext();
+    AdbTaskWaitConnectLog task( ctx );
+    std::size_t lines = 0;
+    for (char c : corpus) if (c == '\n') lines++;
+    feedTask( state, task, corpus, lines, chunk );
+}
+
+// Same corpus in binary form, entries of other tags are skipped by header
+void lookupEntries(BenchState &state, std::size_t chunk)
+{
+    std::size_t entries;
+    const std::string &corpus = binaryCorpus( entries );
+    auto ctx = makeContext( "binary" );
+    AdbTaskWaitConnectLog task( ctx );
+    task.start();
+    feedTask( state, task, corpus, entries, chunk );
+}
+
+std::vector<std::string> tagLines(std::size_t routes)
+{
+    std::vector<std::string> lines;
+    for (std::size_t i = 0; i < 64; i++) {
+        lines.push_back( "10-19 12:00:00.000  4321  4321 W adbjoinwifi: " + std::to_string( 100000 + (i * 7919) % routes ) +
+                         (i % 2 ? " Mode connect run completed home" : " Joining, network id=3") );
+    }
+    return lines;
+}
+
+// N pending operations on one stream: one automaton pass per tag line
+void signatureRouter(BenchState &state, std::size_t routes)
+{
+    SignatureRouter router;
+    std::size_t hits = 0;
+    for (std::size_t i = 0; i < routes; i++) {
+        router.addRoute( std::to_string( 100000 + i ), "Mode connect run completed",
+                         [&hits](SignatureRouter::RouteId, std::string_view) {hits++;} );
+    }
+    const auto lines = tagLines( routes );
+    while (state.next()) {
+        for (auto &l : lines) router.dispatch( l );
+    }
+    state.setItemsProcessed( state.iterations() * lines.size() );
+    state.setCounter( "hits_per_pass", static_cast<double>( hits ) / static_cast<double>( state.iterations() ) );
+}
+
+// Same work done the AdbTaskWaitConnectLog::onTagLine way: two find() per operation
+void naiveFind(BenchState &state, std::size_t routes)
+{
+    std::vector<std::string> uniq;
+    for (std::size_t i = 0; i < routes; i++) uniq.push_back( std::to_string( 100000 + i ) );
+    const auto lines = tagLines( routes );
+    std::size_t hits = 0;
+    while (state.next()) {
+        for (auto &l : lines) {
+            std::string_view line( l );
+            for (auto &u : uniq) {
+                if (line.find( u ) != std::string_view::npos &&
+                        line.find( "Mode connect run completed" ) != std::string_view::npos) hits++;
+            }
+        }
+    }
+    state.setItemsProcessed( state.iterations() * lines.size() );
+    state.setCounter( "hits_per_pass", static_cast<double>( hits ) / static_cast<double>( state.iterations() ) );
+}
+
+
+const char *const MatcherWords[] = {"adbjoinwifi", "Broadcasting:", "ActivityManager", "WifiService",
+                                    "wpa_supplicant", "Displayed", "CONNECTED", "exited"};
+
+// N patterns over the text corpus in one pass, whatever the chunking
+void streamMatcher(BenchState &state, std::size_t patterns, std::size_t chunk)
+{
+    StreamPatterns p;
+    for (std::size_t i = 0; i < patterns; i++) p.addLiteral( MatcherWords[i] );
+    p.compile();
+    StreamMatcher matcher( p );
+    const std::string &corpus = benchLogcatCorpus();
+    std::size_t hits = 0;
+    while (state.next()) {
+        for (std::size_t pos = 0; pos < corpus.size(); pos += chunk) {
+            matcher.feed( corpus.data() + pos, std::min( chunk, corpus.size() - pos ),
+                          [&hits](StreamPatterns::PatternId, std::string_view) {return ++hits != 0;} );
+        }
+    }
+    state.setBytesProcessed( state.iterations() * corpus.size() );
+    state.setCounter( "states", static_cast<double>( p.stateCount() ) );
+    state.setCounter( "hits_per_pass", static_cast<double>( hits ) / static_cast<double>( state.iterations() ) );
+}
+
+// A flow's command answer is the logcat corpus, collected from adb's
+// stdout chunk by chunk: one frame from the pool and one resume per pass
+class OutputFlow : public AdbTaskFlow {
+public:
+    using AdbTaskFlow::AdbTaskFlow;
+    virtual const char *name() const override {return "bench-output";}
+
+    std::size_t size = 0;
+
+private:
+    virtual Flow<Res> run() override
+    {
+        std::list<std::string> args;
+        args.emplace_back( "logcat" );
+        args.emplace_back( "-d" );
+        if (!co_await command( args )) co_return Fail;
+        const auto answer = co_await output();
+        if (!answer) co_return Fail;
+        size = answer->size();
+        co_return Next;
+    }
+};
+
+void flowOutput(BenchState &state, std::size_t chunk)
+{
+    auto ctx = makeContext();
+    const std::string &corpus = benchLogcatCorpus();
+    std::size_t failed = 0;
+    while (state.next()) {
+        OutputFlow task( ctx );
+        task.start();
+        AdbTask::Res res = AdbTask::Res::Continue;
+        for (std::size_t pos = 0; pos < corpus.size(); pos += chunk) {
+            std::size_t size = std::min( chunk, corpus.size() - pos );
+            res = task.onDataReady( AdbContext::FStream::fsStdOut, corpus.data() + pos, size );
+        }
+        std::size_t end = 0;
+        res = task.onDataReady( AdbContext::FStream::fsStdOut, nullptr, end );
+        if (res != AdbTask::Res::Next || task.size != corpus.size()) failed++;
+    }
+    state.setBytesProcessed( state.iterations() * corpus.size() );
+    state.setCounter( "failed", static_cast<double>( failed ) );
+}
+
+// The same the old way: split lines, then one find() per pattern
+void lineFind(BenchState &state, std::size_t patterns)
+{
+    std::string_view corpus( benchLogcatCorpus() );
+    std::size_t hits = 0;
+    while (state.next()) {
+        std::string_view view( corpus );
+        std::size_t pos;
+        while ((pos = view.find( '\n' )) != std::string_view::npos) {
+            std::string_view line( view.substr( 0, pos ) );
+            view.remove_prefix( pos + 1 );
+            for (std::size_t i = 0; i < patterns; i++) {
+                if (line.find( MatcherWords[i] ) != std::string_view::npos) hits++;
+            }
+        }
+    }
+    state.setBytesProcessed( state.iterations() * corpus.size() );
+    state.setCounter( "hits_per_pass", static_cast<double>( hits ) / static_cast<double>( state.iterations() ) );
+}
+
+}
+
+BENCHMARK("parsers/signature_router/1", [](BenchState &s) {signatureRouter( s, 1 );});
+BENCHMARK("parsers/signature_router/64", [](BenchState &s) {signatureRouter( s, 64 );});
+BENCHMARK("parsers/signature_router/1024", [](BenchState &s) {signatureRouter( s, 1024 );});
+BENCHMARK("parsers/naive_find/1", [](BenchState &s) {naiveFind( s, 1 );});
+BENCHMARK("parsers/naive_find/64", [](BenchState &s) {naiveFind( s, 64 );});
+BENCHMARK("parsers/naive_find/1024", [](BenchState &s) {naiveFind( s, 1024 );});
+BENCHMARK("parsers/lookup_tag/512", [](BenchState &s) {lookupTag( s, 512 );});
+BENCHMARK("parsers/lookup_tag/4096", [](BenchState &s) {lookupTag( s, 4096 );});
+BENCHMARK("parsers/lookup_tag/65536", [](BenchState &s) {lookupTag( s, 65536 );});
+BENCHMARK("parsers/lookup_entries/512", [](BenchState &s) {lookupEntries( s, 512 );});
+BENCHMARK("parsers/lookup_entries/4096", [](BenchState &s) {lookupEntries( s, 4096 );});
+BENCHMARK("parsers/lookup_entries/65536", [](BenchState &s) {lookupEntries( s, 65536 );});
+BENCHMARK("parsers/stream_matcher/1/512", [](BenchState &s) {streamMatcher( s, 1, 512 );});
+BENCHMARK("parsers/stream_matcher/1/65536", [](BenchState &s) {streamMatcher( s, 1, 65536 );});
+BENCHMARK("parsers/stream_matcher/8/512", [](BenchState &s) {streamMatcher( s, 8, 512 );});
+BENCHMARK("parsers/stream_matcher/8/65536", [](BenchState &s) {streamMatcher( s, 8, 65536 );});
+BENCHMARK("parsers/line_find/1", [](BenchState &s) {lineFind( s, 1 );});
+BENCHMARK("parsers/line_find/8", [](BenchState &s) {lineFind( s, 8 );});
+BENCHMARK("parsers/flow_output/4096", [](BenchState &s) {flowOutput( s, 4096 );});
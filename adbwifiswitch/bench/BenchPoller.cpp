@@ -0,0 +1,291 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+#include "FileHandler.h"
+#include "FilePoller.h"
+
+namespace {
+
+class PipeReader : public FileHandler {
+public:
+    PipeReader(int fd) : FileHandler(fd) {}
+
+    virtual bool onReadyToRead() override
+    {
+        char buf[64];
+        while (read( getFd(), buf, sizeof(buf) ) > 0) events++;
+        return true;
+    }
+    virtual bool onReadyToWrite() override {return true;}
+    virtual bool onError() override {return true;}
+
+    std::size_t events = 0;
+};
+
+class PipeSet {
+public:
+    PipeSet(FilePoller &fpoll, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; i++) {
+            int fds[2];
+            if (pipe( fds ) < 0) return;
+            fcntl( fds[0], F_SETFL, O_NONBLOCK );
+            auto h = std::make_shared<PipeReader>( fds[0] );
+            h->setState( true );
+            fpoll.addHandler( h );
+            m_readers.push_back( h );
+            m_writers.push_back( fds[1] );
+        }
+    }
+    ~PipeSet()
+    {
+        for (auto fd : m_writers) close( fd );
+    }
+
+    bool ok(std::size_t count) const {return m_writers.size() == count;}
+    void poke(std::size_t i) {const char c = 'x'; (void)!write( m_writers[i], &c, 1 );}
+    std::size_t events() const
+    {
+        std::size_t ret = 0;
+        for (auto &r : m_readers) ret += r->events;
+        return ret;
+    }
+
+private:
+    std::vector<std::shared_ptr<PipeReader> > m_readers;
+    std::vector<int> m_writers;
+};
+
+// N idle handlers and one active: cost of building & scanning the poll set
+void dispatchIdle(BenchState &state, std::size_t idle)
+{
+    FilePoller fpoll;
+    PipeSet active( fpoll, 1 );
+    PipeSet idle_set( fpoll, idle );
+    if (!active.ok( 1 ) || !idle_set.ok( idle )) return state.skip( "out of file descriptors" );
+
+    while (state.next()) {
+        active.poke( 0 );
+        fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+    }
+    state.setItemsProcessed( active.events() );
+}
+
+// N handlers, all of them readable on every loop iteration
+void dispatchActive(BenchState &state, std::size_t count)
+{
+    FilePoller fpoll;
+    PipeSet set( fpoll, count );
+    if (!set.ok( count )) return state.skip( "out of file descriptors" );
+
+    while (state.next()) {
+        for (std::size_t i = 0; i < count; i++) set.poke( i );
+        fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+    }
+    state.setItemsProcessed( set.events() );
+}
+
+// No fd, a timer far ahead: walked on every loop iteration, never fires
+class TimerHolder : public FileHandler {
+public:
+    TimerHolder() : FileHandler(-1)
+    {
+        setState( true );
+        startTimer( 1, std::chrono::hours(1) );
+    }
+    virtual bool onReadyToRead() override {return true;}
+    virtual bool onReadyToWrite() override {return true;}
+    virtual bool onError() override {return true;}
+};
+
+// One readable pipe among N fd-less handlers with timers: the poll set
+// stays small, what's left is the loop's walk over its handlers
+void loopOverhead(BenchState &state, std::size_t count)
+{
+    FilePoller fpoll;
+    PipeSet active( fpoll, 1 );
+    if (!active.ok( 1 )) return state.skip( "out of file descriptors" );
+    std::vector<std::shared_ptr<TimerHolder> > holders;
+    for (std::size_t i = 0; i < count; i++) {
+        holders.push_back( std::make_shared<TimerHolder>() );
+        fpoll.addHandler( holders.back() );
+    }
+
+    while (state.next()) {
+        active.poke( 0 );
+        fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+    }
+    state.setItemsProcessed( active.events() );
+}
+
+// Handlers coming and going among N registered ones, a loop iteration
+// after each batch
+void handlerChurn(BenchState &state, std::size_t count)
+{
+    FilePoller fpoll;
+    PipeSet active( fpoll, 1 );
+    if (!active.ok( 1 )) return state.skip( "out of file descriptors" );
+    std::vector<std::shared_ptr<TimerHolder> > holders;
+    std::vector<FilePoller::HandlerId> ids;
+    for (std::size_t i = 0; i < count; i++) {
+        holders.push_back( std::make_shared<TimerHolder>() );
+        ids.push_back( fpoll.addHandler( holders.back() ) );
+    }
+
+    std::size_t next = 0;
+    while (state.next()) {
+        for (std::size_t i = 0; i < 16; i++, next = (next + 7) % count) {
+            fpoll.removeHandler( ids[next] );
+            ids[next] = fpoll.addHandler( holders[next] );
+        }
+        active.poke( 0 );
+        fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+    }
+    state.setItemsProcessed( state.iterations() * 16 );
+}
+
+// Never drains its fd, readable on every loop iteration
+class Readable final : public FileHandler {
+public:
+    Readable(int fd) : FileHandler(fd) {setState( true );}
+
+    virtual bool onReadyToRead() override {events++; return true;}
+    virtual bool onReadyToWrite() override {return true;}
+    virtual bool onError() override {return true;}
+
+    std::size_t events = 0;
+};
+
+// N handlers on copies of one readable pipe end: a single poll() per
+// iteration, the rest is dispatch. Added as FileHandler the callbacks go
+// through the vtable, added as their own final type they don't
+void eventDispatch(BenchState &state, std::size_t count, bool statically)
+{
+    int fds[2];
+    if (pipe( fds ) < 0) return state.skip( "out of file descriptors" );
+    const char c = 'x';
+    (void)!write( fds[1], &c, 1 );
+
+    FilePoller fpoll;
+    std::vector<std::shared_ptr<Readable> > handlers;
+    for (std::size_t i = 0; i < count; i++) {
+        const int fd = dup( fds[0] );
+        if (fd < 0) break;
+        handlers.push_back( std::make_shared<Readable>( fd ) );
+        if (statically) fpoll.addHandler( handlers.back() );
+        else fpoll.addHandler( std::shared_ptr<FileHandler>( handlers.back() ) );
+    }
+    close( fds[0] );
+    close( fds[1] );
+    if (handlers.size() != count) return state.skip( "out of file descriptors" );
+
+    while (state.next()) fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+    std::size_t events = 0;
+    for (auto &h : handlers) events += h->events;
+    state.setItemsProcessed( events );
+}
+
+// Bounces every byte it gets back from another thread, through the pipe
+// or the relay
+class Echo {
+public:
+    Echo(std::function<void()> relay = std::function<void()>()) : m_relay(std::move(relay))
+    {
+        if (pipe( m_to ) < 0) return;
+        if (pipe( m_from ) < 0) {
+            close( m_to[0] );
+            close( m_to[1] );
+            return;
+        }
+        fcntl( m_from[0], F_SETFL, O_NONBLOCK );
+        m_thread = std::thread( [this]() {
+            char c;
+            while (read( m_to[0], &c, 1 ) == 1) {
+                if (m_relay) m_relay();
+                else (void)!write( m_from[1], &c, 1 );
+            }
+        });
+    }
+    ~Echo()
+    {
+        if (!m_thread.joinable()) return;
+        close( m_to[1] );
+        m_thread.join();
+        close( m_to[0] );
+        close( m_from[1] );
+    }
+
+    bool ok() const {return m_thread.joinable();}
+    // the reading end, for a handler which owns it
+    int output() const {return m_from[0];}
+    void ping() {const char c = 'x'; (void)!write( m_to[1], &c, 1 );}
+
+private:
+    int m_to[2] = {-1, -1};
+    int m_from[2] = {-1, -1};
+    std::function<void()> m_relay;
+    std::thread m_thread;
+};
+
+// A round trip through another thread: both loops sleep until the fd wakes
+// them. The embedded one is driven the way a host loop would, poll() on
+// the epoll fd then dispatchReady(). Posted, the way back is a task
+void wakeup(BenchState &state, bool embedded, bool posted, std::size_t idle)
+{
+    FilePoller fpoll;
+    std::shared_ptr<PipeReader> reader;
+    Echo echo( posted ? [&fpoll, &reader]() {fpoll.post( [&reader]() {reader->events++;} );} :
+                        std::function<void()>() );
+    if (!echo.ok()) return state.skip( "can't start echo thread" );
+    reader = std::make_shared<PipeReader>( echo.output() );
+    reader->setState( true );
+    fpoll.addHandler( reader );
+    PipeSet idle_set( fpoll, idle );
+    if (!idle_set.ok( idle )) return state.skip( "out of file descriptors" );
+
+    struct pollfd pfd = {embedded ? fpoll.embedFd() : -1, POLLIN, 0};
+    while (state.next()) {
+        const std::size_t seen = reader->events;
+        echo.ping();
+        while (reader->events == seen) {
+            if (!embedded) {
+                fpoll.pollHandlers( std::chrono::milliseconds(1000) );
+                continue;
+            }
+            const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                fpoll.nextDeadline() - std::chrono::steady_clock::now() ).count();
+            poll( &pfd, 1, static_cast<int>( std::clamp<long long>( wait, 0, 1000 ) ) );
+            fpoll.dispatchReady();
+        }
+    }
+    state.setItemsProcessed( reader->events );
+}
+
+}
+
+BENCHMARK("poller/dispatch_idle/16", [](BenchState &s) {dispatchIdle( s, 16 );});
+BENCHMARK("poller/dispatch_idle/256", [](BenchState &s) {dispatchIdle( s, 256 );});
+BENCHMARK("poller/dispatch_idle/1024", [](BenchState &s) {dispatchIdle( s, 1024 );});
+BENCHMARK("poller/dispatch_active/16", [](BenchState &s) {dispatchActive( s, 16 );});
+BENCHMARK("poller/dispatch_active/256", [](BenchState &s) {dispatchActive( s, 256 );});
+BENCHMARK("poller/dispatch_active/1024", [](BenchState &s) {dispatchActive( s, 1024 );});
+BENCHMARK("poller/loop_overhead/1000", [](BenchState &s) {loopOverhead( s, 1000 );});
+BENCHMARK("poller/loop_overhead/10000", [](BenchState &s) {loopOverhead( s, 10000 );});
+BENCHMARK("poller/handler_churn/1000", [](BenchState &s) {handlerChurn( s, 1000 );});
+BENCHMARK("poller/handler_churn/10000", [](BenchState &s) {handlerChurn( s, 10000 );});
+BENCHMARK("poller/event_dispatch/virtual/256", [](BenchState &s) {eventDispatch( s, 256, false );});
+BENCHMARK("poller/event_dispatch/static/256", [](BenchState &s) {eventDispatch( s, 256, true );});
+BENCHMARK("poller/wakeup/poll", [](BenchState &s) {wakeup( s, false, false, 0 );});
+BENCHMARK("poller/wakeup/embedded", [](BenchState &s) {wakeup( s, true, false, 0 );});
+BENCHMARK("poller/wakeup/poll_idle/256", [](BenchState &s) {wakeup( s, false, false, 256 );});
+BENCHMARK("poller/wakeup/embedded_idle/256", [](BenchState &s) {wakeup( s, true, false, 256 );});
+BENCHMARK("poller/wakeup/poll_post", [](BenchState &s) {wakeup( s, false, true, 0 );});
+BENCHMARK("poller/wakeup/embedded_post", [](BenchState &s) {wakeup( s, true, true, 0 );});
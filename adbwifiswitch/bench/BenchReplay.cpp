@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "AdbController.h"
+#include "Bench.h"
+#include "Config.h"
+#include "FilePoller.h"
+#include "SessionRecorder.h"
+#include "SessionReplayer.h"
+
+namespace {
+
+class StaticConfigDeleter {
+public:
+    void operator()(Config *) {}
+};
+
+// Records one connect session against fakeadb with background logcat noise
+bool recordSession(const std::string &path)
+{
+    setenv( "FAKEADB_STATE_DIR", benchStateDir().c_str(), 1 );
+    setenv( "FAKEADB_AM_DELAY_MS", "0", 1 );
+    setenv( "FAKEADB_CONNECT_DELAY_MS", "300", 1 );
+    setenv( "FAKEADB_NOISE_RATE", "20000", 1 );
+
+    Config cfg = Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                  .setSsid( "bench" ).setPassword( "password" )
+                                  .setAuthType( "WPA" ).build();
+    FilePoller fpoll;
+    AdbController adb( std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll );
+    adb.setRecorder( SessionRecorder::open( path ) );
+    const bool run = adb.connectWiFi();
+    if (run) fpoll.exec();
+
+    unsetenv( "FAKEADB_NOISE_RATE" );
+    unsetenv( "FAKEADB_CONNECT_DELAY_MS" );
+    return run && adb.exitCode() == 0;
+}
+
+void replay(BenchState &state)
+{
+    static SessionRecording recording;
+    static bool loaded = false;
+    if (!loaded) {
+        if (Bench::options().fakeAdb.empty()) return state.skip( "no stub adb" );
+        if (benchStateDir().empty()) return state.skip( "can't create fakeadb state dir" );
+        // the run's own directory, concurrent runs don't share it
+        const std::string path = benchStateDir() + "/session.rec";
+        if (!recordSession( path ) || !recording.load( path )) return state.skip( "can't record session" );
+        unlink( path.c_str() );
+        loaded = true;
+    }
+
+    std::size_t bytes = 0, failed = 0;
+    while (state.next()) {
+        SessionReplayer replayer( recording );
+        if (!replayer.run( SessionReplayer::Pace::AsFastAsPossible )) failed++;
+        bytes += replayer.bytesReplayed();
+    }
+    state.setBytesProcessed( bytes );
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    state.setCounter( "events", static_cast<double>( recording.events().size() ) );
+}
+
+}
+
+BENCHMARK("replay/connect_noisy/fast", replay);
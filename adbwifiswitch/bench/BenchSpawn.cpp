@@ -0,0 +1,41 @@
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Bench.h"
+#include "ChildProcess.h"
+
+namespace {
+
+// exec() until the child closes its stdout, i.e. has run and exited
+void spawn(BenchState &state, const std::string &cmd, const std::list<std::string> &args)
+{
+    if (cmd.empty()) return state.skip( "no stub adb" );
+    std::size_t failed = 0;
+    while (state.next()) {
+        ChildProcess proc( ChildProcess::Flags::fDefault | ChildProcess::Flags::fStdErr );
+        if (!proc.exec( cmd, args )) {
+            failed++;
+            continue;
+        }
+        char buf[256];
+        struct pollfd pfd = {proc.getStdoutFd(), POLLIN, 0};
+        while (poll( &pfd, 1, 5000 ) > 0 && read( pfd.fd, buf, sizeof(buf) ) > 0);
+
+        state.pauseTiming();
+        // let the child become a zombie first, cleanup() hands it to the reaper otherwise
+        siginfo_t info;
+        waitid( P_ALL, 0, &info, WEXITED | WNOWAIT );
+        for (int fd : {proc.getStdinFd(), proc.getStdoutFd(), proc.getStderrFd()}) close( fd );
+        proc.cleanup( true );
+        state.resumeTiming();
+    }
+    state.setCounter( "failed", static_cast<double>( failed ) );
+}
+
+}
+
+BENCHMARK("spawn/child_process_exec/true", [](BenchState &s) {spawn( s, "/bin/true", {} );}, 200);
+BENCHMARK("spawn/child_process_exec/adb_version", [](BenchState &s) {
+    spawn( s, Bench::options().fakeAdb, {"version"} );
+}, 200);
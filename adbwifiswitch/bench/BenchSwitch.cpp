@@ -0,0 +1,445 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AdbController.h"
+#include "AdbSwitcher.h"
+#include "Bench.h"
+#include "Config.h"
+#include "FilePoller.h"
+#include "LatencyHistory.h"
+#include "LogcatHub.h"
+#include "ReactorGroup.h"
+#include "ShellSession.h"
+
+namespace {
+enum {
+    SteadyWarmup = 64,
+};
+
+class StaticConfigDeleter {
+public:
+    void operator()(Config *) {}
+};
+
+bool prepareStub(BenchState &state)
+{
+    if (Bench::options().fakeAdb.empty()) {
+        state.skip( "no stub adb" );
+        return false;
+    }
+    if (benchStateDir().empty()) {
+        state.skip( "can't create fakeadb state dir" );
+        return false;
+    }
+    setenv( "FAKEADB_STATE_DIR", benchStateDir().c_str(), 1 );
+    setenv( "FAKEADB_AM_DELAY_MS", "0", 0 );
+    setenv( "FAKEADB_CONNECT_DELAY_MS", "0", 0 );
+    setenv( "FAKEADB_DISCONNECT_DELAY_MS", "0", 0 );
+    return true;
+}
+
+// One full switch per iteration: am start, logcat, signature match, cleanup.
+// Average task durations are reported as phase_<task>_ms counters
+void runSwitch(BenchState &state, bool connect, bool pushdown = true, const char *noiseRate = "0",
+               bool composite = false, unsigned short resultPort = 0, bool broadcast = false,
+               bool native = false, unsigned int hedge = 1, const std::string &serial = std::string())
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_NOISE_RATE", noiseRate, 1 );
+
+    std::size_t failed = 0, bytes = 0, launches = 0;
+    std::map<std::string, double> phases;
+    while (state.next()) {
+        Config cfg = Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                      .setSsid( "bench" ).setPassword( "password" )
+                                      .setAuthType( "WPA" ).setLogcatPushdown( pushdown )
+                                      .setCompositeCommand( composite ).setBroadcastEntry( broadcast )
+                                      .setResultPort( resultPort ).setNativeShell( native )
+                                      .setHedgeAttempts( hedge ).setHedgeDelayMs( 200 )
+                                      .setSerial( serial ).build();
+        FilePoller fpoll;
+        AdbController adb( std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll );
+        const bool run = connect ? adb.connectWiFi() : adb.disconnectWiFi();
+        if (run) fpoll.exec();
+        if (!run || adb.exitCode() != 0) failed++;
+        bytes += adb.bytesRead();
+        launches += adb.adbLaunches();
+        for (auto &p : adb.phases()) phases[p.name] += static_cast<double>( p.duration.count() ) / 1000.0;
+    }
+    unsetenv( "FAKEADB_NOISE_RATE" );
+    for (auto &p : phases) {
+        state.setCounter( "phase_" + p.first + "_ms", p.second / static_cast<double>( state.iterations() ) );
+    }
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    state.setCounter( "bytes_read", static_cast<double>( bytes ) / static_cast<double>( state.iterations() ) );
+    state.setCounter( "adb_launches", static_cast<double>( launches ) / static_cast<double>( state.iterations() ) );
+}
+
+// Agent entry point with fakeadb's default start costs: 50ms for an
+// activity, 10ms for a broadcast receiver
+void runEntry(BenchState &state, bool broadcast)
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_AM_DELAY_MS", "50", 1 );
+    setenv( "FAKEADB_BROADCAST_DELAY_MS", "10", 1 );
+    runSwitch( state, true, true, "0", false, 0, broadcast );
+    setenv( "FAKEADB_AM_DELAY_MS", "0", 1 );
+    unsetenv( "FAKEADB_BROADCAST_DELAY_MS" );
+}
+
+// A loopback port free right now, 0 if none
+unsigned short freePort()
+{
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (fd < 0) return 0;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t len = sizeof(addr);
+    unsigned short port = 0;
+    if (bind( fd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof(addr) ) == 0 &&
+        getsockname( fd, reinterpret_cast<struct sockaddr *>( &addr ), &len ) == 0) {
+        port = ntohs( addr.sin_port );
+    }
+    close( fd );
+    return port;
+}
+
+// "shell" commands straight to fakeadb's server with shell protocol v2, the
+// first iteration spawns adb which starts the server. am completes on its
+// exit packet, no adb client process per command
+void runNative(BenchState &state, bool connect, bool composite)
+{
+    if (!prepareStub( state )) return;
+    // a server of its own: one left from another run would serve another
+    // state dir
+    const unsigned short port = freePort();
+    if (!port) return state.skip( "no free port for the adb server" );
+    setenv( "ANDROID_ADB_SERVER_PORT", std::to_string( port ).c_str(), 1 );
+    runSwitch( state, connect, true, "0", composite, 0, false, true );
+    benchKillFakeAdb();
+    unsetenv( "ANDROID_ADB_SERVER_PORT" );
+}
+
+// Results over fakeadb's forward daemon, which answers for the agent on a
+// port of its own; kill-server takes the forward down afterwards
+void runChannel(BenchState &state, bool connect)
+{
+    if (!prepareStub( state )) return;
+    const unsigned short port = freePort();
+    if (!port) return state.skip( "no free port for the result channel" );
+    runSwitch( state, connect, true, "0", false, port );
+    benchKillFakeAdb();
+}
+
+// Every other launch never answers: the hedged one does, once the device
+// has latency history at the p95 of it instead of the 200ms default
+void runHedged(BenchState &state, bool composite = false)
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_FAULT", "am:nosig=2", 1 );
+    runSwitch( state, true, true, "0", composite, 0, false, false, 2 );
+    unsetenv( "FAKEADB_FAULT" );
+}
+
+// Every launch is lost: the failure shows at the answer deadline learned
+// from the device's 300ms answers instead of the fixed 30 seconds. A device
+// of its own, the others keep their fixed deadlines
+void runLostAnswer(BenchState &state)
+{
+    static const std::string serial = "bench-lost-answer";
+    if (!prepareStub( state )) return;
+    for (int i = 0; i < 8; i++) {
+        LatencyHistory::instance().add( serial, LatencyHistory::Phase::Answer, std::chrono::milliseconds(300) );
+    }
+    setenv( "FAKEADB_FAULT", "am:nosig", 1 );
+    runSwitch( state, true, true, "0", false, 0, false, false, 1, serial );
+    unsetenv( "FAKEADB_FAULT" );
+}
+
+// The agent logs its failure line: the composite command reports it right
+// away instead of waiting out the answer deadline, every run fails
+void runCompositeAgentFail(BenchState &state)
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_FAULT", "am:fail", 1 );
+    runSwitch( state, true, true, "0", true );
+    unsetenv( "FAKEADB_FAULT" );
+}
+
+// The agent was built before the broadcast receiver & result channel: the
+// probe finds it once and the switches go through the activity and logcat
+// instead of failing or waiting for the channel. A device of its own, the
+// others keep their current agent
+void runOlderAgent(BenchState &state)
+{
+    static const std::string serial = "bench-older-agent";
+    if (!prepareStub( state )) return;
+    const unsigned short port = freePort();
+    if (!port) return state.skip( "no free port for the result channel" );
+    setenv( "FAKEADB_AGENT_VERSION", "1", 1 );
+    runSwitch( state, true, true, "0", false, port, true, false, 1, serial );
+    unsetenv( "FAKEADB_AGENT_VERSION" );
+    benchKillFakeAdb();
+}
+
+// Back-to-back switches on one poller, agent lines come from one shared
+// logcat stream instead of a logcat spawn per switch. With shells the clock
+// probe and am go to one persistent adb shell, so the steady state runs
+// without process creation. adb_launches counts the adb processes of the
+// controllers and the shells
+void runSwitchHub(BenchState &state, bool connect, bool shell = false)
+{
+    if (!prepareStub( state )) return;
+
+    FilePoller fpoll;
+    auto hubs = std::make_shared<LogcatHubPool>( fpoll );
+    auto shells = shell ? std::make_shared<ShellSessionPool>( fpoll ) : std::shared_ptr<ShellSessionPool>();
+    std::size_t failed = 0, launches = 0;
+    while (state.next()) {
+        Config cfg = Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                      .setSsid( "bench" ).setPassword( "password" )
+                                      .setAuthType( "WPA" ).build();
+        AdbController adb( std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll );
+        bool done = false;
+        adb.setLogcatHubs( hubs );
+        adb.setShellSessions( shells );
+        adb.setCompletionHandler( [&done](bool) {done = true;} );
+        const bool run = connect ? adb.connectWiFi() : adb.disconnectWiFi();
+        while (run && !done && fpoll.pollHandlers( std::chrono::seconds(1) )) {}
+        if (!run || adb.exitCode() != 0) failed++;
+        launches += adb.adbLaunches();
+    }
+    if (shells) {
+        launches += shells->launches();
+        shells->shutdown();
+    }
+    hubs->shutdown();
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    state.setCounter( "adb_launches", static_cast<double>( launches ) / static_cast<double>( state.iterations() ) );
+}
+
+// adb's logcat exits at once: the hub gives up after its restarts and the
+// operation fails at the answer deadline learned from the device's 300ms
+// answers, held to 1s; each time-out doubles it. SIGPIPE has its default
+// action in the bench, a Ctrl-C to the dead adb would end the run
+void runSwitchHubLogcatExit(BenchState &state)
+{
+    static const std::string serial = "bench-logcat-exit";
+    if (!prepareStub( state )) return;
+    for (int i = 0; i < 8; i++) {
+        LatencyHistory::instance().add( serial, LatencyHistory::Phase::Answer, std::chrono::milliseconds(300) );
+    }
+    setenv( "FAKEADB_FAULT", "logcat:exit=1", 1 );
+
+    FilePoller fpoll;
+    auto hubs = std::make_shared<LogcatHubPool>( fpoll );
+    std::size_t failed = 0;
+    while (state.next()) {
+        Config cfg = Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                      .setSsid( "bench" ).setPassword( "password" )
+                                      .setAuthType( "WPA" ).setSerial( serial )
+                                      .setMinTimeoutMs( 1000 ).build();
+        AdbController adb( std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll );
+        bool done = false;
+        adb.setLogcatHubs( hubs );
+        adb.setCompletionHandler( [&done](bool) {done = true;} );
+        const bool run = adb.connectWiFi();
+        while (run && !done && fpoll.pollHandlers( std::chrono::seconds(1) )) {}
+        if (!run || !done || adb.exitCode() != 0) failed++;
+    }
+    hubs->shutdown();
+    unsetenv( "FAKEADB_FAULT" );
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    if (failed != state.iterations()) state.fail( "an operation succeeded without logcat" );
+}
+
+// Cancelled shell commands never run: one still in the shell's input is
+// taken back, one the shell already has costs a restart that fails the
+// command it was busy with. A cancelled command leaving its mark fails the
+// run, failed counts iterations that went otherwise
+void runShellCancel(BenchState &state)
+{
+    if (!prepareStub( state )) return;
+    const std::string mark = benchStateDir() + "/cancelled";
+
+    FilePoller fpoll;
+    ShellSessionPool shells( fpoll );
+    std::size_t failed = 0;
+    while (state.next()) {
+        unlink( mark.c_str() );
+        auto shell = shells.session( Bench::options().fakeAdb, std::string() );
+        int busy = 0, last = -2;
+        std::size_t done = 0;
+        shell->run( "sleep 0.3", [&](ShellSession::CommandId, int status, std::string_view) {busy = status; done++;} );
+        const auto written = shell->run( "touch " + mark, [](ShellSession::CommandId, int, std::string_view) {} );
+        const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        while (std::chrono::steady_clock::now() < until && fpoll.pollHandlers( std::chrono::milliseconds(10) )) {}
+        shell->cancel( written );
+        shell->cancel( shell->run( "touch " + mark, [](ShellSession::CommandId, int, std::string_view) {} ) );
+        shell->run( "true", [&](ShellSession::CommandId, int status, std::string_view) {last = status; done++;} );
+        while (done < 2 && fpoll.pollHandlers( std::chrono::seconds(1) )) {}
+        if (access( mark.c_str(), F_OK ) == 0) {
+            shells.shutdown();
+            return state.fail( "a cancelled command ran" );
+        }
+        if (busy != ShellSession::ShellFailed || last != 0) failed++;
+    }
+    shells.shutdown();
+    state.setCounter( "failed", static_cast<double>( failed ) );
+}
+
+// One controller, its hub & shell kept for all operations as a service
+// keeps them. Once warm an operation allocates nothing on the loop thread:
+// allocating_ops counts the measured ones that did, any fails the run
+void runSwitchSteady(BenchState &state, bool connect)
+{
+    if (!prepareStub( state )) return;
+
+    FilePoller fpoll;
+    auto hubs = std::make_shared<LogcatHubPool>( fpoll );
+    auto shells = std::make_shared<ShellSessionPool>( fpoll );
+    Config cfg = Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                  .setSsid( "bench" ).setPassword( "password" )
+                                  .setAuthType( "WPA" ).build();
+    AdbController adb( std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll );
+    bool done = false;
+    adb.setLogcatHubs( hubs );
+    adb.setShellSessions( shells );
+    adb.setCompletionHandler( [&done](bool) {done = true;} );
+    auto operation = [&]() {
+        done = false;
+        const bool run = connect ? adb.connectWiFi() : adb.disconnectWiFi();
+        while (run && !done && fpoll.pollHandlers( std::chrono::seconds(1) )) {}
+        return run && adb.exitCode() == 0;
+    };
+
+    std::size_t failed = 0, allocating = 0;
+    std::uint64_t allocs = 0;
+    // till the hub's backlog of recent lines is full
+    for (int i = 0; i < SteadyWarmup; i++) {
+        if (!operation()) failed++;
+    }
+    while (state.next()) {
+        const std::uint64_t before = benchAllocations();
+        if (!operation()) failed++;
+        const std::uint64_t count = benchAllocations() - before;
+        allocs += count;
+        if (count) allocating++;
+    }
+    shells->shutdown();
+    hubs->shutdown();
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    state.setCounter( "allocating_ops", static_cast<double>( allocating ) );
+    state.setCounter( "allocs_per_op", static_cast<double>( allocs ) / static_cast<double>( state.iterations() ) );
+    if (allocating) state.fail( std::to_string( allocating ) + " warm operations allocated" );
+}
+
+
+// A batch of switches on as many devices submitted at once to one switcher,
+// they overlap on its poller. am takes 50ms as on a device; ns/op is per
+// batch
+void runSwitcher(BenchState &state, unsigned int devices)
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_AM_DELAY_MS", "50", 1 );
+
+    FilePoller fpoll;
+    AdbSwitcher switcher( fpoll );
+    std::size_t failed = 0, launches = 0;
+    while (state.next()) {
+        const std::string uniq = Config::Builder().build().getUniqTag();
+        for (unsigned int i = 0; i < devices; i++) {
+            auto cfg = std::make_shared<Config>( Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                                                  .setSsid( "bench" ).setPassword( "password" )
+                                                                  .setAuthType( "WPA" )
+                                                                  .setSerial( "bench" + std::to_string( i ) )
+                                                                  .setUniqTag( uniq + "d" + std::to_string( i ) )
+                                                                  .build() );
+            switcher.submitConnect( cfg, [&failed, &launches](const AdbSwitcher::Result &res) {
+                if (!res.succeeded) failed++;
+                launches += res.adbLaunches;
+            });
+        }
+        while (switcher.pending() && fpoll.pollHandlers( std::chrono::seconds(1) )) {}
+    }
+    setenv( "FAKEADB_AM_DELAY_MS", "0", 1 );
+    state.setCounter( "failed", static_cast<double>( failed ) );
+    state.setCounter( "adb_launches", static_cast<double>( launches ) / static_cast<double>( state.iterations() ) );
+}
+
+// A batch of devices with noisy logcats parsed on the host, spread over
+// the reactors; with scan threads the logcats are scanned on those
+void runReactors(BenchState &state, unsigned int devices, std::size_t reactors, std::size_t scanThreads = 0)
+{
+    if (!prepareStub( state )) return;
+    setenv( "FAKEADB_NOISE_RATE", "2000", 1 );
+
+    ReactorGroup group( reactors, ReactorGroup::Placement::LeastLoaded, false );
+    group.setScanThreads( scanThreads );
+    if (!group.start()) return state.skip( "can't start reactors" );
+    std::size_t failed = 0;
+    while (state.next()) {
+        const std::string uniq = Config::Builder().build().getUniqTag();
+        std::vector<std::future<AdbSwitcher::Result> > results;
+        for (unsigned int i = 0; i < devices; i++) {
+            results.push_back( group.submitConnect( std::make_shared<Config>(
+                Config::Builder().setAdbCmd( Bench::options().fakeAdb )
+                                 .setSsid( "bench" ).setPassword( "password" ).setAuthType( "WPA" )
+                                 .setLogcatPushdown( false )
+                                 .setSerial( "bench" + std::to_string( i ) )
+                                 .setUniqTag( uniq + "d" + std::to_string( i ) )
+                                 .build() ) ) );
+        }
+        for (auto &res : results) {
+            if (!res.get().succeeded) failed++;
+        }
+    }
+    group.stop();
+    unsetenv( "FAKEADB_NOISE_RATE" );
+    state.setCounter( "failed", static_cast<double>( failed ) );
+}
+
+}
+
+BENCHMARK("switch/connect/fakeadb", [](BenchState &s) {runSwitch( s, true );}, 20);
+BENCHMARK("switch/disconnect/fakeadb", [](BenchState &s) {runSwitch( s, false );}, 20);
+BENCHMARK("switch/connect/fakeadb_composite", [](BenchState &s) {runSwitch( s, true, true, "0", true );}, 20);
+BENCHMARK("switch/disconnect/fakeadb_composite", [](BenchState &s) {runSwitch( s, false, true, "0", true );}, 20);
+BENCHMARK("switch/connect/fakeadb_composite_agent_fail", [](BenchState &s) {runCompositeAgentFail( s );}, 5);
+BENCHMARK("switch/connect/fakeadb_channel", [](BenchState &s) {runChannel( s, true );}, 20);
+BENCHMARK("switch/disconnect/fakeadb_channel", [](BenchState &s) {runChannel( s, false );}, 20);
+BENCHMARK("switch/connect/fakeadb_entry_activity", [](BenchState &s) {runEntry( s, false );}, 20);
+BENCHMARK("switch/connect/fakeadb_entry_broadcast", [](BenchState &s) {runEntry( s, true );}, 20);
+BENCHMARK("switch/connect/fakeadb_native", [](BenchState &s) {runNative( s, true, false );}, 20);
+BENCHMARK("switch/disconnect/fakeadb_native", [](BenchState &s) {runNative( s, false, false );}, 20);
+BENCHMARK("switch/connect/fakeadb_native_composite", [](BenchState &s) {runNative( s, true, true );}, 20);
+BENCHMARK("switch/connect/fakeadb_hedged_lost_launch", [](BenchState &s) {runHedged( s );}, 20);
+BENCHMARK("switch/connect/fakeadb_composite_hedged_lost_launch", [](BenchState &s) {runHedged( s, true );}, 20);
+BENCHMARK("switch/connect/fakeadb_lost_answer", [](BenchState &s) {runLostAnswer( s );}, 1);
+BENCHMARK("switch/connect/fakeadb_older_agent", [](BenchState &s) {runOlderAgent( s );}, 10);
+BENCHMARK("switch/connect/fakeadb_switcher_1dev", [](BenchState &s) {runSwitcher( s, 1 );}, 10);
+BENCHMARK("switch/connect/fakeadb_switcher_4dev", [](BenchState &s) {runSwitcher( s, 4 );}, 10);
+BENCHMARK("switch/connect/fakeadb_reactors_1x4dev", [](BenchState &s) {runReactors( s, 4, 1 );}, 10);
+BENCHMARK("switch/connect/fakeadb_reactors_4x4dev", [](BenchState &s) {runReactors( s, 4, 4 );}, 10);
+BENCHMARK("switch/connect/fakeadb_reactors_1x4dev_scan2", [](BenchState &s) {runReactors( s, 4, 1, 2 );}, 10);
+BENCHMARK("switch/connect/fakeadb_reactors_4x4dev_scan2", [](BenchState &s) {runReactors( s, 4, 4, 2 );}, 10);
+// noisy phone: 20000 lines/s of other tags
+BENCHMARK("switch/connect/fakeadb_noise", [](BenchState &s) {runSwitch( s, true, true, "20000" );}, 20);
+BENCHMARK("switch/connect/fakeadb_noise_nopushdown", [](BenchState &s) {runSwitch( s, true, false, "20000" );}, 20);
+BENCHMARK("switch/connect/fakeadb_hub", [](BenchState &s) {runSwitchHub( s, true );}, 20);
+BENCHMARK("switch/disconnect/fakeadb_hub", [](BenchState &s) {runSwitchHub( s, false );}, 20);
+BENCHMARK("switch/connect/fakeadb_hub_shell", [](BenchState &s) {runSwitchHub( s, true, true );}, 20);
+BENCHMARK("switch/disconnect/fakeadb_hub_shell", [](BenchState &s) {runSwitchHub( s, false, true );}, 20);
+BENCHMARK("switch/shell/fakeadb_cancel", [](BenchState &s) {runShellCancel( s );}, 5);
+BENCHMARK("switch/connect/fakeadb_hub_logcat_exit", [](BenchState &s) {runSwitchHubLogcatExit( s );}, 2);
+BENCHMARK("switch/connect/fakeadb_steady", [](BenchState &s) {runSwitchSteady( s, true );}, 50);
+BENCHMARK("switch/disconnect/fakeadb_steady", [](BenchState &s) {runSwitchSteady( s, false );}, 50);
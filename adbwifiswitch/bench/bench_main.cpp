@@ -0,0 +1,88 @@
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "Bench.h"
+
+namespace {
+
+void usage(const char *pname)
+{
+    fprintf(stderr, "Usage:\n%s [options]\n"
+                    " -f|--filter <substring> - run matching benchmarks only\n"
+                    " -m|--min-time <ms> - minimal run time per benchmark, default 200\n"
+                    " -o|--out <file> - write JSON report to file instead of stdout\n"
+                    " -l|--logcat <file> - recorded logcat text for parser benchmarks\n"
+                    " -a|--adbcmd <fakeadb> - stub adb for spawn & switch benchmarks\n", pname);
+}
+
+void raiseFdLimit()
+{
+    struct rlimit rl;
+    if (getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &rl );
+    }
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    struct option longopts[] = {
+        {"adbcmd", required_argument, nullptr, 'a'},
+        {"filter", required_argument, nullptr, 'f'},
+        {"help", no_argument, nullptr, 'h'},
+        {"logcat", required_argument, nullptr, 'l'},
+        {"min-time", required_argument, nullptr, 'm'},
+        {"out", required_argument, nullptr, 'o'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Bench::Options opt;
+#ifdef FAKEADB_PATH
+    opt.fakeAdb = FAKEADB_PATH;
+#endif
+    std::string out;
+
+    while (1) {
+        int opt_index = 0;
+        int c = getopt_long(argc, argv, "a:f:hl:m:o:", longopts, &opt_index);
+        if (c == -1) break;
+        switch (c) {
+            case 'a':
+                opt.fakeAdb = optarg;
+                break;
+            case 'f':
+                opt.filter = optarg;
+                break;
+            case 'l':
+                opt.logcatFile = optarg;
+                break;
+            case 'm':
+                opt.minTime = std::chrono::milliseconds( strtol( optarg, nullptr, 10 ) );
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'h':
+            default:
+                usage( argv[0] );
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    raiseFdLimit();
+
+    if (out.empty()) return Bench::runAll( opt, std::cout );
+    std::ofstream os( out );
+    if (!os) {
+        fprintf(stderr, "Can't open %s\n", out.c_str());
+        return 1;
+    }
+    return Bench::runAll( opt, os );
+}
@@ -0,0 +1,68 @@
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#include "AdbSwitcher.h"
+#include "Config.h"
+#include "FilePoller.h"
+
+// Switches devices from a host event loop instead of FilePoller::exec().
+// The host here is a plain poll() loop with a timer of its own, standing in
+// for libuv or asio; the mapping is one to one:
+//  - libuv: uv_poll_start() on embedFd() for UV_READABLE and a uv_timer_t
+//    at nextDeadline(), both callbacks call dispatchReady() and re-arm
+//    the timer
+//  - asio: a posix::stream_descriptor on embedFd() with
+//    async_wait(wait_read) and a steady_timer at nextDeadline()
+//
+// adbwifiswitch_embed <adb command> <ssid> <key> [serial...]
+
+namespace {
+enum {
+    HeartbeatMs = 500,
+};
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <adb command> <ssid> <key> [serial...]\n", argv[0]);
+        return 1;
+    }
+
+    FilePoller fpoll;
+    AdbSwitcher switcher( fpoll );
+    int failed = 0;
+    auto report = [&failed](const AdbSwitcher::Result &res) {
+        printf("operation %u %s\n", res.id, res.succeeded ? "succeeded" : "failed");
+        if (!res.succeeded) failed++;
+    };
+    // no serial: the only attached device
+    for (int i = 4; i == 4 || i < argc; i++) {
+        auto builder = Config::Builder().setAdbCmd( argv[1] ).setSsid( argv[2] ).setPassword( argv[3] )
+                                        .setAuthType( "WPA" );
+        if (i < argc) builder.setSerial( argv[i] );
+        switcher.submitConnect( std::make_shared<Config>( builder.build() ), report );
+    }
+
+    struct pollfd pfd = {fpoll.embedFd(), POLLIN, 0};
+    if (pfd.fd == -1) return 1;
+    using namespace std::chrono;
+    auto heartbeat = steady_clock::now() + milliseconds(HeartbeatMs);
+    while (switcher.pending()) {
+        // the host's own work shares the loop
+        const auto deadline = std::min( fpoll.nextDeadline(), heartbeat );
+        const auto wait = duration_cast<milliseconds>( deadline - steady_clock::now() ).count();
+        poll( &pfd, 1, static_cast<int>( std::max<long long>( wait, 0 ) ) );
+        fpoll.dispatchReady();
+        if (steady_clock::now() >= heartbeat) {
+            printf("host loop alive, %zu operations pending\n", switcher.pending());
+            heartbeat += milliseconds(HeartbeatMs);
+        }
+    }
+    switcher.shutdown();
+    return failed ? 1 : 0;
+}
@@ -6,19 +6,47 @@
 
 #include <array>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <sstream>
 
-#include "AdbController.h"
+#include "AdbSwitcher.h"
 #include "Config.h"
+#include "DeviceClock.h"
 #include "FilePoller.h"
+#include "LatencyHistory.h"
 #include "Logger.h"
+#include "ScanPool.h"
+#include "SessionRecorder.h"
+#include "SessionReplayer.h"
 
 enum RunMode {
-    None, Help, Connect, Disconnect
+    None, Help, Connect, Disconnect, Replay
 };
 
+struct RunOptions {
+    std::string recordFile;
+    std::string replayFile;
+    bool realtime = false;
+    bool logcatHub = false;
+    bool shellSession = false;
+    unsigned int scanThreads = 0;
+};
+
+namespace {
+const char ClockStateFile[] = "adbwifiswitch-clocks";
+const char LatencyStateFile[] = "adbwifiswitch-latencies";
+
+std::string statePath(const char *file)
+{
+    const char *cache = getenv( "XDG_CACHE_HOME" );
+    if (cache && *cache) return std::string(cache) + "/" + file;
+    const char *home = getenv( "HOME" );
+    return home && *home ? std::string(home) + "/.cache/" + file : std::string();
+}
+}
+
 static const std::array<const char * const, 2> AuthTypes({"WEP", "WPA"});
 static const char *AdbCmdDefault = "adb";
 
@@ -41,11 +69,33 @@ void usage(char *pname)
     fprintf(stderr, "Usage:\n%s -s|--ssid <SSID> -k|--key <security key>\n"
                     "\t- connect to WiFi AP\n"
                     "%s -d|--disconnect\n\t- disconnect from AP\n"
+                    "%s -R|--replay <file> [--realtime]\n\t- replay recorded session without adb\n"
                     "Optional switches:\n"
                     " -a|--adbcmd=<adb command>, default is \"adb\"\n"
+                    " -b|--broadcast - start the agent with 'am broadcast' to its receiver, no activity\n"
+                    " -B|--binary-logcat - read agent answers from binary logcat, text is the fallback\n"
+                    " -C|--composite - start the agent and wait for its answer in one device command\n"
+                    " -F|--result-port <port> - get the agent answer over 'adb forward tcp:<port>',\n"
+                    "\tlogcat is the fallback\n"
+                    " --fixed-timeouts - don't learn phase deadlines from the device's latencies\n"
                     " -h|--help - print usage\n"
+                    " -H|--hedge <attempts> - run the operation again, up to <attempts> in all,\n"
+                    "\twhen the agent's answer is late; the first one that answers wins\n"
+                    " --hedge-percentile <p> - late is over the p-th percentile of the device's launch\n"
+                    "\tand answer latencies seen so far, default 95\n"
+                    " --hedge-after <ms> - late before there are enough latencies, default 5000\n"
+                    " -L|--logcat-hub - wait for the agent on a shared per-device logcat stream\n"
+                    " --min-timeout <ms> - lower bound of learned phase deadlines, default 1000\n"
+                    " -p|--persistent-shell - run device commands in one long-lived adb shell\n"
+                    " -n|--native-shell - run 'adb shell' commands over the adb server socket with\n"
+                    "\tshell protocol v2, the adb client is the fallback\n"
+                    " --no-pushdown - don't filter logcat on the device, don't probe device clock\n"
+                    " -r|--record <file> - record adb streams of the session\n"
+                    " --scan-threads <n> - scan text logcat for the agent's lines on <n> threads,\n"
+                    "\toff the I/O thread\n"
+                    " -S|--serial <serial> - device to use when several are attached\n"
                     " -t|--type <%s>, default is WPA\n"
-                    " -v|--verbose - noisy logging\n", cpname, cpname, ss.str().c_str());
+                    " -v|--verbose - noisy logging\n", cpname, cpname, cpname, ss.str().c_str());
 }
 
 __attribute__((__format__ (__printf__, 2, 3)))
@@ -60,13 +110,31 @@ void print_err(char *pname, const char *errmsg, ... )
     usage( pname );
 }
 
-bool parseClArgs(int argc, char** argv, Config &cfg, RunMode &rmode)
+bool parseClArgs(int argc, char** argv, Config &cfg, RunMode &rmode, RunOptions &ropts)
 {
     struct option longopts[] = {
         {"adbcmd", required_argument, nullptr, 'a'},
+        {"binary-logcat", no_argument, nullptr, 'B'},
+        {"broadcast", no_argument, nullptr, 'b'},
+        {"composite", no_argument, nullptr, 'C'},
         {"disconnect", required_argument, nullptr, 'd'},
+        {"fixed-timeouts", no_argument, nullptr, 'X'},
         {"help", no_argument, nullptr, 'h'},
+        {"hedge", required_argument, nullptr, 'H'},
+        {"hedge-after", required_argument, nullptr, 'W'},
+        {"hedge-percentile", required_argument, nullptr, 'Q'},
+        {"result-port", required_argument, nullptr, 'F'},
         {"key", required_argument, nullptr, 'k'},
+        {"logcat-hub", no_argument, nullptr, 'L'},
+        {"min-timeout", required_argument, nullptr, 'M'},
+        {"native-shell", no_argument, nullptr, 'n'},
+        {"no-pushdown", no_argument, nullptr, 'P'},
+        {"persistent-shell", no_argument, nullptr, 'p'},
+        {"realtime", no_argument, nullptr, 'T'},
+        {"record", required_argument, nullptr, 'r'},
+        {"replay", required_argument, nullptr, 'R'},
+        {"scan-threads", required_argument, nullptr, 'J'},
+        {"serial", required_argument, nullptr, 'S'},
         {"ssid", required_argument, nullptr, 's'},
         {"type", required_argument, nullptr, 't'},
         {"verbose", required_argument, nullptr, 'v'},
@@ -82,7 +150,7 @@ bool parseClArgs(int argc, char** argv, Config &cfg, RunMode &rmode)
 
     while (1) {
         int option_index = 0;
-        int opt = getopt_long(argc, argv, "a:ds:k:t:v", longopts, &option_index);
+        int opt = getopt_long(argc, argv, "a:bBCdF:H:Lnpr:R:s:S:k:t:v", longopts, &option_index);
 
         if (opt == -1)
             break;
@@ -92,24 +160,125 @@ bool parseClArgs(int argc, char** argv, Config &cfg, RunMode &rmode)
                 builder.setAdbCmd( optarg );
                 break;
 
+            case 'b':
+                builder.setBroadcastEntry( true );
+                break;
+
+            case 'B':
+                builder.setLogcatFormat( "binary" );
+                break;
+
+            case 'C':
+                builder.setCompositeCommand( true );
+                break;
+
             case 'd':
                 dflag = true;
                 break;
 
+            case 'F':
+            {
+                char *end = nullptr;
+                const long port = strtol( optarg, &end, 10 );
+                if (!end || *end || port <= 0 || port > 65535) {
+                    print_err(*argv, "Bad result port %s", optarg);
+                    return false;
+                }
+                builder.setResultPort( static_cast<unsigned short>( port ) );
+            }
+                break;
+
             case 'h':
                 hflag = true;
                 break;
 
+            case 'X':
+                builder.setAdaptiveTimeouts( false );
+                break;
+
+            case 'H':
+            case 'Q':
+            case 'W':
+            {
+                char *end = nullptr;
+                const long val = strtol( optarg, &end, 10 );
+                const long max = opt == 'H' ? 16 : opt == 'Q' ? 100 : 60000;
+                if (!end || *end || val <= 0 || val > max) {
+                    print_err(*argv, "Bad hedge value %s", optarg);
+                    return false;
+                }
+                if (opt == 'H') builder.setHedgeAttempts( static_cast<unsigned int>( val ) );
+                else if (opt == 'Q') builder.setHedgePercentile( static_cast<unsigned int>( val ) );
+                else builder.setHedgeDelayMs( static_cast<unsigned int>( val ) );
+            }
+                break;
+
             case 'k':
                 builder.setPassword( optarg );
                 conn_flag = true;
                 break;
 
+            case 'L':
+                ropts.logcatHub = true;
+                break;
+
+            case 'M':
+            {
+                char *end = nullptr;
+                const long ms = strtol( optarg, &end, 10 );
+                if (!end || *end || ms <= 0 || ms > 60000) {
+                    print_err(*argv, "Bad minimal timeout %s", optarg);
+                    return false;
+                }
+                builder.setMinTimeoutMs( static_cast<unsigned int>( ms ) );
+            }
+                break;
+
+            case 'n':
+                builder.setNativeShell( true );
+                break;
+
+            case 'p':
+                ropts.shellSession = true;
+                break;
+
+            case 'P':
+                builder.setLogcatPushdown( false );
+                break;
+
+            case 'r':
+                ropts.recordFile = optarg;
+                break;
+
+            case 'R':
+                ropts.replayFile = optarg;
+                break;
+
+            case 'J':
+            {
+                char *end = nullptr;
+                const long threads = strtol( optarg, &end, 10 );
+                if (!end || *end || threads <= 0 || threads > 64) {
+                    print_err(*argv, "Bad scan threads %s", optarg);
+                    return false;
+                }
+                ropts.scanThreads = static_cast<unsigned int>( threads );
+            }
+                break;
+
+            case 'T':
+                ropts.realtime = true;
+                break;
+
             case 's':
                 builder.setSsid( optarg );
                 conn_flag = true;
                 break;
 
+            case 'S':
+                builder.setSerial( optarg );
+                break;
+
             case 't':
             {
                 bool found = false;
@@ -147,6 +316,14 @@ bool parseClArgs(int argc, char** argv, Config &cfg, RunMode &rmode)
         return false;
     }
 
+    if (!ropts.replayFile.empty()) {
+        if (dflag || conn_flag) {
+            print_err(*argv, "Replay mode can't be combined with connect or disconnect");
+            return false;
+        }
+        rmode = RunMode::Replay;
+    }
+
     if (conn_flag || dflag) {
         cfg = builder.build();
         if (conn_flag) {
@@ -187,9 +364,10 @@ int main(int argc, char** argv)
 {
     Config cfg;
     RunMode rmode;
+    RunOptions ropts;
     
     Logger::instance().setTag( getPname(*argv) );
-    if (!parseClArgs( argc, argv, cfg, rmode ))
+    if (!parseClArgs( argc, argv, cfg, rmode, ropts ))
         return 1;
 
 #ifndef NDEBUG
@@ -199,23 +377,47 @@ int main(int argc, char** argv)
     if (rmode == RunMode::Help)
         return 0;
 
-    bool run = false;
-    FilePoller fpoll;
-    AdbController adb(std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), fpoll);
-    
-    switch (rmode) {
-        case RunMode::Connect:
-            run = adb.connectWiFi();
-            break;
-        case RunMode::Disconnect:
-            run = adb.disconnectWiFi();
-            break;
-        default:
-            assert( false );
+    if (rmode == RunMode::Replay) {
+        SessionRecording recording;
+        if (!recording.load( ropts.replayFile ))
+            return 255;
+        SessionReplayer replayer( recording );
+        replayer.run( ropts.realtime ? SessionReplayer::Pace::RealTime : SessionReplayer::Pace::AsFastAsPossible );
+        return replayer.exitCode();
     }
-    
-    if (run)
+
+    const std::string clock_state = statePath( ClockStateFile );
+    if (!clock_state.empty()) DeviceClock::instance().load( clock_state );
+    const std::string latency_state = statePath( LatencyStateFile );
+    if (!latency_state.empty()) LatencyHistory::instance().load( latency_state );
+
+    std::shared_ptr<SessionRecorder> recorder;
+    if (!ropts.recordFile.empty()) {
+        recorder = SessionRecorder::open( ropts.recordFile );
+        if (!recorder)
+            return 255;
+    }
+
+    FilePoller fpoll;
+    AdbSwitcher switcher( fpoll );
+    if (ropts.scanThreads) switcher.setScanPool( std::make_shared<ScanPool>( ropts.scanThreads ) );
+    switcher.setLogcatHubs( ropts.logcatHub );
+    switcher.setShellSessions( ropts.shellSession );
+
+    int ret = 255;
+    // one shot run, don't keep the shared streams for their idle timeout
+    auto done = [&ret, &switcher](const AdbSwitcher::Result &res) {
+        ret = !res.started ? 255 : res.succeeded ? 0 : 1;
+        switcher.shutdown();
+    };
+    assert( rmode == RunMode::Connect || rmode == RunMode::Disconnect );
+    const auto mode = rmode == RunMode::Connect ? AdbSwitcher::Mode::Connect : AdbSwitcher::Mode::Disconnect;
+    if (switcher.submit( mode, std::shared_ptr<Config>(&cfg, StaticConfigDeleter()), done, recorder ) !=
+            AdbSwitcher::BadOperationId)
         fpoll.exec();
+
+    if (!clock_state.empty()) DeviceClock::instance().save( clock_state );
+    if (!latency_state.empty()) LatencyHistory::instance().save( latency_state );
     
-    return run ? adb.exitCode() : 255;
+    return ret;
 }
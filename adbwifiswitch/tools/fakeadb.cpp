@@ -0,0 +1,1216 @@
+// fakeadb - stand-in for the Android debug bridge used to exercise adbwifiswitch
+// without a phone. Point adbwifiswitch at it with -a|--adbcmd.
+//
+// Behaviour is driven by environment variables (see usage()), because
+// adbwifiswitch passes a fixed command line to the adb executable.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char AgentTag[] = "adbjoinwifi";
+const char AgentActivity[] = "com.steinwurf.adbjoinwifi/.MainActivity";
+const char AgentReceiver[] = "com.steinwurf.adbjoinwifi/.SwitchReceiver";
+const char ConnectSignature[] = "Mode connect run completed";
+const char DisconnectSignature[] = "Mode disconnect run completed";
+const char ConnectFailedSignature[] = "Mode connect run failed";
+const char AgentSocket[] = "localabstract:adbjoinwifi";
+const char ShellMetaChars[] = ";&|$`<>()\"'\\*?\n";
+const int AgentPid = 4321;
+
+enum {
+    DefaultAmDelayMs = 50,
+    DefaultBroadcastDelayMs = 10,
+    DefaultConnectDelayMs = 300,
+    DefaultDisconnectDelayMs = 100,
+    AgentDebugDelayMs = 10,
+    DefaultRescanMs = 10,
+    DefaultForwardIdleMs = 30000,
+    AgentRequestWaitMs = 5000,
+    AgentHoldMs = 60000,
+    NoiseTickMs = 10,
+    MaxHistoryLines = 256,
+    MaxLaunchRecords = 64,
+    // SwitchReceiver & ResultServer came with it
+    CurrentAgentVersion = 2,
+};
+
+typedef std::chrono::system_clock Clock;
+
+long envLong(const char *name, long def)
+{
+    const char *v = getenv( name );
+    if (!v || !*v) return def;
+    char *end = nullptr;
+    long ret = strtol( v, &end, 10 );
+    return (end && *end == 0) ? ret : def;
+}
+
+// device clock, FAKEADB_CLOCK_OFFSET_MS ahead of the host
+long long nowMs()
+{
+    static const long offset = envLong( "FAKEADB_CLOCK_OFFSET_MS", 0 );
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now().time_since_epoch()).count() + offset;
+}
+
+std::string envStr(const char *name, const char *def = "")
+{
+    const char *v = getenv( name );
+    return v ? std::string(v) : std::string(def);
+}
+
+void sleepMs(long ms)
+{
+    if (ms <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep( &ts, &ts ) < 0 && errno == EINTR);
+}
+
+bool writeAll(int fd, const char *buf, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t ret = write( fd, buf, size );
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll( &pfd, 1, -1 );
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        size -= static_cast<std::size_t>( ret );
+    }
+    return true;
+}
+
+bool writeAll(int fd, const std::string &s)
+{
+    return writeAll( fd, s.data(), s.size() );
+}
+
+[[noreturn]] void hangForever()
+{
+    while (1) pause();
+}
+
+std::string stateDir()
+{
+    std::string dir = envStr( "FAKEADB_STATE_DIR" );
+    if (dir.empty()) dir = std::string("/tmp/fakeadb-") + std::to_string( getuid() );
+    mkdir( dir.c_str(), 0700 );
+    return dir;
+}
+
+std::vector<std::string> splitWords(const std::string &s)
+{
+    std::vector<std::string> ret;
+    std::istringstream is( s );
+    std::string w;
+    while (is >> w) ret.push_back( w );
+    return ret;
+}
+
+std::string joinWords(const std::vector<std::string> &v, std::size_t from = 0)
+{
+    std::string ret;
+    for (std::size_t i = from; i < v.size(); i++) {
+        if (i > from) ret.push_back(' ');
+        ret.append( v[i] );
+    }
+    return ret;
+}
+
+
+// Fault injection: FAKEADB_FAULT=<stage>:<kind>[=arg][,...]
+
+struct Fault {
+    std::string kind;
+    std::string arg;
+};
+
+std::vector<Fault> faultsFor(const std::string &stage)
+{
+    std::vector<Fault> ret;
+    std::string spec = envStr( "FAKEADB_FAULT" );
+    std::size_t pos = 0;
+    while (pos <= spec.size()) {
+        std::size_t end = spec.find( ',', pos );
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr( pos, end - pos );
+        pos = end + 1;
+
+        auto colon = item.find( ':' );
+        if (colon == std::string::npos || item.compare( 0, colon, stage ) != 0) continue;
+        Fault f;
+        f.kind = item.substr( colon + 1 );
+        auto eq = f.kind.find( '=' );
+        if (eq != std::string::npos) {
+            f.arg = f.kind.substr( eq + 1 );
+            f.kind.resize( eq );
+        }
+        ret.push_back( f );
+    }
+    return ret;
+}
+
+std::size_t launchCount();
+
+// Applies the faults configured for a stage; may exit or hang.
+// Sets nosig if the agent should never log its completion signature,
+// nosig=<n> only for the first of every n launches; fail if a connect
+// should log the failure signature instead.
+void applyFaults(const std::string &stage, bool *nosig = nullptr, bool *fail = nullptr)
+{
+    for (auto &f : faultsFor( stage )) {
+        if (f.kind == "hang") {
+            hangForever();
+        } else if (f.kind == "stderr") {
+            writeAll( STDERR_FILENO, (f.arg.empty() ? std::string("error: injected failure") : f.arg) + "\n" );
+        } else if (f.kind == "exit") {
+            exit( static_cast<int>( strtol( f.arg.c_str(), nullptr, 10 ) ) );
+        } else if (f.kind == "delay") {
+            sleepMs( strtol( f.arg.c_str(), nullptr, 10 ) );
+        } else if (f.kind == "nosig") {
+            const long every = f.arg.empty() ? 1 : strtol( f.arg.c_str(), nullptr, 10 );
+            if (nosig && (every <= 1 || launchCount() % static_cast<std::size_t>( every ) == 0)) *nosig = true;
+        } else if (f.kind == "fail") {
+            if (fail) *fail = true;
+        }
+    }
+}
+
+
+// Launch records shared between "am" and "logcat" invocations
+
+struct Launch {
+    long long timeMs = 0;
+    std::string mode;
+    std::string uniq;
+    std::string flags;
+    std::string ssid;
+};
+
+std::string launchFile()
+{
+    return stateDir() + "/launches";
+}
+
+std::size_t launchCount()
+{
+    std::ifstream is( launchFile() );
+    std::size_t ret = 0;
+    std::string line;
+    while (std::getline( is, line )) ret++;
+    return ret;
+}
+
+void recordLaunch(const Launch &l)
+{
+    std::ofstream os( launchFile(), std::ios::app );
+    os << l.timeMs << ' ' << l.mode << ' ' << (l.uniq.empty() ? "-" : l.uniq) << ' '
+       << (l.flags.empty() ? "-" : l.flags) << ' ' << l.ssid << '\n';
+}
+
+bool parseLaunch(const std::string &line, Launch &l)
+{
+    std::istringstream is( line );
+    if (!(is >> l.timeMs >> l.mode >> l.uniq >> l.flags)) return false;
+    if (is.peek() == ' ') is.get();
+    std::getline( is, l.ssid );
+    return true;
+}
+
+
+// Logcat lines
+
+struct LogLine {
+    long long timeMs;
+    int pid;
+    int tid;
+    char prio;
+    std::string tag;
+    std::string msg;
+};
+
+std::string formatThreadTime(const LogLine &l)
+{
+    time_t sec = static_cast<time_t>( l.timeMs / 1000 );
+    struct tm tmv;
+    localtime_r( &sec, &tmv );
+    char buf[64];
+    snprintf( buf, sizeof(buf), "%02d-%02d %02d:%02d:%02d.%03d %5d %5d %c ",
+              tmv.tm_mon + 1, tmv.tm_mday, tmv.tm_hour, tmv.tm_min, tmv.tm_sec,
+              static_cast<int>( l.timeMs % 1000 ), l.pid, l.tid, l.prio );
+    std::string ret( buf );
+    ret.append( l.tag );
+    if (l.tag.size() < 8) ret.append( 8 - l.tag.size(), ' ' );
+    ret.append( ": " );
+    ret.append( l.msg );
+    return ret;
+}
+
+int prioLevel(char prio)
+{
+    static const char Order[] = "VDIWEFS";
+    const char *p = strchr( Order, prio );
+    return p ? static_cast<int>( p - Order ) : 0;
+}
+
+// "logcat -B" record: logger_entry v4 header, prio, tag and message
+void appendEntry(std::string &out, const LogLine &l)
+{
+    struct {
+        uint16_t len;
+        uint16_t hdr_size;
+        int32_t pid;
+        uint32_t tid;
+        uint32_t sec;
+        uint32_t nsec;
+        uint32_t lid;
+        uint32_t uid;
+    } hdr;
+    hdr.len = static_cast<uint16_t>( 1 + l.tag.size() + 1 + l.msg.size() + 1 );
+    hdr.hdr_size = sizeof(hdr);
+    hdr.pid = l.pid;
+    hdr.tid = static_cast<uint32_t>( l.tid );
+    hdr.sec = static_cast<uint32_t>( l.timeMs / 1000 );
+    hdr.nsec = static_cast<uint32_t>( (l.timeMs % 1000) * 1000000 );
+    hdr.lid = 0;
+    hdr.uid = 10000;
+    out.append( reinterpret_cast<const char *>( &hdr ), sizeof(hdr) );
+    out.push_back( static_cast<char>( prioLevel( l.prio ) + 2 ) );
+    out.append( l.tag.c_str(), l.tag.size() + 1 );
+    out.append( l.msg.c_str(), l.msg.size() + 1 );
+}
+
+// Events the agent emits in logcat for one launch record
+void agentEvents(const Launch &l, std::vector<LogLine> &out)
+{
+    const bool nosig = l.flags.find( "nosig" ) != std::string::npos;
+    const bool fail = l.flags.find( "fail" ) != std::string::npos;
+    const std::size_t first = out.size();
+    if (l.mode == "connect") {
+        out.push_back( {l.timeMs + AgentDebugDelayMs, AgentPid, AgentPid, 'D', AgentTag, "Trying to join:"} );
+        out.push_back( {l.timeMs + AgentDebugDelayMs, AgentPid, AgentPid, 'D', AgentTag, "SSID: " + l.ssid} );
+        if (fail) {
+            out.push_back( {l.timeMs + envLong( "FAKEADB_CONNECT_DELAY_MS", DefaultConnectDelayMs ),
+                            AgentPid, AgentPid, 'W', AgentTag,
+                            l.uniq + " " + ConnectFailedSignature + " injected failure"} );
+        } else if (!nosig) {
+            out.push_back( {l.timeMs + envLong( "FAKEADB_CONNECT_DELAY_MS", DefaultConnectDelayMs ),
+                            AgentPid, AgentPid, 'W', AgentTag,
+                            l.uniq + " " + ConnectSignature + " " + l.ssid} );
+        }
+    } else if (l.mode == "disconnect") {
+        if (!nosig) {
+            out.push_back( {l.timeMs + envLong( "FAKEADB_DISCONNECT_DELAY_MS", DefaultDisconnectDelayMs ),
+                            AgentPid, AgentPid, 'W', AgentTag,
+                            l.uniq + " " + DisconnectSignature} );
+        }
+    }
+    out.push_back( {out.size() > first ? out.back().timeMs : l.timeMs, AgentPid, AgentPid, 'D', AgentTag, "onDestroy"} );
+}
+
+class NoiseGenerator {
+public:
+    NoiseGenerator() : m_rng(static_cast<unsigned>( envLong( "FAKEADB_SEED", 1 ) )) {}
+
+    LogLine make(long long timeMs)
+    {
+        static const char * const Tags[] = {"ActivityManager", "WifiStateMachine", "chatty",
+                                            "SurfaceFlinger", "NetworkMonitor", "BatteryService"};
+        static const char * const Msgs[] = {
+            "Background concurrent copying GC freed 12345(1024KB) AllocSpace objects",
+            "uid=1000(system) Binder:1234_5 expire 3 lines",
+            "Start proc 8123:com.android.vending/u0a42 for service",
+            "NetworkAgentInfo [WIFI () - 101] validation passed",
+            "updateTxRxBytes rx=123456 tx=65432",
+            "Display 0 vsync period 16666666ns",
+        };
+        const std::size_t n = m_seq++;
+        const int pid = 1000 + static_cast<int>( m_rng() % 9000 );
+        return {timeMs, pid, pid + static_cast<int>( n % 7 ), "VDIW"[n % 4],
+                Tags[n % (sizeof(Tags)/sizeof(Tags[0]))],
+                std::string(Msgs[m_rng() % (sizeof(Msgs)/sizeof(Msgs[0]))]) + " #" + std::to_string( n )};
+    }
+
+private:
+    std::mt19937 m_rng;
+    std::size_t m_seq = 0;
+};
+
+
+// logcat
+
+class Logcat {
+public:
+    Logcat(bool pty) : m_pty(pty) {}
+
+    bool parseArgs(const std::vector<std::string> &args);
+    int run();
+
+private:
+    bool accept(const LogLine &l) const;
+    bool emit(const LogLine &l);
+    void scanLaunches(std::vector<LogLine> &events);
+
+    bool m_pty;
+    bool m_binary = false;
+    bool m_dumpOnly = false;
+    long m_tail = -1;
+    long long m_since = -1;
+    long m_maxCount = -1;
+    long m_printed = 0;
+    bool m_hasRegex = false;
+    std::regex m_regex;
+    std::vector<std::pair<std::string, char> > m_filters;
+    char m_defaultFilter = 'V';
+    std::string m_out;
+    std::streamoff m_launchOffset = 0;
+};
+
+bool Logcat::parseArgs(const std::vector<std::string> &args)
+{
+    for (std::size_t i = 0; i < args.size(); i++) {
+        std::string a = args[i];
+        auto value = [&](const char *opt) -> std::string {
+            if (a.size() > strlen( opt )) return a.substr( strlen( opt ) );
+            return i + 1 < args.size() ? args[++i] : std::string();
+        };
+        if (a.compare( 0, 2, "-v" ) == 0) {
+            value( "-v" );
+        } else if (a.compare( 0, 2, "-T" ) == 0 || a.compare( 0, 2, "-t" ) == 0) {
+            std::string v = value( "-T" );
+            if (v.size() >= 2 && v.front() == '\'' && v.back() == '\'') v = v.substr( 1, v.size() - 2 );
+            if (v.find( '.' ) != std::string::npos) {
+                m_since = static_cast<long long>( strtod( v.c_str(), nullptr ) * 1000.0 );
+            } else {
+                m_tail = strtol( v.c_str(), nullptr, 10 );
+            }
+            if (a[1] == 't') m_dumpOnly = true;
+        } else if (a.compare( 0, 2, "-m" ) == 0) {
+            m_maxCount = strtol( value( "-m" ).c_str(), nullptr, 10 );
+        } else if (a.compare( 0, 2, "-e" ) == 0) {
+            std::string v = value( "-e" );
+            if (v.size() >= 2 && v.front() == '\'' && v.back() == '\'') v = v.substr( 1, v.size() - 2 );
+            try {
+                m_regex = std::regex( v );
+                m_hasRegex = true;
+            } catch (const std::regex_error &) {
+                writeAll( STDERR_FILENO, "logcat: invalid regex " + v + "\n" );
+                return false;
+            }
+        } else if (a == "-B") {
+            m_binary = true;
+        } else if (a == "-d") {
+            m_dumpOnly = true;
+        } else if (a == "-s") {
+            m_defaultFilter = 'S';
+        } else if (a.compare( 0, 2, "-b" ) == 0) {
+            value( "-b" );
+        } else if (a.find( ':' ) != std::string::npos && a[0] != '-') {
+            auto colon = a.rfind( ':' );
+            char prio = colon + 1 < a.size() ? a[colon + 1] : 'V';
+            if (a.compare( 0, colon, "*" ) == 0) m_defaultFilter = prio;
+            else m_filters.emplace_back( a.substr( 0, colon ), prio );
+        } else {
+            writeAll( STDERR_FILENO, "logcat: unknown option " + a + "\n" );
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Logcat::accept(const LogLine &l) const
+{
+    char level = m_defaultFilter;
+    for (auto &f : m_filters) {
+        if (f.first == l.tag) {
+            level = f.second;
+            break;
+        }
+    }
+    if (prioLevel( l.prio ) < prioLevel( level ) || level == 'S') return false;
+    if (m_hasRegex && !std::regex_search( l.msg, m_regex )) return false;
+    return true;
+}
+
+bool Logcat::emit(const LogLine &l)
+{
+    if (!accept( l )) return true;
+    if (m_binary) {
+        std::string entry;
+        appendEntry( entry, l );
+        // a pty translates line feeds, which breaks the binary stream
+        for (char c : entry) {
+            if (c == '\n' && m_pty) m_out.push_back( '\r' );
+            m_out.push_back( c );
+        }
+    } else {
+        m_out.append( formatThreadTime( l ) );
+        m_out.append( m_pty ? "\r\n" : "\n" );
+    }
+    return m_maxCount < 0 || ++m_printed < m_maxCount;
+}
+
+void Logcat::scanLaunches(std::vector<LogLine> &events)
+{
+    std::ifstream is( launchFile() );
+    if (!is) return;
+    is.seekg( 0, std::ios::end );
+    const std::streamoff size = is.tellg();
+    if (size < m_launchOffset) m_launchOffset = 0;
+    if (size == m_launchOffset) return;
+    is.seekg( m_launchOffset );
+
+    std::deque<Launch> launches;
+    std::string line;
+    while (std::getline( is, line )) {
+        Launch l;
+        if (parseLaunch( line, l )) {
+            launches.push_back( l );
+            if (launches.size() > MaxLaunchRecords) launches.pop_front();
+        }
+    }
+    m_launchOffset = size;
+    for (auto &l : launches) agentEvents( l, events );
+}
+
+int Logcat::run()
+{
+    applyFaults( "logcat" );
+
+    NoiseGenerator noise;
+    const long rate = envLong( "FAKEADB_NOISE_RATE", 0 );
+    const long long start = nowMs();
+
+    std::vector<LogLine> pending;
+    scanLaunches( pending );
+    std::stable_sort( pending.begin(), pending.end(),
+                      [](const LogLine &a, const LogLine &b) {return a.timeMs < b.timeMs;} );
+
+    // history: whatever the device buffer would have had before we attached
+    std::vector<LogLine> history;
+    auto due = std::partition_point( pending.begin(), pending.end(),
+                                     [&](const LogLine &l) {return l.timeMs <= start;} );
+    history.assign( pending.begin(), due );
+    pending.erase( pending.begin(), due );
+    if (m_since >= 0) {
+        history.erase( std::remove_if( history.begin(), history.end(),
+                                       [&](const LogLine &l) {return l.timeMs < m_since;} ), history.end() );
+    }
+    long history_lines = m_tail >= 0 ? m_tail : (m_since >= 0 ? static_cast<long>( history.size() ) : static_cast<long>( MaxHistoryLines ));
+    for (long i = static_cast<long>( history.size() ); i < history_lines && rate > 0; i++) {
+        history.insert( history.begin(), noise.make( start - (history_lines - i) ) );
+    }
+    if (static_cast<long>( history.size() ) > history_lines) {
+        history.erase( history.begin(), history.end() - history_lines );
+    }
+    for (auto &l : history) {
+        if (!emit( l )) {
+            writeAll( STDOUT_FILENO, m_out );
+            return 0;
+        }
+    }
+    if (!writeAll( STDOUT_FILENO, m_out )) return 1;
+    m_out.clear();
+    if (m_dumpOnly) return 0;
+
+    const long rescan = envLong( "FAKEADB_RESCAN_MS", DefaultRescanMs );
+    double noise_due = 0.0;
+    long long last = start, last_scan = start;
+    while (1) {
+        const long long now = nowMs();
+        if (now - last_scan >= rescan) {
+            last_scan = now;
+            const std::size_t before = pending.size();
+            scanLaunches( pending );
+            if (pending.size() != before) {
+                std::stable_sort( pending.begin(), pending.end(),
+                                  [](const LogLine &a, const LogLine &b) {return a.timeMs < b.timeMs;} );
+            }
+        }
+
+        bool more = true;
+        if (rate > 0) {
+            noise_due += static_cast<double>( rate ) * static_cast<double>( now - last ) / 1000.0;
+            while (more && noise_due >= 1.0) {
+                more = emit( noise.make( now ) );
+                noise_due -= 1.0;
+            }
+        }
+        last = now;
+        while (more && !pending.empty() && pending.front().timeMs <= now) {
+            more = emit( pending.front() );
+            pending.erase( pending.begin() );
+        }
+        if (!m_out.empty()) {
+            if (!writeAll( STDOUT_FILENO, m_out )) return 1;
+            m_out.clear();
+        }
+        if (!more) return 0;
+
+        long long timeo = rescan - (now - last_scan);
+        if (rate > 0) timeo = std::min<long long>( timeo, NoiseTickMs );
+        if (!pending.empty()) timeo = std::min<long long>( timeo, std::max<long long>( 0, pending.front().timeMs - now ) );
+
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        int pret = poll( &pfd, 1, static_cast<int>( timeo ) );
+        if (pret > 0) {
+            char buf[256];
+            ssize_t rd = read( STDIN_FILENO, buf, sizeof(buf) );
+            if (rd == 0) return 0;
+            if (rd > 0 && memchr( buf, 0x03, static_cast<std::size_t>( rd ) )) return 130;
+            if (rd < 0 && errno != EAGAIN && errno != EINTR) return 0;
+            if (pfd.revents & (POLLHUP | POLLERR)) return 0;
+        }
+    }
+}
+
+
+// am
+
+bool olderAgent()
+{
+    return envLong( "FAKEADB_AGENT_VERSION", CurrentAgentVersion ) < CurrentAgentVersion;
+}
+
+int amMain(const std::vector<std::string> &args)
+{
+    const bool broadcast = !args.empty() && args[0] == "broadcast";
+    if (args.empty() || (args[0] != "start" && !broadcast)) {
+        writeAll( STDERR_FILENO, "am: only 'start' and 'broadcast' are supported\n" );
+        return 1;
+    }
+
+    std::string component;
+    Launch l;
+    for (std::size_t i = 1; i < args.size(); i++) {
+        const std::string &a = args[i];
+        if (a == "-n" && i + 1 < args.size()) {
+            component = args[++i];
+        } else if ((a == "-e" || a == "--es") && i + 2 < args.size()) {
+            const std::string &key = args[i + 1];
+            const std::string &val = args[i + 2];
+            i += 2;
+            if (key == "mode") l.mode = val;
+            else if (key == "uniq") l.uniq = val;
+            else if (key == "ssid") l.ssid = val;
+        }
+    }
+
+    bool nosig = false, fail = false;
+    applyFaults( "am", &nosig, &fail );
+    // an activity start pays for the process, window & first frame; a receiver only for the process
+    sleepMs( broadcast ? envLong( "FAKEADB_BROADCAST_DELAY_MS", DefaultBroadcastDelayMs )
+                       : envLong( "FAKEADB_AM_DELAY_MS", DefaultAmDelayMs ) );
+
+    if (broadcast && (component != AgentReceiver || olderAgent())) {
+        // nobody receives it, which am doesn't consider an error
+        writeAll( STDOUT_FILENO, "Broadcasting: Intent { flg=0x400000 cmp=" + component + " }\n"
+                                 "Broadcast completed: result=0\n" );
+        return 0;
+    }
+    if (!broadcast && component != AgentActivity) {
+        writeAll( STDOUT_FILENO, "Starting: Intent { cmp=" + component + " }\n"
+                                 "Error type 3\nError: Activity class {" + component + "} does not exist.\n" );
+        return 1;
+    }
+
+    if (l.mode.empty()) l.mode = "connect";
+    l.timeMs = nowMs();
+    l.flags = nosig ? "nosig" : (fail ? "fail" : "");
+    recordLaunch( l );
+
+    if (!broadcast) {
+        writeAll( STDOUT_FILENO, std::string("Starting: Intent { cmp=") + AgentActivity + " (has extras) }\n" );
+        return 0;
+    }
+    // am waits for the receiver's goAsync() run to finish
+    writeAll( STDOUT_FILENO, std::string("Broadcasting: Intent { flg=0x400000 cmp=") + AgentReceiver + " (has extras) }\n" );
+    if (!nosig) {
+        sleepMs( l.mode == "disconnect" ? envLong( "FAKEADB_DISCONNECT_DELAY_MS", DefaultDisconnectDelayMs )
+                                        : envLong( "FAKEADB_CONNECT_DELAY_MS", DefaultConnectDelayMs ) );
+    }
+    writeAll( STDOUT_FILENO, "Broadcast completed: result=0\n" );
+    return 0;
+}
+
+
+// daemons listening on loopback ports, one process per client
+
+bool daemonRunning(const std::string &pidFile, pid_t *pid = nullptr)
+{
+    std::ifstream is( pidFile );
+    long p = 0;
+    if (!(is >> p) || p <= 0 || kill( static_cast<pid_t>( p ), 0 ) != 0) return false;
+    if (pid) *pid = static_cast<pid_t>( p );
+    return true;
+}
+
+[[noreturn]] void daemonLoop(int lfd, const std::string &pidFile, int idleMs, void (*serve)(int))
+{
+    setsid();
+    int null_fd = open( "/dev/null", O_RDWR );
+    for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) dup2( null_fd, fd );
+    close( null_fd );
+    signal( SIGCHLD, SIG_IGN );
+
+    while (1) {
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        int pret = poll( &pfd, 1, idleMs );
+        if (pret == 0) break;
+        if (pret < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int cfd = accept( lfd, nullptr, nullptr );
+        if (cfd < 0) continue;
+        if (fork() == 0) {
+            close( lfd );
+            signal( SIGCHLD, SIG_DFL );
+            serve( cfd );
+            close( cfd );
+            _exit( 0 );
+        }
+        close( cfd );
+    }
+    pid_t pid;
+    if (daemonRunning( pidFile, &pid ) && pid == getpid()) unlink( pidFile.c_str() );
+    _exit( 0 );
+}
+
+// 0 and the daemon is running, 1 with the error printed otherwise
+int startDaemon(long port, const std::string &pidFile, int idleMs, void (*serve)(int))
+{
+    int lfd = socket( AF_INET, SOCK_STREAM, 0 );
+    int on = 1;
+    setsockopt( lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( static_cast<uint16_t>( port ) );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if (lfd < 0 || bind( lfd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof(addr) ) < 0 || listen( lfd, 16 ) < 0) {
+        writeAll( STDERR_FILENO, "error: cannot bind listener: " + std::string(strerror( errno )) + "\n" );
+        if (lfd >= 0) close( lfd );
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0) daemonLoop( lfd, pidFile, idleMs, serve );
+    close( lfd );
+    std::ofstream( pidFile ) << pid << '\n';
+    return 0;
+}
+
+void stopDaemon(const std::string &pidFile)
+{
+    pid_t pid;
+    // the daemon leads its own group, clients still being served go with it
+    if (daemonRunning( pidFile, &pid )) kill( -pid, SIGTERM );
+    unlink( pidFile.c_str() );
+}
+
+
+// forward: a daemon on the host port stands in for the agent's result socket
+
+std::string forwardPidFile(long port)
+{
+    return stateDir() + "/forward-" + std::to_string( port ) + ".pid";
+}
+
+bool forwardRunning(long port)
+{
+    return daemonRunning( forwardPidFile( port ) );
+}
+
+void removeForward(long port)
+{
+    stopDaemon( forwardPidFile( port ) );
+}
+
+void removeAllForwards()
+{
+    DIR *dir = opendir( stateDir().c_str() );
+    if (!dir) return;
+    std::vector<long> ports;
+    while (struct dirent *de = readdir( dir )) {
+        long port;
+        if (sscanf( de->d_name, "forward-%ld.pid", &port ) == 1) ports.push_back( port );
+    }
+    closedir( dir );
+    for (long port : ports) removeForward( port );
+}
+
+// One host connection: "uniq\n" in, one frame with the signature line out
+// when the agent would have logged it. Without a launch for uniq the agent
+// isn't running, so the connection is dropped like adb does.
+void serveAgentClient(int fd)
+{
+    std::string req;
+    char buf[256];
+    while (req.find( '\n' ) == std::string::npos) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll( &pfd, 1, AgentRequestWaitMs ) <= 0) return;
+        ssize_t rd = read( fd, buf, sizeof(buf) );
+        if (rd <= 0) return;
+        req.append( buf, static_cast<std::size_t>( rd ) );
+    }
+    const std::string uniq = req.substr( 0, req.find_first_of( "\r\n" ) );
+    applyFaults( "agent" );
+    // built before the ResultServer, nobody listens on the socket
+    if (olderAgent()) return;
+
+    Launch launch;
+    bool found = false;
+    std::ifstream is( launchFile() );
+    std::string line;
+    while (std::getline( is, line )) {
+        Launch l;
+        if (parseLaunch( line, l ) && l.uniq == uniq) {
+            launch = l;
+            found = true;
+        }
+    }
+    if (!found) return;
+
+    std::vector<LogLine> events;
+    agentEvents( launch, events );
+    for (auto &e : events) {
+        if (e.prio != 'W') continue;
+        sleepMs( static_cast<long>( e.timeMs - nowMs() ) );
+        std::string frame;
+        frame.push_back( static_cast<char>( (e.msg.size() >> 8) & 0xff ) );
+        frame.push_back( static_cast<char>( e.msg.size() & 0xff ) );
+        frame.append( e.msg );
+        writeAll( fd, frame );
+        return;
+    }
+    // nosig: the agent never answers, the host gives up first
+    struct pollfd pfd = {fd, POLLIN, 0};
+    poll( &pfd, 1, AgentHoldMs );
+}
+
+long parseTcpSpec(const std::string &spec)
+{
+    if (spec.compare( 0, 4, "tcp:" ) != 0) return -1;
+    char *end = nullptr;
+    long port = strtol( spec.c_str() + 4, &end, 10 );
+    return (end && *end == 0 && port > 0 && port < 65536) ? port : -1;
+}
+
+int forwardMain(const std::vector<std::string> &args)
+{
+    applyFaults( "forward" );
+
+    if (args.size() == 1 && args[0] == "--remove-all") {
+        removeAllForwards();
+        return 0;
+    }
+    if (args.size() == 2 && args[0] == "--remove" && parseTcpSpec( args[1] ) > 0) {
+        removeForward( parseTcpSpec( args[1] ) );
+        return 0;
+    }
+    std::size_t i = args.size() == 3 && args[0] == "--no-rebind" ? 1 : 0;
+    const long port = args.size() == i + 2 ? parseTcpSpec( args[i] ) : -1;
+    if (port < 0 || args[i + 1] != AgentSocket) {
+        writeAll( STDERR_FILENO, std::string("error: only 'forward tcp:<port> ") + AgentSocket + "' is supported\n" );
+        return 1;
+    }
+    if (forwardRunning( port )) return 0;
+    return startDaemon( port, forwardPidFile( port ),
+                        static_cast<int>( envLong( "FAKEADB_FORWARD_IDLE_MS", DefaultForwardIdleMs ) ),
+                        serveAgentClient );
+}
+
+
+// shell
+
+std::string selfExe()
+{
+    char buf[PATH_MAX];
+    ssize_t n = readlink( "/proc/self/exe", buf, sizeof(buf) - 1 );
+    if (n <= 0) return std::string();
+    buf[n] = 0;
+    return buf;
+}
+
+// Directory with am/logcat links to this executable, used as PATH head for sh
+std::string toolsDir()
+{
+    std::string dir = stateDir() + "/bin";
+    mkdir( dir.c_str(), 0700 );
+    const std::string exe = selfExe();
+    for (auto name : {"am", "logcat", "date", "cmd"}) {
+        std::string link = dir + "/" + name;
+        char cur[PATH_MAX];
+        ssize_t n = readlink( link.c_str(), cur, sizeof(cur) - 1 );
+        if (n > 0 && exe.compare( 0, std::string::npos, cur, static_cast<std::size_t>( n ) ) == 0) continue;
+        unlink( link.c_str() );
+        symlink( exe.c_str(), link.c_str() );
+    }
+    return dir;
+}
+
+int dispatchTool(const std::string &name, const std::vector<std::string> &args, bool pty);
+
+int shellMain(const std::vector<std::string> &args, bool pty)
+{
+    applyFaults( "shell" );
+
+    if (pty) {
+        dup2( STDOUT_FILENO, STDERR_FILENO );
+        setenv( "FAKEADB_PTY", "1", 1 );
+    }
+
+    const std::string cmd = joinWords( args );
+    if (!cmd.empty() && cmd.find_first_of( ShellMetaChars ) == std::string::npos) {
+        auto words = splitWords( cmd );
+        if (!words.empty() && (words[0] == "am" || words[0] == "logcat" || words[0] == "date" ||
+                               words[0] == "cmd")) {
+            return dispatchTool( words[0], std::vector<std::string>( words.begin() + 1, words.end() ), pty );
+        }
+    }
+
+    std::string path = toolsDir();
+    const char *old_path = getenv( "PATH" );
+    if (old_path) path.append( ":" ).append( old_path );
+    setenv( "PATH", path.c_str(), 1 );
+
+    if (cmd.empty() && (pty || isatty( STDIN_FILENO ))) {
+        setenv( "PS1", "fake:/ $ ", 1 );
+        execl( "/bin/sh", "sh", "-i", static_cast<char *>( nullptr ) );
+    } else if (cmd.empty()) {
+        // commands piped in, no prompts
+        execl( "/bin/sh", "sh", "-s", static_cast<char *>( nullptr ) );
+    } else {
+        execl( "/bin/sh", "sh", "-c", cmd.c_str(), static_cast<char *>( nullptr ) );
+    }
+    writeAll( STDERR_FILENO, "fakeadb: can't exec /bin/sh\n" );
+    return 127;
+}
+
+// date [+%s.%N], other formats aren't needed
+int dateMain(const std::vector<std::string> &args)
+{
+    const long long now = nowMs();
+    char buf[64];
+    if (!args.empty() && args[0] == "+%s.%N") {
+        snprintf( buf, sizeof(buf), "%lld.%03lld000000\n", now / 1000, now % 1000 );
+    } else {
+        time_t sec = static_cast<time_t>( now / 1000 );
+        struct tm tmv;
+        localtime_r( &sec, &tmv );
+        strftime( buf, sizeof(buf), "%a %b %e %H:%M:%S %Z %Y\n", &tmv );
+    }
+    return writeAll( STDOUT_FILENO, buf ) ? 0 : 1;
+}
+
+// cmd package query-receivers --brief -n <component>, the agent's receiver only
+int cmdMain(const std::vector<std::string> &args)
+{
+    if (args.size() < 2 || args[0] != "package" || args[1] != "query-receivers") {
+        writeAll( STDERR_FILENO, "cmd: only 'package query-receivers' is supported\n" );
+        return 1;
+    }
+    std::string component;
+    for (std::size_t i = 2; i + 1 < args.size(); i++) {
+        if (args[i] == "-n") component = args[i + 1];
+    }
+    if (component != AgentReceiver || olderAgent()) return writeAll( STDOUT_FILENO, "No receivers found\n" ) ? 0 : 1;
+    return writeAll( STDOUT_FILENO, "priority=0 preferredOrder=0 match=0x108000 specificIndex=-1 isDefault=false\n" +
+                                    component + "\n" ) ? 0 : 1;
+}
+
+int dispatchTool(const std::string &name, const std::vector<std::string> &args, bool pty)
+{
+    if (name == "am") return amMain( args );
+    if (name == "date") return dateMain( args );
+    if (name == "cmd") return cmdMain( args );
+    Logcat lc( pty );
+    if (!lc.parseArgs( args )) return 1;
+    return lc.run();
+}
+
+// server: what a client finds on ANDROID_ADB_SERVER_PORT, enough of the
+// smart socket protocol to open "shell,v2" services on the fake device
+
+enum ShellPacket : char {
+    PktStdin = 0,
+    PktStdout = 1,
+    PktStderr = 2,
+    PktExit = 3,
+    PktCloseStdin = 4,
+    PktWindowSize = 5,
+};
+
+std::string serverPidFile(long port)
+{
+    return stateDir() + "/server-" + std::to_string( port ) + ".pid";
+}
+
+long serverPort()
+{
+    const long port = envLong( "ANDROID_ADB_SERVER_PORT", 0 );
+    return port > 0 && port < 65536 ? port : 0;
+}
+
+bool readExact(int fd, char *buf, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t rd = read( fd, buf, size );
+        if (rd < 0 && errno == EINTR) continue;
+        if (rd <= 0) return false;
+        buf += rd;
+        size -= static_cast<std::size_t>( rd );
+    }
+    return true;
+}
+
+bool readRequest(int fd, std::string &req)
+{
+    char len[5] = {};
+    if (!readExact( fd, len, 4 )) return false;
+    req.resize( strtoul( len, nullptr, 16 ) );
+    return readExact( fd, &req[0], req.size() );
+}
+
+void replyFail(int fd, const std::string &msg)
+{
+    char len[8];
+    snprintf( len, sizeof(len), "%04x", static_cast<unsigned int>( msg.size() & 0xffff ) );
+    writeAll( fd, "FAIL" + std::string(len) + msg );
+}
+
+bool writePacket(int fd, ShellPacket id, const char *buf, std::size_t size)
+{
+    std::string pkt( 1, id );
+    for (unsigned int i = 0; i < 4; i++) pkt.push_back( static_cast<char>( (size >> (8 * i)) & 0xff ) );
+    pkt.append( buf, size );
+    return writeAll( fd, pkt );
+}
+
+// Runs the command like "fakeadb shell" would, its stdio goes to the
+// client as packets; the exit packet follows once stdout & stderr close
+void serveShellV2(int fd, const std::string &cmd, bool pty)
+{
+    int in[2], out[2], err[2];
+    if (pipe( in ) < 0 || pipe( out ) < 0 || pipe( err ) < 0) return;
+    pid_t pid = fork();
+    if (pid < 0) return;
+    if (pid == 0) {
+        setpgid( 0, 0 );
+        dup2( in[0], STDIN_FILENO );
+        dup2( out[1], STDOUT_FILENO );
+        dup2( err[1], STDERR_FILENO );
+        for (int p : {in[0], in[1], out[0], out[1], err[0], err[1], fd}) close( p );
+        std::vector<std::string> args;
+        if (!cmd.empty()) args.push_back( cmd );
+        _exit( shellMain( args, pty ) );
+    }
+    close( in[0] );
+    close( out[1] );
+    close( err[1] );
+
+    std::string inbuf;
+    int to_child = in[1];
+    struct pollfd pfds[3] = {{fd, POLLIN, 0}, {out[0], POLLIN, 0}, {err[0], POLLIN, 0}};
+    char buf[4096];
+    while (pfds[1].fd >= 0 || pfds[2].fd >= 0) {
+        if (poll( pfds, 3, -1 ) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 1; i < 3; i++) {
+            if (pfds[i].fd < 0 || !pfds[i].revents) continue;
+            ssize_t rd = read( pfds[i].fd, buf, sizeof(buf) );
+            if (rd > 0) {
+                writePacket( fd, i == 1 ? PktStdout : PktStderr, buf, static_cast<std::size_t>( rd ) );
+            } else {
+                close( pfds[i].fd );
+                pfds[i].fd = -1;
+            }
+        }
+        if (!pfds[0].revents) continue;
+        ssize_t rd = read( fd, buf, sizeof(buf) );
+        if (rd <= 0) {
+            // the client is gone, so is the command
+            kill( -pid, SIGHUP );
+            waitpid( pid, nullptr, 0 );
+            return;
+        }
+        inbuf.append( buf, static_cast<std::size_t>( rd ) );
+        while (inbuf.size() >= 5) {
+            std::size_t len = 0;
+            for (unsigned int i = 0; i < 4; i++) len |= static_cast<std::size_t>( static_cast<unsigned char>( inbuf[1 + i] ) ) << (8 * i);
+            if (inbuf.size() < 5 + len) break;
+            if (inbuf[0] == PktStdin && to_child >= 0) {
+                writeAll( to_child, inbuf.data() + 5, len );
+            } else if (inbuf[0] == PktCloseStdin && to_child >= 0) {
+                close( to_child );
+                to_child = -1;
+            }
+            // window size: there is no terminal to resize
+            inbuf.erase( 0, 5 + len );
+        }
+    }
+    if (to_child >= 0) close( to_child );
+
+    int status = 0;
+    waitpid( pid, &status, 0 );
+    const char code = static_cast<char>( WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status ) );
+    writePacket( fd, PktExit, &code, 1 );
+}
+
+// "host:transport*" requests, then one service; FAKEADB_SHELL_V2=0 is
+// a device without the shell_v2 feature
+void serveServerClient(int fd)
+{
+    std::string req;
+    while (readRequest( fd, req )) {
+        if (req == "host:transport-any" || req == "host:transport" || req.compare( 0, 15, "host:transport:" ) == 0) {
+            writeAll( fd, "OKAY" );
+            continue;
+        }
+        if (req == "host:features") {
+            const std::string features = envLong( "FAKEADB_SHELL_V2", 1 ) ? "shell_v2,cmd" : "cmd";
+            char len[8];
+            snprintf( len, sizeof(len), "%04x", static_cast<unsigned int>( features.size() ) );
+            writeAll( fd, "OKAY" + std::string(len) + features );
+            return;
+        }
+        const bool raw = req.compare( 0, 13, "shell,v2,raw:" ) == 0;
+        const bool pty = req.compare( 0, 13, "shell,v2,pty:" ) == 0;
+        if ((raw || pty) && envLong( "FAKEADB_SHELL_V2", 1 )) {
+            writeAll( fd, "OKAY" );
+            serveShellV2( fd, req.substr( 13 ), pty );
+            return;
+        }
+        replyFail( fd, raw || pty ? "closed" : "unknown service " + req );
+        return;
+    }
+}
+
+int startServer(long port)
+{
+    if (daemonRunning( serverPidFile( port ) )) return 0;
+    return startDaemon( port, serverPidFile( port ),
+                        static_cast<int>( envLong( "FAKEADB_FORWARD_IDLE_MS", DefaultForwardIdleMs ) ),
+                        serveServerClient );
+}
+
+
+void usage(const char *pname)
+{
+    fprintf(stderr, "Usage:\n%s [-s <serial>] shell [-t|-T] [command...]\n"
+                    "%s [-s <serial>] exec-out command...\n"
+                    "%s [-s <serial>] forward [--remove|--remove-all] tcp:<port> localabstract:adbjoinwifi\n"
+                    "%s devices|version|start-server|kill-server|wait-for-device\n"
+                    "Environment:\n"
+                    " FAKEADB_STATE_DIR - launch records & tool links, default /tmp/fakeadb-<uid>\n"
+                    " FAKEADB_AM_DELAY_MS - 'am start' latency, default %d\n"
+                    " FAKEADB_BROADCAST_DELAY_MS - 'am broadcast' latency, default %d\n"
+                    " FAKEADB_CONNECT_DELAY_MS - launch to connect signature, default %d\n"
+                    " FAKEADB_DISCONNECT_DELAY_MS - launch to disconnect signature, default %d\n"
+                    " FAKEADB_NOISE_RATE - background logcat lines per second, default 0\n"
+                    " FAKEADB_CLOCK_OFFSET_MS - device clock ahead of host, default 0\n"
+                    " FAKEADB_RESCAN_MS - how often a running logcat looks for new launches, default %d\n"
+                    " FAKEADB_FORWARD_IDLE_MS - forward & server daemons exit after that long idle, default %d\n"
+                    " ANDROID_ADB_SERVER_PORT - serve 'shell,v2' there, any command starts the server\n"
+                    " FAKEADB_SHELL_V2 - 0 for a device without shell protocol v2, default 1\n"
+                    " FAKEADB_AGENT_VERSION - 1 for an agent without SwitchReceiver & ResultServer, default %d\n"
+                    " FAKEADB_SEED - noise generator seed\n"
+                    " FAKEADB_FAULT - <stage>:<kind>[=arg],... stage am|logcat|shell|forward|agent,\n"
+                    "\tkind hang|stderr=<msg>|exit=<code>|delay=<ms>|nosig[=<every n-th launch>]|fail\n",
+            pname, pname, pname, pname, DefaultAmDelayMs, DefaultBroadcastDelayMs, DefaultConnectDelayMs,
+            DefaultDisconnectDelayMs,
+            DefaultRescanMs, DefaultForwardIdleMs, CurrentAgentVersion);
+}
+
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    signal( SIGPIPE, SIG_IGN );
+
+    const char *slash = strrchr( argv[0], '/' );
+    const std::string pname( slash ? slash + 1 : argv[0] );
+    std::vector<std::string> args( argv + 1, argv + argc );
+
+    if (pname == "am" || pname == "logcat" || pname == "date" || pname == "cmd") {
+        return dispatchTool( pname, args, getenv( "FAKEADB_PTY" ) != nullptr );
+    }
+
+    std::size_t i = 0;
+    while (i < args.size() && args[i].size() > 1 && args[i][0] == '-') {
+        if (args[i] == "-h" || args[i] == "--help") {
+            usage( pname.c_str() );
+            return 0;
+        }
+        if ((args[i] == "-s" || args[i] == "-H" || args[i] == "-P") && i + 1 < args.size()) i++;
+        i++;
+    }
+    if (i >= args.size()) {
+        usage( pname.c_str() );
+        return 1;
+    }
+
+    const std::string cmd = args[i++];
+    // like adb, the first client starts the server
+    if (serverPort() && cmd != "kill-server" && startServer( serverPort() ) != 0) return 1;
+
+    if (cmd == "shell" || cmd == "exec-out") {
+        bool pty = false;
+        while (cmd == "shell" && i < args.size() && args[i].size() == 2 && args[i][0] == '-') {
+            if (args[i] == "-t") pty = true;
+            else if (args[i] == "-T") pty = false;
+            else if (args[i] != "-x" && args[i] != "-n") break;
+            i++;
+        }
+        return shellMain( std::vector<std::string>( args.begin() + static_cast<long>( i ), args.end() ), pty );
+    } else if (cmd == "forward") {
+        return forwardMain( std::vector<std::string>( args.begin() + static_cast<long>( i ), args.end() ) );
+    } else if (cmd == "kill-server") {
+        removeAllForwards();
+        if (serverPort()) stopDaemon( serverPidFile( serverPort() ) );
+    } else if (cmd == "devices") {
+        writeAll( STDOUT_FILENO, "List of devices attached\nfake0001\tdevice\n\n" );
+    } else if (cmd == "version") {
+        writeAll( STDOUT_FILENO, "Android Debug Bridge version 1.0.41 (fakeadb)\n" );
+    } else if (cmd != "start-server" && cmd != "kill-server" && cmd != "wait-for-device") {
+        writeAll( STDERR_FILENO, "fakeadb: unknown command " + cmd + "\n" );
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+package com.steinwurf.adbjoinwifi;
+
+import android.net.LocalServerSocket;
+import android.net.LocalSocket;
+import android.util.Log;
+
+import java.io.BufferedReader;
+import java.io.IOException;
+import java.io.InputStreamReader;
+import java.io.OutputStream;
+import java.nio.charset.Charset;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
+/**
+ * Hands operation results to the host without logcat. The host forwards a
+ * TCP port to it with "adb forward tcp:PORT localabstract:adbjoinwifi",
+ * sends "uniq\n" and gets a single frame back: 2 bytes big endian length,
+ * then the same text the signature line in logcat has.
+ *
+ * Results are kept for a while, so a host connecting after the operation
+ * completed still gets its answer.
+ */
+final class ResultServer
+{
+    private static final String TAG = "adbjoinwifi";
+    static final String SOCKET_NAME = "adbjoinwifi";
+
+    private static final int MAX_RESULTS = 16;
+    private static final long WAIT_TIME_MS = 60000;
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    private static ResultServer sInstance;
+
+    private final Map<String, String> mResults = new LinkedHashMap<String, String>()
+    {
+        @Override
+        protected boolean removeEldestEntry(Map.Entry<String, String> eldest)
+        {
+            return size() > MAX_RESULTS;
+        }
+    };
+
+    private ResultServer()
+    {
+    }
+
+    static synchronized ResultServer start()
+    {
+        if (sInstance != null)
+            return sInstance;
+
+        final LocalServerSocket server;
+        try
+        {
+            server = new LocalServerSocket(SOCKET_NAME);
+        }
+        catch (IOException e)
+        {
+            Log.e(TAG, "Result channel is not available", e);
+            return null;
+        }
+
+        sInstance = new ResultServer();
+        Thread acceptor = new Thread("ResultServer")
+        {
+            @Override
+            public void run()
+            {
+                sInstance.acceptLoop(server);
+            }
+        };
+        acceptor.setDaemon(true);
+        acceptor.start();
+        return sInstance;
+    }
+
+    static void publish(String uniq, String message)
+    {
+        ResultServer server;
+        synchronized (ResultServer.class)
+        {
+            server = sInstance;
+        }
+        if (server == null || uniq == null)
+            return;
+        synchronized (server)
+        {
+            server.mResults.put(uniq, message);
+            server.notifyAll();
+        }
+    }
+
+    private void acceptLoop(LocalServerSocket server)
+    {
+        while (true)
+        {
+            final LocalSocket client;
+            try
+            {
+                client = server.accept();
+            }
+            catch (IOException e)
+            {
+                Log.e(TAG, "Result channel accept failed", e);
+                return;
+            }
+            Thread worker = new Thread("ResultServer client")
+            {
+                @Override
+                public void run()
+                {
+                    serve(client);
+                }
+            };
+            worker.setDaemon(true);
+            worker.start();
+        }
+    }
+
+    private void serve(LocalSocket client)
+    {
+        try
+        {
+            BufferedReader reader = new BufferedReader(new InputStreamReader(client.getInputStream(), UTF8));
+            String uniq = reader.readLine();
+            String message = uniq == null ? null : await(uniq.trim());
+            if (message != null)
+            {
+                byte[] payload = message.getBytes(UTF8);
+                OutputStream os = client.getOutputStream();
+                os.write(new byte[] {(byte)(payload.length >> 8), (byte)payload.length});
+                os.write(payload);
+                os.flush();
+            }
+        }
+        catch (IOException | InterruptedException e)
+        {
+            Log.d(TAG, "Result channel client gone: " + e);
+        }
+        finally
+        {
+            try
+            {
+                client.close();
+            }
+            catch (IOException ignored)
+            {
+            }
+        }
+    }
+
+    private synchronized String await(String uniq) throws InterruptedException
+    {
+        final long deadline = System.currentTimeMillis() + WAIT_TIME_MS;
+        String message;
+        while ((message = mResults.get(uniq)) == null)
+        {
+            long rest = deadline - System.currentTimeMillis();
+            if (rest <= 0)
+                return null;
+            wait(rest);
+        }
+        return message;
+    }
+}
@@ -0,0 +1,60 @@
+package com.steinwurf.adbjoinwifi;
+
+import android.content.BroadcastReceiver;
+import android.content.Context;
+import android.content.Intent;
+import android.os.Handler;
+import android.os.Looper;
+import android.util.Log;
+
+/**
+ * Headless entry point, takes the same extras as MainActivity:
+ *
+ *   adb shell am broadcast -n com.steinwurf.adbjoinwifi/.SwitchReceiver -e mode connect ...
+ *
+ * No activity is created, so the run skips the window and layout work of
+ * an activity start. The switch runs under goAsync(); "am broadcast"
+ * returns only when it is over, the host doesn't wait for that and reads
+ * the result from logcat or the ResultServer as usual.
+ */
+public class SwitchReceiver extends BroadcastReceiver
+{
+    private static final String TAG = "adbjoinwifi";
+
+    // background broadcasts get an ANR after 60s
+    private static final long MAX_RUN_TIME_MS = 50000;
+
+    @Override
+    public void onReceive(Context context, Intent intent)
+    {
+        ResultServer.start();
+
+        final WifiSwitcher switcher = WifiSwitcher.fromIntent(context.getApplicationContext(), intent);
+        if (switcher == null)
+            return;
+
+        final PendingResult result = goAsync();
+        final Handler handler = new Handler(Looper.getMainLooper());
+        final Runnable timeout = new Runnable()
+        {
+            @Override
+            public void run()
+            {
+                Log.d(TAG, "Switch is taking too long, giving up");
+                switcher.stop();
+                result.finish();
+            }
+        };
+        handler.postDelayed(timeout, MAX_RUN_TIME_MS);
+
+        switcher.start(new WifiSwitcher.Listener()
+        {
+            @Override
+            public void onDone()
+            {
+                handler.removeCallbacks(timeout);
+                result.finish();
+            }
+        });
+    }
+}
@@ -0,0 +1,409 @@
+package com.steinwurf.adbjoinwifi;
+
+import android.app.admin.DevicePolicyManager;
+import android.content.ComponentName;
+import android.content.Context;
+import android.content.Intent;
+import android.content.IntentFilter;
+import android.net.ConnectivityManager;
+import android.net.wifi.WifiConfiguration;
+import android.net.wifi.WifiManager;
+import android.os.Build;
+import android.support.annotation.RequiresApi;
+import android.util.Log;
+
+import java.lang.reflect.Field;
+
+/**
+ * The Wi-Fi work of one connect/disconnect run without any UI, shared by
+ * MainActivity and SwitchReceiver. The outcome goes to logcat and to the
+ * ResultServer.
+ */
+final class WifiSwitcher implements CheckSSIDBroadcastReceiver.SSIDFoundListener
+{
+    interface Listener
+    {
+        void onDone();
+    }
+
+    private static final String TAG = "adbjoinwifi";
+
+    static final String WEP_PASSWORD = "WEP";
+    static final String WPA_PASSWORD = "WPA";
+
+    static final String RUNMODE = "mode";
+    static final String SSID = "ssid";
+    static final String PASSWORD_TYPE = "password_type";
+    static final String PASSWORD = "password";
+    static final String UNIQPARAM = "uniq";
+
+    private static final String ConnectSignature = "Mode connect run completed";
+    private static final String DisconnectSignature = "Mode disconnect run completed";
+    private static final String ConnectFailedSignature = "Mode connect run failed";
+
+    static final String USAGE =
+            "adb shell am start" +
+            " -n com.steinwurf.adbjoinwifi/.MainActivity " +
+            "-e mode [connect|disconnect]" +
+            "-e uniq <uniq tag>" +
+            "-e ssid SSID " +
+            "-e password_type [WEP|WPA] " +
+            "-e password PASSWORD\n" +
+            "or the same extras with:\n" +
+            "adb shell am broadcast -n com.steinwurf.adbjoinwifi/.SwitchReceiver";
+
+    private final Context mContext;
+    private final boolean mConnect;
+    private final String mSSID;
+    private final String mPassword;
+    private final String mPasswordType;
+    private final String mUniqTag;
+    private final WifiManager mWifiManager;
+
+    private Listener mListener;
+    private CheckSSIDBroadcastReceiver mBroadcastReceiver;
+    private Thread mThread;
+    private boolean mDone;
+
+    private WifiSwitcher(Context context, boolean connect, String ssid, String passwordType, String password,
+                         String uniq)
+    {
+        mContext = context;
+        mConnect = connect;
+        mSSID = ssid;
+        mPasswordType = passwordType;
+        mPassword = password;
+        mUniqTag = uniq;
+        mWifiManager = (WifiManager)context.getApplicationContext().getSystemService(Context.WIFI_SERVICE);
+    }
+
+    /**
+     * Validates the intent extras, returns null (with the reason logged)
+     * when they don't describe a run.
+     */
+    static WifiSwitcher fromIntent(Context context, Intent intent)
+    {
+        final String mode = intent.getStringExtra(RUNMODE);
+        boolean connect = true;
+        if (mode != null) {
+            if (mode.equals("connect")) connect = true;
+            else if (mode.equals("disconnect")) connect = false;
+            else {
+                Log.d(TAG, "Unknown mode " + mode + ". Use the following adb command:");
+                Log.d(TAG, USAGE);
+                return null;
+            }
+        }
+
+        String ssid = intent.getStringExtra(SSID);
+        String passwordType = intent.getStringExtra(PASSWORD_TYPE);
+        String password = intent.getStringExtra(PASSWORD);
+        final String uniq = intent.getStringExtra(UNIQPARAM);
+
+        if (connect) {
+            if ((ssid == null) || // SSID REQUIRED
+                    (passwordType != null && password == null) || // PASSWORD REQUIRED IF PASSWORD TYPE GIVEN
+                    (password != null && passwordType == null) || // PASSWORD TYPE REQUIRED IF PASSWORD GIVEN
+                    (passwordType != null && !passwordType.equals(WPA_PASSWORD) && !passwordType.equals(WEP_PASSWORD))) // PASSWORD TYPE MUST BE NULL OR WPA OR WEP
+            {
+                Log.d(TAG, "Connect mode: no datastring provided. Use the following adb command:");
+                Log.d(TAG, USAGE);
+                return null;
+            }
+
+            Log.d(TAG, "Trying to join:");
+            Log.d(TAG, "SSID: " + ssid);
+            if (passwordType != null && password != null)
+            {
+                Log.d(TAG, "Password Type: " + passwordType);
+                Log.d(TAG, "Password: " + password);
+            }
+        } else {
+            ssid = password = passwordType = "";
+        }
+        return new WifiSwitcher(context, connect, ssid, passwordType, password, uniq);
+    }
+
+    boolean modeConnect()
+    {
+        return mConnect;
+    }
+
+    String getSSID()
+    {
+        return mSSID;
+    }
+
+    /**
+     * Runs the switch, the listener is called once on the main thread when
+     * the run is over, whatever the outcome.
+     */
+    void start(Listener listener)
+    {
+        mListener = listener;
+
+        if (!modeConnect()) {
+            if (mWifiManager.isWifiEnabled()) {
+                mWifiManager.disconnect();
+                mWifiManager.setWifiEnabled( false );
+            }
+            notifyDisconnected();
+            done();
+            return;
+        }
+
+        // Setup broadcast receiver
+
+        mBroadcastReceiver = new CheckSSIDBroadcastReceiver(mSSID);
+        mBroadcastReceiver.setSSIDFoundListener(this);
+
+        IntentFilter filter = new IntentFilter();
+        filter.addAction(WifiManager.WIFI_STATE_CHANGED_ACTION);
+        filter.addAction(ConnectivityManager.CONNECTIVITY_ACTION);
+        mContext.getApplicationContext().registerReceiver(mBroadcastReceiver, filter);
+
+        // Check if wifi is enabled, and act accordingly
+
+        if (!mWifiManager.isWifiEnabled())
+            mWifiManager.setWifiEnabled(true);
+        else {
+            WifiEnabled();
+        }
+    }
+
+    /**
+     * Stops waiting for the network; the listener isn't called after this.
+     */
+    void stop()
+    {
+        mListener = null;
+        cleanup();
+    }
+
+    private void done()
+    {
+        cleanup();
+        Listener listener = mListener;
+        mListener = null;
+        if (listener != null)
+            listener.onDone();
+    }
+
+    private void cleanup()
+    {
+        mDone = true;
+        if (mBroadcastReceiver != null)
+            mContext.getApplicationContext().unregisterReceiver(mBroadcastReceiver);
+        mBroadcastReceiver = null;
+        stopJoinThread();
+    }
+
+    private void stopJoinThread()
+    {
+        if (mThread != null)
+        {
+            mThread.interrupt();
+            try
+            {
+                mThread.join();
+            }
+            catch (InterruptedException e)
+            {
+                Log.e(TAG, "Hit exception", e);
+            }
+        }
+    }
+
+    private void notifyConnected()
+    {
+        final String message = mUniqTag + " " + ConnectSignature + " " + mSSID;
+        Log.w(TAG, message);
+        ResultServer.publish(mUniqTag, message);
+    }
+
+    private void notifyDisconnected()
+    {
+        final String message = mUniqTag + " " + DisconnectSignature;
+        Log.w(TAG, message);
+        ResultServer.publish(mUniqTag, message);
+    }
+
+    private void notifyConnectFailed(final String reason)
+    {
+        final String message = mUniqTag + " " + ConnectFailedSignature + " " + reason;
+        Log.w(TAG, message);
+        ResultServer.publish(mUniqTag, message);
+    }
+
+    @Override
+    public void SSIDFound()
+    {
+        if (mDone)
+            return;
+        Log.d(TAG, "Device Connected to " + mSSID);
+        stopJoinThread();
+        notifyConnected();
+        done();
+    }
+
+    @Override
+    public void WifiEnabled()
+    {
+        Log.d(TAG, "WifiEnabled");
+        if (mThread != null || mDone)
+            return;
+
+        WifiConfiguration wfc = getExistingWifiConfiguration();
+        int networkId;
+
+        if (wfc == null)
+        {
+            // Wifi configuration didn't exist for this SSID, create it.
+            wfc = new WifiConfiguration();
+            updateWifiConfiguration(wfc);
+            networkId = mWifiManager.addNetwork(wfc);
+        }
+        else if (permittedToUpdate(wfc))
+        {
+            // Wifi configuration already exists, update if we can
+            updateWifiConfiguration(wfc);
+            networkId = mWifiManager.updateNetwork(wfc);
+        }
+        else {
+            // Wifi configuration already exists, we cannot update it so just join it
+            networkId = wfc.networkId;
+        }
+
+        if (networkId == -1)
+        {
+            Log.d(TAG, "Invalid wifi network (ensure this SSID exists, auth method and password are correct, etc.)");
+            notifyConnectFailed("invalid network");
+            done();
+            return;
+        }
+
+        final int finalNetworkId = networkId;
+
+        mThread = new Thread() {
+            @Override
+            public void run() {
+                mWifiManager.disconnect();
+                try
+                {
+                    while(!isInterrupted())
+                    {
+                        Log.d(TAG, "Joining, network id=" + Integer.toString(finalNetworkId));
+                        mWifiManager.enableNetwork(finalNetworkId, true);
+                        mWifiManager.reconnect();
+                        // Wait and see if it worked. Otherwise try again.
+                        sleep(10000);
+                    }
+                } catch (InterruptedException ignored) {
+                }
+            }
+        };
+        mThread.start();
+    }
+
+    private boolean permittedToUpdate(WifiConfiguration wfc)
+    {
+        Field field;
+        int creatorUid;
+
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.KITKAT) {
+            try
+            {
+                field = wfc.getClass().getDeclaredField("creatorUid");
+                creatorUid = field.getInt(wfc);
+            }
+            catch (ReflectiveOperationException e)
+            {
+                Log.e(TAG, "Hit exception", e);
+                return false;
+            }
+            if (creatorUid == mContext.getApplicationInfo().uid || canEditWifi(mContext))
+            {
+                Log.d(TAG, "App is permitted to modify this wifi configuration");
+                return true;
+            }
+        }
+        // Since app doesn't have proper permissions, we will join the existing Wifi network as configured
+        Log.w(TAG, "App does not have admin access, unable to modify a wifi network created by another app");
+        return false;
+    }
+
+    private void updateWifiConfiguration(WifiConfiguration wfc)
+    {
+        wfc.SSID = "\"".concat(mSSID).concat("\"");
+        wfc.status = WifiConfiguration.Status.ENABLED;
+        wfc.priority = 100;
+        if (mPasswordType == null) // no password
+        {
+            wfc.allowedKeyManagement.set(WifiConfiguration.KeyMgmt.NONE);
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.RSN);
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.WPA);
+            wfc.allowedAuthAlgorithms.clear();
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.CCMP);
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.TKIP);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP40);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP104);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.CCMP);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.TKIP);
+        }
+        else if (mPasswordType.equals(WEP_PASSWORD)) // WEP
+        {
+            wfc.allowedKeyManagement.set(WifiConfiguration.KeyMgmt.NONE);
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.RSN);
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.WPA);
+            wfc.allowedAuthAlgorithms.set(WifiConfiguration.AuthAlgorithm.OPEN);
+            wfc.allowedAuthAlgorithms.set(WifiConfiguration.AuthAlgorithm.SHARED);
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.CCMP);
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.TKIP);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP40);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP104);
+
+            // if hex string
+            // wfc.wepKeys[0] = password;
+
+            wfc.wepKeys[0] = "\"".concat(mPassword).concat("\"");
+            wfc.wepTxKeyIndex = 0;
+        }
+        else if (mPasswordType.equals(WPA_PASSWORD)) // WPA(2)
+        {
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.RSN);
+            wfc.allowedProtocols.set(WifiConfiguration.Protocol.WPA);
+            wfc.allowedKeyManagement.set(WifiConfiguration.KeyMgmt.WPA_PSK);
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.CCMP);
+            wfc.allowedPairwiseCiphers.set(WifiConfiguration.PairwiseCipher.TKIP);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP40);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.WEP104);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.CCMP);
+            wfc.allowedGroupCiphers.set(WifiConfiguration.GroupCipher.TKIP);
+
+            wfc.preSharedKey = "\"".concat(mPassword).concat("\"");
+        }
+    }
+
+    private WifiConfiguration getExistingWifiConfiguration()
+    {
+        for( WifiConfiguration i : mWifiManager.getConfiguredNetworks())
+        {
+            if(i.SSID != null && i.SSID.equals("\"".concat(mSSID).concat("\"")))
+            {
+                Log.d(TAG, "wifi network already exists.");
+                return i;
+            }
+        }
+        return null;
+    }
+
+    @RequiresApi(api = Build.VERSION_CODES.JELLY_BEAN_MR2)
+    static boolean canEditWifi(Context context)
+    {
+        DevicePolicyManager devicePolicyManager =
+                (DevicePolicyManager) context.getSystemService(Context.DEVICE_POLICY_SERVICE);
+
+        return devicePolicyManager.isAdminActive(new ComponentName(context, AdminReceiver.class)) &&
+               devicePolicyManager.isDeviceOwnerApp(context.getPackageName());
+    }
+}